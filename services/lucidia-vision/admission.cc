@@ -0,0 +1,37 @@
+#include "services/lucidia-vision/admission.h"
+
+namespace lucidia {
+namespace vision {
+
+void AdmissionController::SetLimit(const std::string& method, int limit) {
+  auto& slot = slots_[method];
+  if (!slot) slot = std::make_unique<Slot>();
+  slot->limit = limit;
+}
+
+grpc::Status AdmissionController::Admit(const std::string& method,
+                                        Ticket* ticket) {
+  auto it = slots_.find(method);
+  if (it == slots_.end() || it->second->limit <= 0) {
+    *ticket = Ticket();
+    return grpc::Status::OK;
+  }
+  Slot* slot = it->second.get();
+  int current = slot->in_flight.load();
+  do {
+    if (current >= slot->limit) {
+      return grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED,
+                          method + ": concurrency limit reached");
+    }
+  } while (!slot->in_flight.compare_exchange_weak(current, current + 1));
+  *ticket = Ticket(&slot->in_flight);
+  return grpc::Status::OK;
+}
+
+int AdmissionController::in_flight(const std::string& method) const {
+  auto it = slots_.find(method);
+  return it == slots_.end() ? 0 : it->second->in_flight.load();
+}
+
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,58 @@
+// Per-RPC concurrency limits and admission control.
+//
+// Requests over their method's limit are rejected with RESOURCE_EXHAUSTED
+// instead of queueing without bound; clients are expected to back off.
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+
+#include <grpcpp/support/status.h>
+
+namespace lucidia {
+namespace vision {
+
+class AdmissionController {
+ public:
+  // Held for the lifetime of an admitted call; releases its slot on
+  // destruction.
+  class Ticket {
+   public:
+    Ticket() = default;
+    explicit Ticket(std::atomic<int>* slot) : slot_(slot) {}
+    ~Ticket() { if (slot_) slot_->fetch_sub(1); }
+    Ticket(Ticket&& o) noexcept : slot_(o.slot_) { o.slot_ = nullptr; }
+    Ticket& operator=(Ticket&& o) noexcept {
+      if (this != &o) {
+        if (slot_) slot_->fetch_sub(1);
+        slot_ = o.slot_;
+        o.slot_ = nullptr;
+      }
+      return *this;
+    }
+
+   private:
+    std::atomic<int>* slot_ = nullptr;
+  };
+
+  // Limits are fixed before serving starts. 0 (or no entry) means
+  // unlimited.
+  void SetLimit(const std::string& method, int limit);
+
+  // Admits one call of `method` or returns RESOURCE_EXHAUSTED.
+  grpc::Status Admit(const std::string& method, Ticket* ticket);
+
+  int in_flight(const std::string& method) const;
+
+ private:
+  struct Slot {
+    int limit = 0;
+    std::atomic<int> in_flight{0};
+  };
+  std::map<std::string, std::unique_ptr<Slot>> slots_;
+};
+
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,222 @@
+#include "services/lucidia-vision/async_server.h"
+
+#include <atomic>
+#include <functional>
+
+namespace lucidia {
+namespace vision {
+
+using namespace v1;  // import request/response messages
+
+namespace {
+
+// One in-flight call; the completion-queue tag is the call itself.
+class AsyncCall {
+ public:
+  virtual ~AsyncCall() = default;
+  virtual void Proceed(bool ok) = 0;
+};
+
+template <typename Request, typename Response>
+struct UnaryMethod {
+  using RequestFn = void (HybridVisionService::*)(
+      grpc::ServerContext*, Request*,
+      grpc::ServerAsyncResponseWriter<Response>*, grpc::CompletionQueue*,
+      grpc::ServerCompletionQueue*, void*);
+  using HandlerFn = grpc::Status (VisionServiceImpl::*)(grpc::ServerContext*,
+                                                        const Request*,
+                                                        Response*);
+  // Handlers that poll for cancellation take it as a predicate, since the
+  // call's ServerContext may not be asked until the call is done.
+  using CancellableFn = grpc::Status (VisionServiceImpl::*)(
+      const Request*, Response*, const std::function<bool()>&);
+  const char* name;
+  RequestFn request;
+  HandlerFn handler;
+  CancellableFn cancellable = nullptr;
+};
+
+template <typename Request, typename Response>
+class UnaryCall : public AsyncCall {
+ public:
+  using Method = UnaryMethod<Request, Response>;
+
+  UnaryCall(AsyncVisionServer* server, grpc::ServerCompletionQueue* cq,
+            const Method* method)
+      : server_(server),
+        cq_(cq),
+        method_(method),
+        responder_(&ctx_),
+        done_(this) {
+    ctx_.AsyncNotifyWhenDone(&done_);
+    (server_->service()->*method_->request)(&ctx_, &request_, &responder_, cq_,
+                                            cq_, this);
+  }
+
+  void Proceed(bool ok) override {
+    if (!started_) {
+      // The server is shutting down and no call arrived; the done tag is
+      // never delivered for a call that never started.
+      if (!ok) {
+        delete this;
+        return;
+      }
+      Start();
+      return;
+    }
+    // The reply went out (or could not); the done tag may still be pending.
+    Release();
+  }
+
+ private:
+  // Delivered once the call is over, finished or cancelled; only then may
+  // ctx_ be asked whether the client cancelled.
+  class DoneTag : public AsyncCall {
+   public:
+    explicit DoneTag(UnaryCall* call) : call_(call) {}
+    void Proceed(bool) override {
+      call_->cancelled_ = call_->ctx_.IsCancelled();
+      call_->Release();
+    }
+
+   private:
+    UnaryCall* call_;
+  };
+
+  void Start() {
+    // A call arrived: arm a replacement before doing anything else.
+    new UnaryCall(server_, cq_, method_);
+    started_ = true;
+    grpc::Status s = server_->admission()->Admit(method_->name, &ticket_);
+    if (s.ok() && !server_->pool()->TrySubmit([this] { Run(); })) {
+      ticket_ = AdmissionController::Ticket();
+      s = grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED,
+                       "worker queue full");
+    }
+    if (!s.ok()) {
+      // Rejected calls never reach a handler; count them here.
+      CallRecorder(server_->handlers()->metrics(), method_->name).Finish(s);
+      responder_.FinishWithError(s, this);
+    }
+  }
+
+  void Run() {
+    VisionServiceImpl* handlers = server_->handlers();
+    grpc::Status s =
+        method_->cancellable != nullptr
+            ? (handlers->*method_->cancellable)(
+                  &request_, &response_, [this] { return cancelled_.load(); })
+            : (handlers->*method_->handler)(&ctx_, &request_, &response_);
+    ticket_ = AdmissionController::Ticket();
+    responder_.Finish(response_, s, this);
+  }
+
+  // Both tags of a started call come back on cq_, which one thread polls.
+  void Release() {
+    if (--pending_ == 0) delete this;
+  }
+
+  AsyncVisionServer* server_;
+  grpc::ServerCompletionQueue* cq_;
+  const Method* method_;
+  grpc::ServerContext ctx_;
+  Request request_;
+  Response response_;
+  grpc::ServerAsyncResponseWriter<Response> responder_;
+  DoneTag done_;
+  AdmissionController::Ticket ticket_;
+  std::atomic<bool> cancelled_{false};
+  bool started_ = false;
+  int pending_ = 2;  // The reply and the done tag.
+};
+
+template <typename Request, typename Response>
+void Arm(AsyncVisionServer* server, grpc::ServerCompletionQueue* cq,
+         const UnaryMethod<Request, Response>* method) {
+  new UnaryCall<Request, Response>(server, cq, method);
+}
+
+const UnaryMethod<ReprojectImageRequest, ReprojectImageResponse> kReproject{
+    "ReprojectImage", &HybridVisionService::RequestReprojectImage,
+    &VisionServiceImpl::ReprojectImage};
+const UnaryMethod<TilePyramidRequest, TilePyramidResponse> kTilePyramid{
+    "TilePyramid", &HybridVisionService::RequestTilePyramid,
+    &VisionServiceImpl::TilePyramid};
+const UnaryMethod<MosaicRequest, MosaicResponse> kMosaic{
+    "Mosaic", &HybridVisionService::RequestMosaic, &VisionServiceImpl::Mosaic};
+const UnaryMethod<HillshadeRequest, HillshadeResponse> kHillshade{
+    "Hillshade", &HybridVisionService::RequestHillshade,
+    &VisionServiceImpl::Hillshade};
+const UnaryMethod<OrthorectifyDEMRequest, OrthorectifyDEMResponse> kOrtho{
+    "OrthorectifyDEM", &HybridVisionService::RequestOrthorectifyDEM,
+    &VisionServiceImpl::OrthorectifyDEM};
+const UnaryMethod<ResampleRequest, ResampleResponse> kResample{
+    "Resample", &HybridVisionService::RequestResample,
+    &VisionServiceImpl::Resample};
+const UnaryMethod<ColorMapRequest, ColorMapResponse> kColorMap{
+    "ColorMap", &HybridVisionService::RequestColorMap,
+    &VisionServiceImpl::ColorMap};
+const UnaryMethod<PipelineRequest, PipelineResponse> kPipeline{
+    "Pipeline", &HybridVisionService::RequestPipeline,
+    &VisionServiceImpl::Pipeline};
+const UnaryMethod<BatchRequest, BatchResponse> kBatch{
+    "Batch", &HybridVisionService::RequestBatch, &VisionServiceImpl::Batch,
+    &VisionServiceImpl::RunBatch};
+const UnaryMethod<RegisterDatasetRequest, RegisterDatasetResponse> kRegister{
+    "RegisterDataset", &HybridVisionService::RequestRegisterDataset,
+    &VisionServiceImpl::RegisterDataset};
+const UnaryMethod<ReleaseDatasetRequest, ReleaseDatasetResponse> kRelease{
+    "ReleaseDataset", &HybridVisionService::RequestReleaseDataset,
+    &VisionServiceImpl::ReleaseDataset};
+
+}  // namespace
+
+AsyncVisionServer::AsyncVisionServer(HybridVisionService* service,
+                                     VisionServiceImpl* handlers,
+                                     ThreadPool* pool,
+                                     AdmissionController* admission)
+    : service_(service),
+      handlers_(handlers),
+      pool_(pool),
+      admission_(admission) {}
+
+AsyncVisionServer::~AsyncVisionServer() { Shutdown(); }
+
+void AsyncVisionServer::AddCompletionQueues(grpc::ServerBuilder* builder,
+                                            int count) {
+  for (int i = 0; i < count; ++i) {
+    cqs_.push_back(builder->AddCompletionQueue());
+  }
+}
+
+void AsyncVisionServer::Start() {
+  for (auto& cq : cqs_) {
+    grpc::ServerCompletionQueue* q = cq.get();
+    Arm(this, q, &kReproject);
+    Arm(this, q, &kTilePyramid);
+    Arm(this, q, &kMosaic);
+    Arm(this, q, &kHillshade);
+    Arm(this, q, &kOrtho);
+    Arm(this, q, &kResample);
+    Arm(this, q, &kColorMap);
+    Arm(this, q, &kPipeline);
+    Arm(this, q, &kBatch);
+    Arm(this, q, &kRegister);
+    Arm(this, q, &kRelease);
+    pollers_.emplace_back([q] {
+      void* tag;
+      bool ok;
+      while (q->Next(&tag, &ok)) static_cast<AsyncCall*>(tag)->Proceed(ok);
+    });
+  }
+}
+
+void AsyncVisionServer::Shutdown() {
+  if (pollers_.empty()) return;
+  for (auto& cq : cqs_) cq->Shutdown();
+  for (auto& t : pollers_) t.join();
+  pollers_.clear();
+}
+
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,71 @@
+// Completion-queue serving mode for lucidia-vision.
+//
+// Unary RPCs are accepted on a few completion-queue polling threads, admitted
+// against per-method limits and run on the bounded worker pool. A call that
+// is over its limit, or that finds the pool queue full, is finished with
+// RESOURCE_EXHAUSTED immediately, so bursts cost a status reply rather than
+// a thread. Streaming RPCs keep their synchronous handlers.
+#pragma once
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "proto/vision_service.grpc.pb.h"
+#include "services/lucidia-vision/admission.h"
+#include "services/lucidia-vision/thread_pool.h"
+#include "services/lucidia-vision/vision_service_impl.h"
+
+namespace lucidia {
+namespace vision {
+
+// The dataset methods, split off to keep HybridVisionService within bounds.
+using AsyncDatasetMethods = v1::VisionService::WithAsyncMethod_RegisterDataset<
+    v1::VisionService::WithAsyncMethod_ReleaseDataset<VisionServiceImpl>>;
+
+// Registers with the server in place of VisionServiceImpl: unary methods are
+// async, streaming methods fall through to the inherited sync handlers.
+using HybridVisionService = v1::VisionService::WithAsyncMethod_ReprojectImage<
+    v1::VisionService::WithAsyncMethod_TilePyramid<
+        v1::VisionService::WithAsyncMethod_Mosaic<
+            v1::VisionService::WithAsyncMethod_Hillshade<
+                v1::VisionService::WithAsyncMethod_OrthorectifyDEM<
+                    v1::VisionService::WithAsyncMethod_Resample<
+                        v1::VisionService::WithAsyncMethod_ColorMap<
+                            v1::VisionService::WithAsyncMethod_Pipeline<
+                                v1::VisionService::WithAsyncMethod_Batch<
+                                    AsyncDatasetMethods>>>>>>>>>;
+
+class AsyncVisionServer {
+ public:
+  // `handlers` runs admitted calls and must not admit them again (construct
+  // it without an AdmissionController).
+  AsyncVisionServer(HybridVisionService* service, VisionServiceImpl* handlers,
+                    ThreadPool* pool, AdmissionController* admission);
+  ~AsyncVisionServer();
+
+  // Adds `count` completion queues; call before BuildAndStart().
+  void AddCompletionQueues(grpc::ServerBuilder* builder, int count);
+  // Arms every unary method on every queue and starts the polling threads.
+  void Start();
+  // Call after grpc::Server::Shutdown(); drains and joins the pollers.
+  void Shutdown();
+
+  HybridVisionService* service() { return service_; }
+  VisionServiceImpl* handlers() { return handlers_; }
+  ThreadPool* pool() { return pool_; }
+  AdmissionController* admission() { return admission_; }
+
+ private:
+  HybridVisionService* service_;
+  VisionServiceImpl* handlers_;
+  ThreadPool* pool_;
+  AdmissionController* admission_;
+  std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> cqs_;
+  std::vector<std::thread> pollers_;
+};
+
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,189 @@
+#include "services/lucidia-vision/buffer_pool.h"
+
+#include <sys/mman.h>
+
+#include <cstdlib>
+#include <new>
+
+namespace lucidia {
+namespace vision {
+
+namespace {
+
+constexpr size_t kMinClassBytes = 1024;
+// Blocks from here up are mapped pages rather than malloc'd, so releasing
+// one unmaps it (glibc's own mmap threshold starts at the same size).
+constexpr size_t kMapBytes = size_t{128} << 10;
+// Per-thread cache bounds: a few blocks per class, a few tiles in total.
+constexpr size_t kThreadCacheDepth = 4;
+constexpr size_t kThreadCacheBytes = size_t{8} << 20;
+
+// Set once the calling thread's cache is destroyed, so buffers freed later
+// in thread or process teardown bypass it.
+thread_local bool tls_cache_gone = false;
+
+}  // namespace
+
+struct BufferPool::ThreadCache {
+  ~ThreadCache() {
+    tls_cache_gone = true;
+    BufferPool& pool = Shared();
+    for (int c = 0; c < kClasses; ++c) {
+      for (void* block : blocks[c]) {
+        pool.cached_bytes_.fetch_sub(ClassBytes(c), std::memory_order_relaxed);
+        pool.Stash(c, block);
+      }
+    }
+  }
+
+  std::vector<void*> blocks[kClasses];
+  size_t bytes = 0;
+};
+
+BufferPool& BufferPool::Shared() {
+  static BufferPool* pool = new BufferPool();
+  return *pool;
+}
+
+// Classes run 1, 1.25, 1.5, 1.75, 2, 2.5, ... KiB: four per power of two.
+int BufferPool::ClassOf(size_t size) {
+  if (size <= kMinClassBytes) return 0;
+  const size_t x = size - 1;
+  const int e = 63 - __builtin_clzll(x);
+  const int c = (e - 10) * 4 + static_cast<int>((x >> (e - 2)) & 3) + 1;
+  return c < kClasses ? c : -1;
+}
+
+size_t BufferPool::ClassBytes(int c) {
+  return (kMinClassBytes << (c / 4)) * (4 + c % 4) / 4;
+}
+
+BufferPool::ThreadCache* BufferPool::LocalCache() {
+  if (tls_cache_gone) return nullptr;
+  thread_local ThreadCache cache;
+  return &cache;
+}
+
+void* BufferPool::Fresh(size_t bytes) {
+  void* block;
+  if (bytes >= kMapBytes) {
+    block = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED) block = nullptr;
+  } else {
+    block = std::aligned_alloc(kAlignment, bytes);
+  }
+  if (block == nullptr) throw std::bad_alloc();
+  return block;
+}
+
+void BufferPool::ReturnToOs(void* block, size_t bytes) {
+  if (bytes >= kMapBytes) {
+    munmap(block, bytes);
+  } else {
+    std::free(block);
+  }
+  released_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void BufferPool::Stash(int c, void* block) {
+  const size_t bytes = ClassBytes(c);
+  if (cached_bytes_.load(std::memory_order_relaxed) + bytes >
+      max_cached_bytes_.load(std::memory_order_relaxed)) {
+    ReturnToOs(block, bytes);
+    return;
+  }
+  cached_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+  std::lock_guard<std::mutex> lock(lists_[c].mu);
+  lists_[c].blocks.push_back(block);
+}
+
+void* BufferPool::Allocate(size_t size) {
+  constexpr auto relaxed = std::memory_order_relaxed;
+  allocations_.fetch_add(1, relaxed);
+  const int c = ClassOf(size);
+  if (c < 0) {
+    const size_t bytes = (size + kAlignment - 1) / kAlignment * kAlignment;
+    void* block = Fresh(bytes);
+    in_use_bytes_.fetch_add(bytes, relaxed);
+    return block;
+  }
+  const size_t bytes = ClassBytes(c);
+  void* block = nullptr;
+  if (ThreadCache* cache = LocalCache()) {
+    std::vector<void*>& mine = cache->blocks[c];
+    if (!mine.empty()) {
+      block = mine.back();
+      mine.pop_back();
+      cache->bytes -= bytes;
+    }
+  }
+  if (block == nullptr) {
+    FreeList& list = lists_[c];
+    std::lock_guard<std::mutex> lock(list.mu);
+    if (!list.blocks.empty()) {
+      block = list.blocks.back();
+      list.blocks.pop_back();
+    }
+  }
+  if (block != nullptr) {
+    reused_.fetch_add(1, relaxed);
+    cached_bytes_.fetch_sub(bytes, relaxed);
+  } else {
+    block = Fresh(bytes);
+  }
+  in_use_bytes_.fetch_add(bytes, relaxed);
+  return block;
+}
+
+void BufferPool::Release(void* block, size_t size) {
+  constexpr auto relaxed = std::memory_order_relaxed;
+  if (block == nullptr) return;
+  const int c = ClassOf(size);
+  if (c < 0) {
+    const size_t bytes = (size + kAlignment - 1) / kAlignment * kAlignment;
+    in_use_bytes_.fetch_sub(bytes, relaxed);
+    ReturnToOs(block, bytes);
+    return;
+  }
+  const size_t bytes = ClassBytes(c);
+  in_use_bytes_.fetch_sub(bytes, relaxed);
+  ThreadCache* cache = LocalCache();
+  if (cache != nullptr && cache->blocks[c].size() < kThreadCacheDepth &&
+      cache->bytes + bytes <= kThreadCacheBytes &&
+      cached_bytes_.load(relaxed) + bytes <= max_cached_bytes_.load(relaxed)) {
+    cache->blocks[c].push_back(block);
+    cache->bytes += bytes;
+    cached_bytes_.fetch_add(bytes, relaxed);
+    return;
+  }
+  Stash(c, block);
+}
+
+void BufferPool::Trim() {
+  for (int c = 0; c < kClasses; ++c) {
+    std::vector<void*> blocks;
+    {
+      std::lock_guard<std::mutex> lock(lists_[c].mu);
+      blocks.swap(lists_[c].blocks);
+    }
+    for (void* block : blocks) {
+      cached_bytes_.fetch_sub(ClassBytes(c), std::memory_order_relaxed);
+      ReturnToOs(block, ClassBytes(c));
+    }
+  }
+}
+
+BufferPool::Stats BufferPool::stats() const {
+  constexpr auto relaxed = std::memory_order_relaxed;
+  Stats s;
+  s.in_use_bytes = in_use_bytes_.load(relaxed);
+  s.cached_bytes = cached_bytes_.load(relaxed);
+  s.allocations = allocations_.load(relaxed);
+  s.reused = reused_.load(relaxed);
+  s.released_bytes = released_bytes_.load(relaxed);
+  return s;
+}
+
+}  // namespace vision
+}  // namespace lucidia
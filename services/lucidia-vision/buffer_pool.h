@@ -0,0 +1,86 @@
+// Size-classed pool of 64-byte-aligned blocks behind every AlignedBuffer.
+//
+// Requests allocate and free the same tile- and scanline-sized buffers over
+// and over; going to malloc each time fragments the heap of a long-running
+// server and lets RSS creep up. Blocks are rounded up to one of four size
+// classes per power of two (1 KiB to 64 MiB, so at most 25% slack) and kept
+// on free lists when released: first in a small cache owned by the
+// releasing thread, which needs no lock, then in a shared list per class.
+// Idle blocks beyond the high-water mark go straight back to the OS; blocks
+// of 128 KiB and up are mapped pages, so releasing them shrinks RSS.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace lucidia {
+namespace vision {
+
+class BufferPool {
+ public:
+  static constexpr size_t kAlignment = 64;
+
+  struct Stats {
+    size_t in_use_bytes = 0;     // Handed out, rounded up to the class size.
+    size_t cached_bytes = 0;     // Idle in thread caches and shared lists.
+    uint64_t allocations = 0;
+    uint64_t reused = 0;         // Allocations served from an idle block.
+    uint64_t released_bytes = 0; // Given back to the OS.
+  };
+
+  // The process-wide pool. It is never destroyed, so buffers may outlive
+  // main().
+  static BufferPool& Shared();
+
+  // Returns a block of at least `size` bytes aligned to kAlignment. Throws
+  // std::bad_alloc when the OS refuses.
+  void* Allocate(size_t size);
+  // `size` must be the value passed to Allocate.
+  void Release(void* block, size_t size);
+
+  // High-water mark for idle bytes; past it, released blocks are returned to
+  // the OS instead of cached. Lowering it does not free anything by itself.
+  void set_max_cached_bytes(size_t bytes) {
+    max_cached_bytes_.store(bytes, std::memory_order_relaxed);
+  }
+  // Returns every block on the shared lists to the OS. Thread caches keep
+  // theirs until the thread exits.
+  void Trim();
+
+  Stats stats() const;
+
+ private:
+  struct ThreadCache;
+  struct FreeList {
+    std::mutex mu;
+    std::vector<void*> blocks;
+  };
+
+  BufferPool() = default;
+
+  // Size class of `size`, or -1 when it is too large to pool.
+  static int ClassOf(size_t size);
+  static size_t ClassBytes(int c);
+  static ThreadCache* LocalCache();
+
+  void* Fresh(size_t bytes);
+  void ReturnToOs(void* block, size_t bytes);
+  // Keeps an idle block on the shared list unless that would pass the
+  // high-water mark.
+  void Stash(int c, void* block);
+
+  static constexpr int kClasses = 65;  // 1 KiB to 64 MiB.
+  FreeList lists_[kClasses];
+  std::atomic<size_t> max_cached_bytes_{size_t{256} << 20};
+  std::atomic<size_t> in_use_bytes_{0};
+  std::atomic<size_t> cached_bytes_{0};
+  std::atomic<uint64_t> allocations_{0};
+  std::atomic<uint64_t> reused_{0};
+  std::atomic<uint64_t> released_bytes_{0};
+};
+
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,127 @@
+#include "services/lucidia-vision/buffer_pool.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace lucidia {
+namespace vision {
+namespace {
+
+constexpr size_t kKiB = 1024;
+constexpr size_t kMiB = 1024 * kKiB;
+
+// Every test works on a thread of its own, so its thread cache is handed
+// back when the thread exits and Trim() can then empty the pool.
+class BufferPoolTest : public ::testing::Test {
+ protected:
+  void TearDown() override {
+    pool_.set_max_cached_bytes(256 * kMiB);
+    pool_.Trim();
+    const BufferPool::Stats s = pool_.stats();
+    EXPECT_EQ(s.in_use_bytes, 0u);
+    EXPECT_EQ(s.cached_bytes, 0u);
+  }
+  static void OnThread(const std::function<void()>& fn) {
+    std::thread(fn).join();
+  }
+  // Bytes in use while a block of `size` is held.
+  size_t HeldBytes(size_t size) {
+    const size_t before = pool_.stats().in_use_bytes;
+    void* block = pool_.Allocate(size);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(block) % BufferPool::kAlignment,
+              0u);
+    const size_t held = pool_.stats().in_use_bytes - before;
+    pool_.Release(block, size);
+    return held;
+  }
+
+  BufferPool& pool_ = BufferPool::Shared();
+};
+
+TEST_F(BufferPoolTest, RoundsUpToSizeClass) {
+  OnThread([&] {
+    EXPECT_EQ(HeldBytes(1), kKiB);
+    EXPECT_EQ(HeldBytes(kKiB), kKiB);
+    EXPECT_EQ(HeldBytes(kKiB + 1), 1280u);
+    EXPECT_EQ(HeldBytes(1280), 1280u);
+    EXPECT_EQ(HeldBytes(1281), 1536u);
+    EXPECT_EQ(HeldBytes(2 * kKiB), 2 * kKiB);
+    EXPECT_EQ(HeldBytes(2 * kKiB + 1), 2560u);
+    EXPECT_EQ(HeldBytes(96 * kKiB + 1), 112 * kKiB);
+    EXPECT_EQ(HeldBytes(48 * kMiB), 48 * kMiB);
+    EXPECT_EQ(HeldBytes(64 * kMiB), 64 * kMiB);
+  });
+}
+
+// Past the largest class, blocks are not pooled: rounded to the alignment
+// and returned to the OS on release.
+TEST_F(BufferPoolTest, OversizeBlocksBypassPool) {
+  OnThread([&] {
+    const BufferPool::Stats before = pool_.stats();
+    EXPECT_EQ(HeldBytes(64 * kMiB + 1), 64 * kMiB + BufferPool::kAlignment);
+    const BufferPool::Stats after = pool_.stats();
+    EXPECT_EQ(after.released_bytes - before.released_bytes,
+              64 * kMiB + BufferPool::kAlignment);
+    EXPECT_EQ(after.cached_bytes, before.cached_bytes);
+    EXPECT_EQ(after.reused, before.reused);
+  });
+}
+
+TEST_F(BufferPoolTest, ReusesReleasedBlocks) {
+  OnThread([&] {
+    const BufferPool::Stats before = pool_.stats();
+    void* first = pool_.Allocate(5000);
+    pool_.Release(first, 5000);
+    EXPECT_EQ(pool_.stats().cached_bytes - before.cached_bytes, 5 * kKiB);
+    // Any size in the same class gets the idle block back.
+    void* second = pool_.Allocate(4500);
+    EXPECT_EQ(second, first);
+    const BufferPool::Stats after = pool_.stats();
+    EXPECT_EQ(after.reused - before.reused, 1u);
+    EXPECT_EQ(after.allocations - before.allocations, 2u);
+    EXPECT_EQ(after.cached_bytes, before.cached_bytes);
+    pool_.Release(second, 4500);
+  });
+}
+
+// Releases that would take idle bytes past the high-water mark go back to
+// the OS; the ones below it stay cached.
+TEST_F(BufferPoolTest, ReleasesPastHighWaterGoToOs) {
+  OnThread([&] {
+    constexpr size_t kBlock = 256 * kKiB;
+    std::vector<void*> blocks;
+    for (int i = 0; i < 3; ++i) blocks.push_back(pool_.Allocate(kBlock));
+    const BufferPool::Stats before = pool_.stats();
+    pool_.set_max_cached_bytes(before.cached_bytes + 2 * kBlock);
+    for (void* block : blocks) pool_.Release(block, kBlock);
+    const BufferPool::Stats after = pool_.stats();
+    EXPECT_EQ(after.cached_bytes - before.cached_bytes, 2 * kBlock);
+    EXPECT_EQ(after.released_bytes - before.released_bytes, kBlock);
+    EXPECT_EQ(before.in_use_bytes - after.in_use_bytes, 3 * kBlock);
+  });
+}
+
+// A thread's cached blocks reach the shared lists when it exits, where
+// other threads pick them up.
+TEST_F(BufferPoolTest, ExitingThreadHandsCacheToOthers) {
+  void* block = nullptr;
+  OnThread([&] {
+    block = pool_.Allocate(3000);
+    pool_.Release(block, 3000);
+  });
+  EXPECT_EQ(pool_.stats().cached_bytes, 3 * kKiB);
+  OnThread([&] {
+    void* again = pool_.Allocate(3000);
+    EXPECT_EQ(again, block);
+    pool_.Release(again, 3000);
+  });
+}
+
+}  // namespace
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,136 @@
+#include "services/lucidia-vision/byte_stream.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace lucidia {
+namespace vision {
+
+grpc::Status MemoryByteStream::ReadAt(uint64_t offset, void* dst, size_t n,
+                                      size_t* got) {
+  *got = offset >= size_ ? 0 : std::min<uint64_t>(n, size_ - offset);
+  if (*got) std::memcpy(dst, data_ + offset, *got);
+  return grpc::Status::OK;
+}
+
+const uint8_t* MemoryByteStream::View(uint64_t offset, size_t n) {
+  return offset <= size_ && n <= size_ - offset ? data_ + offset : nullptr;
+}
+
+grpc::Status MmapByteStream::Open(const std::string& path,
+                                  std::shared_ptr<MmapByteStream>* out) {
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return grpc::Status(errno == ENOENT ? grpc::StatusCode::NOT_FOUND
+                                        : grpc::StatusCode::PERMISSION_DENIED,
+                        path + ": " + std::strerror(errno));
+  }
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    ::close(fd);
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        path + ": not a regular file");
+  }
+  const size_t size = static_cast<size_t>(st.st_size);
+  void* data = nullptr;
+  if (size > 0) {
+    data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  ::close(fd);  // The mapping keeps the file alive.
+  if (data == MAP_FAILED) {
+    return grpc::Status(grpc::StatusCode::INTERNAL,
+                        path + ": mmap: " + std::strerror(errno));
+  }
+  // Tile reads are scattered; don't let the kernel read ahead whole runs.
+  if (data != nullptr) ::madvise(data, size, MADV_RANDOM);
+  out->reset(new MmapByteStream(static_cast<const uint8_t*>(data), size));
+  return grpc::Status::OK;
+}
+
+MmapByteStream::~MmapByteStream() {
+  if (data_ != nullptr) ::munmap(const_cast<uint8_t*>(data_), size_);
+}
+
+grpc::Status MmapByteStream::ReadAt(uint64_t offset, void* dst, size_t n,
+                                    size_t* got) {
+  *got = offset >= size_ ? 0 : std::min<uint64_t>(n, size_ - offset);
+  if (*got) std::memcpy(dst, data_ + offset, *got);
+  return grpc::Status::OK;
+}
+
+const uint8_t* MmapByteStream::View(uint64_t offset, size_t n) {
+  return offset <= size_ && n <= size_ - offset ? data_ + offset : nullptr;
+}
+
+grpc::Status ChunkedByteStream::ReadAt(uint64_t offset, void* dst, size_t n,
+                                       size_t* got) {
+  std::unique_lock<std::mutex> lock(mu_);
+  cv_.wait(lock, [&] {
+    return !abort_status_.ok() || closed_ ||
+           (offset <= size_ && n <= size_ - offset);
+  });
+  if (!abort_status_.ok()) return abort_status_;
+  *got = 0;
+  if (offset >= size_) return grpc::Status::OK;
+  // First chunk containing `offset`.
+  size_t i = std::upper_bound(starts_.begin(), starts_.end(), offset) -
+             starts_.begin() - 1;
+  auto* out = static_cast<uint8_t*>(dst);
+  while (*got < n && i < chunks_.size()) {
+    const std::string& c = chunks_[i];
+    const uint64_t in_chunk = offset + *got - starts_[i];
+    const size_t take = std::min<uint64_t>(n - *got, c.size() - in_chunk);
+    std::memcpy(out + *got, c.data() + in_chunk, take);
+    *got += take;
+    ++i;
+  }
+  return grpc::Status::OK;
+}
+
+bool ChunkedByteStream::FinalSize(uint64_t* size) const {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (!closed_ || !abort_status_.ok()) return false;
+  *size = size_;
+  return true;
+}
+
+void ChunkedByteStream::Append(std::string chunk) {
+  if (chunk.empty()) return;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    starts_.push_back(size_);
+    size_ += chunk.size();
+    chunks_.push_back(std::move(chunk));
+  }
+  cv_.notify_all();
+}
+
+void ChunkedByteStream::Close() {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    closed_ = true;
+  }
+  cv_.notify_all();
+}
+
+void ChunkedByteStream::Abort(const grpc::Status& status) {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    abort_status_ = status;
+  }
+  cv_.notify_all();
+}
+
+uint64_t ChunkedByteStream::size() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return size_;
+}
+
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,119 @@
+// Encoded raster bytes that may still be arriving.
+//
+// Decoders read through a ByteStream instead of a contiguous buffer so the
+// same code serves unary requests (bytes already in the proto) and chunked
+// uploads (bytes trickling in while decoding runs).
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <grpcpp/support/status.h>
+
+namespace lucidia {
+namespace vision {
+
+class ByteStream {
+ public:
+  virtual ~ByteStream() = default;
+
+  // Copies up to `n` bytes starting at `offset` into `dst`, blocking until
+  // they have arrived. `*got` is short only at end of stream.
+  virtual grpc::Status ReadAt(uint64_t offset, void* dst, size_t n,
+                              size_t* got) = 0;
+
+  // Pointer to bytes [offset, offset + n) valid for the stream's lifetime,
+  // when they are already contiguous in memory; null otherwise (callers then
+  // fall back to ReadAt).
+  virtual const uint8_t* View(uint64_t offset, size_t n) {
+    (void)offset;
+    (void)n;
+    return nullptr;
+  }
+
+  // Stores the total length in `*size` once it is known; false while more
+  // bytes may still arrive. Decoders check file offsets against it.
+  virtual bool FinalSize(uint64_t* size) const {
+    (void)size;
+    return false;
+  }
+};
+
+// Bytes already in memory; does not copy or own them.
+class MemoryByteStream : public ByteStream {
+ public:
+  MemoryByteStream(const void* data, size_t size)
+      : data_(static_cast<const uint8_t*>(data)), size_(size) {}
+
+  grpc::Status ReadAt(uint64_t offset, void* dst, size_t n,
+                      size_t* got) override;
+  const uint8_t* View(uint64_t offset, size_t n) override;
+  bool FinalSize(uint64_t* size) const override {
+    *size = size_;
+    return true;
+  }
+
+ private:
+  const uint8_t* data_;
+  size_t size_;
+};
+
+// A read-only memory-mapped file. Pages are faulted in on access, so
+// decoders that touch a few tiles of a large file read only those.
+class MmapByteStream : public ByteStream {
+ public:
+  static grpc::Status Open(const std::string& path,
+                           std::shared_ptr<MmapByteStream>* out);
+  ~MmapByteStream() override;
+  MmapByteStream(const MmapByteStream&) = delete;
+  MmapByteStream& operator=(const MmapByteStream&) = delete;
+
+  grpc::Status ReadAt(uint64_t offset, void* dst, size_t n,
+                      size_t* got) override;
+  const uint8_t* View(uint64_t offset, size_t n) override;
+  bool FinalSize(uint64_t* size) const override {
+    *size = size_;
+    return true;
+  }
+  uint64_t size() const { return size_; }
+
+ private:
+  MmapByteStream(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+
+  const uint8_t* data_;
+  size_t size_;
+};
+
+// Bytes appended chunk by chunk by an upload. Chunks are kept (not
+// concatenated) so a decoder can restart from any offset without the upload
+// ever being copied into one buffer.
+class ChunkedByteStream : public ByteStream {
+ public:
+  grpc::Status ReadAt(uint64_t offset, void* dst, size_t n,
+                      size_t* got) override;
+  bool FinalSize(uint64_t* size) const override;
+
+  void Append(std::string chunk);
+  // No more bytes will arrive; readers past the end see a short read.
+  void Close();
+  // Fails current and future reads with `status`.
+  void Abort(const grpc::Status& status);
+  uint64_t size() const;
+
+ private:
+  mutable std::mutex mu_;
+  std::condition_variable cv_;
+  std::vector<std::string> chunks_;
+  std::vector<uint64_t> starts_;  // starts_[i] is the offset of chunks_[i].
+  uint64_t size_ = 0;
+  bool closed_ = false;
+  grpc::Status abort_status_;
+};
+
+}  // namespace vision
+}  // namespace lucidia
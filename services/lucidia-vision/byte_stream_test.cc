@@ -0,0 +1,41 @@
+#include "services/lucidia-vision/byte_stream.h"
+
+#include <cstdint>
+#include <string>
+
+#include <gtest/gtest.h>
+
+namespace lucidia {
+namespace vision {
+namespace {
+
+TEST(MemoryByteStreamTest, ViewRejectsRangesPastTheEnd) {
+  const std::string data(8192, 'x');
+  MemoryByteStream stream(data.data(), data.size());
+  const auto* base = reinterpret_cast<const uint8_t*>(data.data());
+  EXPECT_EQ(stream.View(0, 8192), base);
+  EXPECT_EQ(stream.View(8192, 0), base + 8192);
+  EXPECT_EQ(stream.View(1, 8192), nullptr);
+  EXPECT_EQ(stream.View(9000, 0), nullptr);
+  // offset + n wraps to 4096, which a naive bound check accepts.
+  EXPECT_EQ(stream.View(0xFFFFFFFFFFFFF000, 0x2000), nullptr);
+}
+
+TEST(ChunkedByteStreamTest, SizeIsFinalOnlyOnceClosed) {
+  ChunkedByteStream stream;
+  stream.Append("abc");
+  uint64_t size = 0;
+  EXPECT_FALSE(stream.FinalSize(&size));
+  stream.Append("de");
+  stream.Close();
+  ASSERT_TRUE(stream.FinalSize(&size));
+  EXPECT_EQ(size, 5u);
+  char buf[8];
+  size_t got = 0;
+  ASSERT_TRUE(stream.ReadAt(0xFFFFFFFFFFFFFFF0, buf, 0x20, &got).ok());
+  EXPECT_EQ(got, 0u);
+}
+
+}  // namespace
+}  // namespace vision
+}  // namespace lucidia
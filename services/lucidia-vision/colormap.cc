@@ -0,0 +1,219 @@
+#include "services/lucidia-vision/colormap.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "services/lucidia-vision/engine.h"
+
+namespace lucidia {
+namespace vision {
+
+namespace {
+
+// Palettes are piecewise-linear between stops at evenly spaced positions.
+struct Stop {
+  uint8_t r, g, b;
+};
+
+template <size_t N, size_t K>
+constexpr std::array<Rgba, N> BuildLut(const Stop (&stops)[K]) {
+  std::array<Rgba, N> lut{};
+  for (size_t i = 0; i < N; ++i) {
+    // Fixed point: position of entry i along the stops, in 1/N units.
+    const uint64_t pos = static_cast<uint64_t>(i) * (K - 1);
+    const size_t seg = std::min<size_t>(pos / (N - 1), K - 2);
+    const uint64_t frac = pos - seg * (N - 1);
+    const Stop& a = stops[seg];
+    const Stop& b = stops[seg + 1];
+    auto lerp = [&](uint8_t x, uint8_t y) {
+      return static_cast<uint8_t>(
+          (x * (N - 1 - frac) + y * frac + (N - 1) / 2) / (N - 1));
+    };
+    lut[i] = Rgba{lerp(a.r, b.r), lerp(a.g, b.g), lerp(a.b, b.b), 255};
+  }
+  return lut;
+}
+
+constexpr Stop kGray[] = {{0, 0, 0}, {255, 255, 255}};
+constexpr Stop kViridis[] = {{0x44, 0x01, 0x54}, {0x46, 0x32, 0x7e},
+                             {0x36, 0x5c, 0x8d}, {0x27, 0x7f, 0x8e},
+                             {0x1f, 0xa1, 0x87}, {0x4a, 0xc1, 0x6d},
+                             {0xa0, 0xda, 0x39}, {0xfd, 0xe7, 0x25}};
+constexpr Stop kMagma[] = {{0x00, 0x00, 0x04}, {0x2c, 0x11, 0x5f},
+                           {0x72, 0x1f, 0x81}, {0xb7, 0x37, 0x79},
+                           {0xf1, 0x60, 0x5d}, {0xfe, 0xb0, 0x78},
+                           {0xfc, 0xfd, 0xbf}};
+// Sea, lowland green, upland tan, brown rock, snow.
+constexpr Stop kTerrain[] = {{0x33, 0x33, 0x99}, {0x00, 0x99, 0xff},
+                             {0x00, 0xcc, 0x66}, {0xff, 0xff, 0x99},
+                             {0x80, 0x5c, 0x54}, {0xff, 0xff, 0xff}};
+
+template <const auto& kStops>
+struct Tables {
+  static constexpr std::array<Rgba, 256> lut8 = BuildLut<256>(kStops);
+  static constexpr std::array<Rgba, 65536> lut16 = BuildLut<65536>(kStops);
+};
+
+template <const auto& kStops>
+constexpr Palette MakePalette(const char* name) {
+  return Palette{name, Tables<kStops>::lut8.data(),
+                 Tables<kStops>::lut16.data()};
+}
+
+constexpr Palette kPalettes[] = {
+    MakePalette<kViridis>("viridis"),
+    MakePalette<kMagma>("magma"),
+    MakePalette<kTerrain>("terrain"),
+    MakePalette<kGray>("gray"),
+};
+
+inline void Put(uint8_t* out, const Rgba& c) { std::memcpy(out, &c, 4); }
+
+// Integer inputs index a table directly: either the palette's own (full
+// range) or one remapped to the requested range once per request.
+template <typename T>
+void LookupRows(const uint8_t* in, size_t in_stride, const Rgba* lut,
+                Tile* out) {
+  const int w = out->rect().width;
+  for (int y = 0; y < out->rect().height; ++y) {
+    const T* src = reinterpret_cast<const T*>(in + y * in_stride);
+    uint8_t* dst = out->row(y);
+    for (int x = 0; x < w; ++x) Put(dst + 4 * x, lut[src[x]]);
+  }
+}
+
+void LookupFloatRows(const uint8_t* in, size_t in_stride, const Rgba* lut16,
+                     float min, float scale, Rgba nan, Tile* out) {
+  const int w = out->rect().width;
+  for (int y = 0; y < out->rect().height; ++y) {
+    const float* src = reinterpret_cast<const float*>(in + y * in_stride);
+    uint8_t* dst = out->row(y);
+    for (int x = 0; x < w; ++x) {
+      const float v = src[x];
+      if (!std::isfinite(v)) {
+        Put(dst + 4 * x, nan);
+        continue;
+      }
+      // A zero scale turns an infinite min into NaN, which clamp passes.
+      float i = std::clamp((v - min) * scale, 0.0f, 65535.0f);
+      if (!(i >= 0.0f)) i = 0.0f;
+      Put(dst + 4 * x, lut16[static_cast<int>(i + 0.5f)]);
+    }
+  }
+}
+
+// Table of `entries` integer inputs remapped from [min, max] onto lut16.
+std::shared_ptr<std::vector<Rgba>> RemapLut(const Palette& p, int entries,
+                                            double min, double max) {
+  auto lut = std::make_shared<std::vector<Rgba>>(entries);
+  const double scale = max > min ? 65535.0 / (max - min) : 0.0;
+  for (int v = 0; v < entries; ++v) {
+    double i = std::clamp((v - min) * scale, 0.0, 65535.0);
+    if (!(i >= 0.0)) i = 0.0;
+    (*lut)[v] = p.lut16[static_cast<int>(i + 0.5)];
+  }
+  return lut;
+}
+
+}  // namespace
+
+const Palette* FindPalette(const std::string& name) {
+  if (name.empty()) return &kPalettes[0];
+  for (const Palette& p : kPalettes) {
+    if (name == p.name) return &p;
+  }
+  return nullptr;
+}
+
+std::string PaletteNames() {
+  std::string names;
+  for (const Palette& p : kPalettes) {
+    if (!names.empty()) names += ", ";
+    names += p.name;
+  }
+  return names;
+}
+
+grpc::Status ScanValueRange(RasterSource& source, double* min, double* max) {
+  const RasterInfo& info = source.info();
+  if (info.bands != 1) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "colormap: input must have a single band");
+  }
+  float lo = std::numeric_limits<float>::infinity();
+  float hi = -lo;
+  const size_t row_bytes = static_cast<size_t>(info.tile_size) * sizeof(float);
+  ScratchArray<float> buf(static_cast<size_t>(info.tile_size) *
+                          info.tile_size);
+  for (TileIndex t : TileRange(info)) {
+    const Rect r = info.TileRect(t.tx, t.ty);
+    grpc::Status s = source.ReadWindow(r, PixelType::kF32, buf.data(),
+                                       row_bytes);
+    if (!s.ok()) return s;
+    for (int y = 0; y < r.height; ++y) {
+      const float* row = buf.data() + static_cast<size_t>(y) * info.tile_size;
+      for (int x = 0; x < r.width; ++x) {
+        if (std::isfinite(row[x])) {
+          lo = std::min(lo, row[x]);
+          hi = std::max(hi, row[x]);
+        }
+      }
+    }
+  }
+  *min = lo <= hi ? lo : 0.0;
+  *max = lo <= hi ? hi : 1.0;
+  return grpc::Status::OK;
+}
+
+std::shared_ptr<RasterSource> MakeColorMapSource(
+    std::shared_ptr<RasterSource> input, const ColorMapParams& params) {
+  RasterInfo info = input->info();
+  const PixelType in_type = info.type;
+  info.bands = 4;
+  info.type = PixelType::kU8;
+  const Palette& palette = *params.palette;
+
+  WindowOpSource::Kernel kernel;
+  if (in_type == PixelType::kF32) {
+    const float min = static_cast<float>(params.min);
+    const float scale = params.max > params.min
+                            ? static_cast<float>(65535.0 / (params.max -
+                                                            params.min))
+                            : 0.0f;
+    const Rgba nan = params.nan;
+    const Rgba* lut16 = palette.lut16;
+    kernel = [lut16, min, scale, nan](const uint8_t* in, size_t stride,
+                                      Tile* out) {
+      LookupFloatRows(in, stride, lut16, min, scale, nan, out);
+    };
+  } else if (!params.has_range) {
+    const bool wide = in_type == PixelType::kU16;
+    const Rgba* lut = wide ? palette.lut16 : palette.lut8;
+    kernel = [lut, wide](const uint8_t* in, size_t stride, Tile* out) {
+      if (wide) {
+        LookupRows<uint16_t>(in, stride, lut, out);
+      } else {
+        LookupRows<uint8_t>(in, stride, lut, out);
+      }
+    };
+  } else {
+    const bool wide = in_type == PixelType::kU16;
+    auto lut = RemapLut(palette, wide ? 65536 : 256, params.min, params.max);
+    kernel = [lut, wide](const uint8_t* in, size_t stride, Tile* out) {
+      if (wide) {
+        LookupRows<uint16_t>(in, stride, lut->data(), out);
+      } else {
+        LookupRows<uint8_t>(in, stride, lut->data(), out);
+      }
+    };
+  }
+  return std::make_shared<WindowOpSource>(std::move(input), info, in_type,
+                                          /*halo=*/0, std::move(kernel));
+}
+
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,53 @@
+// Palette lookup for single-band rasters.
+//
+// Every named palette is compiled into a 256-entry and a 65536-entry RGBA
+// table, so integer inputs are coloured with one table load per pixel.
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "services/lucidia-vision/raster.h"
+
+namespace lucidia {
+namespace vision {
+
+struct Rgba {
+  uint8_t r = 0;
+  uint8_t g = 0;
+  uint8_t b = 0;
+  uint8_t a = 0;
+};
+
+struct Palette {
+  const char* name;
+  const Rgba* lut8;   // 256 entries.
+  const Rgba* lut16;  // 65536 entries.
+};
+
+// Null when `name` is not compiled in; "" is viridis.
+const Palette* FindPalette(const std::string& name);
+// Comma-separated list for error messages.
+std::string PaletteNames();
+
+struct ColorMapParams {
+  const Palette* palette = nullptr;
+  // Values mapped to the first and last palette entries. Without a range
+  // integer inputs span their full type range; f32 inputs need one.
+  bool has_range = false;
+  double min = 0.0;
+  double max = 1.0;
+  Rgba nan;  // Colour of NaN and infinite pixels (f32 only).
+};
+
+// Min and max of the finite values of a single-band raster; reads every
+// tile once.
+grpc::Status ScanValueRange(RasterSource& source, double* min, double* max);
+
+// Lazily coloured RGBA u8 view of a single-band raster.
+std::shared_ptr<RasterSource> MakeColorMapSource(
+    std::shared_ptr<RasterSource> input, const ColorMapParams& params);
+
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,144 @@
+#include "services/lucidia-vision/colormap.h"
+
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include "services/lucidia-vision/test_util.h"
+
+namespace lucidia {
+namespace vision {
+namespace {
+
+using testing::MakeRaster;
+using testing::ReadAll;
+
+std::vector<uint8_t> Colour(std::shared_ptr<RasterSource> input,
+                            const ColorMapParams& params) {
+  auto coloured = MakeColorMapSource(std::move(input), params);
+  EXPECT_EQ(coloured->info().bands, 4);
+  return ReadAll<uint8_t>(*coloured, PixelType::kU8);
+}
+
+TEST(ColorMapTest, PaletteLookup) {
+  EXPECT_EQ(FindPalette(""), FindPalette("viridis"));
+  EXPECT_EQ(FindPalette("no-such-palette"), nullptr);
+  // First and last entries are the palette's end stops.
+  const Palette* viridis = FindPalette("viridis");
+  ASSERT_NE(viridis, nullptr);
+  EXPECT_EQ(viridis->lut8[0].r, 0x44);
+  EXPECT_EQ(viridis->lut8[0].g, 0x01);
+  EXPECT_EQ(viridis->lut8[0].b, 0x54);
+  EXPECT_EQ(viridis->lut16[65535].r, 0xfd);
+  EXPECT_EQ(viridis->lut16[65535].g, 0xe7);
+  EXPECT_EQ(viridis->lut16[65535].b, 0x25);
+}
+
+TEST(ColorMapTest, GrayMapsU8ToItself) {
+  auto input = MakeRaster(256, 3, 1, PixelType::kU8,
+                          [](int x, int, int) { return x; });
+  ColorMapParams params;
+  params.palette = FindPalette("gray");
+  const std::vector<uint8_t> out = Colour(input, params);
+  for (int x = 0; x < 256; ++x) {
+    EXPECT_EQ(out[4 * x + 0], x);
+    EXPECT_EQ(out[4 * x + 1], x);
+    EXPECT_EQ(out[4 * x + 2], x);
+    EXPECT_EQ(out[4 * x + 3], 255);
+  }
+}
+
+TEST(ColorMapTest, FloatRangeClampsAndColoursNan) {
+  const float values[] = {-50.0f, 0.0f, 25.0f, 100.0f, 400.0f,
+                          std::numeric_limits<float>::quiet_NaN()};
+  auto input = MakeRaster(6, 1, 1, PixelType::kF32,
+                          [&](int x, int, int) { return values[x]; });
+  ColorMapParams params;
+  params.palette = FindPalette("gray");
+  params.has_range = true;
+  params.min = 0.0;
+  params.max = 100.0;
+  params.nan = Rgba{1, 2, 3, 4};
+  const std::vector<uint8_t> out = Colour(input, params);
+  const uint8_t expected[][4] = {{0, 0, 0, 255},       {0, 0, 0, 255},
+                                 {64, 64, 64, 255},    {255, 255, 255, 255},
+                                 {255, 255, 255, 255}, {1, 2, 3, 4}};
+  for (int x = 0; x < 6; ++x) {
+    for (int c = 0; c < 4; ++c) {
+      EXPECT_EQ(out[4 * x + c], expected[x][c]) << "value " << values[x];
+    }
+  }
+}
+
+TEST(ColorMapTest, IntegerRangeRemapsTable) {
+  auto input = MakeRaster(3, 1, 1, PixelType::kU16, [](int x, int, int) {
+    return 1000.0f + 1000.0f * x;  // 1000, 2000, 3000.
+  });
+  ColorMapParams params;
+  params.palette = FindPalette("gray");
+  params.has_range = true;
+  params.min = 1000.0;
+  params.max = 3000.0;
+  const std::vector<uint8_t> out = Colour(input, params);
+  EXPECT_EQ(out[0], 0);
+  EXPECT_EQ(out[4], 128);
+  EXPECT_EQ(out[8], 255);
+}
+
+// A non-finite range start makes every position NaN; the lookup must
+// still land on the table.
+TEST(ColorMapTest, NonFiniteRangeStaysInTable) {
+  const double starts[] = {std::numeric_limits<double>::quiet_NaN(),
+                           std::numeric_limits<double>::infinity(),
+                           -std::numeric_limits<double>::infinity()};
+  for (double start : starts) {
+    ColorMapParams params;
+    params.palette = FindPalette("gray");
+    params.has_range = true;
+    params.min = start;
+    params.max = 100.0;
+    auto u8 = MakeRaster(4, 2, 1, PixelType::kU8,
+                         [](int x, int, int) { return 60 * x; });
+    EXPECT_EQ(Colour(u8, params).size(), 32u) << start;
+    auto f32 = MakeRaster(4, 2, 1, PixelType::kF32,
+                          [](int x, int, int) { return 60.0f * x; });
+    EXPECT_EQ(Colour(f32, params).size(), 32u) << start;
+  }
+}
+
+// A constant raster scans to min == max, a zero scale; its infinite cells
+// are coloured as nodata.
+TEST(ColorMapTest, InfiniteSamplesAreNodata) {
+  auto input = MakeRaster(3, 1, 1, PixelType::kF32, [](int x, int, int) {
+    if (x == 1) return std::numeric_limits<float>::infinity();
+    if (x == 2) return -std::numeric_limits<float>::infinity();
+    return 7.0f;
+  });
+  ColorMapParams params;
+  params.palette = FindPalette("gray");
+  ASSERT_TRUE(ScanValueRange(*input, &params.min, &params.max).ok());
+  EXPECT_EQ(params.min, params.max);
+  params.nan = Rgba{1, 2, 3, 4};
+  const std::vector<uint8_t> out = Colour(input, params);
+  EXPECT_EQ(out, (std::vector<uint8_t>{0, 0, 0, 255, 1, 2, 3, 4, 1, 2, 3,
+                                       4}));
+}
+
+TEST(ColorMapTest, ScanValueRangeSkipsNonFinite) {
+  auto input = MakeRaster(300, 300, 1, PixelType::kF32, [](int x, int y,
+                                                           int) {
+    if (x == 5) return std::numeric_limits<float>::quiet_NaN();
+    if (x == 6) return std::numeric_limits<float>::infinity();
+    return static_cast<float>(x - y);
+  });
+  double min = 0, max = 0;
+  ASSERT_TRUE(ScanValueRange(*input, &min, &max).ok());
+  EXPECT_EQ(min, -299.0);
+  EXPECT_EQ(max, 299.0);
+}
+
+}  // namespace
+}  // namespace vision
+}  // namespace lucidia
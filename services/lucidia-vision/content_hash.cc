@@ -0,0 +1,389 @@
+#include "services/lucidia-vision/content_hash.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LUCIDIA_VISION_X86 1
+#endif
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+
+namespace lucidia {
+namespace vision {
+
+namespace {
+
+constexpr uint64_t kP1 = 11400714785074694791ULL;
+constexpr uint64_t kP2 = 14029467366897019727ULL;
+constexpr uint64_t kP3 = 1609587929392839161ULL;
+constexpr uint64_t kP4 = 9650029242287828579ULL;
+constexpr uint64_t kP5 = 2870177450012600261ULL;
+
+inline uint64_t Rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+inline uint64_t Read64(const uint8_t* p) {
+  uint64_t v;
+  std::memcpy(&v, p, 8);
+  return v;  // XXH64 is defined on little-endian lanes; so are our hosts.
+}
+
+inline uint32_t Read32(const uint8_t* p) {
+  uint32_t v;
+  std::memcpy(&v, p, 4);
+  return v;
+}
+
+inline uint64_t Round(uint64_t acc, uint64_t input) {
+  acc += input * kP2;
+  acc = Rotl(acc, 31);
+  return acc * kP1;
+}
+
+inline uint64_t Merge(uint64_t acc, uint64_t v) {
+  acc ^= Round(0, v);
+  return acc * kP1 + kP4;
+}
+
+}  // namespace
+
+Xxh64::Xxh64(uint64_t seed)
+    : v_{seed + kP1 + kP2, seed + kP2, seed, seed - kP1}, seed_(seed) {}
+
+void Xxh64::Update(const void* data, size_t n) {
+  const auto* p = static_cast<const uint8_t*>(data);
+  total_ += n;
+  if (buffered_ + n < 32) {
+    std::memcpy(buf_ + buffered_, p, n);
+    buffered_ += n;
+    return;
+  }
+  if (buffered_ > 0) {
+    const size_t fill = 32 - buffered_;
+    std::memcpy(buf_ + buffered_, p, fill);
+    for (int i = 0; i < 4; ++i) v_[i] = Round(v_[i], Read64(buf_ + 8 * i));
+    p += fill;
+    n -= fill;
+    buffered_ = 0;
+  }
+  uint64_t v0 = v_[0], v1 = v_[1], v2 = v_[2], v3 = v_[3];
+  for (; n >= 32; p += 32, n -= 32) {
+    v0 = Round(v0, Read64(p));
+    v1 = Round(v1, Read64(p + 8));
+    v2 = Round(v2, Read64(p + 16));
+    v3 = Round(v3, Read64(p + 24));
+  }
+  v_[0] = v0;
+  v_[1] = v1;
+  v_[2] = v2;
+  v_[3] = v3;
+  std::memcpy(buf_, p, n);
+  buffered_ = n;
+}
+
+uint64_t Xxh64::Digest() const {
+  uint64_t h;
+  if (total_ >= 32) {
+    h = Rotl(v_[0], 1) + Rotl(v_[1], 7) + Rotl(v_[2], 12) + Rotl(v_[3], 18);
+    for (uint64_t v : v_) h = Merge(h, v);
+  } else {
+    h = seed_ + kP5;
+  }
+  h += total_;
+  const uint8_t* p = buf_;
+  size_t n = buffered_;
+  for (; n >= 8; p += 8, n -= 8) {
+    h ^= Round(0, Read64(p));
+    h = Rotl(h, 27) * kP1 + kP4;
+  }
+  if (n >= 4) {
+    h ^= static_cast<uint64_t>(Read32(p)) * kP1;
+    h = Rotl(h, 23) * kP2 + kP3;
+    p += 4;
+    n -= 4;
+  }
+  for (; n > 0; ++p, --n) {
+    h ^= *p * kP5;
+    h = Rotl(h, 11) * kP1;
+  }
+  h ^= h >> 33;
+  h *= kP2;
+  h ^= h >> 29;
+  h *= kP3;
+  h ^= h >> 32;
+  return h;
+}
+
+namespace {
+
+constexpr uint32_t kSha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+inline uint32_t Rotr(uint32_t x, int r) { return (x >> r) | (x << (32 - r)); }
+
+void Sha256BlockScalar(uint32_t* state, const uint8_t* p) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; ++i) {
+    w[i] = uint32_t{p[4 * i]} << 24 | uint32_t{p[4 * i + 1]} << 16 |
+           uint32_t{p[4 * i + 2]} << 8 | p[4 * i + 3];
+  }
+  for (int i = 16; i < 64; ++i) {
+    const uint32_t s0 =
+        Rotr(w[i - 15], 7) ^ Rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    const uint32_t s1 =
+        Rotr(w[i - 2], 17) ^ Rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+  for (int i = 0; i < 64; ++i) {
+    const uint32_t t1 = h + (Rotr(e, 6) ^ Rotr(e, 11) ^ Rotr(e, 25)) +
+                        ((e & f) ^ (~e & g)) + kSha256K[i] + w[i];
+    const uint32_t t2 = (Rotr(a, 2) ^ Rotr(a, 13) ^ Rotr(a, 22)) +
+                        ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
+}
+
+void Sha256BlocksScalar(uint32_t* state, const uint8_t* p, size_t blocks) {
+  for (; blocks > 0; --blocks, p += 64) Sha256BlockScalar(state, p);
+}
+
+#ifdef LUCIDIA_VISION_X86
+
+// SHA extensions: two rounds per sha256rnds2, state held as ABEF/CDGH.
+__attribute__((target("sha,sse4.1"))) void Sha256BlocksShaNi(
+    uint32_t* state, const uint8_t* p, size_t blocks) {
+  const __m128i bswap =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(state));
+  __m128i cdgh = _mm_loadu_si128(reinterpret_cast<const __m128i*>(state + 4));
+  tmp = _mm_shuffle_epi32(tmp, 0xb1);
+  cdgh = _mm_shuffle_epi32(cdgh, 0x1b);
+  __m128i abef = _mm_alignr_epi8(tmp, cdgh, 8);
+  cdgh = _mm_blend_epi16(cdgh, tmp, 0xf0);
+  for (; blocks > 0; --blocks, p += 64) {
+    const __m128i abef_in = abef, cdgh_in = cdgh;
+    __m128i w[4];
+    for (int g = 0; g < 16; ++g) {
+      __m128i& m = w[g & 3];
+      if (g < 4) {
+        m = _mm_shuffle_epi8(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * g)),
+            bswap);
+      } else {
+        // W[t-16] + s0(W[t-15]) + W[t-7], then + s1(W[t-2]).
+        m = _mm_add_epi32(_mm_sha256msg1_epu32(m, w[(g + 1) & 3]),
+                          _mm_alignr_epi8(w[(g + 3) & 3], w[(g + 2) & 3], 4));
+        m = _mm_sha256msg2_epu32(m, w[(g + 3) & 3]);
+      }
+      __m128i k = _mm_add_epi32(
+          m, _mm_loadu_si128(reinterpret_cast<const __m128i*>(kSha256K) + g));
+      cdgh = _mm_sha256rnds2_epu32(cdgh, abef, k);
+      k = _mm_shuffle_epi32(k, 0x0e);
+      abef = _mm_sha256rnds2_epu32(abef, cdgh, k);
+    }
+    abef = _mm_add_epi32(abef, abef_in);
+    cdgh = _mm_add_epi32(cdgh, cdgh_in);
+  }
+  tmp = _mm_shuffle_epi32(abef, 0x1b);
+  cdgh = _mm_shuffle_epi32(cdgh, 0xb1);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(state),
+                   _mm_blend_epi16(tmp, cdgh, 0xf0));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(state + 4),
+                   _mm_alignr_epi8(cdgh, tmp, 8));
+}
+
+#endif  // LUCIDIA_VISION_X86
+
+using Sha256Kernel = void (*)(uint32_t* state, const uint8_t* p,
+                              size_t blocks);
+
+Sha256Kernel SelectSha256() {
+#ifdef LUCIDIA_VISION_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+    return Sha256BlocksShaNi;
+  }
+#endif
+  return Sha256BlocksScalar;
+}
+
+void Sha256Blocks(uint32_t* state, const uint8_t* p, size_t blocks) {
+  static const Sha256Kernel kernel = SelectSha256();
+  kernel(state, p, blocks);
+}
+
+}  // namespace
+
+Sha256::Sha256()
+    : h_{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f,
+         0x9b05688c, 0x1f83d9ab, 0x5be0cd19} {}
+
+void Sha256::Update(const void* data, size_t n) {
+  const auto* p = static_cast<const uint8_t*>(data);
+  total_ += n;
+  if (buffered_ > 0) {
+    const size_t fill = std::min(n, 64 - buffered_);
+    std::memcpy(buf_ + buffered_, p, fill);
+    buffered_ += fill;
+    p += fill;
+    n -= fill;
+    if (buffered_ < 64) return;
+    Sha256Blocks(h_, buf_, 1);
+    buffered_ = 0;
+  }
+  Sha256Blocks(h_, p, n / 64);
+  p += n / 64 * 64;
+  n %= 64;
+  std::memcpy(buf_, p, n);
+  buffered_ = n;
+}
+
+Sha256Digest Sha256::Digest() const {
+  uint32_t state[8];
+  std::memcpy(state, h_, sizeof(state));
+  // Padding: 0x80, zeros to 56 mod 64, then the bit length big-endian.
+  uint8_t tail[128] = {};
+  std::memcpy(tail, buf_, buffered_);
+  tail[buffered_] = 0x80;
+  const size_t len = buffered_ < 56 ? 64 : 128;
+  const uint64_t bits = total_ * 8;
+  for (int i = 0; i < 8; ++i) {
+    tail[len - 1 - i] = static_cast<uint8_t>(bits >> (8 * i));
+  }
+  Sha256Blocks(state, tail, len / 64);
+  Sha256Digest out;
+  for (int i = 0; i < 8; ++i) {
+    for (int k = 0; k < 4; ++k) {
+      out[4 * i + k] = static_cast<uint8_t>(state[i] >> (24 - 8 * k));
+    }
+  }
+  return out;
+}
+
+size_t Sha256DigestHash::operator()(const Sha256Digest& d) const {
+  size_t v;
+  std::memcpy(&v, d.data(), sizeof(v));
+  return v;
+}
+
+namespace {
+
+using google::protobuf::FieldDescriptor;
+
+template <typename Hasher, typename T>
+void Put(Hasher* h, T v) {
+  h->Update(&v, sizeof(v));
+}
+
+template <typename Hasher>
+void HashMessageWith(const google::protobuf::Message& msg, Hasher* h);
+
+template <typename Hasher>
+void HashField(const google::protobuf::Message& msg,
+               const google::protobuf::Reflection& r,
+               const FieldDescriptor* f, int i, Hasher* h) {
+  const bool rep = f->is_repeated();
+  switch (f->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_INT32:
+      Put(h, rep ? r.GetRepeatedInt32(msg, f, i) : r.GetInt32(msg, f));
+      break;
+    case FieldDescriptor::CPPTYPE_INT64:
+      Put(h, rep ? r.GetRepeatedInt64(msg, f, i) : r.GetInt64(msg, f));
+      break;
+    case FieldDescriptor::CPPTYPE_UINT32:
+      Put(h, rep ? r.GetRepeatedUInt32(msg, f, i) : r.GetUInt32(msg, f));
+      break;
+    case FieldDescriptor::CPPTYPE_UINT64:
+      Put(h, rep ? r.GetRepeatedUInt64(msg, f, i) : r.GetUInt64(msg, f));
+      break;
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+      Put(h, rep ? r.GetRepeatedDouble(msg, f, i) : r.GetDouble(msg, f));
+      break;
+    case FieldDescriptor::CPPTYPE_FLOAT:
+      Put(h, rep ? r.GetRepeatedFloat(msg, f, i) : r.GetFloat(msg, f));
+      break;
+    case FieldDescriptor::CPPTYPE_BOOL:
+      Put(h, static_cast<uint8_t>(rep ? r.GetRepeatedBool(msg, f, i)
+                                      : r.GetBool(msg, f)));
+      break;
+    case FieldDescriptor::CPPTYPE_ENUM:
+      Put(h, rep ? r.GetRepeatedEnumValue(msg, f, i)
+                 : r.GetEnumValue(msg, f));
+      break;
+    case FieldDescriptor::CPPTYPE_STRING: {
+      std::string scratch;
+      const std::string& s =
+          rep ? r.GetRepeatedStringReference(msg, f, i, &scratch)
+              : r.GetStringReference(msg, f, &scratch);
+      Put(h, static_cast<uint64_t>(s.size()));
+      h->Update(s.data(), s.size());
+      break;
+    }
+    case FieldDescriptor::CPPTYPE_MESSAGE:
+      HashMessageWith(
+          rep ? r.GetRepeatedMessage(msg, f, i) : r.GetMessage(msg, f), h);
+      break;
+  }
+}
+
+template <typename Hasher>
+void HashMessageWith(const google::protobuf::Message& msg, Hasher* h) {
+  const google::protobuf::Reflection& r = *msg.GetReflection();
+  std::vector<const FieldDescriptor*> fields;
+  r.ListFields(msg, &fields);  // Set fields, in field-number order.
+  Put(h, static_cast<uint32_t>(fields.size()));
+  for (const FieldDescriptor* f : fields) {
+    Put(h, f->number());
+    if (f->is_repeated()) {
+      const int n = r.FieldSize(msg, f);
+      Put(h, n);
+      for (int i = 0; i < n; ++i) HashField(msg, r, f, i, h);
+    } else {
+      HashField(msg, r, f, 0, h);
+    }
+  }
+}
+
+}  // namespace
+
+void HashMessage(const google::protobuf::Message& msg, Xxh64* h) {
+  HashMessageWith(msg, h);
+}
+
+void HashMessage(const google::protobuf::Message& msg, Sha256* h) {
+  HashMessageWith(msg, h);
+}
+
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,62 @@
+// Content hashing: fast XXH64 for IDs and checksums, SHA-256 where a
+// crafted collision must not pass (result cache keys).
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace google {
+namespace protobuf {
+class Message;
+}  // namespace protobuf
+}  // namespace google
+
+namespace lucidia {
+namespace vision {
+
+// Streaming XXH64. Output matches the reference implementation for the
+// same seed and byte sequence, however the input is split across Update().
+class Xxh64 {
+ public:
+  explicit Xxh64(uint64_t seed = 0);
+  void Update(const void* data, size_t n);
+  uint64_t Digest() const;
+
+ private:
+  uint64_t v_[4];
+  uint64_t seed_;
+  uint64_t total_ = 0;
+  uint8_t buf_[32];
+  size_t buffered_ = 0;
+};
+
+using Sha256Digest = std::array<uint8_t, 32>;
+
+// Streaming SHA-256 (FIPS 180-4).
+class Sha256 {
+ public:
+  Sha256();
+  void Update(const void* data, size_t n);
+  Sha256Digest Digest() const;
+
+ private:
+  uint32_t h_[8];
+  uint64_t total_ = 0;
+  uint8_t buf_[64];
+  size_t buffered_ = 0;
+};
+
+// For unordered containers keyed by a digest, which is already uniform.
+struct Sha256DigestHash {
+  size_t operator()(const Sha256Digest& d) const;
+};
+
+// Feeds every set field of `msg` into `h`, tagged by field number. Bytes
+// fields are hashed in place, so image payloads are never copied. Equal
+// messages hash equally regardless of how they were serialized.
+void HashMessage(const google::protobuf::Message& msg, Xxh64* h);
+void HashMessage(const google::protobuf::Message& msg, Sha256* h);
+
+}  // namespace vision
+}  // namespace lucidia
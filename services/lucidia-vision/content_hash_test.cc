@@ -0,0 +1,55 @@
+#include "services/lucidia-vision/content_hash.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+
+#include <gtest/gtest.h>
+
+namespace lucidia {
+namespace vision {
+namespace {
+
+std::string Hex(const Sha256Digest& d) {
+  std::string out;
+  for (uint8_t byte : d) {
+    char hex[3];
+    std::snprintf(hex, sizeof(hex), "%02x", byte);
+    out += hex;
+  }
+  return out;
+}
+
+std::string Sha256Hex(const std::string& data) {
+  Sha256 h;
+  h.Update(data.data(), data.size());
+  return Hex(h.Digest());
+}
+
+// FIPS 180-4 example vectors.
+TEST(Sha256Test, KnownAnswers) {
+  EXPECT_EQ(Sha256Hex(""),
+            "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+  EXPECT_EQ(Sha256Hex("abc"),
+            "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+  EXPECT_EQ(
+      Sha256Hex("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"),
+      "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+}
+
+TEST(Sha256Test, SplitUpdatesMatchOneUpdate) {
+  const std::string a(1000000, 'a');
+  Sha256 h;
+  // Uneven pieces, straddling block boundaries every way.
+  for (size_t at = 0, step = 1; at < a.size(); step = step * 3 % 97 + 1) {
+    const size_t n = std::min(step, a.size() - at);
+    h.Update(a.data() + at, n);
+    at += n;
+  }
+  EXPECT_EQ(Hex(h.Digest()),
+            "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+}
+
+}  // namespace
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,565 @@
+#include "services/lucidia-vision/dataset_registry.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <vector>
+
+#include "services/lucidia-vision/byte_stream.h"
+#include "services/lucidia-vision/content_hash.h"
+#include "services/lucidia-vision/engine.h"
+#include "services/lucidia-vision/image_io.h"
+#include "services/lucidia-vision/resample.h"
+#include "services/lucidia-vision/vision_ops.h"
+
+namespace lucidia {
+namespace vision {
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr char kMagic[8] = {'L', 'V', 'D', 'S', 'E', 'T', '2', '\0'};
+constexpr char kSuffix[] = ".dataset";
+// Tiles start on a page boundary; 256 x 256 samples is a whole number of
+// pages for every pixel type.
+constexpr size_t kHeaderBytes = 4096;
+constexpr int kStoredTile = 256;
+
+struct FileHeader {
+  char magic[8];
+  uint32_t width;
+  uint32_t height;
+  uint32_t bands;
+  uint32_t type;
+  uint32_t tile_size;
+  uint32_t has_georef;
+  int32_t epsg;  // 0 when unknown.
+  double origin_x;
+  double origin_y;
+  double pixel_width;
+  double pixel_height;
+};
+static_assert(sizeof(FileHeader) <= kHeaderBytes, "header fits its page");
+
+grpc::Status DatasetError(const std::string& msg) {
+  return grpc::Status(grpc::StatusCode::INTERNAL, "dataset: " + msg);
+}
+
+// Dataset ID of `image` in hex: a SHA-256 of the message and, for a path,
+// of the file it names (device, inode, size, mtime), so a file rewritten in
+// place registers as a new dataset. Register trusts a matching ID without
+// comparing content, so it must not be open to crafted collisions.
+std::string ImageId(const v1::Image& image) {
+  Sha256 h;
+  HashMessage(image, &h);
+  HashImageFiles(image, &h);
+  std::string id;
+  id.reserve(2 * sizeof(Sha256Digest));
+  for (uint8_t byte : h.Digest()) {
+    char hex[3];
+    std::snprintf(hex, sizeof(hex), "%02x", byte);
+    id += hex;
+  }
+  return id;
+}
+
+bool IsId(const std::string& s) {
+  return s.size() == 2 * sizeof(Sha256Digest) &&
+         std::all_of(s.begin(), s.end(), [](char c) {
+           return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+         });
+}
+
+}  // namespace
+
+// Geometry of one tile file: the full-resolution level, then each overview.
+struct DatasetRegistry::Mapping {
+  std::shared_ptr<MmapByteStream> file;  // Null while the file is written.
+  bool has_georef = false;
+  Georef georef;                         // Of level 0.
+  std::vector<RasterInfo> levels;
+  std::vector<uint64_t> offsets;         // Of each level's first tile.
+  uint64_t bytes = 0;                    // Header and every level.
+
+  size_t tile_bytes() const {
+    return size_t{kStoredTile} * kStoredTile * levels[0].pixel_bytes();
+  }
+  const uint8_t* TileData(int level, int tx, int ty) const {
+    const RasterInfo& l = levels[level];
+    return file->View(offsets[level] +
+                          (static_cast<uint64_t>(ty) * l.tiles_x() + tx) *
+                              tile_bytes(),
+                      tile_bytes());
+  }
+
+  // Lays out a file for `info` down to a level that fits one tile.
+  static Mapping Plan(const RasterInfo& info) {
+    Mapping m;
+    RasterInfo l = info;
+    l.tile_size = kStoredTile;
+    m.bytes = kHeaderBytes;
+    for (;;) {
+      m.levels.push_back(l);
+      m.offsets.push_back(m.bytes);
+      m.bytes += static_cast<uint64_t>(l.tiles_x()) * l.tiles_y() *
+                 kStoredTile * kStoredTile * l.pixel_bytes();
+      if (std::max(l.width, l.height) <= kStoredTile) break;
+      l.width = (l.width + 1) / 2;
+      l.height = (l.height + 1) / 2;
+    }
+    return m;
+  }
+};
+
+namespace {
+
+using Mapping = DatasetRegistry::Mapping;
+
+// One level of a mapped dataset, re-tiled at whatever size the caller
+// asked for. Reads copy (and convert) straight out of the mapping.
+class DatasetSource : public RasterSource {
+ public:
+  DatasetSource(std::shared_ptr<const Mapping> mapping, int level,
+                int tile_size)
+      : mapping_(std::move(mapping)), level_(level) {
+    info_ = mapping_->levels[level];
+    info_.tile_size = tile_size;
+  }
+
+  const RasterInfo& info() const override { return info_; }
+
+  grpc::Status ReadWindow(const Rect& rect, PixelType type, void* dst,
+                          size_t dst_stride) override {
+    const RasterInfo& l = mapping_->levels[level_];
+    const size_t src_px = l.pixel_bytes();
+    const size_t dst_px = BytesPerSample(type) * l.bands;
+    const size_t tile_stride = size_t{kStoredTile} * src_px;
+    auto* out = static_cast<uint8_t*>(dst);
+    for (int row = 0; row < rect.height; ++row) {
+      const int sy = std::clamp(rect.y + row, 0, l.height - 1);
+      const int ty = sy / kStoredTile;
+      uint8_t* dst_row = out + row * dst_stride;
+      int col = 0;
+      while (col < rect.width) {
+        const int sx = std::clamp(rect.x + col, 0, l.width - 1);
+        const int tx = sx / kStoredTile;
+        // Run length within this tile; clamped (edge) pixels go one at a
+        // time.
+        int run = 1;
+        if (rect.x + col >= 0 && rect.x + col < l.width) {
+          run = std::min(rect.width - col,
+                         std::min(l.width, (tx + 1) * kStoredTile) - sx);
+        }
+        const uint8_t* tile = mapping_->TileData(level_, tx, ty);
+        if (tile == nullptr) return DatasetError("tile file is truncated");
+        const uint8_t* s = tile + (sy - ty * kStoredTile) * tile_stride +
+                           (sx - tx * kStoredTile) * src_px;
+        ConvertSamples(s, l.type, dst_row + col * dst_px, type,
+                       static_cast<size_t>(run) * l.bands);
+        col += run;
+      }
+    }
+    return grpc::Status::OK;
+  }
+
+  bool GetGeoref(Georef* out) const override {
+    if (!mapping_->has_georef) return false;
+    const Georef& g = mapping_->georef;
+    *out = g;
+    out->pixel_width = g.pixel_width * g.width / info_.width;
+    out->pixel_height = g.pixel_height * g.height / info_.height;
+    out->width = info_.width;
+    out->height = info_.height;
+    return true;
+  }
+
+  std::shared_ptr<RasterSource> Reduced(double factor) override {
+    // Coarsest overview that is still at least as fine as requested.
+    const double current = static_cast<double>(mapping_->levels[0].width) /
+                           mapping_->levels[level_].width;
+    int best = -1;
+    for (int i = level_ + 1; i < static_cast<int>(mapping_->levels.size());
+         ++i) {
+      const double r = static_cast<double>(mapping_->levels[0].width) /
+                       mapping_->levels[i].width;
+      if (r / current <= factor * 1.001) best = i;
+    }
+    if (best < 0) return nullptr;
+    return std::make_shared<DatasetSource>(mapping_, best, info_.tile_size);
+  }
+
+ private:
+  std::shared_ptr<const Mapping> mapping_;
+  int level_;
+  RasterInfo info_;
+};
+
+grpc::Status WriteFully(int fd, uint64_t at, const void* data, size_t n) {
+  const auto* p = static_cast<const uint8_t*>(data);
+  while (n > 0) {
+    const ssize_t wrote = ::pwrite(fd, p, n, static_cast<off_t>(at));
+    if (wrote < 0 && errno == EINTR) continue;
+    if (wrote <= 0) {
+      return DatasetError(std::string("write: ") + std::strerror(errno));
+    }
+    p += wrote;
+    at += static_cast<uint64_t>(wrote);
+    n -= static_cast<size_t>(wrote);
+  }
+  return grpc::Status::OK;
+}
+
+// Writes tile rows of one level into their slots of the file behind `fd`,
+// each tile padded to the full stored size.
+class LevelSink : public RasterSink {
+ public:
+  LevelSink(int fd, const Mapping& layout, int level)
+      : fd_(fd), layout_(layout), level_(level) {}
+
+  grpc::Status Begin(const RasterInfo& info) override {
+    const RasterInfo& l = layout_.levels[level_];
+    if (info.width != l.width || info.height != l.height ||
+        info.bands != l.bands || info.type != l.type ||
+        info.tile_size != kStoredTile) {
+      return DatasetError("level does not match its layout");
+    }
+    return grpc::Status::OK;
+  }
+
+  grpc::Status WriteTileRow(int ty, std::vector<Tile>& tiles) override {
+    const size_t px = layout_.levels[level_].pixel_bytes();
+    const size_t tile_stride = size_t{kStoredTile} * px;
+    AlignedBuffer padded(layout_.tile_bytes());
+    for (size_t tx = 0; tx < tiles.size(); ++tx) {
+      const Tile& t = tiles[tx];
+      std::memset(padded.data(), 0, padded.size());
+      for (int y = 0; y < t.rect().height; ++y) {
+        std::memcpy(padded.data() + y * tile_stride, t.row(y),
+                    t.rect().width * px);
+      }
+      const uint64_t at =
+          layout_.offsets[level_] +
+          (static_cast<uint64_t>(ty) * layout_.levels[level_].tiles_x() + tx) *
+              padded.size();
+      grpc::Status s = WriteFully(fd_, at, padded.data(), padded.size());
+      if (!s.ok()) return s;
+    }
+    return grpc::Status::OK;
+  }
+
+  grpc::Status Finish() override { return grpc::Status::OK; }
+
+ private:
+  int fd_;
+  const Mapping& layout_;
+  int level_;
+};
+
+// Reads the header of the file `stream` maps into `*out`.
+bool ParseFile(std::shared_ptr<MmapByteStream> stream, Mapping* out) {
+  const uint8_t* head = stream->View(0, sizeof(FileHeader));
+  if (head == nullptr) return false;
+  FileHeader h;
+  std::memcpy(&h, head, sizeof(h));
+  if (std::memcmp(h.magic, kMagic, sizeof(kMagic)) != 0 ||
+      h.type > static_cast<uint32_t>(PixelType::kF32) || h.width == 0 ||
+      h.height == 0 || h.width > INT32_MAX || h.height > INT32_MAX ||
+      h.bands == 0 || h.bands > 64 || h.tile_size != kStoredTile) {
+    return false;
+  }
+  RasterInfo info;
+  info.width = static_cast<int>(h.width);
+  info.height = static_cast<int>(h.height);
+  info.bands = static_cast<int>(h.bands);
+  info.type = static_cast<PixelType>(h.type);
+  *out = Mapping::Plan(info);
+  if (stream->size() < out->bytes) return false;
+  out->file = std::move(stream);
+  out->has_georef = h.has_georef != 0;
+  out->georef.origin_x = h.origin_x;
+  out->georef.origin_y = h.origin_y;
+  out->georef.pixel_width = h.pixel_width;
+  out->georef.pixel_height = h.pixel_height;
+  out->georef.epsg = h.epsg;
+  out->georef.width = info.width;
+  out->georef.height = info.height;
+  return true;
+}
+
+}  // namespace
+
+DatasetRegistry::DatasetRegistry(const DatasetRegistryOptions& options)
+    : options_(options) {
+  if (options_.dir.empty()) return;
+  std::error_code ec;
+  fs::create_directories(options_.dir, ec);
+  std::vector<std::pair<fs::file_time_type, std::string>> found;
+  for (const auto& entry : fs::directory_iterator(options_.dir, ec)) {
+    const fs::path& path = entry.path();
+    if (path.extension() == ".tmp") {
+      fs::remove(path, ec);  // A build that never finished.
+      continue;
+    }
+    if (path.extension() != kSuffix) continue;
+    const std::string id = path.stem().string();
+    if (!IsId(id)) {
+      fs::remove(path, ec);  // Named by an older ID scheme.
+      continue;
+    }
+    std::shared_ptr<MmapByteStream> stream;
+    auto mapping = std::make_shared<Mapping>();
+    if (!MmapByteStream::Open(path.string(), &stream).ok() ||
+        !ParseFile(std::move(stream), mapping.get())) {
+      fs::remove(path, ec);  // Damaged, or written in an older layout.
+      continue;
+    }
+    stored_bytes_ += mapping->bytes;
+    entries_[id].mapping = std::move(mapping);
+    found.push_back({entry.last_write_time(ec), id});
+  }
+  std::sort(found.begin(), found.end(),
+            [](const auto& a, const auto& b) { return a.first > b.first; });
+  for (const auto& f : found) {
+    released_.push_back(f.second);
+    entries_[f.second].lru = std::prev(released_.end());
+  }
+  MakeRoomLocked(0);
+}
+
+DatasetRegistry::~DatasetRegistry() = default;
+
+std::string DatasetRegistry::FilePath(const std::string& id) const {
+  return (fs::path(options_.dir) / (id + kSuffix)).string();
+}
+
+DatasetRegistry::Info DatasetRegistry::InfoLocked(const std::string& id,
+                                                  const Entry& e) const {
+  Info info;
+  info.id = id;
+  info.raster = e.mapping->levels[0];
+  info.has_georef = e.mapping->has_georef;
+  info.georef = e.mapping->georef;
+  info.stored_bytes = e.mapping->bytes;
+  info.references = e.references;
+  return info;
+}
+
+grpc::Status DatasetRegistry::Register(const v1::Image& image, Info* out) {
+  if (options_.dir.empty()) {
+    return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION,
+                        "register: datasets are disabled (no --dataset_dir)");
+  }
+  if (!image.dataset().empty()) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "register: image must carry data or a path");
+  }
+  const std::string id = ImageId(image);
+  for (;;) {
+    std::promise<grpc::Status> promise;
+    std::shared_future<grpc::Status> wait;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      auto it = entries_.find(id);
+      if (it != entries_.end()) {
+        Entry& e = it->second;
+        if (e.references++ == 0) released_.erase(e.lru);
+        ++stats_.registrations;
+        ++stats_.reused;
+        *out = InfoLocked(id, e);
+        return grpc::Status::OK;
+      }
+      auto p = pending_.find(id);
+      if (p != pending_.end()) {
+        wait = p->second;
+      } else {
+        pending_[id] = promise.get_future().share();
+      }
+    }
+    if (wait.valid()) {
+      grpc::Status s = wait.get();
+      if (!s.ok()) return s;
+      continue;  // Take a reference on the finished entry.
+    }
+
+    std::shared_ptr<const Mapping> mapping;
+    grpc::Status s = Build(image, id, &mapping);
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      pending_.erase(id);
+      if (s.ok()) {
+        Entry& e = entries_[id];
+        e.mapping = std::move(mapping);
+        e.references = 1;
+        ++stats_.registrations;
+        *out = InfoLocked(id, e);
+      }
+    }
+    promise.set_value(s);
+    return s;
+  }
+}
+
+grpc::Status DatasetRegistry::Build(const v1::Image& image,
+                                    const std::string& id,
+                                    std::shared_ptr<const Mapping>* out) {
+  std::shared_ptr<RasterSource> source;
+  grpc::Status s = OpenImage(image, kStoredTile, &source);
+  if (!s.ok()) return s;
+  auto layout = std::make_shared<Mapping>(Mapping::Plan(source->info()));
+  layout->has_georef = ResolveGeoref(image, *source, &layout->georef);
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (!MakeRoomLocked(layout->bytes)) {
+      return grpc::Status(
+          grpc::StatusCode::RESOURCE_EXHAUSTED,
+          "register: " + std::to_string(layout->bytes >> 20) +
+              " MiB dataset does not fit the dataset budget");
+    }
+    reserved_bytes_ += layout->bytes;
+  }
+
+  const std::string path = FilePath(id);
+  const std::string tmp = path + ".tmp";
+  const int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                        0644);
+  if (fd < 0) {
+    s = DatasetError(tmp + ": " + std::strerror(errno));
+  } else if (::ftruncate(fd, static_cast<off_t>(layout->bytes)) != 0) {
+    s = DatasetError(std::string("ftruncate: ") + std::strerror(errno));
+  }
+  if (s.ok()) {
+    FileHeader h = {};
+    std::memcpy(h.magic, kMagic, sizeof(kMagic));
+    const RasterInfo& info = layout->levels[0];
+    h.width = static_cast<uint32_t>(info.width);
+    h.height = static_cast<uint32_t>(info.height);
+    h.bands = static_cast<uint32_t>(info.bands);
+    h.type = static_cast<uint32_t>(info.type);
+    h.tile_size = kStoredTile;
+    h.has_georef = layout->has_georef;
+    h.epsg = layout->georef.epsg;
+    h.origin_x = layout->georef.origin_x;
+    h.origin_y = layout->georef.origin_y;
+    h.pixel_width = layout->georef.pixel_width;
+    h.pixel_height = layout->georef.pixel_height;
+    s = WriteFully(fd, 0, &h, sizeof(h));
+  }
+  // Full resolution from the decoder, then each overview box-filtered from
+  // the level above it, read back through a mapping of the file so far.
+  for (size_t level = 0; s.ok() && level < layout->levels.size(); ++level) {
+    std::shared_ptr<RasterSource> input = source;
+    if (level > 0) {
+      s = MmapByteStream::Open(tmp, &layout->file);
+      if (!s.ok()) break;
+      const RasterInfo& l = layout->levels[level];
+      input = std::make_shared<ResampleSource>(
+          std::make_shared<DatasetSource>(layout, static_cast<int>(level) - 1,
+                                          kStoredTile),
+          l.width, l.height, ResampleFilter::kArea);
+    }
+    LevelSink sink(fd, *layout, static_cast<int>(level));
+    s = Materialize(*input, sink);
+    if (level == 0) source.reset();  // Done with the upload or file.
+  }
+  if (fd >= 0) ::close(fd);
+  layout->file.reset();
+  if (s.ok() && std::rename(tmp.c_str(), path.c_str()) != 0) {
+    s = DatasetError(std::string("rename: ") + std::strerror(errno));
+  }
+  if (s.ok()) s = MmapByteStream::Open(path, &layout->file);
+
+  std::lock_guard<std::mutex> lock(mu_);
+  reserved_bytes_ -= layout->bytes;
+  if (!s.ok()) {
+    std::error_code ec;
+    fs::remove(tmp, ec);
+    fs::remove(path, ec);
+    return s;
+  }
+  stored_bytes_ += layout->bytes;
+  *out = std::move(layout);
+  return grpc::Status::OK;
+}
+
+grpc::Status DatasetRegistry::Release(const std::string& id,
+                                      uint32_t* references) {
+  std::lock_guard<std::mutex> lock(mu_);
+  auto it = entries_.find(id);
+  if (it == entries_.end() || it->second.references == 0) {
+    return grpc::Status(grpc::StatusCode::NOT_FOUND,
+                        "release: no registration of dataset " + id);
+  }
+  Entry& e = it->second;
+  if (--e.references == 0) {
+    released_.push_front(id);
+    e.lru = released_.begin();
+  }
+  *references = e.references;
+  return grpc::Status::OK;
+}
+
+grpc::Status DatasetRegistry::Open(const std::string& id, int tile_size,
+                                   std::shared_ptr<RasterSource>* out) {
+  std::shared_ptr<const Mapping> mapping;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = entries_.find(id);
+    if (it == entries_.end()) {
+      return grpc::Status(grpc::StatusCode::NOT_FOUND,
+                          "unknown dataset " + id +
+                              " (never registered, or released and evicted)");
+    }
+    Entry& e = it->second;
+    if (e.references == 0) {
+      released_.splice(released_.begin(), released_, e.lru);
+    }
+    mapping = e.mapping;
+  }
+  *out = std::make_shared<DatasetSource>(std::move(mapping), 0, tile_size);
+  return grpc::Status::OK;
+}
+
+bool DatasetRegistry::MakeRoomLocked(uint64_t incoming) {
+  while (stored_bytes_ + reserved_bytes_ + incoming > options_.max_bytes &&
+         !released_.empty()) {
+    EvictLocked(released_.back());
+  }
+  return stored_bytes_ + reserved_bytes_ + incoming <= options_.max_bytes;
+}
+
+void DatasetRegistry::EvictLocked(const std::string& id) {
+  auto it = entries_.find(id);
+  Entry& e = it->second;
+  released_.erase(e.lru);
+  stored_bytes_ -= e.mapping->bytes;
+  ++stats_.evictions;
+  // Readers holding the mapping keep the pages; the name goes now.
+  std::error_code ec;
+  fs::remove(FilePath(id), ec);
+  entries_.erase(it);
+}
+
+DatasetRegistry::Stats DatasetRegistry::stats() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  Stats s = stats_;
+  for (const auto& [id, e] : entries_) {
+    (void)id;
+    if (e.references > 0) {
+      ++s.referenced;
+      s.referenced_bytes += e.mapping->bytes;
+    } else {
+      ++s.released;
+      s.released_bytes += e.mapping->bytes;
+    }
+  }
+  return s;
+}
+
+}  // namespace vision
+}  // namespace lucidia
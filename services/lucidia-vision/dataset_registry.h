@@ -0,0 +1,112 @@
+// Rasters registered once and then referenced by ID (Image.dataset).
+//
+// Registering decodes the input a single time into a file of raw tiles:
+// native sample type, bands interleaved, every tile padded to full size and
+// page aligned, followed by 2x overviews down to a single tile. The file is
+// mapped read-only, so a request reads its tiles straight from the page
+// cache with no transfer, no inflate and no decode, and a window touches
+// only the tiles under it.
+//
+// IDs are the SHA-256 of the registered Image (a path by the identity of
+// the file it names, so rewriting the file yields a new ID), so registering
+// the same image twice shares one copy, no other image can be crafted to
+// share it, and result-cache keys naming an ID stay valid. Every Register
+// takes a reference and every Release drops one. Datasets left with none
+// stay on disk (and survive restarts) until registering another would pass
+// the byte budget; they are then deleted least recently used first.
+// Referenced datasets are never evicted, and requests already reading an
+// evicted dataset keep their mapping until they finish.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "proto/vision_service.pb.h"
+#include "services/lucidia-vision/raster.h"
+
+namespace lucidia {
+namespace vision {
+
+struct DatasetRegistryOptions {
+  std::string dir;  // Where tile files live; empty disables registration.
+  size_t max_bytes = size_t{64} << 30;
+};
+
+class DatasetRegistry {
+ public:
+  struct Info {
+    std::string id;
+    RasterInfo raster;
+    bool has_georef = false;
+    Georef georef;
+    uint64_t stored_bytes = 0;
+    uint32_t references = 0;
+  };
+
+  struct Stats {
+    size_t referenced = 0;         // Datasets with at least one reference.
+    size_t released = 0;           // Kept for reuse, evictable.
+    uint64_t referenced_bytes = 0;
+    uint64_t released_bytes = 0;
+    uint64_t registrations = 0;    // Successful ones.
+    uint64_t reused = 0;           // Registrations of an existing copy.
+    uint64_t evictions = 0;
+  };
+
+  // Creates options.dir and indexes the datasets already in it as released,
+  // so they are served again after a restart.
+  explicit DatasetRegistry(const DatasetRegistryOptions& options);
+  ~DatasetRegistry();
+  DatasetRegistry(const DatasetRegistry&) = delete;
+  DatasetRegistry& operator=(const DatasetRegistry&) = delete;
+
+  // Registers `image` (data or path, resolved as OpenImage does) and adds a
+  // reference. Concurrent registrations of one image decode it once.
+  grpc::Status Register(const v1::Image& image, Info* out);
+  // Drops one reference; *references is what remains.
+  grpc::Status Release(const std::string& id, uint32_t* references);
+  // Opens dataset `id` tiled at `tile_size` (which need not match the
+  // stored tiles). Does not take a reference.
+  grpc::Status Open(const std::string& id, int tile_size,
+                    std::shared_ptr<RasterSource>* out);
+
+  Stats stats() const;
+
+  // Layout and mapping of one tile file (defined with the sources that read
+  // it).
+  struct Mapping;
+
+ private:
+  struct Entry {
+    std::shared_ptr<const Mapping> mapping;
+    uint32_t references = 0;
+    std::list<std::string>::iterator lru;  // Valid when references == 0.
+  };
+
+  grpc::Status Build(const v1::Image& image, const std::string& id,
+                     std::shared_ptr<const Mapping>* out);
+  // Evicts released datasets, oldest first, until `incoming` more bytes fit
+  // the budget. False if they cannot.
+  bool MakeRoomLocked(uint64_t incoming);
+  void EvictLocked(const std::string& id);
+  std::string FilePath(const std::string& id) const;
+  Info InfoLocked(const std::string& id, const Entry& e) const;
+
+  const DatasetRegistryOptions options_;
+  mutable std::mutex mu_;
+  std::map<std::string, Entry> entries_;
+  std::list<std::string> released_;  // Unreferenced IDs, most recent first.
+  std::map<std::string, std::shared_future<grpc::Status>> pending_;
+  uint64_t stored_bytes_ = 0;
+  uint64_t reserved_bytes_ = 0;      // Of builds in progress.
+  Stats stats_;
+};
+
+}  // namespace vision
+}  // namespace lucidia
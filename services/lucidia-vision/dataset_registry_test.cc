@@ -0,0 +1,129 @@
+#include "services/lucidia-vision/dataset_registry.h"
+
+#include <unistd.h>
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include "proto/vision_service.pb.h"
+#include "services/lucidia-vision/image_io.h"
+#include "services/lucidia-vision/test_util.h"
+
+namespace lucidia {
+namespace vision {
+namespace {
+
+namespace fs = std::filesystem;
+
+using testing::MakeRaster;
+using testing::ReadAll;
+
+// A PNG of `width` x `height` u8 samples all equal to `value`.
+v1::Image Flat(int width, int height, int value) {
+  auto raster = MakeRaster(width, height, 1, PixelType::kU8,
+                           [=](int, int, int) { return value; });
+  v1::Image image;
+  EXPECT_TRUE(EncodeImage(*raster, "png", &image).ok());
+  return image;
+}
+
+class DatasetRegistryTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    root_ = fs::temp_directory_path() /
+            ("lucidia-datasets-" + std::to_string(::getpid()));
+    fs::create_directories(root_ / "images");
+    SetImageRoot((root_ / "images").string());
+    options_.dir = (root_ / "datasets").string();
+  }
+  void TearDown() override {
+    SetImageRoot("");
+    fs::remove_all(root_);
+  }
+  void WriteImage(const std::string& name, const v1::Image& image) {
+    std::ofstream(root_ / "images" / name, std::ios::binary | std::ios::trunc)
+        << image.data();
+  }
+  // First sample of dataset `id`.
+  int FirstSample(DatasetRegistry& registry, const std::string& id) {
+    std::shared_ptr<RasterSource> source;
+    EXPECT_TRUE(registry.Open(id, kDefaultTileSize, &source).ok());
+    if (source == nullptr) return -1;
+    return ReadAll<uint8_t>(*source, PixelType::kU8).at(0);
+  }
+
+  fs::path root_;
+  DatasetRegistryOptions options_;
+};
+
+// A path is registered by the file it names, not its spelling: rewriting
+// the file registers a new dataset with the new pixels.
+TEST_F(DatasetRegistryTest, RewrittenPathIsANewDataset) {
+  DatasetRegistry registry(options_);
+  WriteImage("dem.png", Flat(40, 30, 10));
+  v1::Image image;
+  image.set_path("dem.png");
+  DatasetRegistry::Info first;
+  ASSERT_TRUE(registry.Register(image, &first).ok());
+  EXPECT_EQ(FirstSample(registry, first.id), 10);
+
+  WriteImage("dem.png", Flat(40, 30, 20));
+  fs::last_write_time(root_ / "images" / "dem.png",
+                      fs::last_write_time(root_ / "images" / "dem.png") +
+                          std::chrono::seconds(5));
+  DatasetRegistry::Info second;
+  ASSERT_TRUE(registry.Register(image, &second).ok());
+  EXPECT_NE(second.id, first.id);
+  EXPECT_EQ(FirstSample(registry, second.id), 20);
+  EXPECT_EQ(FirstSample(registry, first.id), 10);
+}
+
+// IDs are SHA-256 hex and name the stored file; files named by the older
+// 16-digit IDs are dropped at startup.
+TEST_F(DatasetRegistryTest, IdIsSha256Hex) {
+  fs::create_directories(options_.dir);
+  const fs::path stale = fs::path(options_.dir) / "0123456789abcdef.dataset";
+  std::ofstream(stale, std::ios::binary) << std::string(8192, '\0');
+  DatasetRegistry registry(options_);
+  EXPECT_FALSE(fs::exists(stale));
+  DatasetRegistry::Info info;
+  ASSERT_TRUE(registry.Register(Flat(40, 30, 10), &info).ok());
+  ASSERT_EQ(info.id.size(), 64u);
+  EXPECT_EQ(info.id.find_first_not_of("0123456789abcdef"), std::string::npos);
+  EXPECT_TRUE(fs::exists(fs::path(options_.dir) / (info.id + ".dataset")));
+}
+
+// The georeferencing, CRS included, survives a restart.
+TEST_F(DatasetRegistryTest, RestartKeepsGeoref) {
+  v1::Image image = Flat(40, 30, 10);
+  v1::GeoTransform* geo = image.mutable_geo();
+  geo->set_origin_x(500000.0);
+  geo->set_origin_y(4200000.0);
+  geo->set_pixel_width(10.0);
+  geo->set_pixel_height(-10.0);
+  geo->set_epsg(32633);
+  std::string id;
+  {
+    DatasetRegistry registry(options_);
+    DatasetRegistry::Info info;
+    ASSERT_TRUE(registry.Register(image, &info).ok());
+    id = info.id;
+  }
+  DatasetRegistry registry(options_);
+  std::shared_ptr<RasterSource> source;
+  ASSERT_TRUE(registry.Open(id, kDefaultTileSize, &source).ok());
+  Georef georef;
+  ASSERT_TRUE(source->GetGeoref(&georef));
+  EXPECT_EQ(georef.epsg, 32633);
+  EXPECT_DOUBLE_EQ(georef.origin_x, 500000.0);
+  EXPECT_DOUBLE_EQ(georef.pixel_height, -10.0);
+}
+
+}  // namespace
+}  // namespace vision
+}  // namespace lucidia
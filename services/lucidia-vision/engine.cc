@@ -0,0 +1,230 @@
+#include "services/lucidia-vision/engine.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "services/lucidia-vision/thread_pool.h"
+
+namespace lucidia {
+namespace vision {
+
+// TileOpSource --------------------------------------------------------------
+
+TileOpSource::TileOpSource(const RasterInfo& info, size_t cache_tiles)
+    : info_(info),
+      cache_tiles_(cache_tiles ? cache_tiles
+                               : static_cast<size_t>(2 * info.tiles_x() + 2)) {}
+
+grpc::Status TileOpSource::ReadTile(TileIndex t, Tile* tile) {
+  // Sequential consumers (Materialize) own the output tile; compute straight
+  // into it instead of going through the cache.
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = index_.find(t.ty * info_.tiles_x() + t.tx);
+    if (it != index_.end()) {
+      const Tile& cached = *it->second->second;
+      for (int y = 0; y < cached.rect().height; ++y) {
+        std::memcpy(tile->row(y), cached.row(y),
+                    cached.rect().width * info_.pixel_bytes());
+      }
+      return grpc::Status::OK;
+    }
+  }
+  return ComputeTile(t, tile);
+}
+
+grpc::Status TileOpSource::CachedTile(TileIndex t, TilePtr* out) {
+  const int key = t.ty * info_.tiles_x() + t.tx;
+  std::promise<std::pair<grpc::Status, TilePtr>> promise;
+  std::shared_future<std::pair<grpc::Status, TilePtr>> wait;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second);
+      *out = it->second->second;
+      return grpc::Status::OK;
+    }
+    auto p = pending_.find(key);
+    if (p != pending_.end()) {
+      wait = p->second;
+    } else {
+      pending_[key] = promise.get_future().share();
+    }
+  }
+  if (wait.valid()) {
+    auto result = wait.get();
+    *out = result.second;
+    return result.first;
+  }
+
+  auto tile = std::make_shared<Tile>(info_.TileRect(t.tx, t.ty), info_.bands,
+                                     info_.type);
+  grpc::Status status = ComputeTile(t, tile.get());
+  TilePtr result = status.ok() ? TilePtr(tile) : nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    pending_.erase(key);
+    if (status.ok()) {
+      lru_.emplace_front(key, result);
+      index_[key] = lru_.begin();
+      while (lru_.size() > cache_tiles_) {
+        index_.erase(lru_.back().first);
+        lru_.pop_back();
+      }
+    }
+  }
+  promise.set_value({status, result});
+  *out = result;
+  return status;
+}
+
+grpc::Status TileOpSource::ReadWindow(const Rect& rect, PixelType type,
+                                      void* dst, size_t dst_stride) {
+  const int ts = info_.tile_size;
+  const size_t dst_px = BytesPerSample(type) * info_.bands;
+  auto* out = static_cast<uint8_t*>(dst);
+  // Clamp coordinates first so edge replication falls out of the tile lookup.
+  std::vector<int> sx(rect.width);
+  for (int c = 0; c < rect.width; ++c) {
+    sx[c] = std::clamp(rect.x + c, 0, info_.width - 1);
+  }
+  TilePtr tile;
+  int cur_tx = -1, cur_ty = -1;
+  for (int r = 0; r < rect.height; ++r) {
+    const int sy = std::clamp(rect.y + r, 0, info_.height - 1);
+    uint8_t* drow = out + r * dst_stride;
+    int c = 0;
+    while (c < rect.width) {
+      const int tx = sx[c] / ts, ty = sy / ts;
+      if (tx != cur_tx || ty != cur_ty) {
+        grpc::Status s = CachedTile(TileIndex{tx, ty}, &tile);
+        if (!s.ok()) return s;
+        cur_tx = tx;
+        cur_ty = ty;
+      }
+      // Extend the run while the source columns stay contiguous in this tile.
+      int run = 1;
+      while (c + run < rect.width && sx[c + run] == sx[c] + run &&
+             sx[c + run] / ts == tx) {
+        ++run;
+      }
+      const uint8_t* srow = tile->row(sy - tile->rect().y) +
+                            (sx[c] - tile->rect().x) * info_.pixel_bytes();
+      ConvertSamples(srow, info_.type, drow + c * dst_px, type,
+                     static_cast<size_t>(run) * info_.bands);
+      c += run;
+    }
+  }
+  return grpc::Status::OK;
+}
+
+// WindowOpSource ------------------------------------------------------------
+
+WindowOpSource::WindowOpSource(std::shared_ptr<RasterSource> upstream,
+                               const RasterInfo& info, PixelType in_type,
+                               int halo, Kernel kernel)
+    : TileOpSource(info),
+      upstream_(std::move(upstream)),
+      in_type_(in_type),
+      halo_(halo),
+      kernel_(std::move(kernel)) {}
+
+grpc::Status WindowOpSource::ComputeTile(TileIndex t, Tile* out) {
+  (void)t;
+  const Rect window = out->rect().Inflate(halo_);
+  const int bands = upstream_->info().bands;
+  const size_t row_bytes =
+      static_cast<size_t>(window.width) * bands * BytesPerSample(in_type_);
+  const size_t stride =
+      (row_bytes + kTileAlignment - 1) / kTileAlignment * kTileAlignment;
+  AlignedBuffer in(stride * window.height);
+  grpc::Status s = upstream_->ReadWindow(window, in_type_, in.data(), stride);
+  if (!s.ok()) return s;
+  kernel_(in.data(), stride, out);
+  return grpc::Status::OK;
+}
+
+// CropSource ----------------------------------------------------------------
+
+CropSource::CropSource(std::shared_ptr<RasterSource> upstream, const Rect& rect)
+    : upstream_(std::move(upstream)), rect_(rect), info_(upstream_->info()) {
+  info_.width = rect.width;
+  info_.height = rect.height;
+}
+
+grpc::Status CropSource::ReadWindow(const Rect& rect, PixelType type,
+                                    void* dst, size_t dst_stride) {
+  const Rect shifted{rect.x + rect_.x, rect.y + rect_.y, rect.width,
+                     rect.height};
+  return upstream_->ReadWindow(shifted, type, dst, dst_stride);
+}
+
+bool CropSource::GetGeoref(Georef* out) const {
+  if (!upstream_->GetGeoref(out)) return false;
+  out->origin_x += rect_.x * out->pixel_width;
+  out->origin_y += rect_.y * out->pixel_height;
+  out->width = rect_.width;
+  out->height = rect_.height;
+  return true;
+}
+
+std::shared_ptr<RasterSource> CropSource::Reduced(double factor) {
+  // Overviews halve the side per level, rounding up. Walk from the coarsest
+  // one allowed towards full resolution until the window's edges land on
+  // overview pixel boundaries (or on the raster's edge).
+  const RasterInfo& full = upstream_->info();
+  for (double f = factor; f >= 2.0; f /= 2.0) {
+    std::shared_ptr<RasterSource> overview = upstream_->Reduced(f);
+    if (overview == nullptr) return nullptr;
+    const RasterInfo& o = overview->info();
+    int scale = 1;
+    while ((full.width + scale - 1) / scale > o.width) scale *= 2;
+    if ((full.width + scale - 1) / scale != o.width ||
+        (full.height + scale - 1) / scale != o.height) {
+      return nullptr;
+    }
+    const auto aligned = [scale](int start, int end, int size) {
+      return start % scale == 0 && (end % scale == 0 || end == size);
+    };
+    if (!aligned(rect_.x, rect_.right(), full.width) ||
+        !aligned(rect_.y, rect_.bottom(), full.height)) {
+      continue;
+    }
+    const Rect reduced{rect_.x / scale, rect_.y / scale,
+                       (rect_.right() + scale - 1) / scale - rect_.x / scale,
+                       (rect_.bottom() + scale - 1) / scale - rect_.y / scale};
+    return std::make_shared<CropSource>(std::move(overview), reduced);
+  }
+  return nullptr;
+}
+
+// Materialize ---------------------------------------------------------------
+
+grpc::Status Materialize(RasterSource& source, RasterSink& sink) {
+  const RasterInfo& info = source.info();
+  grpc::Status s = sink.Begin(info);
+  if (!s.ok()) return s;
+  for (int ty = 0; ty < info.tiles_y(); ++ty) {
+    std::vector<Tile> row;
+    row.reserve(info.tiles_x());
+    for (int tx = 0; tx < info.tiles_x(); ++tx) {
+      row.emplace_back(info.TileRect(tx, ty), info.bands, info.type);
+    }
+    // Tiles of one row are independent; the sink still sees rows in order.
+    std::vector<grpc::Status> status(info.tiles_x());
+    ParallelFor(info.tiles_x(), [&](int tx) {
+      status[tx] = source.ReadTile(TileIndex{tx, ty}, &row[tx]);
+    });
+    for (const grpc::Status& ts : status) {
+      if (!ts.ok()) return ts;
+    }
+    s = sink.WriteTileRow(ty, row);
+    if (!s.ok()) return s;
+  }
+  return sink.Finish();
+}
+
+}  // namespace vision
+}  // namespace lucidia
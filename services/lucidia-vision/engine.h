@@ -0,0 +1,103 @@
+// Tile-by-tile execution of raster operations.
+//
+// Each operation is a TileOpSource: a lazily evaluated raster whose tiles are
+// computed from windows of its upstream source. Materialize() drives a
+// source into a sink in tile-row order, so peak memory is a few tile rows of
+// the output plus whatever window the upstream keeps decoded.
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "services/lucidia-vision/raster.h"
+
+namespace lucidia {
+namespace vision {
+
+class TileOpSource : public RasterSource {
+ public:
+  // `cache_tiles` bounds how many computed tiles are kept for ReadWindow
+  // callers (downstream operations reading with a halo). 0 picks two tile
+  // rows, enough for any halo smaller than a tile.
+  explicit TileOpSource(const RasterInfo& info, size_t cache_tiles = 0);
+
+  const RasterInfo& info() const override { return info_; }
+  grpc::Status ReadWindow(const Rect& rect, PixelType type, void* dst,
+                          size_t dst_stride) override;
+  grpc::Status ReadTile(TileIndex t, Tile* tile) override;
+
+ protected:
+  // Computes tile `t` into `out`, which is already shaped to its TileRect.
+  virtual grpc::Status ComputeTile(TileIndex t, Tile* out) = 0;
+
+  RasterInfo info_;
+
+ private:
+  using TilePtr = std::shared_ptr<const Tile>;
+  grpc::Status CachedTile(TileIndex t, TilePtr* out);
+
+  size_t cache_tiles_;
+  std::mutex mu_;
+  // LRU of computed tiles, most recent at the front; in-flight computations
+  // are shared so concurrent readers of one tile compute it once.
+  std::list<std::pair<int, TilePtr>> lru_;
+  std::map<int, std::list<std::pair<int, TilePtr>>::iterator> index_;
+  std::map<int, std::shared_future<std::pair<grpc::Status, TilePtr>>> pending_;
+};
+
+// Convenience TileOpSource for kernels that only need a halo'd window of one
+// upstream source: fn(input_window, input_stride_bytes, out_tile).
+class WindowOpSource : public TileOpSource {
+ public:
+  using Kernel = std::function<void(const uint8_t* in, size_t in_stride,
+                                    Tile* out)>;
+  WindowOpSource(std::shared_ptr<RasterSource> upstream, const RasterInfo& info,
+                 PixelType in_type, int halo, Kernel kernel);
+
+ protected:
+  grpc::Status ComputeTile(TileIndex t, Tile* out) override;
+
+ private:
+  std::shared_ptr<RasterSource> upstream_;
+  PixelType in_type_;
+  int halo_;
+  Kernel kernel_;
+};
+
+// View of `rect` of an upstream source (a request's window). Reads are
+// offset into the upstream and not clipped to the view, so a halo at the
+// view's edge sees the real neighbouring pixels; only the upstream's own
+// border is replicated. Nothing outside what consumers read is decoded.
+class CropSource : public RasterSource {
+ public:
+  // `rect` must lie within the upstream raster.
+  CropSource(std::shared_ptr<RasterSource> upstream, const Rect& rect);
+
+  const RasterInfo& info() const override { return info_; }
+  grpc::Status ReadWindow(const Rect& rect, PixelType type, void* dst,
+                          size_t dst_stride) override;
+  void Trim() override { upstream_->Trim(); }
+  bool GetGeoref(Georef* out) const override;
+  // The same window of an upstream overview, when the window falls on
+  // whole overview pixels.
+  std::shared_ptr<RasterSource> Reduced(double factor) override;
+
+ private:
+  std::shared_ptr<RasterSource> upstream_;
+  Rect rect_;
+  RasterInfo info_;
+};
+
+// Pulls every tile of `source` in tile-row order and hands each finished row
+// to `sink`. Tiles within a row are computed in parallel on the default pool;
+// they are dropped as soon as the sink has consumed them.
+grpc::Status Materialize(RasterSource& source, RasterSink& sink);
+
+}  // namespace vision
+}  // namespace lucidia
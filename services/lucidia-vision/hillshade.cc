@@ -0,0 +1,407 @@
+#include "services/lucidia-vision/hillshade.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LUCIDIA_VISION_X86 1
+#endif
+
+#include "services/lucidia-vision/engine.h"
+
+namespace lucidia {
+namespace vision {
+
+namespace {
+
+// With gx = (c + 2f + i) - (a + 2d + g) and gy = (a + 2b + c) - (g + 2h + i)
+// over the 3x3 window
+//   a b c
+//   d e f
+//   g h i
+// the surface normal is (-p, -q, 1) with p = z*gx/(8*cell_x) and
+// q = z*gy/(8*cell_y). Dotting it with the unit sun vector gives
+//   shade = (sin_alt - gx*ke - gy*kn) / sqrt(1 + gx^2*kxx + gy^2*kyy)
+// which needs no trigonometry per pixel.
+struct RowConstants {
+  float sin_alt;
+  float ke;   // z * sin(az) * cos(alt) / (8 * cell_x)
+  float kn;   // z * cos(az) * cos(alt) / (8 * cell_y)
+  float kxx;  // (z / (8 * cell_x))^2
+  float kyy;  // (z / (8 * cell_y))^2
+};
+
+RowConstants MakeConstants(const HillshadeParams& p, double azimuth_deg,
+                           double altitude_deg) {
+  const double rad = M_PI / 180.0;
+  const double az = azimuth_deg * rad, alt = altitude_deg * rad;
+  const double sx = p.z_factor / (8.0 * p.cell_x);
+  const double sy = p.z_factor / (8.0 * p.cell_y);
+  RowConstants k;
+  k.sin_alt = static_cast<float>(std::sin(alt));
+  k.ke = static_cast<float>(sx * std::sin(az) * std::cos(alt));
+  k.kn = static_cast<float>(sy * std::cos(az) * std::cos(alt));
+  k.kxx = static_cast<float>(sx * sx);
+  k.kyy = static_cast<float>(sy * sy);
+  return k;
+}
+
+// Several lights share kxx/kyy, so the denominator above is computed once
+// per pixel; each light then adds sin_alt - gx*ke - gy*kn.
+struct LightConstants {
+  float sin_alt;
+  float ke;
+  float kn;
+  float weight;  // Normalised; unused for one band per light.
+};
+
+struct MultiConstants {
+  float kxx;
+  float kyy;
+  int count;
+  bool blend;  // Weighted mean into one plane, else one plane per light.
+  LightConstants light[kMaxHillshadeLights];
+};
+
+MultiConstants MakeMultiConstants(const HillshadeParams& p) {
+  MultiConstants k;
+  k.count = static_cast<int>(
+      std::min<size_t>(p.lights.size(), kMaxHillshadeLights));
+  k.blend = !p.band_per_light;
+  double total = 0;
+  for (int l = 0; l < k.count; ++l) total += p.lights[l].weight;
+  for (int l = 0; l < k.count; ++l) {
+    const HillshadeLight& light = p.lights[l];
+    const RowConstants one =
+        MakeConstants(p, light.azimuth_deg, light.altitude_deg);
+    k.kxx = one.kxx;
+    k.kyy = one.kyy;
+    k.light[l] = {one.sin_alt, one.ke, one.kn,
+                  static_cast<float>(total > 0 ? light.weight / total
+                                               : 1.0 / k.count)};
+  }
+  return k;
+}
+
+// r0/r1/r2 point at the halo column of the rows above, at and below the
+// output row; n output pixels are produced.
+using RowKernel = void (*)(const float* r0, const float* r1, const float* r2,
+                           int n, const RowConstants& k, uint8_t* out);
+// Writes shades in [0, 1]: plane p of n floats at out + p * n, one plane when
+// blending, else one per light.
+using MultiRowKernel = void (*)(const float* r0, const float* r1,
+                                const float* r2, int n,
+                                const MultiConstants& k, float* out);
+
+inline uint8_t ShadeScalar(const float* r0, const float* r1, const float* r2,
+                           int x, const RowConstants& k) {
+  const float a = r0[x], b = r0[x + 1], c = r0[x + 2];
+  const float d = r1[x], f = r1[x + 2];
+  const float g = r2[x], h = r2[x + 1], i = r2[x + 2];
+  const float gx = (c + 2 * f + i) - (a + 2 * d + g);
+  const float gy = (a + 2 * b + c) - (g + 2 * h + i);
+  const float shade = (k.sin_alt - gx * k.ke - gy * k.kn) /
+                      std::sqrt(1.0f + gx * gx * k.kxx + gy * gy * k.kyy);
+  // NaN (a nodata cell under the stencil) shades to 0, as max_ps makes it in
+  // the SIMD rows; casting it would be undefined.
+  if (!std::isfinite(shade)) return 0;
+  return static_cast<uint8_t>(std::clamp(shade, 0.0f, 1.0f) * 255.0f + 0.5f);
+}
+
+void HillshadeRowScalar(const float* r0, const float* r1, const float* r2,
+                        int n, const RowConstants& k, uint8_t* out) {
+  for (int x = 0; x < n; ++x) out[x] = ShadeScalar(r0, r1, r2, x, k);
+}
+
+inline void MultiShadeScalar(const float* r0, const float* r1, const float* r2,
+                             int x, int n, const MultiConstants& k,
+                             float* out) {
+  const float a = r0[x], b = r0[x + 1], c = r0[x + 2];
+  const float d = r1[x], f = r1[x + 2];
+  const float g = r2[x], h = r2[x + 1], i = r2[x + 2];
+  const float gx = (c + 2 * f + i) - (a + 2 * d + g);
+  const float gy = (a + 2 * b + c) - (g + 2 * h + i);
+  const float r = 1.0f / std::sqrt(1.0f + gx * gx * k.kxx + gy * gy * k.kyy);
+  float acc = 0;
+  for (int l = 0; l < k.count; ++l) {
+    const LightConstants& light = k.light[l];
+    float shade = (light.sin_alt - gx * light.ke - gy * light.kn) * r;
+    // NaN (nodata under the stencil) counts as 0, as in the SIMD rows.
+    shade = std::isfinite(shade) ? std::clamp(shade, 0.0f, 1.0f) : 0.0f;
+    if (k.blend) {
+      acc += light.weight * shade;
+    } else {
+      out[l * n + x] = shade;
+    }
+  }
+  if (k.blend) out[x] = acc;
+}
+
+void MultiShadeRowScalar(const float* r0, const float* r1, const float* r2,
+                         int n, const MultiConstants& k, float* out) {
+  for (int x = 0; x < n; ++x) MultiShadeScalar(r0, r1, r2, x, n, k, out);
+}
+
+#ifdef LUCIDIA_VISION_X86
+
+void HillshadeRowSse2(const float* r0, const float* r1, const float* r2, int n,
+                      const RowConstants& k, uint8_t* out) {
+  const __m128 two = _mm_set1_ps(2.0f), one = _mm_set1_ps(1.0f);
+  const __m128 sin_alt = _mm_set1_ps(k.sin_alt);
+  const __m128 ke = _mm_set1_ps(k.ke), kn = _mm_set1_ps(k.kn);
+  const __m128 kxx = _mm_set1_ps(k.kxx), kyy = _mm_set1_ps(k.kyy);
+  const __m128 scale = _mm_set1_ps(255.0f), zero = _mm_setzero_ps();
+  int x = 0;
+  for (; x + 4 <= n; x += 4) {
+    const __m128 a = _mm_loadu_ps(r0 + x), b = _mm_loadu_ps(r0 + x + 1),
+                 c = _mm_loadu_ps(r0 + x + 2);
+    const __m128 d = _mm_loadu_ps(r1 + x), f = _mm_loadu_ps(r1 + x + 2);
+    const __m128 g = _mm_loadu_ps(r2 + x), h = _mm_loadu_ps(r2 + x + 1),
+                 i = _mm_loadu_ps(r2 + x + 2);
+    const __m128 gx =
+        _mm_sub_ps(_mm_add_ps(_mm_add_ps(c, i), _mm_mul_ps(two, f)),
+                   _mm_add_ps(_mm_add_ps(a, g), _mm_mul_ps(two, d)));
+    const __m128 gy =
+        _mm_sub_ps(_mm_add_ps(_mm_add_ps(a, c), _mm_mul_ps(two, b)),
+                   _mm_add_ps(_mm_add_ps(g, i), _mm_mul_ps(two, h)));
+    const __m128 num = _mm_sub_ps(
+        sin_alt, _mm_add_ps(_mm_mul_ps(gx, ke), _mm_mul_ps(gy, kn)));
+    const __m128 den2 = _mm_add_ps(
+        one, _mm_add_ps(_mm_mul_ps(_mm_mul_ps(gx, gx), kxx),
+                        _mm_mul_ps(_mm_mul_ps(gy, gy), kyy)));
+    __m128 shade = _mm_div_ps(num, _mm_sqrt_ps(den2));
+    shade = _mm_min_ps(_mm_max_ps(shade, zero), one);
+    const __m128i v = _mm_cvtps_epi32(_mm_mul_ps(shade, scale));
+    const __m128i packed = _mm_packus_epi16(_mm_packs_epi32(v, v), v);
+    const int word = _mm_cvtsi128_si32(packed);
+    __builtin_memcpy(out + x, &word, 4);
+  }
+  for (; x < n; ++x) out[x] = ShadeScalar(r0, r1, r2, x, k);
+}
+
+void MultiShadeRowSse2(const float* r0, const float* r1, const float* r2,
+                       int n, const MultiConstants& k, float* out) {
+  const __m128 two = _mm_set1_ps(2.0f), one = _mm_set1_ps(1.0f);
+  const __m128 kxx = _mm_set1_ps(k.kxx), kyy = _mm_set1_ps(k.kyy);
+  const __m128 zero = _mm_setzero_ps();
+  int x = 0;
+  for (; x + 4 <= n; x += 4) {
+    const __m128 a = _mm_loadu_ps(r0 + x), b = _mm_loadu_ps(r0 + x + 1),
+                 c = _mm_loadu_ps(r0 + x + 2);
+    const __m128 d = _mm_loadu_ps(r1 + x), f = _mm_loadu_ps(r1 + x + 2);
+    const __m128 g = _mm_loadu_ps(r2 + x), h = _mm_loadu_ps(r2 + x + 1),
+                 i = _mm_loadu_ps(r2 + x + 2);
+    const __m128 gx =
+        _mm_sub_ps(_mm_add_ps(_mm_add_ps(c, i), _mm_mul_ps(two, f)),
+                   _mm_add_ps(_mm_add_ps(a, g), _mm_mul_ps(two, d)));
+    const __m128 gy =
+        _mm_sub_ps(_mm_add_ps(_mm_add_ps(a, c), _mm_mul_ps(two, b)),
+                   _mm_add_ps(_mm_add_ps(g, i), _mm_mul_ps(two, h)));
+    const __m128 den2 = _mm_add_ps(
+        one, _mm_add_ps(_mm_mul_ps(_mm_mul_ps(gx, gx), kxx),
+                        _mm_mul_ps(_mm_mul_ps(gy, gy), kyy)));
+    const __m128 r = _mm_div_ps(one, _mm_sqrt_ps(den2));
+    __m128 acc = zero;
+    for (int l = 0; l < k.count; ++l) {
+      const LightConstants& light = k.light[l];
+      const __m128 num = _mm_sub_ps(
+          _mm_set1_ps(light.sin_alt),
+          _mm_add_ps(_mm_mul_ps(gx, _mm_set1_ps(light.ke)),
+                     _mm_mul_ps(gy, _mm_set1_ps(light.kn))));
+      const __m128 shade =
+          _mm_min_ps(_mm_max_ps(_mm_mul_ps(num, r), zero), one);
+      if (k.blend) {
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(light.weight), shade));
+      } else {
+        _mm_storeu_ps(out + l * n + x, shade);
+      }
+    }
+    if (k.blend) _mm_storeu_ps(out + x, acc);
+  }
+  for (; x < n; ++x) MultiShadeScalar(r0, r1, r2, x, n, k, out);
+}
+
+__attribute__((target("avx2,fma"))) void HillshadeRowAvx2(
+    const float* r0, const float* r1, const float* r2, int n,
+    const RowConstants& k, uint8_t* out) {
+  const __m256 two = _mm256_set1_ps(2.0f), one = _mm256_set1_ps(1.0f);
+  const __m256 sin_alt = _mm256_set1_ps(k.sin_alt);
+  const __m256 ke = _mm256_set1_ps(k.ke), kn = _mm256_set1_ps(k.kn);
+  const __m256 kxx = _mm256_set1_ps(k.kxx), kyy = _mm256_set1_ps(k.kyy);
+  const __m256 scale = _mm256_set1_ps(255.0f), zero = _mm256_setzero_ps();
+  int x = 0;
+  for (; x + 8 <= n; x += 8) {
+    const __m256 a = _mm256_loadu_ps(r0 + x), b = _mm256_loadu_ps(r0 + x + 1),
+                 c = _mm256_loadu_ps(r0 + x + 2);
+    const __m256 d = _mm256_loadu_ps(r1 + x), f = _mm256_loadu_ps(r1 + x + 2);
+    const __m256 g = _mm256_loadu_ps(r2 + x), h = _mm256_loadu_ps(r2 + x + 1),
+                 i = _mm256_loadu_ps(r2 + x + 2);
+    const __m256 gx =
+        _mm256_sub_ps(_mm256_fmadd_ps(two, f, _mm256_add_ps(c, i)),
+                      _mm256_fmadd_ps(two, d, _mm256_add_ps(a, g)));
+    const __m256 gy =
+        _mm256_sub_ps(_mm256_fmadd_ps(two, b, _mm256_add_ps(a, c)),
+                      _mm256_fmadd_ps(two, h, _mm256_add_ps(g, i)));
+    const __m256 num =
+        _mm256_sub_ps(sin_alt, _mm256_fmadd_ps(gx, ke, _mm256_mul_ps(gy, kn)));
+    const __m256 den2 = _mm256_fmadd_ps(
+        _mm256_mul_ps(gx, gx), kxx,
+        _mm256_fmadd_ps(_mm256_mul_ps(gy, gy), kyy, one));
+    // rsqrt plus one Newton step is accurate to well under 1/255.
+    __m256 r = _mm256_rsqrt_ps(den2);
+    r = _mm256_mul_ps(
+        _mm256_mul_ps(_mm256_set1_ps(0.5f), r),
+        _mm256_fnmadd_ps(_mm256_mul_ps(den2, r), r, _mm256_set1_ps(3.0f)));
+    __m256 shade = _mm256_mul_ps(num, r);
+    shade = _mm256_min_ps(_mm256_max_ps(shade, zero), one);
+    const __m256i v = _mm256_cvtps_epi32(_mm256_mul_ps(shade, scale));
+    // Pack 8 x i32 -> 8 x u8 (packs work per 128-bit lane).
+    const __m128i lo = _mm256_castsi256_si128(v);
+    const __m128i hi = _mm256_extracti128_si256(v, 1);
+    const __m128i w16 = _mm_packs_epi32(lo, hi);
+    const __m128i b8 = _mm_packus_epi16(w16, w16);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out + x), b8);
+  }
+  for (; x < n; ++x) out[x] = ShadeScalar(r0, r1, r2, x, k);
+}
+
+__attribute__((target("avx2,fma"))) void MultiShadeRowAvx2(
+    const float* r0, const float* r1, const float* r2, int n,
+    const MultiConstants& k, float* out) {
+  const __m256 two = _mm256_set1_ps(2.0f), one = _mm256_set1_ps(1.0f);
+  const __m256 kxx = _mm256_set1_ps(k.kxx), kyy = _mm256_set1_ps(k.kyy);
+  const __m256 zero = _mm256_setzero_ps();
+  int x = 0;
+  for (; x + 8 <= n; x += 8) {
+    const __m256 a = _mm256_loadu_ps(r0 + x), b = _mm256_loadu_ps(r0 + x + 1),
+                 c = _mm256_loadu_ps(r0 + x + 2);
+    const __m256 d = _mm256_loadu_ps(r1 + x), f = _mm256_loadu_ps(r1 + x + 2);
+    const __m256 g = _mm256_loadu_ps(r2 + x), h = _mm256_loadu_ps(r2 + x + 1),
+                 i = _mm256_loadu_ps(r2 + x + 2);
+    const __m256 gx =
+        _mm256_sub_ps(_mm256_fmadd_ps(two, f, _mm256_add_ps(c, i)),
+                      _mm256_fmadd_ps(two, d, _mm256_add_ps(a, g)));
+    const __m256 gy =
+        _mm256_sub_ps(_mm256_fmadd_ps(two, b, _mm256_add_ps(a, c)),
+                      _mm256_fmadd_ps(two, h, _mm256_add_ps(g, i)));
+    const __m256 den2 = _mm256_fmadd_ps(
+        _mm256_mul_ps(gx, gx), kxx,
+        _mm256_fmadd_ps(_mm256_mul_ps(gy, gy), kyy, one));
+    __m256 r = _mm256_rsqrt_ps(den2);
+    r = _mm256_mul_ps(
+        _mm256_mul_ps(_mm256_set1_ps(0.5f), r),
+        _mm256_fnmadd_ps(_mm256_mul_ps(den2, r), r, _mm256_set1_ps(3.0f)));
+    __m256 acc = zero;
+    for (int l = 0; l < k.count; ++l) {
+      const LightConstants& light = k.light[l];
+      const __m256 num = _mm256_sub_ps(
+          _mm256_set1_ps(light.sin_alt),
+          _mm256_fmadd_ps(gx, _mm256_set1_ps(light.ke),
+                          _mm256_mul_ps(gy, _mm256_set1_ps(light.kn))));
+      const __m256 shade =
+          _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(num, r), zero), one);
+      if (k.blend) {
+        acc = _mm256_fmadd_ps(_mm256_set1_ps(light.weight), shade, acc);
+      } else {
+        _mm256_storeu_ps(out + l * n + x, shade);
+      }
+    }
+    if (k.blend) _mm256_storeu_ps(out + x, acc);
+  }
+  for (; x < n; ++x) MultiShadeScalar(r0, r1, r2, x, n, k, out);
+}
+
+#endif  // LUCIDIA_VISION_X86
+
+struct Dispatch {
+  RowKernel kernel;
+  MultiRowKernel multi;
+  const char* name;
+};
+
+Dispatch SelectKernel() {
+#ifdef LUCIDIA_VISION_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return {HillshadeRowAvx2, MultiShadeRowAvx2, "avx2"};
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return {HillshadeRowSse2, MultiShadeRowSse2, "sse2"};
+  }
+#endif
+  return {HillshadeRowScalar, MultiShadeRowScalar, "scalar"};
+}
+
+const Dispatch& Selected() {
+  static const Dispatch dispatch = SelectKernel();
+  return dispatch;
+}
+
+void MultiHillshadeTile(const float* in, size_t in_stride,
+                        const HillshadeParams& params, Tile* out) {
+  const MultiConstants k = MakeMultiConstants(params);
+  const MultiRowKernel kernel = Selected().multi;
+  const auto* base = reinterpret_cast<const uint8_t*>(in);
+  const int w = out->rect().width;
+  const int bands = k.blend ? 1 : k.count;
+  ScratchArray<float> shades(static_cast<size_t>(bands) * w);
+  for (int y = 0; y < out->rect().height; ++y) {
+    const auto* r0 = reinterpret_cast<const float*>(base + y * in_stride);
+    const auto* r1 = reinterpret_cast<const float*>(base + (y + 1) * in_stride);
+    const auto* r2 = reinterpret_cast<const float*>(base + (y + 2) * in_stride);
+    kernel(r0, r1, r2, w, k, shades.data());
+    uint8_t* row = out->row(y);
+    for (int b = 0; b < bands; ++b) {
+      const float* plane = shades.data() + static_cast<size_t>(b) * w;
+      for (int x = 0; x < w; ++x) {
+        row[x * bands + b] = static_cast<uint8_t>(plane[x] * 255.0f + 0.5f);
+      }
+    }
+  }
+}
+
+}  // namespace
+
+const char* HillshadeKernelName() { return Selected().name; }
+
+void HillshadeTile(const float* in, size_t in_stride,
+                   const HillshadeParams& params, Tile* out) {
+  if (params.lights.size() > 1) {
+    MultiHillshadeTile(in, in_stride, params, out);
+    return;
+  }
+  // A single listed light shades exactly like the scalar parameters.
+  const RowConstants k =
+      params.lights.empty()
+          ? MakeConstants(params, params.azimuth_deg, params.altitude_deg)
+          : MakeConstants(params, params.lights[0].azimuth_deg,
+                          params.lights[0].altitude_deg);
+  const RowKernel kernel = Selected().kernel;
+  const auto* base = reinterpret_cast<const uint8_t*>(in);
+  const int w = out->rect().width;
+  for (int y = 0; y < out->rect().height; ++y) {
+    const auto* r0 = reinterpret_cast<const float*>(base + y * in_stride);
+    const auto* r1 = reinterpret_cast<const float*>(base + (y + 1) * in_stride);
+    const auto* r2 = reinterpret_cast<const float*>(base + (y + 2) * in_stride);
+    kernel(r0, r1, r2, w, k, out->row(y));
+  }
+}
+
+std::shared_ptr<RasterSource> MakeHillshadeSource(
+    std::shared_ptr<RasterSource> dem, const HillshadeParams& params) {
+  RasterInfo info = dem->info();
+  info.bands = params.band_per_light && params.lights.size() > 1
+                   ? static_cast<int>(std::min<size_t>(params.lights.size(),
+                                                       kMaxHillshadeLights))
+                   : 1;
+  info.type = PixelType::kU8;
+  return std::make_shared<WindowOpSource>(
+      std::move(dem), info, PixelType::kF32, /*halo=*/1,
+      [params](const uint8_t* in, size_t stride, Tile* out) {
+        HillshadeTile(reinterpret_cast<const float*>(in), stride, params, out);
+      });
+}
+
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,53 @@
+// Horn-method hillshade over f32 DEM tiles.
+//
+// The 3x3 stencil reads a one-pixel halo from the neighbouring tiles (edge
+// replicated at the raster border), so tile seams never show. Rows are
+// shaded by an AVX2, SSE2 or scalar kernel picked once at startup. With
+// several lights the gradient and its normalisation are computed once per
+// pixel and each light costs only a dot product.
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "services/lucidia-vision/raster.h"
+
+namespace lucidia {
+namespace vision {
+
+constexpr int kMaxHillshadeLights = 16;
+
+struct HillshadeLight {
+  double azimuth_deg = 315.0;   // Clockwise from north.
+  double altitude_deg = 45.0;
+  double weight = 1.0;          // Relative; weights are normalised to sum 1.
+};
+
+struct HillshadeParams {
+  double azimuth_deg = 315.0;   // Clockwise from north.
+  double altitude_deg = 45.0;
+  double z_factor = 1.0;
+  double cell_x = 1.0;          // Ground size of a pixel, same unit as z.
+  double cell_y = 1.0;
+  // Up to kMaxHillshadeLights; when set they replace azimuth_deg and
+  // altitude_deg.
+  std::vector<HillshadeLight> lights;
+  bool band_per_light = false;  // One band per light, else their weighted mean.
+};
+
+// Shades `out` (u8; one band, or one per light with band_per_light). `in` is
+// the f32 DEM window covering out's rect plus one pixel on every side, rows
+// `in_stride` bytes apart.
+void HillshadeTile(const float* in, size_t in_stride,
+                   const HillshadeParams& params, Tile* out);
+
+// "avx2", "sse2" or "scalar": the row kernel HillshadeTile dispatches to.
+const char* HillshadeKernelName();
+
+// Lazily shaded view of a single-band DEM.
+std::shared_ptr<RasterSource> MakeHillshadeSource(
+    std::shared_ptr<RasterSource> dem, const HillshadeParams& params);
+
+}  // namespace vision
+}  // namespace lucidia
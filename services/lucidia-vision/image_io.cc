@@ -0,0 +1,264 @@
+#include "services/lucidia-vision/image_io.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <system_error>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "services/lucidia-vision/dataset_registry.h"
+#include "services/lucidia-vision/engine.h"
+#include "services/lucidia-vision/png_codec.h"
+#include "services/lucidia-vision/tiff_codec.h"
+
+namespace lucidia {
+namespace vision {
+
+namespace {
+
+namespace fs = std::filesystem;
+
+fs::path& ImageRoot() {
+  static fs::path root;
+  return root;
+}
+
+DatasetRegistry*& Datasets() {
+  static DatasetRegistry* registry = nullptr;
+  return registry;
+}
+
+// Resolves `path` relative to the image root, refusing anything that
+// resolves outside it (absolute paths, "..", symlinks pointing elsewhere).
+grpc::Status ResolveImagePath(const std::string& path, fs::path* full) {
+  const fs::path& root = ImageRoot();
+  if (root.empty()) {
+    return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION,
+                        "image paths are disabled (no --data_dir)");
+  }
+  const fs::path rel(path);
+  if (rel.empty() || rel.is_absolute()) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "image path must be relative: " + path);
+  }
+  std::error_code ec;
+  *full = fs::weakly_canonical(root / rel, ec);
+  const auto [end, unused] =
+      std::mismatch(root.begin(), root.end(), full->begin(), full->end());
+  (void)unused;
+  if (ec || end != root.end()) {
+    return grpc::Status(grpc::StatusCode::PERMISSION_DENIED,
+                        "image path escapes the data directory: " + path);
+  }
+  return grpc::Status::OK;
+}
+
+// Maps `path` relative to the image root.
+grpc::Status MapImageFile(const std::string& path,
+                          std::shared_ptr<ByteStream>* out) {
+  fs::path full;
+  grpc::Status s = ResolveImagePath(path, &full);
+  if (!s.ok()) return s;
+  std::shared_ptr<MmapByteStream> stream;
+  s = MmapByteStream::Open(full.string(), &stream);
+  if (!s.ok()) return s;
+  *out = std::move(stream);
+  return grpc::Status::OK;
+}
+
+}  // namespace
+
+void SetImageRoot(const std::string& dir) {
+  if (dir.empty()) {
+    ImageRoot().clear();
+    return;
+  }
+  std::error_code ec;
+  ImageRoot() = fs::weakly_canonical(dir, ec);
+  if (ec) ImageRoot() = fs::absolute(dir).lexically_normal();
+}
+
+void SetDatasetRegistry(DatasetRegistry* registry) { Datasets() = registry; }
+
+namespace {
+
+template <typename Hasher>
+void HashImageFilesWith(const google::protobuf::Message& msg, Hasher* h) {
+  if (msg.GetDescriptor() == v1::Image::descriptor()) {
+    const auto& image = static_cast<const v1::Image&>(msg);
+    if (image.path().empty()) return;
+    // Zeros when the path does not resolve or stat; such requests fail.
+    uint64_t stamp[5] = {};
+    fs::path full;
+    struct stat st;
+    if (ResolveImagePath(image.path(), &full).ok() &&
+        ::stat(full.c_str(), &st) == 0) {
+      stamp[0] = static_cast<uint64_t>(st.st_dev);
+      stamp[1] = static_cast<uint64_t>(st.st_ino);
+      stamp[2] = static_cast<uint64_t>(st.st_size);
+      stamp[3] = static_cast<uint64_t>(st.st_mtim.tv_sec);
+      stamp[4] = static_cast<uint64_t>(st.st_mtim.tv_nsec);
+    }
+    h->Update(stamp, sizeof(stamp));
+    return;
+  }
+  const google::protobuf::Reflection* reflection = msg.GetReflection();
+  std::vector<const google::protobuf::FieldDescriptor*> fields;
+  reflection->ListFields(msg, &fields);
+  for (const auto* field : fields) {
+    if (field->cpp_type() !=
+        google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE) {
+      continue;
+    }
+    if (!field->is_repeated()) {
+      HashImageFilesWith(reflection->GetMessage(msg, field), h);
+      continue;
+    }
+    for (int i = 0; i < reflection->FieldSize(msg, field); ++i) {
+      HashImageFilesWith(reflection->GetRepeatedMessage(msg, field, i), h);
+    }
+  }
+}
+
+}  // namespace
+
+void HashImageFiles(const google::protobuf::Message& msg, Xxh64* h) {
+  HashImageFilesWith(msg, h);
+}
+
+void HashImageFiles(const google::protobuf::Message& msg, Sha256* h) {
+  HashImageFilesWith(msg, h);
+}
+
+grpc::Status OpenImage(const v1::Image& image, int tile_size,
+                       std::shared_ptr<RasterSource>* out) {
+  if (!image.dataset().empty()) {
+    if (Datasets() == nullptr) {
+      return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION,
+                          "datasets are disabled (no --dataset_dir)");
+    }
+    return Datasets()->Open(image.dataset(), tile_size, out);
+  }
+  if (!image.path().empty()) {
+    std::shared_ptr<ByteStream> stream;
+    grpc::Status s = MapImageFile(image.path(), &stream);
+    if (!s.ok()) return s;
+    return OpenImageStream(image.format(), std::move(stream), tile_size, out);
+  }
+  if (image.data().empty()) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "image has no data, path or dataset");
+  }
+  return OpenImageStream(image.format(),
+                         std::make_shared<MemoryByteStream>(
+                             image.data().data(), image.data().size()),
+                         tile_size, out);
+}
+
+grpc::Status OpenImageStream(const std::string& format,
+                             std::shared_ptr<ByteStream> stream, int tile_size,
+                             std::shared_ptr<RasterSource>* out) {
+  std::string kind = format;
+  if (kind.empty()) {
+    uint8_t head[4] = {};
+    size_t got = 0;
+    grpc::Status s = stream->ReadAt(0, head, sizeof(head), &got);
+    if (!s.ok()) return s;
+    kind = LooksLikeTiff(head, got) ? "tiff" : "png";
+  }
+  if (kind == "png") {
+    std::unique_ptr<PngSource> png;
+    grpc::Status s = PngSource::Open(std::move(stream), tile_size, &png);
+    if (!s.ok()) return s;
+    *out = std::move(png);
+    return grpc::Status::OK;
+  }
+  if (kind == "tiff" || kind == "tif") {
+    std::unique_ptr<TiffSource> tiff;
+    grpc::Status s = TiffSource::Open(std::move(stream), tile_size, &tiff);
+    if (!s.ok()) return s;
+    *out = std::move(tiff);
+    return grpc::Status::OK;
+  }
+  return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                      "unknown image format: " + format);
+}
+
+namespace {
+
+// Sink for output `format`; "png" when empty. Rasters placed by `geo` carry
+// it inside formats that can (GeoTIFF tags).
+grpc::Status MakeSink(const std::string& format, const v1::Image& placed,
+                      int compression_level, std::string* data,
+                      std::unique_ptr<RasterSink>* sink, std::string* name) {
+  if (format == "png" || format.empty()) {
+    *sink = std::make_unique<PngSink>(data, compression_level);
+    *name = "png";
+    return grpc::Status::OK;
+  }
+  if (format == "tiff" || format == "tif") {
+    const v1::GeoTransform& geo = placed.geo();
+    Georef georef;
+    georef.origin_x = geo.origin_x();
+    georef.origin_y = geo.origin_y();
+    georef.pixel_width = geo.pixel_width();
+    georef.pixel_height = geo.pixel_height();
+    georef.epsg = geo.epsg();
+    const bool has_geo = geo.pixel_width() != 0 && geo.pixel_height() != 0;
+    *sink = std::make_unique<CogSink>(data, has_geo ? &georef : nullptr,
+                                      compression_level);
+    *name = "tiff";
+    return grpc::Status::OK;
+  }
+  return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                      "unsupported output format: " + format);
+}
+
+}  // namespace
+
+grpc::Status EncodeImage(RasterSource& source, const std::string& format,
+                         v1::Image* out, int compression_level) {
+  std::string* data = out->mutable_data();
+  data->clear();
+  std::unique_ptr<RasterSink> sink;
+  std::string name;
+  grpc::Status s =
+      MakeSink(format, *out, compression_level, data, &sink, &name);
+  if (!s.ok()) return s;
+  s = Materialize(source, *sink);
+  if (!s.ok()) return s;
+  out->set_format(name);
+  out->set_width(source.info().width);
+  out->set_height(source.info().height);
+  return grpc::Status::OK;
+}
+
+grpc::Status EncodeTile(Tile tile, const std::string& format, v1::Image* out,
+                        int compression_level) {
+  RasterInfo info;
+  info.width = tile.rect().width;
+  info.height = tile.rect().height;
+  info.bands = tile.bands();
+  info.type = tile.type();
+  info.tile_size = std::max(info.width, info.height);
+  std::vector<Tile> row;
+  row.push_back(std::move(tile));
+  std::string* data = out->mutable_data();
+  data->clear();
+  std::unique_ptr<RasterSink> sink;
+  std::string name;
+  grpc::Status s =
+      MakeSink(format, *out, compression_level, data, &sink, &name);
+  if (s.ok()) s = sink->Begin(info);
+  if (s.ok()) s = sink->WriteTileRow(0, row);
+  if (s.ok()) s = sink->Finish();
+  if (!s.ok()) return s;
+  out->set_format(name);
+  out->set_width(info.width);
+  out->set_height(info.height);
+  return grpc::Status::OK;
+}
+
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,59 @@
+// Bridges the `Image` proto and the tiled raster core.
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "proto/vision_service.pb.h"
+#include "services/lucidia-vision/byte_stream.h"
+#include "services/lucidia-vision/content_hash.h"
+#include "services/lucidia-vision/raster.h"
+
+namespace lucidia {
+namespace vision {
+
+// Directory Image.path is resolved against; empty (the default) rejects
+// every path. Call once at startup.
+void SetImageRoot(const std::string& dir);
+
+// Feeds into `h` the identity (device, inode, size and modification time)
+// of the file behind every Image.path in `msg`, however deeply nested. Keys
+// hashed from a request name its files only by path; folding this in makes
+// them change when a file under the root is replaced or rewritten. Paths
+// that do not resolve contribute a marker, as opening them fails anyway.
+void HashImageFiles(const google::protobuf::Message& msg, Xxh64* h);
+void HashImageFiles(const google::protobuf::Message& msg, Sha256* h);
+
+class DatasetRegistry;
+
+// Registry Image.dataset is resolved against; null (the default) rejects
+// every dataset ID. Call once at startup.
+void SetDatasetRegistry(DatasetRegistry* registry);
+
+// Opens `image` as a lazily decoded raster tiled at `tile_size`. Nothing is
+// decoded until tiles are read. `image` must outlive the returned source.
+// With `path` set the file is memory-mapped instead of read from `data`;
+// with `dataset` set the registered copy is read instead of either.
+grpc::Status OpenImage(const v1::Image& image, int tile_size,
+                       std::shared_ptr<RasterSource>* out);
+
+// Same as OpenImage for bytes that arrive through `stream` (chunked uploads).
+// Returns once the header is decoded; pixel reads block on later chunks. An
+// empty `format` is detected from the leading bytes.
+grpc::Status OpenImageStream(const std::string& format,
+                             std::shared_ptr<ByteStream> stream, int tile_size,
+                             std::shared_ptr<RasterSource>* out);
+
+// Drives `source` tile by tile into an encoder for `format` ("png" when
+// empty, or "tiff" for a Cloud-Optimized GeoTIFF) and stores the encoded
+// bytes in `out`. Set `out->geo` first to have it embedded in the file.
+// `compression_level` is the deflate level 1-9; 0 picks 6.
+grpc::Status EncodeImage(RasterSource& source, const std::string& format,
+                         v1::Image* out, int compression_level = 0);
+
+// Encodes a single tile as a standalone image.
+grpc::Status EncodeTile(Tile tile, const std::string& format, v1::Image* out,
+                        int compression_level = 0);
+
+}  // namespace vision
+}  // namespace lucidia
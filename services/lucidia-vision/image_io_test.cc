@@ -0,0 +1,72 @@
+#include "services/lucidia-vision/image_io.h"
+
+#include <unistd.h>
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+#include <gtest/gtest.h>
+#include "proto/vision_service.pb.h"
+#include "services/lucidia-vision/result_cache.h"
+
+namespace lucidia {
+namespace vision {
+namespace {
+
+namespace fs = std::filesystem;
+
+class ImageRootTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    root_ = fs::temp_directory_path() /
+            ("lucidia-image-io-" + std::to_string(::getpid()));
+    fs::create_directories(root_);
+    SetImageRoot(root_.string());
+  }
+  void TearDown() override {
+    SetImageRoot("");
+    fs::remove_all(root_);
+  }
+  void Write(const std::string& name, const std::string& bytes) {
+    std::ofstream(root_ / name, std::ios::binary | std::ios::trunc) << bytes;
+  }
+
+  fs::path root_;
+};
+
+TEST_F(ImageRootTest, RequestKeyFollowsTheFile) {
+  Write("dem.tif", "first version");
+  v1::HillshadeRequest req;
+  req.mutable_dem()->set_path("dem.tif");
+  const ResultCache::Key before = HashRequest("Hillshade", req);
+  EXPECT_EQ(HashRequest("Hillshade", req), before);
+
+  // Same size, rewritten in place: the modification time moves. Pin it
+  // forward explicitly, as back-to-back writes may share a timestamp.
+  Write("dem.tif", "other version");
+  fs::last_write_time(root_ / "dem.tif",
+                      fs::last_write_time(root_ / "dem.tif") +
+                          std::chrono::seconds(5));
+  const ResultCache::Key rewritten = HashRequest("Hillshade", req);
+  EXPECT_NE(rewritten, before);
+
+  // Replaced by a new file (new inode) under the same name.
+  Write("new.tif", "third");
+  fs::rename(root_ / "new.tif", root_ / "dem.tif");
+  EXPECT_NE(HashRequest("Hillshade", req), rewritten);
+}
+
+TEST_F(ImageRootTest, NestedPathsCount) {
+  Write("a.tif", "a");
+  v1::BatchRequest req;
+  req.add_items()->mutable_mosaic()->add_inputs()->set_path("a.tif");
+  const ResultCache::Key before = HashRequest("Batch", req);
+  Write("a.tif", "longer a");
+  EXPECT_NE(HashRequest("Batch", req), before);
+}
+
+}  // namespace
+}  // namespace vision
+}  // namespace lucidia
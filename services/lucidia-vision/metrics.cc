@@ -0,0 +1,315 @@
+#include "services/lucidia-vision/metrics.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include "services/lucidia-vision/admission.h"
+#include "services/lucidia-vision/buffer_pool.h"
+#include "services/lucidia-vision/dataset_registry.h"
+#include "services/lucidia-vision/result_cache.h"
+#include "services/lucidia-vision/thread_pool.h"
+
+namespace lucidia {
+namespace vision {
+
+namespace {
+
+const char* const kCodeNames[Metrics::kStatusCodes] = {
+    "OK",
+    "CANCELLED",
+    "UNKNOWN",
+    "INVALID_ARGUMENT",
+    "DEADLINE_EXCEEDED",
+    "NOT_FOUND",
+    "ALREADY_EXISTS",
+    "PERMISSION_DENIED",
+    "RESOURCE_EXHAUSTED",
+    "FAILED_PRECONDITION",
+    "ABORTED",
+    "OUT_OF_RANGE",
+    "UNIMPLEMENTED",
+    "INTERNAL",
+    "UNAVAILABLE",
+    "DATA_LOSS",
+    "UNAUTHENTICATED",
+};
+
+// Shard of the calling thread; threads are dealt out round-robin.
+int ThreadShard(int shards) {
+  static std::atomic<int> next{0};
+  thread_local const int shard = next.fetch_add(1) % shards;
+  return shard;
+}
+
+void Family(std::string* out, const char* name, const char* type,
+            const char* help) {
+  *out += "# HELP ";
+  *out += name;
+  *out += ' ';
+  *out += help;
+  *out += "\n# TYPE ";
+  *out += name;
+  *out += ' ';
+  *out += type;
+  *out += '\n';
+}
+
+void Sample(std::string* out, const char* name, const std::string& labels,
+            double value) {
+  char buf[64];
+  std::snprintf(buf, sizeof(buf), "%.15g", value);
+  *out += name;
+  if (!labels.empty()) {
+    *out += '{';
+    *out += labels;
+    *out += '}';
+  }
+  *out += ' ';
+  *out += buf;
+  *out += '\n';
+}
+
+std::string MethodLabel(const char* method) {
+  return std::string("method=\"") + method + "\"";
+}
+
+}  // namespace
+
+Metrics::Metrics(const char* const* methods, int num_methods)
+    : methods_(methods),
+      num_methods_(num_methods),
+      shards_(new Shard[static_cast<size_t>(num_methods) * kShards]) {}
+
+// Bounds run 16, 24, 32, 48, 64, ... us, i.e. the two leading bits of the
+// value pick the bucket.
+int Metrics::LatencyBucket(uint64_t us) {
+  if (us <= 16) return 0;
+  const uint64_t x = us - 1;
+  const int e = 63 - __builtin_clzll(x);
+  const int i = (e - 4) * 2 + static_cast<int>((x >> (e - 1)) & 1) + 1;
+  return i < kLatencyBuckets ? i : kLatencyBuckets;
+}
+
+uint64_t Metrics::BucketBoundMicros(int i) {
+  if (i == 0) return 16;
+  const int k = (i - 1) / 2;
+  return ((i & 1) ? uint64_t{24} : uint64_t{32}) << k;
+}
+
+int Metrics::MethodIndex(const char* method) const {
+  for (int i = 0; i < num_methods_; ++i) {
+    if (std::strcmp(method, methods_[i]) == 0) return i;
+  }
+  return -1;
+}
+
+Metrics::Shard& Metrics::ShardFor(int method) {
+  return shards_[static_cast<size_t>(method) * kShards + ThreadShard(kShards)];
+}
+
+void Metrics::Record(const char* method, grpc::StatusCode code,
+                     std::chrono::steady_clock::duration latency,
+                     uint64_t bytes_in, uint64_t bytes_out, uint64_t pixels) {
+  const int m = MethodIndex(method);
+  if (m < 0) return;
+  const uint64_t us = static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::microseconds>(latency).count());
+  const int c = static_cast<int>(code);
+  Shard& s = ShardFor(m);
+  constexpr auto relaxed = std::memory_order_relaxed;
+  s.buckets[LatencyBucket(us)].fetch_add(1, relaxed);
+  s.codes[c >= 0 && c < kStatusCodes ? c : 2].fetch_add(1, relaxed);
+  s.latency_us.fetch_add(us, relaxed);
+  s.bytes_in.fetch_add(bytes_in, relaxed);
+  s.bytes_out.fetch_add(bytes_out, relaxed);
+  s.pixels.fetch_add(pixels, relaxed);
+}
+
+std::string Metrics::Render() const {
+  constexpr auto relaxed = std::memory_order_relaxed;
+  struct Totals {
+    uint64_t buckets[kLatencyBuckets + 1] = {};
+    uint64_t codes[kStatusCodes] = {};
+    uint64_t latency_us = 0, bytes_in = 0, bytes_out = 0, pixels = 0;
+    uint64_t count = 0;
+  };
+  std::vector<Totals> totals(num_methods_);
+  for (int m = 0; m < num_methods_; ++m) {
+    Totals& t = totals[m];
+    for (int k = 0; k < kShards; ++k) {
+      const Shard& s = shards_[static_cast<size_t>(m) * kShards + k];
+      for (int b = 0; b <= kLatencyBuckets; ++b) {
+        t.buckets[b] += s.buckets[b].load(relaxed);
+      }
+      for (int c = 0; c < kStatusCodes; ++c) {
+        t.codes[c] += s.codes[c].load(relaxed);
+      }
+      t.latency_us += s.latency_us.load(relaxed);
+      t.bytes_in += s.bytes_in.load(relaxed);
+      t.bytes_out += s.bytes_out.load(relaxed);
+      t.pixels += s.pixels.load(relaxed);
+    }
+    for (uint64_t n : t.buckets) t.count += n;
+  }
+
+  std::string out;
+  Family(&out, "lucidia_vision_requests_total", "counter",
+         "Finished RPCs by method and status code.");
+  for (int m = 0; m < num_methods_; ++m) {
+    for (int c = 0; c < kStatusCodes; ++c) {
+      if (totals[m].codes[c] == 0) continue;
+      Sample(&out, "lucidia_vision_requests_total",
+             MethodLabel(methods_[m]) + ",code=\"" + kCodeNames[c] + "\"",
+             static_cast<double>(totals[m].codes[c]));
+    }
+  }
+
+  Family(&out, "lucidia_vision_request_duration_seconds", "histogram",
+         "RPC handling time, admission to reply.");
+  for (int m = 0; m < num_methods_; ++m) {
+    const Totals& t = totals[m];
+    if (t.count == 0) continue;
+    const std::string method = MethodLabel(methods_[m]);
+    uint64_t cumulative = 0;
+    char le[32];
+    for (int b = 0; b < kLatencyBuckets; ++b) {
+      cumulative += t.buckets[b];
+      std::snprintf(le, sizeof(le), "%g", BucketBoundMicros(b) * 1e-6);
+      Sample(&out, "lucidia_vision_request_duration_seconds_bucket",
+             method + ",le=\"" + le + "\"", static_cast<double>(cumulative));
+    }
+    Sample(&out, "lucidia_vision_request_duration_seconds_bucket",
+           method + ",le=\"+Inf\"", static_cast<double>(t.count));
+    Sample(&out, "lucidia_vision_request_duration_seconds_sum", method,
+           t.latency_us * 1e-6);
+    Sample(&out, "lucidia_vision_request_duration_seconds_count", method,
+           static_cast<double>(t.count));
+  }
+
+  struct Counter {
+    const char* name;
+    const char* help;
+    uint64_t Totals::*field;
+  };
+  const Counter counters[] = {
+      {"lucidia_vision_request_bytes_total", "Serialized request bytes.",
+       &Totals::bytes_in},
+      {"lucidia_vision_response_bytes_total", "Serialized response bytes.",
+       &Totals::bytes_out},
+      {"lucidia_vision_pixels_total", "Output pixels produced.",
+       &Totals::pixels},
+  };
+  for (const Counter& counter : counters) {
+    Family(&out, counter.name, "counter", counter.help);
+    for (int m = 0; m < num_methods_; ++m) {
+      if (totals[m].count == 0) continue;
+      Sample(&out, counter.name, MethodLabel(methods_[m]),
+             static_cast<double>(totals[m].*counter.field));
+    }
+  }
+
+  if (admission_ != nullptr) {
+    Family(&out, "lucidia_vision_in_flight", "gauge",
+           "Admitted calls still running, for methods with a limit.");
+    for (int m = 0; m < num_methods_; ++m) {
+      Sample(&out, "lucidia_vision_in_flight", MethodLabel(methods_[m]),
+             admission_->in_flight(methods_[m]));
+    }
+  }
+  if (pool_ != nullptr) {
+    Family(&out, "lucidia_vision_queue_depth", "gauge",
+           "Tasks waiting for a worker.");
+    Sample(&out, "lucidia_vision_queue_depth", "",
+           static_cast<double>(pool_->queue_depth()));
+    Family(&out, "lucidia_vision_workers", "gauge", "Worker threads.");
+    Sample(&out, "lucidia_vision_workers", "",
+           static_cast<double>(pool_->threads()));
+  }
+  if (cache_ != nullptr) {
+    const ResultCache::Stats s = cache_->stats();
+    Family(&out, "lucidia_vision_cache_hits_total", "counter",
+           "Result cache hits by tier.");
+    Sample(&out, "lucidia_vision_cache_hits_total", "tier=\"memory\"",
+           static_cast<double>(s.memory_hits));
+    Sample(&out, "lucidia_vision_cache_hits_total", "tier=\"disk\"",
+           static_cast<double>(s.disk_hits));
+    Family(&out, "lucidia_vision_cache_misses_total", "counter",
+           "Result cache misses that ran the computation.");
+    Sample(&out, "lucidia_vision_cache_misses_total", "",
+           static_cast<double>(s.misses));
+    Family(&out, "lucidia_vision_cache_coalesced_total", "counter",
+           "Misses that waited on an identical call in flight.");
+    Sample(&out, "lucidia_vision_cache_coalesced_total", "",
+           static_cast<double>(s.coalesced));
+    Family(&out, "lucidia_vision_cache_hit_ratio", "gauge",
+           "Share of lookups answered without computing, since start.");
+    const uint64_t hits = s.memory_hits + s.disk_hits + s.coalesced;
+    const uint64_t lookups = hits + s.misses;
+    Sample(&out, "lucidia_vision_cache_hit_ratio", "",
+           lookups ? static_cast<double>(hits) / lookups : 0.0);
+    Family(&out, "lucidia_vision_cache_bytes", "gauge",
+           "Bytes held by the result cache by tier.");
+    Sample(&out, "lucidia_vision_cache_bytes", "tier=\"memory\"",
+           static_cast<double>(s.memory_bytes));
+    Sample(&out, "lucidia_vision_cache_bytes", "tier=\"disk\"",
+           static_cast<double>(s.disk_bytes));
+  }
+  if (buffers_ != nullptr) {
+    const BufferPool::Stats s = buffers_->stats();
+    Family(&out, "lucidia_vision_buffer_pool_bytes", "gauge",
+           "Pixel buffer bytes by state: handed out, or idle in the pool.");
+    Sample(&out, "lucidia_vision_buffer_pool_bytes", "state=\"in_use\"",
+           static_cast<double>(s.in_use_bytes));
+    Sample(&out, "lucidia_vision_buffer_pool_bytes", "state=\"cached\"",
+           static_cast<double>(s.cached_bytes));
+    Family(&out, "lucidia_vision_buffer_pool_allocations_total", "counter",
+           "Pixel buffer allocations by where the block came from.");
+    Sample(&out, "lucidia_vision_buffer_pool_allocations_total",
+           "source=\"pool\"", static_cast<double>(s.reused));
+    Sample(&out, "lucidia_vision_buffer_pool_allocations_total",
+           "source=\"os\"", static_cast<double>(s.allocations - s.reused));
+    Family(&out, "lucidia_vision_buffer_pool_released_bytes_total", "counter",
+           "Pixel buffer bytes given back to the OS.");
+    Sample(&out, "lucidia_vision_buffer_pool_released_bytes_total", "",
+           static_cast<double>(s.released_bytes));
+  }
+  if (datasets_ != nullptr) {
+    const DatasetRegistry::Stats s = datasets_->stats();
+    Family(&out, "lucidia_vision_datasets", "gauge",
+           "Registered datasets by state: referenced, or released and "
+           "evictable.");
+    Sample(&out, "lucidia_vision_datasets", "state=\"referenced\"",
+           static_cast<double>(s.referenced));
+    Sample(&out, "lucidia_vision_datasets", "state=\"released\"",
+           static_cast<double>(s.released));
+    Family(&out, "lucidia_vision_dataset_bytes", "gauge",
+           "Disk bytes of registered datasets by state.");
+    Sample(&out, "lucidia_vision_dataset_bytes", "state=\"referenced\"",
+           static_cast<double>(s.referenced_bytes));
+    Sample(&out, "lucidia_vision_dataset_bytes", "state=\"released\"",
+           static_cast<double>(s.released_bytes));
+    Family(&out, "lucidia_vision_dataset_registrations_total", "counter",
+           "Successful registrations by whether a stored copy was reused.");
+    Sample(&out, "lucidia_vision_dataset_registrations_total",
+           "copy=\"reused\"", static_cast<double>(s.reused));
+    Sample(&out, "lucidia_vision_dataset_registrations_total",
+           "copy=\"built\"", static_cast<double>(s.registrations - s.reused));
+    Family(&out, "lucidia_vision_dataset_evictions_total", "counter",
+           "Released datasets deleted to make room.");
+    Sample(&out, "lucidia_vision_dataset_evictions_total", "",
+           static_cast<double>(s.evictions));
+  }
+  return out;
+}
+
+grpc::Status CallRecorder::Finish(grpc::Status status) {
+  if (metrics_ != nullptr) {
+    metrics_->Record(method_, status.error_code(),
+                     std::chrono::steady_clock::now() - start_, bytes_in_,
+                     bytes_out_, pixels_);
+  }
+  return status;
+}
+
+}  // namespace vision
+}  // namespace lucidia
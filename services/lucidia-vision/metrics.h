@@ -0,0 +1,110 @@
+// Per-RPC request metrics in Prometheus text format.
+//
+// Recording is lock-free: each thread adds into its own cache-line-aligned
+// shard with relaxed atomics, and shards are only summed at scrape time.
+// Latencies go into log-spaced buckets (two per octave, 16 us to ~3.5 min).
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <grpcpp/support/status.h>
+
+namespace lucidia {
+namespace vision {
+
+class AdmissionController;
+class BufferPool;
+class DatasetRegistry;
+class ResultCache;
+class ThreadPool;
+
+class Metrics {
+ public:
+  static constexpr int kLatencyBuckets = 48;  // Plus one for +Inf.
+  static constexpr int kStatusCodes = 17;
+
+  // `methods` names every RPC that will be recorded; it must outlive this.
+  Metrics(const char* const* methods, int num_methods);
+  Metrics(const Metrics&) = delete;
+  Metrics& operator=(const Metrics&) = delete;
+
+  // Records one finished call. Unknown methods are ignored.
+  void Record(const char* method, grpc::StatusCode code,
+              std::chrono::steady_clock::duration latency, uint64_t bytes_in,
+              uint64_t bytes_out, uint64_t pixels);
+
+  // Gauges read from their owners at scrape time. Set before serving.
+  void WatchCache(const ResultCache* cache) { cache_ = cache; }
+  void WatchPool(const ThreadPool* pool) { pool_ = pool; }
+  void WatchAdmission(const AdmissionController* admission) {
+    admission_ = admission;
+  }
+  void WatchBuffers(const BufferPool* buffers) { buffers_ = buffers; }
+  void WatchDatasets(const DatasetRegistry* datasets) { datasets_ = datasets; }
+
+  // The exposition for GET /metrics.
+  std::string Render() const;
+
+  // Bucket a latency of `us` microseconds falls in; kLatencyBuckets is +Inf.
+  static int LatencyBucket(uint64_t us);
+  // Upper bound of latency bucket `i`, in microseconds.
+  static uint64_t BucketBoundMicros(int i);
+
+ private:
+  struct alignas(64) Shard {
+    std::array<std::atomic<uint64_t>, kLatencyBuckets + 1> buckets{};
+    std::array<std::atomic<uint64_t>, kStatusCodes> codes{};
+    std::atomic<uint64_t> latency_us{0};
+    std::atomic<uint64_t> bytes_in{0};
+    std::atomic<uint64_t> bytes_out{0};
+    std::atomic<uint64_t> pixels{0};
+  };
+  static constexpr int kShards = 16;
+
+  int MethodIndex(const char* method) const;
+  Shard& ShardFor(int method);
+
+  const char* const* methods_;
+  const int num_methods_;
+  std::unique_ptr<Shard[]> shards_;  // [method * kShards + shard]
+  const ResultCache* cache_ = nullptr;
+  const ThreadPool* pool_ = nullptr;
+  const AdmissionController* admission_ = nullptr;
+  const BufferPool* buffers_ = nullptr;
+  const DatasetRegistry* datasets_ = nullptr;
+};
+
+// Times one call from construction and records it on Finish. A null
+// Metrics makes every call a no-op.
+class CallRecorder {
+ public:
+  CallRecorder(Metrics* metrics, const char* method)
+      : metrics_(metrics),
+        method_(method),
+        start_(std::chrono::steady_clock::now()) {}
+
+  void AddBytesIn(uint64_t n) { bytes_in_ += n; }
+  void AddBytesOut(uint64_t n) { bytes_out_ += n; }
+  void AddPixels(uint64_t n) { pixels_ += n; }
+
+  // Records the call and passes `status` through.
+  grpc::Status Finish(grpc::Status status);
+
+ private:
+  Metrics* metrics_;
+  const char* method_;
+  std::chrono::steady_clock::time_point start_;
+  uint64_t bytes_in_ = 0;
+  uint64_t bytes_out_ = 0;
+  uint64_t pixels_ = 0;
+};
+
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,134 @@
+#include "services/lucidia-vision/metrics_server.h"
+
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+namespace lucidia {
+namespace vision {
+
+namespace {
+
+// How often the accept loop checks for Stop().
+constexpr int kPollMillis = 250;
+// Longest request head read before answering.
+constexpr size_t kMaxRequest = 8192;
+
+bool WriteAll(int fd, const std::string& data) {
+  size_t done = 0;
+  while (done < data.size()) {
+    const ssize_t n =
+        send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+    if (n <= 0) return false;
+    done += static_cast<size_t>(n);
+  }
+  return true;
+}
+
+}  // namespace
+
+grpc::Status MetricsHttpServer::Start(const std::string& address) {
+  const size_t colon = address.rfind(':');
+  if (colon == std::string::npos) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "metrics address must be host:port: " + address);
+  }
+  std::string host = address.substr(0, colon);
+  const std::string port = address.substr(colon + 1);
+  if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+    host = host.substr(1, host.size() - 2);
+  }
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  addrinfo* found = nullptr;
+  if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints,
+                  &found) != 0) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "cannot resolve metrics address: " + address);
+  }
+  int error = 0;
+  for (addrinfo* ai = found; ai != nullptr; ai = ai->ai_next) {
+    const int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) {
+      error = errno;
+      continue;
+    }
+    const int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 16) == 0) {
+      listen_fd_ = fd;
+      break;
+    }
+    error = errno;
+    close(fd);
+  }
+  freeaddrinfo(found);
+  if (listen_fd_ < 0) {
+    return grpc::Status(grpc::StatusCode::UNAVAILABLE,
+                        "cannot listen on metrics address " + address + ": " +
+                            std::strerror(error));
+  }
+  thread_ = std::thread([this] { Serve(); });
+  return grpc::Status::OK;
+}
+
+void MetricsHttpServer::Stop() {
+  if (!thread_.joinable()) return;
+  stopping_ = true;
+  thread_.join();
+  close(listen_fd_);
+  listen_fd_ = -1;
+}
+
+void MetricsHttpServer::Serve() {
+  while (!stopping_) {
+    pollfd p = {listen_fd_, POLLIN, 0};
+    if (poll(&p, 1, kPollMillis) <= 0) continue;
+    const int fd = accept(listen_fd_, nullptr, nullptr);
+    if (fd < 0) continue;
+    // A stalled client must not hold up the next scrape for long.
+    timeval timeout = {2, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    Answer(fd);
+    close(fd);
+  }
+}
+
+void MetricsHttpServer::Answer(int fd) {
+  std::string head;
+  char buf[1024];
+  while (head.find("\r\n\r\n") == std::string::npos &&
+         head.find("\n\n") == std::string::npos && head.size() < kMaxRequest) {
+    const ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0) break;
+    head.append(buf, static_cast<size_t>(n));
+  }
+  const size_t line_end = head.find_first_of("\r\n");
+  const std::string line = head.substr(0, line_end);
+  const bool get = line.compare(0, 4, "GET ") == 0;
+  const std::string path = get ? line.substr(4, line.find(' ', 4) - 4) : "";
+  std::string status, type, body;
+  if (path == "/metrics" || path.compare(0, 9, "/metrics?") == 0) {
+    status = "200 OK";
+    type = "text/plain; version=0.0.4; charset=utf-8";
+    body = metrics_->Render();
+  } else {
+    status = "404 Not Found";
+    type = "text/plain; charset=utf-8";
+    body = "only GET /metrics is served\n";
+  }
+  WriteAll(fd, "HTTP/1.0 " + status + "\r\nContent-Type: " + type +
+                   "\r\nContent-Length: " + std::to_string(body.size()) +
+                   "\r\nConnection: close\r\n\r\n" + body);
+}
+
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,41 @@
+// Minimal HTTP/1.0 listener serving Metrics as GET /metrics.
+//
+// Scrapes are rare and small, so one thread answers them one at a time;
+// anything other than GET /metrics gets a 404.
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include <grpcpp/support/status.h>
+
+#include "services/lucidia-vision/metrics.h"
+
+namespace lucidia {
+namespace vision {
+
+class MetricsHttpServer {
+ public:
+  explicit MetricsHttpServer(const Metrics* metrics) : metrics_(metrics) {}
+  ~MetricsHttpServer() { Stop(); }
+  MetricsHttpServer(const MetricsHttpServer&) = delete;
+  MetricsHttpServer& operator=(const MetricsHttpServer&) = delete;
+
+  // Listens on "host:port" ("[::1]:port" for IPv6 literals) and starts
+  // serving.
+  grpc::Status Start(const std::string& address);
+  void Stop();
+
+ private:
+  void Serve();
+  void Answer(int fd);
+
+  const Metrics* metrics_;
+  int listen_fd_ = -1;
+  std::atomic<bool> stopping_{false};
+  std::thread thread_;
+};
+
+}  // namespace vision
+}  // namespace lucidia
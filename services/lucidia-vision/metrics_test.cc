@@ -0,0 +1,83 @@
+#include "services/lucidia-vision/metrics.h"
+
+#include <chrono>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace lucidia {
+namespace vision {
+namespace {
+
+TEST(MetricsTest, LatencyBucketMatchesBounds) {
+  EXPECT_EQ(Metrics::LatencyBucket(0), 0);
+  for (int i = 0; i < Metrics::kLatencyBuckets; ++i) {
+    const uint64_t bound = Metrics::BucketBoundMicros(i);
+    if (i > 0) {
+      EXPECT_GT(bound, Metrics::BucketBoundMicros(i - 1));
+      EXPECT_EQ(Metrics::LatencyBucket(Metrics::BucketBoundMicros(i - 1) + 1),
+                i)
+          << bound;
+    }
+    EXPECT_EQ(Metrics::LatencyBucket(bound - 1), i) << bound;
+    EXPECT_EQ(Metrics::LatencyBucket(bound), i) << bound;
+    EXPECT_EQ(Metrics::LatencyBucket(bound + 1), i + 1) << bound;
+  }
+  EXPECT_EQ(Metrics::LatencyBucket(UINT64_MAX), Metrics::kLatencyBuckets);
+}
+
+// Value of every line of `text` that starts with `prefix`, in order.
+std::vector<double> Values(const std::string& text,
+                           const std::string& prefix) {
+  std::vector<double> values;
+  std::istringstream lines(text);
+  std::string line;
+  while (std::getline(lines, line)) {
+    if (line.compare(0, prefix.size(), prefix) != 0) continue;
+    values.push_back(std::stod(line.substr(line.rfind(' ') + 1)));
+  }
+  return values;
+}
+
+TEST(MetricsTest, RenderEmitsCumulativeHistogram) {
+  const char* const methods[] = {"Hillshade", "Resample"};
+  Metrics metrics(methods, 2);
+  const int64_t latencies_us[] = {3, 16, 17, 100, 5000, 3600000000};
+  for (int64_t us : latencies_us) {
+    metrics.Record("Hillshade", grpc::StatusCode::OK,
+                   std::chrono::microseconds(us), 10, 20, 30);
+  }
+  metrics.Record("Unknown", grpc::StatusCode::OK,
+                 std::chrono::microseconds(1), 0, 0, 0);
+  const std::string text = metrics.Render();
+
+  const std::string bucket =
+      "lucidia_vision_request_duration_seconds_bucket{method=\"Hillshade\",";
+  const std::vector<double> buckets = Values(text, bucket + "le=");
+  ASSERT_EQ(buckets.size(), size_t{Metrics::kLatencyBuckets} + 1);
+  for (size_t i = 1; i < buckets.size(); ++i) {
+    EXPECT_GE(buckets[i], buckets[i - 1]) << i;
+  }
+  EXPECT_EQ(buckets[0], 2);  // le 16 us.
+  EXPECT_EQ(buckets[1], 3);  // le 24 us.
+  EXPECT_EQ(buckets[Metrics::kLatencyBuckets - 1], 5);
+  EXPECT_EQ(Values(text, bucket + "le=\"+Inf\"}"),
+            std::vector<double>{6});
+  EXPECT_NE(text.find(bucket + "le=\"1.6e-05\"} 2\n"), std::string::npos);
+  EXPECT_EQ(Values(text, "lucidia_vision_request_duration_seconds_count"
+                         "{method=\"Hillshade\"}"),
+            std::vector<double>{6});
+  EXPECT_EQ(Values(text, "lucidia_vision_requests_total"
+                         "{method=\"Hillshade\",code=\"OK\"}"),
+            std::vector<double>{6});
+  // Methods without calls and unknown methods have no samples.
+  EXPECT_EQ(text.find("method=\"Resample\""), std::string::npos);
+  EXPECT_EQ(text.find("Unknown"), std::string::npos);
+}
+
+}  // namespace
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,203 @@
+#include "services/lucidia-vision/mosaic.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <string>
+
+namespace lucidia {
+namespace vision {
+
+namespace {
+
+constexpr int kMaxOutputSide = 1 << 16;
+
+grpc::Status InputError(size_t i, const std::string& what) {
+  return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                      "mosaic: inputs[" + std::to_string(i) + "] " + what);
+}
+
+}  // namespace
+
+MosaicSource::MosaicSource(const RasterInfo& info, const Georef& georef,
+                           int feather)
+    : TileOpSource(info),
+      georef_(georef),
+      feather_(static_cast<float>(feather)) {}
+
+grpc::Status MosaicSource::Create(std::vector<MosaicInput> inputs, int feather,
+                                  std::unique_ptr<MosaicSource>* out) {
+  if (inputs.empty()) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "mosaic: no inputs");
+  }
+  const RasterInfo& first = inputs[0].source->info();
+  double min_x = std::numeric_limits<double>::infinity(), min_y = min_x;
+  double max_x = -min_x, max_y = -min_x;
+  double res_x = min_x, res_y = min_x;
+  int epsg = 0;
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    const RasterInfo& info = inputs[i].source->info();
+    const Georef& g = inputs[i].georef;
+    if (info.bands != first.bands || info.type != first.type) {
+      return InputError(i, "differs in bands or pixel type from inputs[0]");
+    }
+    if (g.pixel_width <= 0 || g.pixel_height >= 0) {
+      return InputError(i, "geo must be north-up with positive pixel_width");
+    }
+    if (g.epsg != 0) {
+      if (epsg != 0 && g.epsg != epsg) {
+        return InputError(i, "is in EPSG:" + std::to_string(g.epsg) +
+                                 ", another input in EPSG:" +
+                                 std::to_string(epsg));
+      }
+      epsg = g.epsg;
+    }
+    min_x = std::min(min_x, g.origin_x);
+    max_x = std::max(max_x, g.origin_x + g.width * g.pixel_width);
+    max_y = std::max(max_y, g.origin_y);
+    min_y = std::min(min_y, g.origin_y + g.height * g.pixel_height);
+    res_x = std::min(res_x, g.pixel_width);
+    res_y = std::min(res_y, -g.pixel_height);
+  }
+  const double w = std::ceil((max_x - min_x) / res_x - 1e-6);
+  const double h = std::ceil((max_y - min_y) / res_y - 1e-6);
+  if (w > kMaxOutputSide || h > kMaxOutputSide) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "mosaic: output larger than 65536 pixels a side");
+  }
+
+  Georef georef;
+  georef.origin_x = min_x;
+  georef.origin_y = max_y;
+  georef.pixel_width = res_x;
+  georef.pixel_height = -res_y;
+  georef.width = std::max(1, static_cast<int>(w));
+  georef.height = std::max(1, static_cast<int>(h));
+  georef.epsg = epsg;
+  RasterInfo info = first;
+  info.width = georef.width;
+  info.height = georef.height;
+
+  std::unique_ptr<MosaicSource> m(new MosaicSource(info, georef, feather));
+  for (MosaicInput& in : inputs) {
+    auto p = std::make_unique<Placed>();
+    const Georef& g = in.georef;
+    // Output pixel centre x + 0.5 in map units, then into input pixels.
+    p->u_scale = res_x / g.pixel_width;
+    p->u_offset = (min_x + 0.5 * res_x - g.origin_x) / g.pixel_width - 0.5;
+    p->v_scale = res_y / -g.pixel_height;
+    p->v_offset = (g.origin_y - (max_y - 0.5 * res_y)) / -g.pixel_height - 0.5;
+    const int x0 = static_cast<int>(std::floor((g.origin_x - min_x) / res_x));
+    const int y0 = static_cast<int>(std::floor((max_y - g.origin_y) / res_y));
+    const int x1 = static_cast<int>(std::ceil(
+        (g.origin_x + g.width * g.pixel_width - min_x) / res_x));
+    const int y1 = static_cast<int>(std::ceil(
+        (max_y - (g.origin_y + g.height * g.pixel_height)) / res_y));
+    p->footprint = Rect{x0, y0, x1 - x0, y1 - y0}.Intersect(info.bounds());
+    p->input = std::move(in);
+    m->inputs_.push_back(std::move(p));
+  }
+  *out = std::move(m);
+  return grpc::Status::OK;
+}
+
+grpc::Status MosaicSource::ComputeTile(TileIndex t, Tile* out) {
+  (void)t;
+  const Rect& rect = out->rect();
+  const int bands = info_.bands;
+  const size_t px = static_cast<size_t>(rect.width) * rect.height;
+  ScratchArray<float> acc(px * bands, 0.0f), weight(px, 0.0f);
+
+  for (auto& p : inputs_) {
+    // Output is produced in tile-row order, so an input that ends above
+    // this tile will not be read again by Materialize.
+    if (p->footprint.bottom() <= rect.y) {
+      if (!p->trimmed.exchange(true)) p->input.source->Trim();
+      continue;
+    }
+    if (p->footprint.Intersect(rect).empty()) continue;
+    grpc::Status s = Blend(*p, rect, acc.data(), weight.data());
+    if (!s.ok()) return s;
+  }
+
+  for (int y = 0; y < rect.height; ++y) {
+    float* a = acc.data() + static_cast<size_t>(y) * rect.width * bands;
+    const float* w = weight.data() + static_cast<size_t>(y) * rect.width;
+    for (int x = 0; x < rect.width; ++x) {
+      const float inv = w[x] > 0 ? 1.0f / w[x] : 0.0f;
+      for (int b = 0; b < bands; ++b) a[x * bands + b] *= inv;
+    }
+    ConvertSamples(a, PixelType::kF32, out->row(y), info_.type,
+                   static_cast<size_t>(rect.width) * bands);
+  }
+  return grpc::Status::OK;
+}
+
+grpc::Status MosaicSource::Blend(Placed& p, const Rect& tile, float* acc,
+                                 float* weight) {
+  const Rect rect = p.footprint.Intersect(tile);
+  const Georef& g = p.input.georef;
+  const int bands = info_.bands;
+  const double u0 = rect.x * p.u_scale + p.u_offset;
+  const double v0 = rect.y * p.v_scale + p.v_offset;
+  const double u1 = (rect.right() - 1) * p.u_scale + p.u_offset;
+  const double v1 = (rect.bottom() - 1) * p.v_scale + p.v_offset;
+  const int wx = static_cast<int>(std::floor(u0));
+  const int wy = static_cast<int>(std::floor(v0));
+  const Rect window{wx, wy, static_cast<int>(std::floor(u1)) - wx + 2,
+                    static_cast<int>(std::floor(v1)) - wy + 2};
+  const size_t in_row = static_cast<size_t>(window.width) * bands;
+  ScratchArray<float> in(in_row * window.height);
+  grpc::Status s = p.input.source->ReadWindow(
+      window, PixelType::kF32, in.data(), in_row * sizeof(float));
+  if (!s.ok()) return s;
+
+  // Distance to the input's edge, in output pixels, drives the feather.
+  const double to_out_x = 1.0 / p.u_scale, to_out_y = 1.0 / p.v_scale;
+  const float inv_feather = feather_ > 0 ? 1.0f / feather_ : 0.0f;
+  for (int y = rect.y; y < rect.bottom(); ++y) {
+    const double v = y * p.v_scale + p.v_offset;
+    if (v < -0.5 || v > g.height - 0.5) continue;
+    const double dy = std::min(v + 0.5, g.height - 0.5 - v) * to_out_y;
+    const float fv = static_cast<float>(v - wy);
+    const int iy = static_cast<int>(fv);
+    const float ay = fv - iy;
+    const float* r0 = in.data() + iy * in_row;
+    const float* r1 = r0 + in_row;
+    const size_t o = static_cast<size_t>(y - tile.y) * tile.width;
+    for (int x = rect.x; x < rect.right(); ++x) {
+      const double u = x * p.u_scale + p.u_offset;
+      if (u < -0.5 || u > g.width - 0.5) continue;
+      float w = 1.0f;
+      if (feather_ > 0) {
+        const double d = std::min((std::min(u + 0.5, g.width - 0.5 - u)) *
+                                      to_out_x, dy);
+        w = std::min(1.0f, static_cast<float>(d) * inv_feather);
+        if (w <= 0.0f) continue;
+      }
+      const float fu = static_cast<float>(u - wx);
+      const int ix = static_cast<int>(fu);
+      const float ax = fu - ix;
+      const float* p00 = r0 + static_cast<size_t>(ix) * bands;
+      const float* p01 = r1 + static_cast<size_t>(ix) * bands;
+      const size_t k = o + (x - tile.x);
+      float* a = acc + k * bands;
+      if (feather_ < 0) {
+        // No blending: later inputs cover earlier ones.
+        for (int b = 0; b < bands; ++b) a[b] = 0.0f;
+        weight[k] = 0.0f;
+      }
+      for (int b = 0; b < bands; ++b) {
+        const float top = p00[b] + (p00[bands + b] - p00[b]) * ax;
+        const float bottom = p01[b] + (p01[bands + b] - p01[b]) * ax;
+        a[b] += w * (top + (bottom - top) * ay);
+      }
+      weight[k] += w;
+    }
+  }
+  return grpc::Status::OK;
+}
+
+}  // namespace vision
+}  // namespace lucidia
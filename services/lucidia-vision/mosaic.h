@@ -0,0 +1,58 @@
+// Feathered mosaicking of georeferenced rasters sharing one projection.
+//
+// The output footprint is the union of the inputs at the finest input
+// resolution. Each output tile reads only the windows of the inputs that
+// overlap it, one input at a time, so memory per tile is one accumulator
+// plus one input window no matter how many inputs there are. Inputs are
+// trimmed once the output has moved past them.
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "services/lucidia-vision/engine.h"
+#include "services/lucidia-vision/reproject.h"
+
+namespace lucidia {
+namespace vision {
+
+struct MosaicInput {
+  std::shared_ptr<RasterSource> source;
+  Georef georef;  // width/height match source->info(); epsg 0 if unknown.
+};
+
+class MosaicSource : public TileOpSource {
+ public:
+  // `feather` is the seam blend width in output pixels: weights ramp from 0
+  // at an input's edge to 1 that far inside. Negative disables blending and
+  // later inputs cover earlier ones. Inputs naming different CRSs are
+  // rejected; the output takes the one they share.
+  static grpc::Status Create(std::vector<MosaicInput> inputs, int feather,
+                             std::unique_ptr<MosaicSource>* out);
+
+  const Georef& georef() const { return georef_; }
+
+ protected:
+  grpc::Status ComputeTile(TileIndex t, Tile* out) override;
+
+ private:
+  struct Placed {
+    MosaicInput input;
+    // Output pixel (x, y) samples the input at pixel-centre coordinates
+    // u = x * u_scale + u_offset, v = y * v_scale + v_offset.
+    double u_scale, u_offset, v_scale, v_offset;
+    Rect footprint;  // Output pixels the input touches.
+    std::atomic<bool> trimmed{false};
+  };
+
+  MosaicSource(const RasterInfo& info, const Georef& georef, int feather);
+  grpc::Status Blend(Placed& p, const Rect& rect, float* acc, float* weight);
+
+  Georef georef_;
+  float feather_;
+  std::vector<std::unique_ptr<Placed>> inputs_;
+};
+
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,135 @@
+#include "services/lucidia-vision/mosaic.h"
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include "services/lucidia-vision/test_util.h"
+
+namespace lucidia {
+namespace vision {
+namespace {
+
+using testing::MakeRaster;
+using testing::ReadAll;
+
+constexpr int kHeight = 64;
+
+// A kHeight-tall input of unit pixels with every sample `value`, its
+// left edge at map x = `origin_x`.
+MosaicInput Constant(double origin_x, int width, float value) {
+  MosaicInput in;
+  in.source = MakeRaster(width, kHeight, 1, PixelType::kF32,
+                         [value](int, int, int) { return value; });
+  in.georef.origin_x = origin_x;
+  in.georef.origin_y = 0.0;
+  in.georef.pixel_width = 1.0;
+  in.georef.pixel_height = -1.0;
+  in.georef.width = width;
+  in.georef.height = kHeight;
+  return in;
+}
+
+std::vector<float> Mosaic(std::vector<MosaicInput> inputs, int feather,
+                          Georef* georef) {
+  std::unique_ptr<MosaicSource> mosaic;
+  const grpc::Status s =
+      MosaicSource::Create(std::move(inputs), feather, &mosaic);
+  EXPECT_TRUE(s.ok()) << s.error_message();
+  if (!s.ok()) return {};
+  *georef = mosaic->georef();
+  return ReadAll<float>(*mosaic, PixelType::kF32);
+}
+
+// Inputs over x 0-64 and 32-96 overlap in x 32-64.
+std::vector<MosaicInput> Overlapping(float left, float right) {
+  std::vector<MosaicInput> inputs;
+  inputs.push_back(Constant(0.0, 64, left));
+  inputs.push_back(Constant(32.0, 64, right));
+  return inputs;
+}
+
+TEST(MosaicSourceTest, CoversUnionOfInputs) {
+  Georef geo;
+  const std::vector<float> out = Mosaic(Overlapping(100, 200), 8, &geo);
+  ASSERT_EQ(out.size(), size_t{96} * kHeight);
+  EXPECT_EQ(geo.width, 96);
+  EXPECT_EQ(geo.height, kHeight);
+  EXPECT_DOUBLE_EQ(geo.origin_x, 0.0);
+  EXPECT_DOUBLE_EQ(geo.origin_y, 0.0);
+  EXPECT_DOUBLE_EQ(geo.pixel_width, 1.0);
+  EXPECT_DOUBLE_EQ(geo.pixel_height, -1.0);
+}
+
+TEST(MosaicSourceTest, TakesSharedCrs) {
+  std::vector<MosaicInput> inputs = Overlapping(100, 200);
+  inputs[1].georef.epsg = 32633;
+  Georef geo;
+  Mosaic(std::move(inputs), 8, &geo);
+  EXPECT_EQ(geo.epsg, 32633);
+}
+
+TEST(MosaicSourceTest, RejectsMixedCrs) {
+  std::vector<MosaicInput> inputs = Overlapping(100, 200);
+  inputs[0].georef.epsg = 32633;
+  inputs[1].georef.epsg = 32634;
+  std::unique_ptr<MosaicSource> mosaic;
+  EXPECT_EQ(MosaicSource::Create(std::move(inputs), 8, &mosaic).error_code(),
+            grpc::StatusCode::INVALID_ARGUMENT);
+}
+
+TEST(MosaicSourceTest, FeathersSeam) {
+  constexpr int kFeather = 8;
+  Georef geo;
+  const std::vector<float> out =
+      Mosaic(Overlapping(100, 200), kFeather, &geo);
+  ASSERT_EQ(out.size(), size_t{96} * kHeight);
+  // A row far from the top and bottom edges, so only the seams weigh in.
+  const float* row = out.data() + 32 * 96;
+  for (int x = 0; x < 96; ++x) {
+    // Each weight ramps from 0 at its input's edge to 1 kFeather inside.
+    const double centre = x + 0.5;
+    const double left = std::min(1.0, (64 - centre) / kFeather);
+    const double right = std::min(1.0, (centre - 32) / kFeather);
+    double expected = 100;
+    if (x >= 64) {
+      expected = 200;
+    } else if (x >= 32) {
+      expected = (100 * left + 200 * right) / (left + right);
+    }
+    EXPECT_NEAR(row[x], expected, 1e-3) << "x=" << x;
+  }
+  // Both ramps are visible: the right input fades in past x 32 and the
+  // left one fades out before x 64, with an even blend in between.
+  EXPECT_LT(row[32], row[36]);
+  EXPECT_LT(row[36], row[40]);
+  EXPECT_FLOAT_EQ(row[48], 150.0f);
+  EXPECT_LT(row[56], row[60]);
+  EXPECT_LT(row[60], row[63]);
+}
+
+TEST(MosaicSourceTest, NegativeFeatherPaintsLaterInputsOnTop) {
+  Georef geo;
+  std::vector<float> out = Mosaic(Overlapping(100, 200), -1, &geo);
+  ASSERT_EQ(out.size(), size_t{96} * kHeight);
+  for (int y = 0; y < kHeight; ++y) {
+    for (int x = 0; x < 96; ++x) {
+      ASSERT_EQ(out[y * 96 + x], x < 32 ? 100.0f : 200.0f) << x << "," << y;
+    }
+  }
+  // Listed the other way round, the left input covers the overlap.
+  std::vector<MosaicInput> inputs = Overlapping(100, 200);
+  std::swap(inputs[0], inputs[1]);
+  out = Mosaic(std::move(inputs), -1, &geo);
+  ASSERT_EQ(out.size(), size_t{96} * kHeight);
+  for (int y = 0; y < kHeight; ++y) {
+    for (int x = 0; x < 96; ++x) {
+      ASSERT_EQ(out[y * 96 + x], x < 64 ? 100.0f : 200.0f) << x << "," << y;
+    }
+  }
+}
+
+}  // namespace
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,566 @@
+#include "services/lucidia-vision/ortho.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "services/lucidia-vision/engine.h"
+#include "services/lucidia-vision/thread_pool.h"
+
+namespace lucidia {
+namespace vision {
+
+namespace {
+
+// Largest DEM held in memory, in samples.
+constexpr int64_t kMaxDemSamples = int64_t{1} << 26;
+// Largest texture window one output tile may read.
+constexpr int64_t kMaxFootprint = int64_t{1} << 26;
+// DEM rows per task while building.
+constexpr int kBuildRows = 64;
+// Depth buffer pixels are sized to cover about this many DEM cells each.
+constexpr double kCellsPerDepthPixel = 4.0;
+// A ray starts this many cells from its sample; the sample's own cells are
+// covered by the facing test instead, which does not suffer from grazing.
+constexpr double kRayStartCells = 0.5;
+// Step past a node boundary, in cells.
+constexpr double kRayNudgeCells = 1e-4;
+
+constexpr float kInf = std::numeric_limits<float>::infinity();
+
+// Pinhole projection of ground points into texture pixel coordinates (pixel
+// corners on integers).
+struct Camera {
+  double c[3];
+  double m[9];  // Row-major; ground offsets to camera axes.
+  double f, cx, cy;
+
+  // False behind the camera. `depth` is the distance along the view axis.
+  bool Project(double x, double y, double z, float* u, float* v,
+               float* depth) const {
+    const double dx = x - c[0], dy = y - c[1], dz = z - c[2];
+    const double cz = m[6] * dx + m[7] * dy + m[8] * dz;
+    if (!(cz < 0)) return false;
+    const double px = m[0] * dx + m[1] * dy + m[2] * dz;
+    const double py = m[3] * dx + m[4] * dy + m[5] * dz;
+    *u = static_cast<float>(cx - f * px / cz);
+    *v = static_cast<float>(cy + f * py / cz);
+    *depth = static_cast<float>(-cz);
+    return true;
+  }
+};
+
+Camera MakeCamera(const FrameCamera& in, const RasterInfo& texture) {
+  constexpr double kRad = M_PI / 180.0;
+  const double so = std::sin(in.omega_deg * kRad);
+  const double co = std::cos(in.omega_deg * kRad);
+  const double sp = std::sin(in.phi_deg * kRad);
+  const double cp = std::cos(in.phi_deg * kRad);
+  const double sk = std::sin(in.kappa_deg * kRad);
+  const double ck = std::cos(in.kappa_deg * kRad);
+  // Rz(kappa) * Ry(phi) * Rx(omega).
+  const double m[9] = {ck * cp, ck * sp * so - sk * co, ck * sp * co + sk * so,
+                       sk * cp, sk * sp * so + ck * co, sk * sp * co - ck * so,
+                       -sp,     cp * so,                cp * co};
+  Camera cam;
+  cam.c[0] = in.x;
+  cam.c[1] = in.y;
+  cam.c[2] = in.z;
+  std::copy(m, m + 9, cam.m);
+  cam.f = in.focal_px;
+  const bool centred = in.cx == 0 && in.cy == 0;
+  cam.cx = centred ? 0.5 * texture.width : in.cx;
+  cam.cy = centred ? 0.5 * texture.height : in.cy;
+  return cam;
+}
+
+void AtomicMin(std::atomic<uint32_t>* slot, uint32_t value) {
+  uint32_t cur = slot->load(std::memory_order_relaxed);
+  while (value < cur &&
+         !slot->compare_exchange_weak(cur, value, std::memory_order_relaxed)) {
+  }
+}
+
+// Everything visibility needs, built once per request and shared by tiles.
+struct OrthoModel {
+  Georef geo;
+  int w = 0, h = 0;
+  std::vector<float> z;  // DEM samples, row-major.
+  Camera cam;
+  double cam_col = 0, cam_row = 0;  // Camera in DEM sample coordinates.
+  double bias = 0;                  // Height slack for surface tests.
+  double cell_diag = 0;             // Ground diagonal of one DEM cell.
+
+  // Min/max quadtree. Level 0 has one node per DEM cell (the square between
+  // four samples); each level above halves both sides.
+  struct Level {
+    int w = 0, h = 0;
+    std::vector<float> lo, hi;
+  };
+  std::vector<Level> levels;
+
+  // Nearest depth of the terrain over each depth pixel, a `zk`-pixel square
+  // of the texture starting at (zx0, zy0).
+  int zk = 1, zx0 = 0, zy0 = 0, zw = 0, zh = 0;
+  std::vector<float> zbuf;
+
+  float Z(int i, int j) const { return z[static_cast<size_t>(j) * w + i]; }
+  double GroundX(double col) const {
+    return geo.origin_x + (col + 0.5) * geo.pixel_width;
+  }
+  double GroundY(double row) const {
+    return geo.origin_y + (row + 0.5) * geo.pixel_height;
+  }
+
+  grpc::Status Load(RasterSource& dem);
+  void BuildQuadtree();
+  void BuildDepthBuffer(const RasterInfo& texture);
+
+  // True if every cell around the sample turns away from the camera.
+  bool BackFacing(int i, int j) const;
+  // Depth buffer test; false means "not known to be visible".
+  bool SurelyVisible(int i, int j, float u, float v, float depth) const;
+  // Exact test: the ray from sample (i, j) to the camera meets the terrain.
+  bool Occluded(int i, int j) const;
+  bool HitsCell(int ci, int ri, double c0, double r0, double h0, double dc,
+                double dr, double dh, double ta, double tb) const;
+};
+
+grpc::Status OrthoModel::Load(RasterSource& dem) {
+  z.resize(static_cast<size_t>(w) * h);
+  for (int y0 = 0; y0 < h; y0 += kBuildRows) {
+    const int n = std::min(kBuildRows, h - y0);
+    grpc::Status s = dem.ReadWindow(Rect{0, y0, w, n}, PixelType::kF32,
+                                    &z[static_cast<size_t>(y0) * w],
+                                    static_cast<size_t>(w) * sizeof(float));
+    if (!s.ok()) return s;
+  }
+  return grpc::Status::OK;
+}
+
+void OrthoModel::BuildQuadtree() {
+  Level base;
+  base.w = w - 1;
+  base.h = h - 1;
+  base.lo.resize(static_cast<size_t>(base.w) * base.h);
+  base.hi.resize(base.lo.size());
+  ParallelFor(base.h, [&](int r) {
+    for (int c = 0; c < base.w; ++c) {
+      const float a = Z(c, r), b = Z(c + 1, r);
+      const float d = Z(c, r + 1), e = Z(c + 1, r + 1);
+      const size_t k = static_cast<size_t>(r) * base.w + c;
+      base.lo[k] = std::min(std::min(a, b), std::min(d, e));
+      base.hi[k] = std::max(std::max(a, b), std::max(d, e));
+    }
+  });
+  levels.push_back(std::move(base));
+  while (levels.back().w > 1 || levels.back().h > 1) {
+    const Level& below = levels.back();
+    Level up;
+    up.w = (below.w + 1) / 2;
+    up.h = (below.h + 1) / 2;
+    up.lo.resize(static_cast<size_t>(up.w) * up.h);
+    up.hi.resize(up.lo.size());
+    ParallelFor(up.h, [&](int r) {
+      const int r0 = 2 * r, r1 = std::min(2 * r + 1, below.h - 1);
+      for (int c = 0; c < up.w; ++c) {
+        const int c0 = 2 * c, c1 = std::min(2 * c + 1, below.w - 1);
+        const size_t k[4] = {static_cast<size_t>(r0) * below.w + c0,
+                             static_cast<size_t>(r0) * below.w + c1,
+                             static_cast<size_t>(r1) * below.w + c0,
+                             static_cast<size_t>(r1) * below.w + c1};
+        float lo = below.lo[k[0]], hi = below.hi[k[0]];
+        for (int q = 1; q < 4; ++q) {
+          lo = std::min(lo, below.lo[k[q]]);
+          hi = std::max(hi, below.hi[k[q]]);
+        }
+        up.lo[static_cast<size_t>(r) * up.w + c] = lo;
+        up.hi[static_cast<size_t>(r) * up.w + c] = hi;
+      }
+    });
+    levels.push_back(std::move(up));
+  }
+  const Level& top = levels.back();
+  bias = 1e-4 * (top.hi[0] - top.lo[0]) + 1e-6;
+}
+
+void OrthoModel::BuildDepthBuffer(const RasterInfo& texture) {
+  const int bands = (h + kBuildRows - 1) / kBuildRows;
+
+  // Footprint of the DEM on the texture, to size the buffer.
+  std::vector<float> fp(static_cast<size_t>(bands) * 4);
+  ParallelFor(bands, [&](int band) {
+    float x0 = kInf, y0 = kInf, x1 = -kInf, y1 = -kInf;
+    const int end = std::min(h, (band + 1) * kBuildRows);
+    for (int j = band * kBuildRows; j < end; ++j) {
+      for (int i = 0; i < w; ++i) {
+        float u, v, d;
+        if (!cam.Project(GroundX(i), GroundY(j), Z(i, j), &u, &v, &d)) {
+          continue;
+        }
+        x0 = std::min(x0, u);
+        y0 = std::min(y0, v);
+        x1 = std::max(x1, u);
+        y1 = std::max(y1, v);
+      }
+    }
+    float* out = &fp[static_cast<size_t>(band) * 4];
+    out[0] = x0, out[1] = y0, out[2] = x1, out[3] = y1;
+  });
+  float x0 = kInf, y0 = kInf, x1 = -kInf, y1 = -kInf;
+  for (int band = 0; band < bands; ++band) {
+    const float* b = &fp[static_cast<size_t>(band) * 4];
+    x0 = std::min(x0, b[0]);
+    y0 = std::min(y0, b[1]);
+    x1 = std::max(x1, b[2]);
+    y1 = std::max(y1, b[3]);
+  }
+  x0 = std::max(x0, 0.0f);
+  y0 = std::max(y0, 0.0f);
+  x1 = std::min(x1, static_cast<float>(texture.width));
+  y1 = std::min(y1, static_cast<float>(texture.height));
+  if (!(x0 < x1 && y0 < y1)) return;  // Nothing lands on the texture.
+
+  const double area = (static_cast<double>(x1) - x0) * (y1 - y0);
+  const double cells = static_cast<double>(w - 1) * (h - 1);
+  const double side = std::sqrt(area * kCellsPerDepthPixel / cells);
+  zk = std::max(1, static_cast<int>(std::ceil(side)));
+  zx0 = static_cast<int>(x0);
+  zy0 = static_cast<int>(y0);
+  zw = (static_cast<int>(std::ceil(x1)) - zx0 + zk - 1) / zk;
+  zh = (static_cast<int>(std::ceil(y1)) - zy0 + zk - 1) / zk;
+
+  // Every DEM cell writes its nearest depth into the depth pixels its
+  // projected corners span, so no pixel it covers is missed. Positive
+  // floats order like their bit patterns, which lets the minimum be atomic.
+  uint32_t inf_bits;
+  std::memcpy(&inf_bits, &kInf, sizeof(inf_bits));
+  std::vector<std::atomic<uint32_t>> depth(static_cast<size_t>(zw) * zh);
+  for (auto& d : depth) d.store(inf_bits, std::memory_order_relaxed);
+  const int cell_bands = (h - 1 + kBuildRows - 1) / kBuildRows;
+  ParallelFor(cell_bands, [&](int band) {
+    std::vector<float> pu[2], pv[2], pd[2];
+    for (int k = 0; k < 2; ++k) {
+      pu[k].resize(w);
+      pv[k].resize(w);
+      pd[k].resize(w);
+    }
+    auto project_row = [&](int j, int k) {
+      for (int i = 0; i < w; ++i) {
+        if (!cam.Project(GroundX(i), GroundY(j), Z(i, j), &pu[k][i],
+                         &pv[k][i], &pd[k][i])) {
+          pd[k][i] = -1.0f;
+        }
+      }
+    };
+    const int begin = band * kBuildRows;
+    const int end = std::min(h - 1, begin + kBuildRows);
+    project_row(begin, 0);
+    for (int j = begin; j < end; ++j) {
+      const int a = (j - begin) & 1, b = a ^ 1;
+      project_row(j + 1, b);
+      for (int i = 0; i + 1 < w; ++i) {
+        const float d[4] = {pd[a][i], pd[a][i + 1], pd[b][i], pd[b][i + 1]};
+        if (d[0] < 0 || d[1] < 0 || d[2] < 0 || d[3] < 0) continue;
+        const float u[4] = {pu[a][i], pu[a][i + 1], pu[b][i], pu[b][i + 1]};
+        const float v[4] = {pv[a][i], pv[a][i + 1], pv[b][i], pv[b][i + 1]};
+        const float umin = std::min(std::min(u[0], u[1]), std::min(u[2], u[3]));
+        const float umax = std::max(std::max(u[0], u[1]), std::max(u[2], u[3]));
+        const float vmin = std::min(std::min(v[0], v[1]), std::min(v[2], v[3]));
+        const float vmax = std::max(std::max(v[0], v[1]), std::max(v[2], v[3]));
+        const int qx0 = std::max(0, static_cast<int>(std::floor(
+                                        (umin - zx0) / zk)));
+        const int qy0 = std::max(0, static_cast<int>(std::floor(
+                                        (vmin - zy0) / zk)));
+        const int qx1 = std::min(zw - 1, static_cast<int>(std::floor(
+                                             (umax - zx0) / zk)));
+        const int qy1 = std::min(zh - 1, static_cast<int>(std::floor(
+                                             (vmax - zy0) / zk)));
+        if (qx0 > qx1 || qy0 > qy1) continue;
+        const float dmin = std::min(std::min(d[0], d[1]), std::min(d[2], d[3]));
+        uint32_t bits;
+        std::memcpy(&bits, &dmin, sizeof(bits));
+        for (int qy = qy0; qy <= qy1; ++qy) {
+          for (int qx = qx0; qx <= qx1; ++qx) {
+            AtomicMin(&depth[static_cast<size_t>(qy) * zw + qx], bits);
+          }
+        }
+      }
+    }
+  });
+  zbuf.resize(depth.size());
+  for (size_t k = 0; k < depth.size(); ++k) {
+    const uint32_t bits = depth[k].load(std::memory_order_relaxed);
+    std::memcpy(&zbuf[k], &bits, sizeof(bits));
+  }
+}
+
+bool OrthoModel::BackFacing(int i, int j) const {
+  // Each cell sharing the sample as a corner is tried on its own, so the
+  // roof at the lip of a cliff still faces up even though the wall below
+  // it faces away.
+  const double vx = cam.c[0] - GroundX(i), vy = cam.c[1] - GroundY(j);
+  const double vz = cam.c[2] - Z(i, j);
+  for (int ri = std::max(j - 1, 0); ri <= std::min(j, h - 2); ++ri) {
+    for (int ci = std::max(i - 1, 0); ci <= std::min(i, w - 2); ++ci) {
+      const double z00 = Z(ci, ri), z10 = Z(ci + 1, ri);
+      const double z01 = Z(ci, ri + 1), z11 = Z(ci + 1, ri + 1);
+      const double dzdx = (z10 - z00 + z11 - z01) / (2 * geo.pixel_width);
+      const double dzdy = (z01 - z00 + z11 - z10) / (2 * geo.pixel_height);
+      if (-dzdx * vx - dzdy * vy + vz > 0) return false;
+    }
+  }
+  return true;
+}
+
+bool OrthoModel::SurelyVisible(int i, int j, float u, float v,
+                               float depth) const {
+  const int qx = static_cast<int>(std::floor((u - zx0) / zk));
+  const int qy = static_cast<int>(std::floor((v - zy0) / zk));
+  if (qx < 0 || qy < 0 || qx >= zw || qy >= zh) return false;
+  // Visible terrain sharing the depth pixel can be nearer by about the
+  // pixel's ground footprint, plus the relief of the sample's own cells.
+  const int il = std::max(i - 1, 0), ir = std::min(i + 1, w - 1);
+  const int jt = std::max(j - 1, 0), jb = std::min(j + 1, h - 1);
+  const float zc = Z(i, j);
+  const float relief = std::max(
+      std::max(std::abs(Z(il, j) - zc), std::abs(Z(ir, j) - zc)),
+      std::max(std::abs(Z(i, jt) - zc), std::abs(Z(i, jb) - zc)));
+  const double slack = 2.0 * (zk * depth / cam.f + cell_diag + relief);
+  return depth <= zbuf[static_cast<size_t>(qy) * zw + qx] + slack;
+}
+
+bool OrthoModel::Occluded(int i, int j) const {
+  const double c0 = i, r0 = j, h0 = Z(i, j);
+  const double dc = cam_col - c0, dr = cam_row - r0, dh = cam.c[2] - h0;
+  const double len = std::hypot(dc, dr);
+  if (len < 1e-9) return false;  // Camera straight above.
+
+  // The ray only matters while it is over the DEM.
+  double t_end = 1.0;
+  if (dc > 0) t_end = std::min(t_end, (w - 1 - c0) / dc);
+  if (dc < 0) t_end = std::min(t_end, -c0 / dc);
+  if (dr > 0) t_end = std::min(t_end, (h - 1 - r0) / dr);
+  if (dr < 0) t_end = std::min(t_end, -r0 / dr);
+  const double nudge = kRayNudgeCells / len;
+  const float top = levels.back().hi[0];
+  const int top_level = static_cast<int>(levels.size()) - 1;
+
+  double t = kRayStartCells / len;
+  int level = top_level;
+  while (t < t_end) {
+    const double h_in = h0 + t * dh;
+    if (dh >= 0 && h_in > top + bias) return false;  // Above everything.
+    const int bc = std::clamp(static_cast<int>(c0 + t * dc), 0, w - 2);
+    const int br = std::clamp(static_cast<int>(r0 + t * dr), 0, h - 2);
+    const Level& l = levels[level];
+    const int nc = bc >> level, nr = br >> level;
+    const int side = 1 << level;
+    double t_exit = t_end;
+    if (dc > 0) t_exit = std::min(t_exit, ((nc + 1) * side - c0) / dc);
+    if (dc < 0) t_exit = std::min(t_exit, (nc * side - c0) / dc);
+    if (dr > 0) t_exit = std::min(t_exit, ((nr + 1) * side - r0) / dr);
+    if (dr < 0) t_exit = std::min(t_exit, (nr * side - r0) / dr);
+    t_exit = std::max(t_exit, t);
+    const double h_out = h0 + t_exit * dh;
+    const size_t k = static_cast<size_t>(nr) * l.w + nc;
+    if (std::min(h_in, h_out) > l.hi[k] + bias) {
+      // Clears the whole node; continue from its exit one level up.
+      t = t_exit + nudge;
+      level = std::min(level + 1, top_level);
+      continue;
+    }
+    if (std::max(h_in, h_out) < l.lo[k] - bias) return true;  // Beneath it.
+    if (level > 0) {
+      --level;
+      continue;
+    }
+    if (HitsCell(nc, nr, c0, r0, h0, dc, dr, dh, t, t_exit)) return true;
+    t = t_exit + nudge;
+  }
+  return false;
+}
+
+// The ray's height minus the bilinear surface of cell (ci, ri) is quadratic
+// in t; it dips below zero on [ta, tb] only at an end or at its vertex.
+bool OrthoModel::HitsCell(int ci, int ri, double c0, double r0, double h0,
+                          double dc, double dr, double dh, double ta,
+                          double tb) const {
+  const double z00 = Z(ci, ri), z10 = Z(ci + 1, ri);
+  const double z01 = Z(ci, ri + 1), z11 = Z(ci + 1, ri + 1);
+  const double a = z10 - z00, b = z01 - z00, c = z00 - z10 - z01 + z11;
+  const double a0 = c0 - ci, b0 = r0 - ri;
+  const double q0 = h0 - (z00 + a * a0 + b * b0 + c * a0 * b0);
+  const double q1 = dh - (a * dc + b * dr + c * (a0 * dr + b0 * dc));
+  const double q2 = -c * dc * dr;
+  auto f = [&](double t) { return q0 + t * (q1 + t * q2); };
+  if (f(ta) < -bias || f(tb) < -bias) return true;
+  if (q2 > 0) {
+    const double tv = -q1 / (2 * q2);
+    if (tv > ta && tv < tb && f(tv) < -bias) return true;
+  }
+  return false;
+}
+
+RasterInfo OutputInfo(const RasterInfo& dem, const RasterInfo& texture) {
+  RasterInfo info = texture;
+  info.width = dem.width;
+  info.height = dem.height;
+  info.tile_size = dem.tile_size;
+  return info;
+}
+
+class OrthoSource : public TileOpSource {
+ public:
+  OrthoSource(std::shared_ptr<const OrthoModel> model,
+              std::shared_ptr<RasterSource> texture, const RasterInfo& info)
+      : TileOpSource(info),
+        model_(std::move(model)),
+        texture_(std::move(texture)) {}
+
+ protected:
+  grpc::Status ComputeTile(TileIndex t, Tile* out) override;
+
+ private:
+  std::shared_ptr<const OrthoModel> model_;
+  std::shared_ptr<RasterSource> texture_;
+};
+
+grpc::Status OrthoSource::ComputeTile(TileIndex t, Tile* out) {
+  (void)t;
+  const OrthoModel& m = *model_;
+  const Rect& rect = out->rect();
+  const int bands = info_.bands;
+  const RasterInfo& tex = texture_->info();
+
+  // Texture pixel-centre coordinates of every visible sample; NaN otherwise.
+  // Rows are independent, so they spread over the pool as well.
+  const size_t n = static_cast<size_t>(rect.width) * rect.height;
+  ScratchArray<float> u(n), v(n);
+  ScratchArray<float> bounds(static_cast<size_t>(rect.height) * 4);
+  ParallelFor(rect.height, [&](int y) {
+    const int j = rect.y + y;
+    float min_u = kInf, min_v = kInf, max_u = -kInf, max_v = -kInf;
+    for (int x = 0; x < rect.width; ++x) {
+      const int i = rect.x + x;
+      const size_t k = static_cast<size_t>(y) * rect.width + x;
+      float tu, tv, depth;
+      const bool visible =
+          m.cam.Project(m.GroundX(i), m.GroundY(j), m.Z(i, j), &tu, &tv,
+                        &depth) &&
+          tu >= 0 && tu <= tex.width && tv >= 0 && tv <= tex.height &&
+          !m.BackFacing(i, j) &&
+          (m.SurelyVisible(i, j, tu, tv, depth) || !m.Occluded(i, j));
+      if (!visible) {
+        u[k] = v[k] = std::numeric_limits<float>::quiet_NaN();
+        continue;
+      }
+      const float pu = tu - 0.5f, pv = tv - 0.5f;
+      u[k] = pu;
+      v[k] = pv;
+      min_u = std::min(min_u, pu);
+      max_u = std::max(max_u, pu);
+      min_v = std::min(min_v, pv);
+      max_v = std::max(max_v, pv);
+    }
+    float* b = &bounds[static_cast<size_t>(y) * 4];
+    b[0] = min_u, b[1] = min_v, b[2] = max_u, b[3] = max_v;
+  });
+  float min_u = kInf, min_v = kInf, max_u = -kInf, max_v = -kInf;
+  for (int y = 0; y < rect.height; ++y) {
+    const float* b = &bounds[static_cast<size_t>(y) * 4];
+    min_u = std::min(min_u, b[0]);
+    min_v = std::min(min_v, b[1]);
+    max_u = std::max(max_u, b[2]);
+    max_v = std::max(max_v, b[3]);
+  }
+
+  if (!(min_u <= max_u)) {
+    for (int y = 0; y < rect.height; ++y) {
+      std::fill_n(out->row(y), rect.width * info_.pixel_bytes(), 0);
+    }
+    return grpc::Status::OK;
+  }
+
+  // One texture read per tile: neighbouring DEM samples land near each
+  // other in the image, so the window is compact for all but the most
+  // oblique views. The edge halo is replicated.
+  const int wx = static_cast<int>(std::floor(min_u));
+  const int wy = static_cast<int>(std::floor(min_v));
+  const Rect window{wx, wy, static_cast<int>(std::floor(max_u)) - wx + 2,
+                    static_cast<int>(std::floor(max_v)) - wy + 2};
+  if (static_cast<int64_t>(window.width) * window.height > kMaxFootprint) {
+    return grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED,
+                        "orthorectify: tile footprint too large");
+  }
+  const size_t in_row = static_cast<size_t>(window.width) * bands;
+  ScratchArray<float> in(in_row * window.height);
+  grpc::Status s = texture_->ReadWindow(window, PixelType::kF32, in.data(),
+                                        in_row * sizeof(float));
+  if (!s.ok()) return s;
+
+  ScratchArray<float> acc(static_cast<size_t>(rect.width) * bands);
+  for (int y = 0; y < rect.height; ++y) {
+    for (int x = 0; x < rect.width; ++x) {
+      const size_t k = static_cast<size_t>(y) * rect.width + x;
+      float* dst = &acc[static_cast<size_t>(x) * bands];
+      if (std::isnan(u[k])) {
+        std::fill_n(dst, bands, 0.0f);
+        continue;
+      }
+      const float fu = u[k] - wx, fv = v[k] - wy;
+      const int ix = static_cast<int>(fu), iy = static_cast<int>(fv);
+      const float ax = fu - ix, ay = fv - iy;
+      const float* p00 = &in[iy * in_row + static_cast<size_t>(ix) * bands];
+      const float* p01 = p00 + in_row;
+      for (int b = 0; b < bands; ++b) {
+        const float top = p00[b] + (p00[bands + b] - p00[b]) * ax;
+        const float bottom = p01[b] + (p01[bands + b] - p01[b]) * ax;
+        dst[b] = top + (bottom - top) * ay;
+      }
+    }
+    ConvertSamples(acc.data(), PixelType::kF32, out->row(y), info_.type,
+                   acc.size());
+  }
+  return grpc::Status::OK;
+}
+
+}  // namespace
+
+grpc::Status MakeOrthoSource(std::shared_ptr<RasterSource> dem,
+                             const Georef& dem_geo,
+                             std::shared_ptr<RasterSource> texture,
+                             const FrameCamera& camera,
+                             std::shared_ptr<RasterSource>* out) {
+  const RasterInfo& info = dem->info();
+  if (info.width < 2 || info.height < 2) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "orthorectify: dem must be at least 2x2");
+  }
+  if (static_cast<int64_t>(info.width) * info.height > kMaxDemSamples) {
+    return grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED,
+                        "orthorectify: dem too large");
+  }
+  auto model = std::make_shared<OrthoModel>();
+  model->geo = dem_geo;
+  model->w = info.width;
+  model->h = info.height;
+  model->cam = MakeCamera(camera, texture->info());
+  model->cam_col = (camera.x - dem_geo.origin_x) / dem_geo.pixel_width - 0.5;
+  model->cam_row = (camera.y - dem_geo.origin_y) / dem_geo.pixel_height - 0.5;
+  model->cell_diag = std::hypot(dem_geo.pixel_width, dem_geo.pixel_height);
+  grpc::Status s = model->Load(*dem);
+  if (!s.ok()) return s;
+  model->BuildQuadtree();
+  model->BuildDepthBuffer(texture->info());
+  const RasterInfo out_info = OutputInfo(info, texture->info());
+  *out = std::make_shared<OrthoSource>(std::move(model), std::move(texture),
+                                       out_info);
+  return grpc::Status::OK;
+}
+
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,41 @@
+// Orthorectification of a frame-camera image over a DEM.
+//
+// The output lies on the DEM's grid: every DEM sample is projected into the
+// texture through the camera and, if no terrain stands between it and the
+// camera, takes the bilinearly sampled texture value there. Hidden samples
+// and samples outside the texture are zero.
+//
+// Visibility is decided in two steps. A coarse depth buffer in texture space,
+// filled up front with the nearest depth of every DEM cell that covers it,
+// accepts most samples outright. The rest march toward the camera through a
+// min/max quadtree over the DEM, which steps over any block the ray clears
+// and only intersects the bilinear surface in cells it cannot rule out.
+#pragma once
+
+#include <memory>
+
+#include "services/lucidia-vision/raster.h"
+
+namespace lucidia {
+namespace vision {
+
+struct FrameCamera {
+  double x = 0, y = 0, z = 0;  // Perspective centre, DEM ground units.
+  double omega_deg = 0;        // Rz(kappa) * Ry(phi) * Rx(omega) takes
+  double phi_deg = 0;          // ground offsets into camera axes.
+  double kappa_deg = 0;
+  double focal_px = 0;
+  double cx = 0, cy = 0;       // Principal point, texture pixels.
+};
+
+// Orthorectified view of `texture` (any bands and type) on the grid of the
+// single-band `dem`, placed by `dem_geo`. Loads the DEM and builds the
+// quadtree and depth buffer before returning.
+grpc::Status MakeOrthoSource(std::shared_ptr<RasterSource> dem,
+                             const Georef& dem_geo,
+                             std::shared_ptr<RasterSource> texture,
+                             const FrameCamera& camera,
+                             std::shared_ptr<RasterSource>* out);
+
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,154 @@
+#include "services/lucidia-vision/ortho.h"
+
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include "services/lucidia-vision/test_util.h"
+
+namespace lucidia {
+namespace vision {
+namespace {
+
+using testing::MakeRaster;
+using testing::ReadAll;
+
+// North-up grid of unit cells with its top-left corner at (0, 0).
+Georef UnitGeoref(int width, int height) {
+  Georef geo;
+  geo.pixel_width = 1.0;
+  geo.pixel_height = -1.0;
+  geo.width = width;
+  geo.height = height;
+  return geo;
+}
+
+std::vector<float> Ortho(std::shared_ptr<RasterSource> dem,
+                         std::shared_ptr<RasterSource> texture,
+                         const FrameCamera& camera) {
+  const Georef geo = UnitGeoref(dem->info().width, dem->info().height);
+  std::shared_ptr<RasterSource> out;
+  const grpc::Status s =
+      MakeOrthoSource(std::move(dem), geo, std::move(texture), camera, &out);
+  EXPECT_TRUE(s.ok()) << s.error_message();
+  if (!s.ok()) return {};
+  return ReadAll<float>(*out, PixelType::kF32);
+}
+
+TEST(OrthoTest, NadirOverFlatTerrainIsIdentity) {
+  constexpr int kSize = 64;
+  auto dem = MakeRaster(kSize, kSize, 1, PixelType::kF32,
+                        [](int, int, int) { return 0.0f; });
+  auto texture = MakeRaster(kSize, kSize, 1, PixelType::kF32,
+                            [](int x, int y, int) { return x + 100.0f * y; });
+  // One texture pixel per cell: focal length equals the flying height.
+  FrameCamera camera;
+  camera.x = kSize / 2;
+  camera.y = -kSize / 2;
+  camera.z = 250;
+  camera.focal_px = 250;
+  const std::vector<float> out = Ortho(dem, texture, camera);
+  ASSERT_EQ(out.size(), size_t{kSize} * kSize);
+  for (int y = 0; y < kSize; ++y) {
+    for (int x = 0; x < kSize; ++x) {
+      ASSERT_EQ(out[y * kSize + x], x + 100.0f * y) << x << "," << y;
+    }
+  }
+}
+
+TEST(OrthoTest, PillarShadowsTerrainBehindIt) {
+  // A 500-unit pillar over cols 40..47, rows 30..37 of flat ground, seen by
+  // a camera 1000 units up and well to the west.
+  constexpr int kSize = 96;
+  auto pillar = [](int x, int y) {
+    return x >= 40 && x <= 47 && y >= 30 && y <= 37;
+  };
+  auto dem = MakeRaster(kSize, kSize, 1, PixelType::kF32,
+                        [&](int x, int y, int) {
+                          return pillar(x, y) ? 500.0f : 0.0f;
+                        });
+  auto texture = MakeRaster(128, 128, 1, PixelType::kF32,
+                            [](int, int, int) { return 1.0f; });
+  FrameCamera camera;
+  camera.x = -200;
+  camera.y = -34;
+  camera.z = 1000;
+  camera.focal_px = 100;
+  camera.cx = 1;
+  camera.cy = 64;
+  const std::vector<float> out = Ortho(dem, texture, camera);
+  ASSERT_EQ(out.size(), size_t{kSize} * kSize);
+  auto at = [&](int x, int y) { return out[y * kSize + x]; };
+  // The whole roof is visible, its edges included.
+  for (int y = 30; y <= 37; ++y) {
+    for (int x = 40; x <= 47; ++x) EXPECT_EQ(at(x, y), 1.0f) << x << "," << y;
+  }
+  // Rays from the ground east of the pillar pass below its top.
+  for (int y = 31; y <= 36; ++y) {
+    for (int x = 50; x < kSize; ++x) {
+      EXPECT_EQ(at(x, y), 0.0f) << x << "," << y;
+    }
+  }
+  // Ground on the camera's side and away from the pillar's rows is seen.
+  for (int y = 0; y < kSize; ++y) {
+    for (int x = 0; x < 38; ++x) EXPECT_EQ(at(x, y), 1.0f) << x << "," << y;
+  }
+  for (int y = 0; y < 20; ++y) {
+    for (int x = 0; x < kSize; ++x) {
+      EXPECT_EQ(at(x, y), 1.0f) << x << "," << y;
+    }
+  }
+}
+
+TEST(OrthoTest, ObliqueCameraMatchesPinholeModel) {
+  constexpr int kSize = 64;
+  constexpr int kTexture = 256;
+  auto dem = MakeRaster(kSize, kSize, 1, PixelType::kF32,
+                        [](int, int, int) { return 10.0f; });
+  // Linear in both axes, so bilinear sampling reproduces it exactly.
+  auto texture = MakeRaster(kTexture, kTexture, 1, PixelType::kF32,
+                            [](int x, int y, int) { return 3.0f * x + y; });
+  FrameCamera camera;
+  camera.x = 20;
+  camera.y = -40;
+  camera.z = 210;
+  camera.omega_deg = 10;
+  camera.phi_deg = -15;
+  camera.kappa_deg = 30;
+  camera.focal_px = 200;
+  const std::vector<float> out = Ortho(dem, texture, camera);
+  ASSERT_EQ(out.size(), size_t{kSize} * kSize);
+
+  const double rad = M_PI / 180.0;
+  const double o = camera.omega_deg * rad, p = camera.phi_deg * rad;
+  const double k = camera.kappa_deg * rad;
+  int checked = 0;
+  for (int y = 0; y < kSize; ++y) {
+    for (int x = 0; x < kSize; ++x) {
+      // Rz(kappa) * Ry(phi) * Rx(omega) applied one rotation at a time.
+      double dx = x + 0.5 - camera.x, dy = -(y + 0.5) - camera.y;
+      double dz = 10 - camera.z;
+      double t = dy * std::cos(o) - dz * std::sin(o);
+      dz = dy * std::sin(o) + dz * std::cos(o);
+      dy = t;
+      t = dx * std::cos(p) + dz * std::sin(p);
+      dz = -dx * std::sin(p) + dz * std::cos(p);
+      dx = t;
+      t = dx * std::cos(k) - dy * std::sin(k);
+      dy = dx * std::sin(k) + dy * std::cos(k);
+      dx = t;
+      const double u = kTexture / 2 - camera.focal_px * dx / dz;
+      const double v = kTexture / 2 + camera.focal_px * dy / dz;
+      if (u < 1 || v < 1 || u > kTexture - 1 || v > kTexture - 1) continue;
+      const double expected = 3 * (u - 0.5) + (v - 0.5);
+      EXPECT_NEAR(out[y * kSize + x], expected, 1e-2) << x << "," << y;
+      ++checked;
+    }
+  }
+  EXPECT_GT(checked, kSize * kSize / 2);
+}
+
+}  // namespace
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,449 @@
+#include "services/lucidia-vision/png_codec.h"
+
+#include <algorithm>
+#include <csetjmp>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <png.h>
+#include <zlib.h>
+
+#include "services/lucidia-vision/thread_pool.h"
+
+namespace lucidia {
+namespace vision {
+
+namespace {
+
+// Largest image accepted, checked on IHDR before any row is allocated. The
+// decoded row window spans the full width, and interlaced images are held
+// whole, hence their tighter bound.
+constexpr uint32_t kMaxSide = 1 << 16;
+constexpr uint64_t kMaxPixels = uint64_t{1} << 30;
+constexpr uint64_t kMaxInterlacedPixels = uint64_t{1} << 26;
+
+grpc::Status PngError(const char* what) {
+  return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                      std::string("png: ") + what);
+}
+
+struct StreamReader {
+  ByteStream* stream;
+  uint64_t offset;
+  grpc::Status error;
+};
+
+void ReadFromStream(png_structp png, png_bytep out, png_size_t n) {
+  auto* r = static_cast<StreamReader*>(png_get_io_ptr(png));
+  size_t got = 0;
+  r->error = r->stream->ReadAt(r->offset, out, n, &got);
+  if (!r->error.ok()) png_error(png, "read failed");
+  if (got < n) png_error(png, "truncated stream");
+  r->offset += n;
+}
+
+// libpng's default handlers print to stderr; errors surface as Status instead.
+void OnPngError(png_structp png, png_const_charp) { png_longjmp(png, 1); }
+void OnPngWarning(png_structp, png_const_charp) {}
+
+bool HostIsLittleEndian() {
+  const uint16_t probe = 1;
+  return *reinterpret_cast<const uint8_t*>(&probe) == 1;
+}
+
+}  // namespace
+
+// PngSource -----------------------------------------------------------------
+
+struct PngSource::Decoder {
+  png_structp png = nullptr;
+  png_infop png_info = nullptr;
+  StreamReader reader{};
+
+  // Prefers the underlying stream error (e.g. an aborted upload).
+  grpc::Status Fail(const char* what) const {
+    return reader.error.ok() ? PngError(what) : reader.error;
+  }
+  int next_row = 0;
+  bool interlaced = false;
+
+  ~Decoder() { png_destroy_read_struct(&png, &png_info, nullptr); }
+};
+
+PngSource::PngSource(std::shared_ptr<ByteStream> stream)
+    : stream_(std::move(stream)) {}
+
+PngSource::~PngSource() = default;
+
+grpc::Status PngSource::Open(std::shared_ptr<ByteStream> stream, int tile_size,
+                             std::unique_ptr<PngSource>* out) {
+  png_byte sig[8];
+  size_t got = 0;
+  grpc::Status s = stream->ReadAt(0, sig, sizeof(sig), &got);
+  if (!s.ok()) return s;
+  if (got < sizeof(sig) || png_sig_cmp(sig, 0, sizeof(sig)) != 0) {
+    return PngError("bad signature");
+  }
+  std::unique_ptr<PngSource> src(new PngSource(std::move(stream)));
+  src->info_.tile_size = tile_size;
+  s = src->Restart();
+  if (!s.ok()) return s;
+  // A tile row plus halos above and below stays resident, so row-major
+  // tile consumers never force a restart.
+  src->window_rows_ = src->decoder_->interlaced ? src->info_.height
+                                                : 3 * tile_size;
+  *out = std::move(src);
+  return grpc::Status::OK;
+}
+
+grpc::Status PngSource::Restart() {
+  rows_.clear();
+  first_row_ = 0;
+  auto d = std::make_unique<Decoder>();
+  d->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, OnPngError,
+                                  OnPngWarning);
+  if (d->png == nullptr) return PngError("out of memory");
+  d->png_info = png_create_info_struct(d->png);
+  if (d->png_info == nullptr) return PngError("out of memory");
+  d->reader = StreamReader{stream_.get(), 0, grpc::Status::OK};
+  if (setjmp(png_jmpbuf(d->png))) return d->Fail("corrupt header");
+  png_set_read_fn(d->png, &d->reader, ReadFromStream);
+  png_read_info(d->png, d->png_info);
+
+  png_set_expand(d->png);  // palette -> RGB, low-bit gray -> 8, tRNS -> alpha.
+  if (png_get_bit_depth(d->png, d->png_info) == 16 && HostIsLittleEndian()) {
+    png_set_swap(d->png);
+  }
+  d->interlaced = png_set_interlace_handling(d->png) > 1;
+  png_read_update_info(d->png, d->png_info);
+
+  const uint32_t width = png_get_image_width(d->png, d->png_info);
+  const uint32_t height = png_get_image_height(d->png, d->png_info);
+  const uint64_t pixels = uint64_t{width} * height;
+  if (width > kMaxSide || height > kMaxSide || pixels > kMaxPixels ||
+      (d->interlaced && pixels > kMaxInterlacedPixels)) {
+    return PngError("image too large");
+  }
+  info_.width = static_cast<int>(width);
+  info_.height = static_cast<int>(height);
+  info_.bands = png_get_channels(d->png, d->png_info);
+  info_.type = png_get_bit_depth(d->png, d->png_info) == 16 ? PixelType::kU16
+                                                           : PixelType::kU8;
+  row_bytes_ = png_get_rowbytes(d->png, d->png_info);
+  decoder_ = std::move(d);
+  return grpc::Status::OK;
+}
+
+grpc::Status PngSource::DecodeThrough(int row) {
+  Decoder* d = decoder_.get();
+  if (d->interlaced && d->next_row == 0) {
+    // Adam7 needs every pass over the full image; decode it in one go.
+    for (int y = 0; y < info_.height; ++y) rows_.emplace_back(row_bytes_);
+    std::vector<png_bytep> ptrs(info_.height);
+    for (int y = 0; y < info_.height; ++y) ptrs[y] = rows_[y].data();
+    if (setjmp(png_jmpbuf(d->png))) return d->Fail("corrupt image data");
+    png_read_image(d->png, ptrs.data());
+    d->next_row = info_.height;
+    return grpc::Status::OK;
+  }
+  while (d->next_row <= row && d->next_row < info_.height) {
+    if (static_cast<int>(rows_.size()) >= window_rows_) {
+      rows_.pop_front();
+      ++first_row_;
+    }
+    rows_.emplace_back(row_bytes_);
+    png_bytep dst = rows_.back().data();
+    if (setjmp(png_jmpbuf(d->png))) return d->Fail("corrupt image data");
+    png_read_row(d->png, dst, nullptr);
+    ++d->next_row;
+  }
+  return grpc::Status::OK;
+}
+
+grpc::Status PngSource::ReadWindow(const Rect& rect, PixelType type,
+                                   void* dst, size_t dst_stride) {
+  std::lock_guard<std::mutex> lock(mu_);
+  const int y0 = std::clamp(rect.y, 0, info_.height - 1);
+  const int y1 = std::clamp(rect.bottom() - 1, 0, info_.height - 1);
+  // Tall windows (heavy downscales) grow the buffer rather than fail.
+  window_rows_ = std::max(window_rows_, y1 - y0 + 1);
+  if (decoder_ == nullptr || y0 < first_row_) {
+    grpc::Status s = Restart();
+    if (!s.ok()) return s;
+  }
+  grpc::Status s = DecodeThrough(y1);
+  if (!s.ok()) return s;
+
+  const size_t px = info_.pixel_bytes();
+  const size_t dst_px = BytesPerSample(type) * info_.bands;
+  auto* out = static_cast<uint8_t*>(dst);
+  const int x0 = std::max(rect.x, 0);
+  const int x1 = std::min(rect.right(), info_.width);
+  for (int r = 0; r < rect.height; ++r) {
+    const int sy = std::clamp(rect.y + r, 0, info_.height - 1);
+    const uint8_t* srow = rows_[sy - first_row_].data();
+    uint8_t* drow = out + r * dst_stride;
+    // Left and right halos replicate the edge pixel.
+    for (int x = rect.x; x < x0; ++x) {
+      ConvertSamples(srow, info_.type, drow + (x - rect.x) * dst_px, type,
+                     info_.bands);
+    }
+    if (x1 > x0) {
+      ConvertSamples(srow + x0 * px, info_.type, drow + (x0 - rect.x) * dst_px,
+                     type, static_cast<size_t>(x1 - x0) * info_.bands);
+    }
+    for (int x = std::max(x1, rect.x); x < rect.right(); ++x) {
+      ConvertSamples(srow + (info_.width - 1) * px, info_.type,
+                     drow + (x - rect.x) * dst_px, type, info_.bands);
+    }
+  }
+  return grpc::Status::OK;
+}
+
+void PngSource::Trim() {
+  std::lock_guard<std::mutex> lock(mu_);
+  decoder_.reset();
+  rows_.clear();
+  first_row_ = 0;
+}
+
+// PngSink -------------------------------------------------------------------
+
+namespace {
+
+// Filtered bytes per independently compressed chunk, as in pigz.
+constexpr size_t kChunkBytes = size_t{128} << 10;
+// Deflate's window; each chunk is primed with the bytes preceding it.
+constexpr size_t kWindowBytes = size_t{32} << 10;
+
+void PutBe32(std::string* out, uint32_t v) {
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    out->push_back(static_cast<char>(v >> shift));
+  }
+}
+
+void PutChunk(std::string* out, const char type[4], const std::string& data) {
+  PutBe32(out, static_cast<uint32_t>(data.size()));
+  const size_t start = out->size();
+  out->append(type, 4);
+  out->append(data);
+  const uLong crc = crc32(0, reinterpret_cast<const Bytef*>(out->data()) +
+                                 start, static_cast<uInt>(out->size() - start));
+  PutBe32(out, static_cast<uint32_t>(crc));
+}
+
+int PaethPredict(int a, int b, int c) {
+  const int pa = std::abs(b - c), pb = std::abs(a - c),
+            pc = std::abs(a + b - 2 * c);
+  return (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+}
+
+// Filters one scanline into out[0] (filter type) and out[1..n], using
+// libpng's heuristic (smallest sum of absolute signed residuals) without
+// trial compression. The five costs are estimated on a quarter of the row
+// (32 of every 128 bytes) so that only the winning filter is applied to the
+// whole row.
+void FilterRow(const uint8_t* row, const uint8_t* prev, size_t n, int bpp,
+               uint8_t* out) {
+  uint64_t cost[5] = {};
+  for (size_t block = 0; block < n; block += 128) {
+    const size_t end = std::min(n, block + 32);
+    for (size_t i = block; i < end; ++i) {
+      const int x = row[i], b = prev[i];
+      const int a = i >= static_cast<size_t>(bpp) ? row[i - bpp] : 0;
+      const int c = i >= static_cast<size_t>(bpp) ? prev[i - bpp] : 0;
+      cost[0] += std::abs(static_cast<int8_t>(x));
+      cost[1] += std::abs(static_cast<int8_t>(x - a));
+      cost[2] += std::abs(static_cast<int8_t>(x - b));
+      cost[3] += std::abs(static_cast<int8_t>(x - ((a + b) >> 1)));
+      cost[4] += std::abs(static_cast<int8_t>(x - PaethPredict(a, b, c)));
+    }
+  }
+  const int best = static_cast<int>(std::min_element(cost, cost + 5) - cost);
+  out[0] = static_cast<uint8_t>(best);
+  uint8_t* dst = out + 1;
+  const size_t lead = std::min(n, static_cast<size_t>(bpp));
+  switch (best) {
+    case 0:
+      std::memcpy(dst, row, n);
+      break;
+    case 1:
+      std::memcpy(dst, row, lead);
+      for (size_t i = lead; i < n; ++i) dst[i] = row[i] - row[i - bpp];
+      break;
+    case 2:
+      for (size_t i = 0; i < n; ++i) dst[i] = row[i] - prev[i];
+      break;
+    case 3:
+      for (size_t i = 0; i < lead; ++i) dst[i] = row[i] - (prev[i] >> 1);
+      for (size_t i = lead; i < n; ++i) {
+        dst[i] = row[i] - ((row[i - bpp] + prev[i]) >> 1);
+      }
+      break;
+    default:
+      for (size_t i = 0; i < lead; ++i) dst[i] = row[i] - prev[i];
+      for (size_t i = lead; i < n; ++i) {
+        dst[i] = row[i] - PaethPredict(row[i - bpp], prev[i], prev[i - bpp]);
+      }
+  }
+}
+
+// Raw-deflates `n` bytes as a byte-aligned run of non-final blocks that can
+// be concatenated with its neighbours' output.
+bool DeflateChunk(const uint8_t* dict, size_t dict_n, const uint8_t* in,
+                  size_t n, int level, std::string* out) {
+  z_stream z{};
+  if (deflateInit2(&z, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) !=
+      Z_OK) {
+    return false;
+  }
+  bool ok = dict_n == 0 ||
+            deflateSetDictionary(&z, dict, static_cast<uInt>(dict_n)) == Z_OK;
+  out->resize(deflateBound(&z, n) + 16);
+  z.next_in = const_cast<Bytef*>(in);
+  z.avail_in = static_cast<uInt>(n);
+  z.next_out = reinterpret_cast<Bytef*>(&(*out)[0]);
+  z.avail_out = static_cast<uInt>(out->size());
+  ok = ok && deflate(&z, Z_SYNC_FLUSH) == Z_OK && z.avail_in == 0;
+  out->resize(out->size() - z.avail_out);
+  deflateEnd(&z);
+  return ok;
+}
+
+}  // namespace
+
+PngSink::PngSink(std::string* out, int compression_level)
+    : out_(out),
+      level_(compression_level > 0 ? std::min(compression_level, 9) : 6) {}
+
+PngSink::~PngSink() = default;
+
+grpc::Status PngSink::Begin(const RasterInfo& info) {
+  if (info.type == PixelType::kF32) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "png: cannot encode f32 rasters");
+  }
+  if (info.bands < 1 || info.bands > 4) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "png: 1 to 4 bands supported");
+  }
+  info_ = info;
+  row_bytes_ = static_cast<size_t>(info.width) * info.pixel_bytes();
+  prev_row_ = AlignedBuffer(row_bytes_);
+  std::memset(prev_row_.data(), 0, row_bytes_);
+  window_.clear();
+  adler_ = adler32(0, nullptr, 0);
+
+  static const uint8_t kSignature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26,
+                                        '\n'};
+  static const uint8_t kColorTypes[] = {0, 4, 2, 6};
+  out_->append(reinterpret_cast<const char*>(kSignature), 8);
+  std::string ihdr;
+  PutBe32(&ihdr, info.width);
+  PutBe32(&ihdr, info.height);
+  ihdr.push_back(info.type == PixelType::kU16 ? 16 : 8);
+  ihdr.push_back(static_cast<char>(kColorTypes[info.bands - 1]));
+  ihdr.append(3, '\0');  // Deflate, adaptive filtering, no interlace.
+  PutChunk(out_, "IHDR", ihdr);
+  // zlib header; FLEVEL only advertises the speed/size trade-off.
+  static const uint8_t kFlags[] = {0x01, 0x5e, 0x9c, 0xda};
+  pending_.assign(1, '\x78');
+  pending_.push_back(static_cast<char>(
+      kFlags[level_ < 2 ? 0 : level_ < 6 ? 1 : level_ == 6 ? 2 : 3]));
+  return grpc::Status::OK;
+}
+
+grpc::Status PngSink::WriteTileRow(int ty, std::vector<Tile>& tiles) {
+  (void)ty;
+  const size_t px = info_.pixel_bytes();
+  const int rows = tiles.empty() ? 0 : tiles.front().rect().height;
+  const int x0 = tiles.empty() ? 0 : tiles.front().rect().x;
+  const size_t line = row_bytes_ + 1;
+
+  // Scanlines of the whole tile row (16-bit samples big-endian), then their
+  // filtered form. Each row filters against its unfiltered predecessor, so
+  // rows are independent once gathered.
+  AlignedBuffer raw(row_bytes_ * rows);
+  AlignedBuffer filtered(line * rows);
+  const bool swap = info_.type == PixelType::kU16 && HostIsLittleEndian();
+  ParallelFor(rows, [&](int y) {
+    uint8_t* dst = raw.data() + y * row_bytes_;
+    for (const Tile& t : tiles) {
+      std::memcpy(dst + (t.rect().x - x0) * px, t.row(y), t.rect().width * px);
+    }
+    if (swap) {
+      for (size_t i = 0; i + 1 < row_bytes_; i += 2) {
+        std::swap(dst[i], dst[i + 1]);
+      }
+    }
+  });
+  ParallelFor(rows, [&](int y) {
+    const uint8_t* prev =
+        y == 0 ? prev_row_.data() : raw.data() + (y - 1) * row_bytes_;
+    FilterRow(raw.data() + y * row_bytes_, prev, row_bytes_,
+              static_cast<int>(px), filtered.data() + y * line);
+  });
+  if (rows > 0) {
+    std::memcpy(prev_row_.data(), raw.data() + (rows - 1) * row_bytes_,
+                row_bytes_);
+  }
+
+  // Chunks compress in parallel; each is primed with the 32 KiB before it
+  // so the ratio stays close to a single stream.
+  const size_t total = filtered.size();
+  const int chunks = static_cast<int>((total + kChunkBytes - 1) / kChunkBytes);
+  std::vector<std::string> packed(chunks);
+  std::vector<uLong> sums(chunks);
+  std::vector<char> failed(chunks, 0);
+  ParallelFor(chunks, [&](int c) {
+    const size_t begin = static_cast<size_t>(c) * kChunkBytes;
+    const size_t n = std::min(kChunkBytes, total - begin);
+    const uint8_t* in = filtered.data() + begin;
+    std::string dict;
+    const uint8_t* dict_p = in - std::min(begin, kWindowBytes);
+    size_t dict_n = std::min(begin, kWindowBytes);
+    if (begin < kWindowBytes && !window_.empty()) {
+      // Spill over into the previous tile row's tail.
+      const size_t carry = std::min(window_.size(), kWindowBytes - begin);
+      dict.assign(window_.end() - carry, window_.end());
+      dict.append(reinterpret_cast<const char*>(filtered.data()), begin);
+      dict_p = reinterpret_cast<const uint8_t*>(dict.data());
+      dict_n = dict.size();
+    }
+    failed[c] = !DeflateChunk(dict_p, dict_n, in, n, level_, &packed[c]);
+    sums[c] = adler32(1L, in, static_cast<uInt>(n));
+  });
+  for (int c = 0; c < chunks; ++c) {
+    if (failed[c]) {
+      return grpc::Status(grpc::StatusCode::INTERNAL, "png: deflate failed");
+    }
+    const size_t n = std::min(kChunkBytes, total - c * kChunkBytes);
+    adler_ = adler32_combine(adler_, sums[c], static_cast<z_off_t>(n));
+    pending_ += packed[c];
+  }
+  const size_t keep = std::min(total, kWindowBytes);
+  if (keep == kWindowBytes) window_.clear();
+  window_.append(reinterpret_cast<const char*>(filtered.data()) + total - keep,
+                 keep);
+  if (window_.size() > kWindowBytes) {
+    window_.erase(0, window_.size() - kWindowBytes);
+  }
+  PutChunk(out_, "IDAT", pending_);
+  pending_.clear();
+  return grpc::Status::OK;
+}
+
+grpc::Status PngSink::Finish() {
+  // A final, empty fixed-Huffman block closes the deflate stream.
+  pending_.push_back('\x03');
+  pending_.push_back('\x00');
+  PutBe32(&pending_, static_cast<uint32_t>(adler_));
+  PutChunk(out_, "IDAT", pending_);
+  pending_.clear();
+  PutChunk(out_, "IEND", std::string());
+  return grpc::Status::OK;
+}
+
+}  // namespace vision
+}  // namespace lucidia
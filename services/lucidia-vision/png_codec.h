@@ -0,0 +1,77 @@
+// Streaming PNG decode/encode on top of the tiled raster core.
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "services/lucidia-vision/byte_stream.h"
+#include "services/lucidia-vision/raster.h"
+
+namespace lucidia {
+namespace vision {
+
+// Decodes a PNG lazily, scanline by scanline, keeping only a sliding window
+// of decoded rows. Reads are expected to move down the image (as Materialize
+// does); a read above the window restarts the decoder. Interlaced files
+// cannot be streamed and are decoded whole. Reads block while the bytes they
+// need are still being uploaded. Images over 65536 pixels a side or 2^30
+// pixels (2^26 when interlaced) are rejected as INVALID_ARGUMENT.
+class PngSource : public RasterSource {
+ public:
+  static grpc::Status Open(std::shared_ptr<ByteStream> stream, int tile_size,
+                           std::unique_ptr<PngSource>* out);
+  ~PngSource() override;
+
+  const RasterInfo& info() const override { return info_; }
+  grpc::Status ReadWindow(const Rect& rect, PixelType type, void* dst,
+                          size_t dst_stride) override;
+  void Trim() override;
+
+ private:
+  struct Decoder;
+  explicit PngSource(std::shared_ptr<ByteStream> stream);
+  grpc::Status Restart();
+  grpc::Status DecodeThrough(int row);
+
+  std::shared_ptr<ByteStream> stream_;
+  RasterInfo info_;
+  size_t row_bytes_ = 0;
+  int window_rows_ = 0;
+
+  std::mutex mu_;
+  std::unique_ptr<Decoder> decoder_;
+  std::deque<AlignedBuffer> rows_;  // rows [first_row_, first_row_ + size).
+  int first_row_ = 0;
+};
+
+// Encodes tile rows as PNG as they arrive. Supports u8/u16 with 1-4 bands.
+// Each tile row is filtered and then DEFLATE-compressed in independent
+// 128 KiB chunks across the worker pool (pigz-style: every chunk is primed
+// with the preceding 32 KiB and sync-flushed, so the pieces concatenate
+// into one zlib stream). Each tile row becomes one IDAT chunk.
+class PngSink : public RasterSink {
+ public:
+  // `compression_level` is zlib's 1 (fastest) to 9 (smallest); 0 picks 6.
+  explicit PngSink(std::string* out, int compression_level = 0);
+  ~PngSink() override;
+
+  grpc::Status Begin(const RasterInfo& info) override;
+  grpc::Status WriteTileRow(int ty, std::vector<Tile>& tiles) override;
+  grpc::Status Finish() override;
+
+ private:
+  std::string* out_;
+  int level_;
+  RasterInfo info_;
+  size_t row_bytes_ = 0;
+  AlignedBuffer prev_row_;  // Last scanline written, unfiltered.
+  std::string window_;      // Last 32 KiB of filtered bytes.
+  std::string pending_;     // IDAT payload not yet written.
+  unsigned long adler_ = 0; // Running zlib checksum of filtered bytes.
+};
+
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,175 @@
+#include "services/lucidia-vision/png_codec.h"
+
+#include <zlib.h>
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include "proto/vision_service.pb.h"
+#include "services/lucidia-vision/image_io.h"
+#include "services/lucidia-vision/test_util.h"
+
+namespace lucidia {
+namespace vision {
+namespace {
+
+using testing::MakeRaster;
+using testing::ReadAll;
+
+uint32_t Be32(const std::string& s, size_t at) {
+  const auto* p = reinterpret_cast<const uint8_t*>(s.data() + at);
+  return uint32_t{p[0]} << 24 | uint32_t{p[1]} << 16 | uint32_t{p[2]} << 8 |
+         p[3];
+}
+
+// Concatenated IDAT payloads of `png`: the zlib stream.
+std::string IdatStream(const std::string& png) {
+  std::string stream;
+  size_t at = 8;
+  while (at + 12 <= png.size()) {
+    const uint32_t length = Be32(png, at);
+    if (png.compare(at + 4, 4, "IDAT") == 0) {
+      stream.append(png, at + 8, length);
+    }
+    at += 12 + length;
+  }
+  return stream;
+}
+
+// Inflates a zlib stream as strict decoders do: the Adler-32 trailer must
+// match. Returns the zlib result of the last inflate() call.
+int Inflate(const std::string& in, std::string* out) {
+  z_stream z{};
+  if (inflateInit(&z) != Z_OK) return Z_STREAM_ERROR;
+  z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+  z.avail_in = static_cast<uInt>(in.size());
+  char buf[1 << 16];
+  int rc = Z_OK;
+  while (rc == Z_OK) {
+    z.next_out = reinterpret_cast<Bytef*>(buf);
+    z.avail_out = sizeof(buf);
+    rc = inflate(&z, Z_NO_FLUSH);
+    out->append(buf, sizeof(buf) - z.avail_out);
+  }
+  inflateEnd(&z);
+  return rc;
+}
+
+struct Shape {
+  int width;
+  int height;
+  int bands;
+  PixelType type;
+  int level;
+};
+
+void PrintTo(const Shape& s, std::ostream* os) {
+  *os << s.width << "x" << s.height << "x" << s.bands << " "
+      << PixelTypeName(s.type) << " level " << s.level;
+}
+
+class PngRoundTripTest : public ::testing::TestWithParam<Shape> {};
+
+TEST_P(PngRoundTripTest, ZlibStreamAndPixels) {
+  const Shape shape = GetParam();
+  auto raster = MakeRaster(
+      shape.width, shape.height, shape.bands, shape.type,
+      [](int x, int y, int b) {
+        return static_cast<float>((x * 7 + y * 13 + b * 101) % 251);
+      });
+  v1::Image png;
+  ASSERT_TRUE(EncodeImage(*raster, "png", &png, shape.level).ok());
+  const std::string& data = png.data();
+  ASSERT_EQ(data.compare(0, 8, "\x89PNG\r\n\x1a\n"), 0);
+
+  const std::string stream = IdatStream(data);
+  std::string filtered;
+  ASSERT_EQ(Inflate(stream, &filtered), Z_STREAM_END);
+  const size_t row_bytes = static_cast<size_t>(shape.width) * shape.bands *
+                           BytesPerSample(shape.type);
+  ASSERT_EQ(filtered.size(), shape.height * (1 + row_bytes));
+  const uLong adler =
+      adler32(adler32(0L, Z_NULL, 0),
+              reinterpret_cast<const Bytef*>(filtered.data()),
+              static_cast<uInt>(filtered.size()));
+  EXPECT_EQ(Be32(stream, stream.size() - 4), static_cast<uint32_t>(adler));
+
+  std::shared_ptr<RasterSource> decoded;
+  ASSERT_TRUE(OpenImage(png, kDefaultTileSize, &decoded).ok());
+  ASSERT_EQ(decoded->info().width, shape.width);
+  ASSERT_EQ(decoded->info().height, shape.height);
+  ASSERT_EQ(decoded->info().bands, shape.bands);
+  EXPECT_EQ(ReadAll<float>(*decoded, PixelType::kF32),
+            ReadAll<float>(*raster, PixelType::kF32));
+}
+
+// Tile rows of the larger shapes span several 128 KiB deflate chunks.
+INSTANTIATE_TEST_SUITE_P(
+    Shapes, PngRoundTripTest,
+    ::testing::Values(Shape{1, 1, 1, PixelType::kU8, 0},
+                      Shape{300, 200, 1, PixelType::kU8, 1},
+                      Shape{700, 600, 3, PixelType::kU8, 6},
+                      Shape{513, 300, 4, PixelType::kU8, 9},
+                      Shape{640, 520, 2, PixelType::kU16, 6}));
+
+TEST(PngSinkTest, RejectsFloatSamples) {
+  auto raster = MakeRaster(4, 4, 1, PixelType::kF32,
+                           [](int, int, int) { return 0.5f; });
+  v1::Image png;
+  EXPECT_FALSE(EncodeImage(*raster, "png", &png).ok());
+}
+
+// PNG signature, IHDR and an empty IDAT: enough for the header to parse.
+std::string PngHeader(uint32_t width, uint32_t height, bool interlaced) {
+  auto be32 = [](std::string* out, uint32_t v) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+      out->push_back(static_cast<char>(v >> shift));
+    }
+  };
+  auto chunk = [&](std::string* out, const char* type,
+                   const std::string& data) {
+    be32(out, static_cast<uint32_t>(data.size()));
+    const std::string body = type + data;
+    out->append(body);
+    be32(out, static_cast<uint32_t>(
+                  crc32(0, reinterpret_cast<const Bytef*>(body.data()),
+                        static_cast<uInt>(body.size()))));
+  };
+  std::string ihdr;
+  be32(&ihdr, width);
+  be32(&ihdr, height);
+  // 8-bit gray, deflate, adaptive filtering, then the interlace method.
+  ihdr.append({8, 0, 0, 0, static_cast<char>(interlaced ? 1 : 0)});
+  std::string png("\x89PNG\r\n\x1a\n", 8);
+  chunk(&png, "IHDR", ihdr);
+  chunk(&png, "IDAT", "");
+  return png;
+}
+
+grpc::Status OpenPng(const std::string& png) {
+  std::unique_ptr<PngSource> source;
+  return PngSource::Open(
+      std::make_shared<MemoryByteStream>(png.data(), png.size()),
+      kDefaultTileSize, &source);
+}
+
+TEST(PngSourceTest, RejectsOversizedImages) {
+  EXPECT_TRUE(OpenPng(PngHeader(65536, 16, false)).ok());
+  EXPECT_TRUE(OpenPng(PngHeader(8000, 8000, true)).ok());
+  for (const std::string& png :
+       {PngHeader(65537, 16, false), PngHeader(16, 1000000, false),
+        PngHeader(40000, 40000, false), PngHeader(9000, 9000, true)}) {
+    const grpc::Status s = OpenPng(png);
+    EXPECT_EQ(s.error_code(), grpc::StatusCode::INVALID_ARGUMENT);
+    EXPECT_EQ(s.error_message(), "png: image too large");
+  }
+}
+
+}  // namespace
+}  // namespace vision
+}  // namespace lucidia
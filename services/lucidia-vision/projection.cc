@@ -0,0 +1,161 @@
+#include "services/lucidia-vision/projection.h"
+
+#include <cmath>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace lucidia {
+namespace vision {
+
+namespace {
+
+constexpr double kPi = 3.14159265358979323846;
+constexpr double kDeg = kPi / 180.0;
+constexpr double kWgs84A = 6378137.0;
+constexpr double kWgs84F = 1.0 / 298.257223563;
+
+class Geographic : public Projection {
+ public:
+  bool Forward(double lon, double lat, double* x, double* y) const override {
+    *x = lon;
+    *y = lat;
+    return true;
+  }
+  bool Inverse(double x, double y, double* lon, double* lat) const override {
+    *lon = x;
+    *lat = y;
+    return std::abs(y) <= 90.0;
+  }
+};
+
+class WebMercator : public Projection {
+ public:
+  // Latitude where the square WebMercator world ends.
+  static constexpr double kMaxLat = 85.05112877980659;
+
+  bool Forward(double lon, double lat, double* x, double* y) const override {
+    if (std::abs(lat) > kMaxLat) return false;
+    *x = kWgs84A * lon * kDeg;
+    *y = kWgs84A * std::log(std::tan(kPi / 4 + lat * kDeg / 2));
+    return true;
+  }
+  bool Inverse(double x, double y, double* lon, double* lat) const override {
+    *lon = x / kWgs84A / kDeg;
+    *lat = (2 * std::atan(std::exp(y / kWgs84A)) - kPi / 2) / kDeg;
+    return true;
+  }
+};
+
+// Transverse Mercator after Kruger's series to fourth order in n (Karney
+// 2011), accurate to well under a millimetre within a UTM zone.
+class Utm : public Projection {
+ public:
+  Utm(int zone, bool south)
+      : lon0_((zone * 6 - 183) * kDeg), northing0_(south ? 10000000.0 : 0.0) {
+    const double n = kWgs84F / (2 - kWgs84F);
+    const double n2 = n * n, n3 = n2 * n, n4 = n3 * n;
+    e_ = std::sqrt(kWgs84F * (2 - kWgs84F));
+    scale_ = kK0 * kWgs84A / (1 + n) * (1 + n2 / 4 + n4 / 64);
+    alpha_[0] = n / 2 - 2 * n2 / 3 + 5 * n3 / 16 + 41 * n4 / 180;
+    alpha_[1] = 13 * n2 / 48 - 3 * n3 / 5 + 557 * n4 / 1440;
+    alpha_[2] = 61 * n3 / 240 - 103 * n4 / 140;
+    alpha_[3] = 49561 * n4 / 161280;
+    beta_[0] = n / 2 - 2 * n2 / 3 + 37 * n3 / 96 - n4 / 360;
+    beta_[1] = n2 / 48 + n3 / 15 - 437 * n4 / 1440;
+    beta_[2] = 17 * n3 / 480 - 37 * n4 / 840;
+    beta_[3] = 4397 * n4 / 161280;
+    delta_[0] = 2 * n - 2 * n2 / 3 - 2 * n3 + 116 * n4 / 45;
+    delta_[1] = 7 * n2 / 3 - 8 * n3 / 5 - 227 * n4 / 45;
+    delta_[2] = 56 * n3 / 15 - 136 * n4 / 35;
+    delta_[3] = 4279 * n4 / 630;
+  }
+
+  bool Forward(double lon, double lat, double* x, double* y) const override {
+    const double dlon = std::remainder(lon * kDeg - lon0_, 2 * kPi);
+    // The series diverges far from the central meridian.
+    if (std::abs(dlon) > kPi / 2 || std::abs(lat) >= 90.0) return false;
+    const double s = std::sin(lat * kDeg);
+    const double t = std::sinh(std::atanh(s) - e_ * std::atanh(e_ * s));
+    const double xi1 = std::atan2(t, std::cos(dlon));
+    const double eta1 = std::atanh(std::sin(dlon) / std::sqrt(1 + t * t));
+    double xi = xi1, eta = eta1;
+    for (int j = 1; j <= 4; ++j) {
+      xi += alpha_[j - 1] * std::sin(2 * j * xi1) * std::cosh(2 * j * eta1);
+      eta += alpha_[j - 1] * std::cos(2 * j * xi1) * std::sinh(2 * j * eta1);
+    }
+    *x = kFalseEasting + scale_ * eta;
+    *y = northing0_ + scale_ * xi;
+    return true;
+  }
+
+  bool Inverse(double x, double y, double* lon, double* lat) const override {
+    const double xi = (y - northing0_) / scale_;
+    const double eta = (x - kFalseEasting) / scale_;
+    double xi1 = xi, eta1 = eta;
+    for (int j = 1; j <= 4; ++j) {
+      xi1 -= beta_[j - 1] * std::sin(2 * j * xi) * std::cosh(2 * j * eta);
+      eta1 -= beta_[j - 1] * std::cos(2 * j * xi) * std::sinh(2 * j * eta);
+    }
+    const double chi = std::asin(std::sin(xi1) / std::cosh(eta1));
+    double phi = chi;
+    for (int j = 1; j <= 4; ++j) phi += delta_[j - 1] * std::sin(2 * j * chi);
+    *lat = phi / kDeg;
+    *lon = (lon0_ + std::atan2(std::sinh(eta1), std::cos(xi1))) / kDeg;
+    return std::isfinite(*lat) && std::isfinite(*lon);
+  }
+
+ private:
+  static constexpr double kK0 = 0.9996;
+  static constexpr double kFalseEasting = 500000.0;
+
+  double lon0_;
+  double northing0_;
+  double e_;
+  double scale_;  // k0 * A, the meridian arc scale.
+  double alpha_[4];
+  double beta_[4];
+  double delta_[4];
+};
+
+}  // namespace
+
+grpc::Status FindProjection(int epsg, std::shared_ptr<const Projection>* out) {
+  static std::mutex mu;
+  static std::map<int, std::shared_ptr<const Projection>> cache;
+  std::lock_guard<std::mutex> lock(mu);
+  auto it = cache.find(epsg);
+  if (it != cache.end()) {
+    *out = it->second;
+    return grpc::Status::OK;
+  }
+  std::shared_ptr<const Projection> p;
+  if (epsg == 4326) {
+    p = std::make_shared<Geographic>();
+  } else if (epsg == 3857) {
+    p = std::make_shared<WebMercator>();
+  } else if (epsg >= 32601 && epsg <= 32660) {
+    p = std::make_shared<Utm>(epsg - 32600, /*south=*/false);
+  } else if (epsg >= 32701 && epsg <= 32760) {
+    p = std::make_shared<Utm>(epsg - 32700, /*south=*/true);
+  } else {
+    return grpc::Status(grpc::StatusCode::UNIMPLEMENTED,
+                        "unsupported projection EPSG:" + std::to_string(epsg));
+  }
+  cache[epsg] = p;
+  *out = std::move(p);
+  return grpc::Status::OK;
+}
+
+bool CoordTransform::Apply(double x, double y, double* ox, double* oy) const {
+  double lon, lat;
+  if (from_->Inverse(x, y, &lon, &lat) && to_->Forward(lon, lat, ox, oy)) {
+    return true;
+  }
+  *ox = *oy = std::numeric_limits<double>::quiet_NaN();
+  return false;
+}
+
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,44 @@
+// Map projections by EPSG code.
+//
+// Only the systems our traffic uses are built in: geographic WGS84
+// (EPSG:4326, x = longitude, y = latitude in degrees), WebMercator
+// (EPSG:3857) and WGS84 UTM zones (EPSG:32601-32660 north,
+// 32701-32760 south).
+#pragma once
+
+#include <memory>
+
+#include <grpcpp/support/status.h>
+
+namespace lucidia {
+namespace vision {
+
+class Projection {
+ public:
+  virtual ~Projection() = default;
+  // Geographic degrees to projected coordinates. Returns false outside the
+  // projection's domain.
+  virtual bool Forward(double lon, double lat, double* x, double* y) const = 0;
+  virtual bool Inverse(double x, double y, double* lon, double* lat) const = 0;
+};
+
+// Returns a shared, immutable projection for `epsg`.
+grpc::Status FindProjection(int epsg, std::shared_ptr<const Projection>* out);
+
+// Maps points from one projection to another through geographic WGS84.
+class CoordTransform {
+ public:
+  CoordTransform(std::shared_ptr<const Projection> from,
+                 std::shared_ptr<const Projection> to)
+      : from_(std::move(from)), to_(std::move(to)) {}
+
+  // Sets *ox/*oy to NaN and returns false when either step fails.
+  bool Apply(double x, double y, double* ox, double* oy) const;
+
+ private:
+  std::shared_ptr<const Projection> from_;
+  std::shared_ptr<const Projection> to_;
+};
+
+}  // namespace vision
+}  // namespace lucidia
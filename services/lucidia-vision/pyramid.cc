@@ -0,0 +1,263 @@
+#include "services/lucidia-vision/pyramid.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#include "services/lucidia-vision/image_io.h"
+#include "services/lucidia-vision/thread_pool.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace lucidia {
+namespace vision {
+
+namespace {
+
+// Deepest pyramid we build; 2^kMaxLevels must fit comfortably in an int.
+constexpr int kMaxLevels = 24;
+
+// True if all `n` samples equal `value` (or are NaN, when `value` is).
+bool AllEqual(const float* p, size_t n, float value) {
+  const bool nan = std::isnan(value);
+  size_t i = 0;
+#if defined(__SSE2__)
+  // 16 samples per step; one movemask per step keeps the early exit cheap.
+  const __m128 v = _mm_set1_ps(value);
+  for (; i + 16 <= n; i += 16) {
+    __m128 m[4];
+    for (int k = 0; k < 4; ++k) {
+      const __m128 x = _mm_loadu_ps(p + i + 4 * k);
+      m[k] = nan ? _mm_cmpunord_ps(x, x) : _mm_cmpeq_ps(x, v);
+    }
+    const __m128 all =
+        _mm_and_ps(_mm_and_ps(m[0], m[1]), _mm_and_ps(m[2], m[3]));
+    if (_mm_movemask_ps(all) != 0xf) return false;
+  }
+#endif
+  for (; i < n; ++i) {
+    if (nan ? !std::isnan(p[i]) : p[i] != value) return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+grpc::Status ValidatePyramid(const v1::TilePyramidRequest& req,
+                             PyramidOptions* opts) {
+  opts->tile_size = req.tile_size() ? static_cast<int>(req.tile_size())
+                                    : kDefaultTileSize;
+  if (opts->tile_size < 16 || opts->tile_size > 4096) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "tile_size must be in [16, 4096]");
+  }
+  if (req.max_zoom() < req.min_zoom()) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "max_zoom must be >= min_zoom");
+  }
+  if (req.max_zoom() - req.min_zoom() >= kMaxLevels) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "too many zoom levels");
+  }
+  opts->format = req.output_format().empty() ? "png" : req.output_format();
+  if (opts->format != "png" && opts->format != "tiff") {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "unsupported output format: " + opts->format);
+  }
+  opts->compression_level = req.compression_level();
+  opts->skip_empty = req.has_nodata();
+  opts->nodata = static_cast<float>(req.nodata().value());
+  opts->min_zoom = static_cast<int>(req.min_zoom());
+  opts->max_zoom = static_cast<int>(req.max_zoom());
+  return grpc::Status::OK;
+}
+
+grpc::Status BuildTilePyramid(RasterSource& source, const PyramidOptions& opts,
+                              const TileEmitter& emit) {
+  const RasterInfo& src = source.info();
+  const int bands = src.bands;
+  const int ts = opts.tile_size;
+
+  // Zoom max_zoom - i. Rows arrive one at a time from the level above (or
+  // the source); every pair of them is box-reduced into the next level, so
+  // each level costs a quarter of the one above.
+  struct Level {
+    int z = 0;
+    int width = 0, height = 0;
+    int tiles_x = 0;
+    ScratchArray<float> strip;  // Current tile row, ts rows of width pixels.
+    int strip_rows = 0;
+    int ty = 0;
+    ScratchArray<float> pending;  // Upper row of the next pair.
+    bool has_pending = false;
+    ScratchArray<float> halved;
+    // Per tile of the current tile row: every child tile emitted so far was
+    // empty. Tiles past the edge of the level below count as empty.
+    std::vector<uint8_t> children_empty;
+  };
+  std::vector<Level> levels(opts.max_zoom - opts.min_zoom + 1);
+  for (size_t i = 0; i < levels.size(); ++i) {
+    Level& l = levels[i];
+    l.z = opts.max_zoom - static_cast<int>(i);
+    l.width = i == 0 ? src.width : (levels[i - 1].width + 1) / 2;
+    l.height = i == 0 ? src.height : (levels[i - 1].height + 1) / 2;
+    l.tiles_x = (l.width + ts - 1) / ts;
+    l.strip = ScratchArray<float>(static_cast<size_t>(l.width) * bands * ts);
+    l.children_empty.assign(l.tiles_x, 1);
+    if (i + 1 < levels.size()) {
+      l.pending = ScratchArray<float>(static_cast<size_t>(l.width) * bands);
+      l.halved =
+          ScratchArray<float>(static_cast<size_t>((l.width + 1) / 2) * bands);
+    }
+  }
+
+  // Encodes and emits the level's buffered tile row. Every tile of it was
+  // reduced from four children that are already out.
+  auto emit_strip = [&](Level& l) -> grpc::Status {
+    const int rows = l.strip_rows;
+    const bool finest = l.z == opts.max_zoom;
+    std::vector<v1::Image> encoded(l.tiles_x);
+    std::vector<grpc::Status> status(l.tiles_x);
+    std::vector<uint8_t> empty(l.tiles_x, 0);
+    // Encoding dominates; the strip's tiles compress in parallel and are
+    // emitted in order afterwards.
+    ParallelFor(l.tiles_x, [&](int tx) {
+      const int cols = std::min(ts, l.width - tx * ts);
+      if (opts.skip_empty) {
+        bool is_empty = !finest && l.children_empty[tx];
+        if (finest) {
+          is_empty = true;
+          for (int r = 0; r < rows && is_empty; ++r) {
+            const float* in =
+                l.strip.data() +
+                (static_cast<size_t>(r) * l.width + tx * ts) * bands;
+            is_empty = AllEqual(in, static_cast<size_t>(cols) * bands,
+                                opts.nodata);
+          }
+        }
+        if (is_empty) {
+          empty[tx] = 1;
+          encoded[tx].set_empty(true);
+          encoded[tx].set_format(opts.format);
+          encoded[tx].set_width(ts);
+          encoded[tx].set_height(ts);
+          return;
+        }
+      }
+      Tile tile(Rect{0, 0, ts, ts}, bands, src.type);
+      for (int r = 0; r < ts; ++r) {
+        std::memset(tile.row(r), 0, tile.stride());
+        if (r >= rows) continue;
+        const float* in = l.strip.data() +
+                          (static_cast<size_t>(r) * l.width + tx * ts) * bands;
+        ConvertSamples(in, PixelType::kF32, tile.row(r), src.type,
+                       static_cast<size_t>(cols) * bands);
+      }
+      status[tx] = EncodeTile(std::move(tile), opts.format, &encoded[tx],
+                              opts.compression_level);
+    });
+    for (int tx = 0; tx < l.tiles_x; ++tx) {
+      if (!status[tx].ok()) return status[tx];
+      grpc::Status s = emit(l.z, tx, l.ty, &encoded[tx]);
+      if (!s.ok()) return s;
+    }
+    if (l.z > opts.min_zoom) {
+      Level& parent = levels[opts.max_zoom - l.z + 1];
+      for (int tx = 0; tx < l.tiles_x; ++tx) {
+        parent.children_empty[tx / 2] &= empty[tx];
+      }
+    }
+    std::fill(l.children_empty.begin(), l.children_empty.end(), 1);
+    ++l.ty;
+    l.strip_rows = 0;
+    return grpc::Status::OK;
+  };
+
+  // 2x2 box average; the last column and row repeat for odd sizes, which
+  // averages just the pixels that exist. With skip_empty, nodata samples are
+  // left out of the average and a sample is nodata only where all four are,
+  // so valid pixels never blend with nodata and coarse tiles stay exactly
+  // as empty as their children.
+  const bool nan_nodata = std::isnan(opts.nodata);
+  auto halve = [&](const float* a, const float* b, int width, float* out) {
+    for (int x = 0; x < (width + 1) / 2; ++x) {
+      const int x0 = 2 * x * bands;
+      const int x1 = std::min(2 * x + 1, width - 1) * bands;
+      for (int c = 0; c < bands; ++c) {
+        const float v[4] = {a[x0 + c], a[x1 + c], b[x0 + c], b[x1 + c]};
+        if (!opts.skip_empty) {
+          out[x * bands + c] = 0.25f * (v[0] + v[1] + v[2] + v[3]);
+          continue;
+        }
+        float sum = 0;
+        int n = 0;
+        for (float sample : v) {
+          if (nan_nodata ? std::isnan(sample) : sample == opts.nodata) continue;
+          sum += sample;
+          ++n;
+        }
+        out[x * bands + c] = n > 0 ? sum / n : opts.nodata;
+      }
+    }
+  };
+
+  std::function<grpc::Status(size_t, const float*)> push_row =
+      [&](size_t i, const float* row) -> grpc::Status {
+    Level& l = levels[i];
+    const size_t row_floats = static_cast<size_t>(l.width) * bands;
+    std::copy(row, row + row_floats,
+              l.strip.begin() + l.strip_rows * row_floats);
+    ++l.strip_rows;
+    // Emit before feeding the next level so parents never precede children.
+    if (l.strip_rows == ts) {
+      grpc::Status s = emit_strip(l);
+      if (!s.ok()) return s;
+    }
+    if (i + 1 < levels.size()) {
+      if (!l.has_pending) {
+        std::copy(row, row + row_floats, l.pending.begin());
+        l.has_pending = true;
+      } else {
+        halve(l.pending.data(), row, l.width, l.halved.data());
+        l.has_pending = false;
+        return push_row(i + 1, l.halved.data());
+      }
+    }
+    return grpc::Status::OK;
+  };
+
+  // Only max_zoom reads the source, a strip of tile rows at a time.
+  ScratchArray<float> rows(static_cast<size_t>(src.width) * bands * ts);
+  const size_t row_floats = static_cast<size_t>(src.width) * bands;
+  for (int y0 = 0; y0 < src.height; y0 += ts) {
+    const int n = std::min(ts, src.height - y0);
+    grpc::Status s =
+        source.ReadWindow(Rect{0, y0, src.width, n}, PixelType::kF32,
+                          rows.data(), row_floats * sizeof(float));
+    if (!s.ok()) return s;
+    for (int r = 0; r < n; ++r) {
+      s = push_row(0, rows.data() + r * row_floats);
+      if (!s.ok()) return s;
+    }
+  }
+  // Flush partial tile rows top-down; an unpaired last row pairs with itself.
+  for (size_t i = 0; i < levels.size(); ++i) {
+    Level& l = levels[i];
+    grpc::Status s;
+    if (l.strip_rows > 0) s = emit_strip(l);
+    if (s.ok() && l.has_pending) {
+      halve(l.pending.data(), l.pending.data(), l.width, l.halved.data());
+      l.has_pending = false;
+      s = push_row(i + 1, l.halved.data());
+    }
+    if (!s.ok()) return s;
+  }
+  return grpc::Status::OK;
+}
+
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,54 @@
+// XYZ tile pyramid construction.
+//
+// The pyramid uses the raster profile: max_zoom is the source's native
+// resolution and each lower zoom halves it, so tile (z, x, y) covers source
+// pixels scaled by 2^(max_zoom - z). Edge tiles are padded to tile_size with
+// zeros.
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "proto/vision_service.pb.h"
+#include "services/lucidia-vision/raster.h"
+
+namespace lucidia {
+namespace vision {
+
+struct PyramidOptions {
+  int tile_size = kDefaultTileSize;
+  int min_zoom = 0;
+  int max_zoom = 0;
+  std::string format = "png";
+  int compression_level = 0;  // Deflate level 1-9; 0 picks 6.
+  // Tiles whose every sample equals `nodata` (NaN matches NaN) are emitted
+  // as Image.empty without being encoded.
+  bool skip_empty = false;
+  float nodata = 0;
+};
+
+// Receives each finished tile. `tile` may be moved from. Returning a non-OK
+// status aborts the build (e.g. the client went away).
+using TileEmitter =
+    std::function<grpc::Status(int z, int x, int y, v1::Image* tile)>;
+
+grpc::Status ValidatePyramid(const v1::TilePyramidRequest& req,
+                             PyramidOptions* opts);
+
+// Builds every tile from min_zoom to max_zoom and hands each to `emit` as
+// soon as it is encoded. Only max_zoom reads the source; each coarser zoom is
+// a 2x2 box reduction of the one above, built row by row alongside it, so the
+// whole pyramid costs about 4/3 of a single pass. A tile is emitted as soon
+// as its four children are out; zooms interleave, finest first within each
+// tile row, and the first tile needs only tile_size source rows.
+//
+// With skip_empty, max_zoom tiles are scanned for nodata and every coarser
+// tile is empty exactly when its children are (a quadtree built bottom-up
+// as rows stream through), so empty subtrees cost neither a scan nor an
+// encode. The reduction then averages only the samples that are not nodata.
+grpc::Status BuildTilePyramid(RasterSource& source, const PyramidOptions& opts,
+                              const TileEmitter& emit);
+
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,134 @@
+#include "services/lucidia-vision/pyramid.h"
+
+#include <cmath>
+#include <limits>
+#include <map>
+#include <memory>
+#include <tuple>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include "services/lucidia-vision/image_io.h"
+#include "services/lucidia-vision/test_util.h"
+
+namespace lucidia {
+namespace vision {
+namespace {
+
+using testing::MakeRaster;
+using testing::ReadAll;
+
+using TileKey = std::tuple<int, int, int>;  // z, x, y.
+
+// Builds the pyramid as f32 COG tiles; empty tiles map to no samples.
+std::map<TileKey, std::vector<float>> Build(RasterSource& source,
+                                            const PyramidOptions& opts) {
+  std::map<TileKey, std::vector<float>> tiles;
+  const grpc::Status s = BuildTilePyramid(
+      source, opts, [&](int z, int x, int y, v1::Image* tile) {
+        std::vector<float>& samples = tiles[TileKey{z, x, y}];
+        if (tile->empty()) return grpc::Status::OK;
+        std::shared_ptr<RasterSource> decoded;
+        grpc::Status open = OpenImage(*tile, kDefaultTileSize, &decoded);
+        if (!open.ok()) return open;
+        samples = ReadAll<float>(*decoded, PixelType::kF32);
+        return grpc::Status::OK;
+      });
+  EXPECT_TRUE(s.ok()) << s.error_message();
+  return tiles;
+}
+
+bool IsNodata(float v, float nodata) {
+  return std::isnan(nodata) ? std::isnan(v) : v == nodata;
+}
+
+// One sample of each 2x2 block is nodata and the others are 4, 8 and 12;
+// the top-left block is all nodata.
+TEST(PyramidTest, ReduceSkipsNodata) {
+  for (float nodata : {-9999.0f, std::numeric_limits<float>::quiet_NaN()}) {
+    auto raster = MakeRaster(32, 32, 1, PixelType::kF32, [&](int x, int y,
+                                                             int) {
+      if ((x % 2 == 0 && y % 2 == 0) || (x < 2 && y < 2)) return nodata;
+      return 4.0f * (x % 2) + 8.0f * (y % 2);
+    });
+    PyramidOptions opts;
+    opts.tile_size = 16;
+    opts.min_zoom = 0;
+    opts.max_zoom = 1;
+    opts.format = "tiff";
+    opts.skip_empty = true;
+    opts.nodata = nodata;
+    const auto tiles = Build(*raster, opts);
+    const std::vector<float>& coarse = tiles.at(TileKey{0, 0, 0});
+    ASSERT_EQ(coarse.size(), 16u * 16u);
+    EXPECT_TRUE(IsNodata(coarse[0], nodata));
+    for (size_t i = 1; i < coarse.size(); ++i) {
+      ASSERT_EQ(coarse[i], 8.0f) << i << " nodata " << nodata;
+    }
+  }
+}
+
+// Data inside a nodata border whose edges fall mid-block at every zoom. A
+// coarse sample covering any data keeps the data value unblended, one
+// covering none is nodata, and a tile is elided exactly when it covers no
+// data.
+TEST(PyramidTest, NodataBorderStaysCrisp) {
+  constexpr int kSize = 512, kTile = 64, kMaxZoom = 3;
+  constexpr int kX0 = 150, kX1 = 333, kY0 = 70, kY1 = 461;  // Data extent.
+  for (float nodata : {-9999.0f, std::numeric_limits<float>::quiet_NaN()}) {
+    auto raster = MakeRaster(kSize, kSize, 1, PixelType::kF32,
+                             [&](int x, int y, int) {
+                               const bool data =
+                                   x >= kX0 && x < kX1 && y >= kY0 && y < kY1;
+                               return data ? 100.0f : nodata;
+                             });
+    PyramidOptions opts;
+    opts.tile_size = kTile;
+    opts.min_zoom = 0;
+    opts.max_zoom = kMaxZoom;
+    opts.format = "tiff";
+    opts.skip_empty = true;
+    opts.nodata = nodata;
+    const auto tiles = Build(*raster, opts);
+    ASSERT_EQ(tiles.size(), 64u + 16u + 4u + 1u);
+    for (const auto& [key, samples] : tiles) {
+      const auto [z, tx, ty] = key;
+      const int f = 1 << (kMaxZoom - z);
+      // Whether source columns [a * f, b * f) overlap [lo, hi).
+      auto overlaps = [f](int a, int b, int lo, int hi) {
+        return a * f < hi && b * f > lo;
+      };
+      const bool has_data =
+          overlaps(tx * kTile, (tx + 1) * kTile, kX0, kX1) &&
+          overlaps(ty * kTile, (ty + 1) * kTile, kY0, kY1);
+      ASSERT_EQ(samples.empty(), !has_data) << z << "/" << tx << "/" << ty;
+      for (size_t i = 0; i < samples.size(); ++i) {
+        const int x = tx * kTile + static_cast<int>(i) % kTile;
+        const int y = ty * kTile + static_cast<int>(i) / kTile;
+        if (overlaps(x, x + 1, kX0, kX1) && overlaps(y, y + 1, kY0, kY1)) {
+          ASSERT_EQ(samples[i], 100.0f) << z << " at " << x << "," << y;
+        } else {
+          ASSERT_TRUE(IsNodata(samples[i], nodata))
+              << z << " at " << x << "," << y << ": " << samples[i];
+        }
+      }
+    }
+  }
+}
+
+// Without nodata every sample counts, as before.
+TEST(PyramidTest, ReduceAveragesAllWithoutNodata) {
+  auto raster = MakeRaster(32, 32, 1, PixelType::kF32, [](int x, int y, int) {
+    return 4.0f * (x % 2) + 8.0f * (y % 2);
+  });
+  PyramidOptions opts;
+  opts.tile_size = 16;
+  opts.max_zoom = 1;
+  opts.format = "tiff";
+  const auto tiles = Build(*raster, opts);
+  for (float v : tiles.at(TileKey{0, 0, 0})) ASSERT_EQ(v, 6.0f);
+}
+
+}  // namespace
+}  // namespace vision
+}  // namespace lucidia
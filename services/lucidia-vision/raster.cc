@@ -0,0 +1,237 @@
+#include "services/lucidia-vision/raster.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+namespace lucidia {
+namespace vision {
+
+size_t BytesPerSample(PixelType type) {
+  switch (type) {
+    case PixelType::kU8: return 1;
+    case PixelType::kU16: return 2;
+    case PixelType::kF32: return 4;
+  }
+  return 1;
+}
+
+const char* PixelTypeName(PixelType type) {
+  switch (type) {
+    case PixelType::kU8: return "u8";
+    case PixelType::kU16: return "u16";
+    case PixelType::kF32: return "f32";
+  }
+  return "?";
+}
+
+Rect Rect::Intersect(const Rect& o) const {
+  int x0 = std::max(x, o.x), y0 = std::max(y, o.y);
+  int x1 = std::min(right(), o.right()), y1 = std::min(bottom(), o.bottom());
+  if (x1 <= x0 || y1 <= y0) return Rect{x0, y0, 0, 0};
+  return Rect{x0, y0, x1 - x0, y1 - y0};
+}
+
+// AlignedBuffer -------------------------------------------------------------
+
+static_assert(BufferPool::kAlignment % kTileAlignment == 0,
+              "pool blocks must satisfy tile alignment");
+
+AlignedBuffer::AlignedBuffer(size_t size)
+    : data_(static_cast<uint8_t*>(BufferPool::Shared().Allocate(size))),
+      size_(size) {}
+
+AlignedBuffer::~AlignedBuffer() { BufferPool::Shared().Release(data_, size_); }
+
+AlignedBuffer::AlignedBuffer(AlignedBuffer&& o) noexcept
+    : data_(o.data_), size_(o.size_) {
+  o.data_ = nullptr;
+  o.size_ = 0;
+}
+
+AlignedBuffer& AlignedBuffer::operator=(AlignedBuffer&& o) noexcept {
+  if (this != &o) {
+    BufferPool::Shared().Release(data_, size_);
+    data_ = o.data_;
+    size_ = o.size_;
+    o.data_ = nullptr;
+    o.size_ = 0;
+  }
+  return *this;
+}
+
+// RasterInfo / Tile ---------------------------------------------------------
+
+Rect RasterInfo::TileRect(int tx, int ty) const {
+  Rect r{tx * tile_size, ty * tile_size, tile_size, tile_size};
+  return r.Intersect(bounds());
+}
+
+Tile::Tile(const Rect& rect, int bands, PixelType type)
+    : rect_(rect), bands_(bands), type_(type) {
+  size_t row_bytes =
+      static_cast<size_t>(rect.width) * bands * BytesPerSample(type);
+  stride_ = (row_bytes + kTileAlignment - 1) / kTileAlignment * kTileAlignment;
+  buffer_ = AlignedBuffer(stride_ * std::max(rect.height, 1));
+}
+
+// Sample conversion ---------------------------------------------------------
+
+namespace {
+
+template <typename T>
+T SaturateFromFloat(float v) {
+  if (std::isnan(v)) return 0;
+  v = std::nearbyint(v);
+  if (v <= 0.0f) return 0;
+  if (v >= static_cast<float>(std::numeric_limits<T>::max())) {
+    return std::numeric_limits<T>::max();
+  }
+  return static_cast<T>(v);
+}
+
+template <typename S, typename D>
+void ConvertTyped(const S* src, D* dst, size_t n) {
+  for (size_t i = 0; i < n; ++i) dst[i] = static_cast<D>(src[i]);
+}
+
+template <typename D>
+void ConvertFromFloat(const float* src, D* dst, size_t n) {
+  for (size_t i = 0; i < n; ++i) dst[i] = SaturateFromFloat<D>(src[i]);
+}
+
+}  // namespace
+
+void ConvertSamples(const void* src, PixelType src_type, void* dst,
+                    PixelType dst_type, size_t n) {
+  if (src_type == dst_type) {
+    std::memcpy(dst, src, n * BytesPerSample(src_type));
+    return;
+  }
+  switch (src_type) {
+    case PixelType::kU8: {
+      auto* s = static_cast<const uint8_t*>(src);
+      if (dst_type == PixelType::kU16) {
+        // Widen to the full u16 range (x * 257) so 8-bit imagery stays
+        // visually identical after promotion.
+        auto* d = static_cast<uint16_t*>(dst);
+        for (size_t i = 0; i < n; ++i) d[i] = static_cast<uint16_t>(s[i] * 257);
+      } else {
+        ConvertTyped(s, static_cast<float*>(dst), n);
+      }
+      return;
+    }
+    case PixelType::kU16: {
+      auto* s = static_cast<const uint16_t*>(src);
+      if (dst_type == PixelType::kU8) {
+        auto* d = static_cast<uint8_t*>(dst);
+        for (size_t i = 0; i < n; ++i) {
+          d[i] = static_cast<uint8_t>((s[i] + 128) / 257);
+        }
+      } else {
+        ConvertTyped(s, static_cast<float*>(dst), n);
+      }
+      return;
+    }
+    case PixelType::kF32: {
+      auto* s = static_cast<const float*>(src);
+      if (dst_type == PixelType::kU8) {
+        ConvertFromFloat(s, static_cast<uint8_t*>(dst), n);
+      } else {
+        ConvertFromFloat(s, static_cast<uint16_t*>(dst), n);
+      }
+      return;
+    }
+  }
+}
+
+// TiledRaster ---------------------------------------------------------------
+
+TiledRaster::TiledRaster(const RasterInfo& info)
+    : info_(info),
+      tiles_(static_cast<size_t>(info.tiles_x()) * info.tiles_y()) {}
+
+Tile* TiledRaster::FindTile(int tx, int ty) {
+  return tiles_[static_cast<size_t>(ty) * info_.tiles_x() + tx].get();
+}
+
+bool TiledRaster::HasTile(int tx, int ty) const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return tiles_[static_cast<size_t>(ty) * info_.tiles_x() + tx] != nullptr;
+}
+
+Tile& TiledRaster::MutableTile(int tx, int ty) {
+  std::lock_guard<std::mutex> lock(mu_);
+  auto& slot = tiles_[static_cast<size_t>(ty) * info_.tiles_x() + tx];
+  if (!slot) {
+    slot = std::make_unique<Tile>(info_.TileRect(tx, ty), info_.bands,
+                                  info_.type);
+    for (int y = 0; y < slot->rect().height; ++y) {
+      std::memset(slot->row(y), 0, slot->stride());
+    }
+  }
+  return *slot;
+}
+
+void TiledRaster::PutTile(int tx, int ty, Tile tile) {
+  std::lock_guard<std::mutex> lock(mu_);
+  tiles_[static_cast<size_t>(ty) * info_.tiles_x() + tx] =
+      std::make_unique<Tile>(std::move(tile));
+}
+
+void TiledRaster::ReleaseTile(int tx, int ty) {
+  std::lock_guard<std::mutex> lock(mu_);
+  tiles_[static_cast<size_t>(ty) * info_.tiles_x() + tx].reset();
+}
+
+size_t TiledRaster::resident_bytes() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  size_t total = 0;
+  for (const auto& t : tiles_) {
+    if (t) total += t->stride() * t->rect().height;
+  }
+  return total;
+}
+
+grpc::Status TiledRaster::ReadWindow(const Rect& rect, PixelType type,
+                                     void* dst, size_t dst_stride) {
+  if (info_.width <= 0 || info_.height <= 0) {
+    return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "empty raster");
+  }
+  const size_t src_px = info_.pixel_bytes();
+  const size_t dst_px = BytesPerSample(type) * info_.bands;
+  auto* out = static_cast<uint8_t*>(dst);
+  std::lock_guard<std::mutex> lock(mu_);
+  for (int row = 0; row < rect.height; ++row) {
+    int sy = std::clamp(rect.y + row, 0, info_.height - 1);
+    int ty = sy / info_.tile_size;
+    uint8_t* dst_row = out + row * dst_stride;
+    int col = 0;
+    while (col < rect.width) {
+      int sx = std::clamp(rect.x + col, 0, info_.width - 1);
+      int tx = sx / info_.tile_size;
+      Tile* tile = FindTile(tx, ty);
+      // Run length within this tile; clamped (edge) pixels go one at a time.
+      int run = 1;
+      if (rect.x + col >= 0 && rect.x + col < info_.width) {
+        run = std::min(rect.width - col,
+                       std::min(info_.width, (tx + 1) * info_.tile_size) - sx);
+      }
+      uint8_t* d = dst_row + col * dst_px;
+      if (tile == nullptr) {
+        std::memset(d, 0, run * dst_px);
+      } else {
+        const uint8_t* s = tile->row(sy - tile->rect().y) +
+                           (sx - tile->rect().x) * src_px;
+        ConvertSamples(s, info_.type, d, type,
+                       static_cast<size_t>(run) * info_.bands);
+      }
+      col += run;
+    }
+  }
+  return grpc::Status::OK;
+}
+
+}  // namespace vision
+}  // namespace lucidia
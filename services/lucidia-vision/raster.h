@@ -0,0 +1,296 @@
+// Tiled raster core shared by every VisionService operation.
+//
+// Pixels live in fixed-size tiles of 64-byte-aligned memory, band-interleaved
+// within a tile. Operations never see a whole-image heap array: they read
+// windows from a RasterSource and produce output one tile at a time.
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+#include <grpcpp/support/status.h>
+
+#include "services/lucidia-vision/buffer_pool.h"
+
+namespace lucidia {
+namespace vision {
+
+enum class PixelType : uint8_t { kU8, kU16, kF32 };
+
+constexpr size_t kTileAlignment = 64;
+constexpr int kDefaultTileSize = 256;
+
+size_t BytesPerSample(PixelType type);
+const char* PixelTypeName(PixelType type);
+
+// Pixel rectangle. x/y may be negative when a window includes a halo.
+struct Rect {
+  int x = 0;
+  int y = 0;
+  int width = 0;
+  int height = 0;
+
+  int right() const { return x + width; }
+  int bottom() const { return y + height; }
+  bool empty() const { return width <= 0 || height <= 0; }
+  Rect Intersect(const Rect& o) const;
+  Rect Inflate(int halo) const {
+    return Rect{x - halo, y - halo, width + 2 * halo, height + 2 * halo};
+  }
+};
+
+// Owns a 64-byte-aligned block from BufferPool::Shared(). Move-only.
+class AlignedBuffer {
+ public:
+  AlignedBuffer() = default;
+  explicit AlignedBuffer(size_t size);
+  ~AlignedBuffer();
+  AlignedBuffer(AlignedBuffer&& o) noexcept;
+  AlignedBuffer& operator=(AlignedBuffer&& o) noexcept;
+  AlignedBuffer(const AlignedBuffer&) = delete;
+  AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+
+  uint8_t* data() { return data_; }
+  const uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// Array of `n` T in an AlignedBuffer: per-tile scratch drawn from the
+// buffer pool instead of the heap. Elements start uninitialized unless a
+// fill value is given.
+template <typename T>
+class ScratchArray {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "ScratchArray holds plain samples");
+
+ public:
+  ScratchArray() = default;
+  explicit ScratchArray(size_t n) : buffer_(n * sizeof(T)), size_(n) {}
+  ScratchArray(size_t n, T fill) : ScratchArray(n) {
+    std::fill_n(data(), n, fill);
+  }
+
+  T* data() { return reinterpret_cast<T*>(buffer_.data()); }
+  const T* data() const { return reinterpret_cast<const T*>(buffer_.data()); }
+  size_t size() const { return size_; }
+  T* begin() { return data(); }
+  T* end() { return data() + size_; }
+  T& operator[](size_t i) { return data()[i]; }
+  const T& operator[](size_t i) const { return data()[i]; }
+
+ private:
+  AlignedBuffer buffer_;
+  size_t size_ = 0;
+};
+
+// Shape of a raster and of its tile grid.
+struct RasterInfo {
+  int width = 0;
+  int height = 0;
+  int bands = 1;
+  PixelType type = PixelType::kU8;
+  int tile_size = kDefaultTileSize;
+
+  int tiles_x() const { return (width + tile_size - 1) / tile_size; }
+  int tiles_y() const { return (height + tile_size - 1) / tile_size; }
+  size_t pixel_bytes() const { return BytesPerSample(type) * bands; }
+  Rect bounds() const { return Rect{0, 0, width, height}; }
+  // Pixel extent of tile (tx, ty); edge tiles are clipped to the raster.
+  Rect TileRect(int tx, int ty) const;
+};
+
+struct TileIndex {
+  int tx = 0;
+  int ty = 0;
+};
+
+// One tile's pixels. Rows are padded to kTileAlignment so every row starts
+// on a cache line.
+class Tile {
+ public:
+  Tile() = default;
+  Tile(const Rect& rect, int bands, PixelType type);
+
+  const Rect& rect() const { return rect_; }
+  int bands() const { return bands_; }
+  PixelType type() const { return type_; }
+  size_t stride() const { return stride_; }
+  bool allocated() const { return buffer_.data() != nullptr; }
+
+  uint8_t* row(int y) { return buffer_.data() + y * stride_; }
+  const uint8_t* row(int y) const { return buffer_.data() + y * stride_; }
+  template <typename T>
+  T* row_as(int y) { return reinterpret_cast<T*>(row(y)); }
+  template <typename T>
+  const T* row_as(int y) const { return reinterpret_cast<const T*>(row(y)); }
+
+  // Iterates the tile's rows as typed pointers:
+  //   for (float* row : tile.rows<float>()) { ... }
+  template <typename T>
+  class RowRange {
+   public:
+    class iterator {
+     public:
+      iterator(uint8_t* p, size_t stride) : p_(p), stride_(stride) {}
+      T* operator*() const { return reinterpret_cast<T*>(p_); }
+      iterator& operator++() { p_ += stride_; return *this; }
+      bool operator!=(const iterator& o) const { return p_ != o.p_; }
+
+     private:
+      uint8_t* p_;
+      size_t stride_;
+    };
+    RowRange(uint8_t* base, size_t stride, int rows)
+        : base_(base), stride_(stride), rows_(rows) {}
+    iterator begin() const { return iterator(base_, stride_); }
+    iterator end() const { return iterator(base_ + rows_ * stride_, stride_); }
+
+   private:
+    uint8_t* base_;
+    size_t stride_;
+    int rows_;
+  };
+  template <typename T>
+  RowRange<T> rows() {
+    return RowRange<T>(buffer_.data(), stride_, rect_.height);
+  }
+
+ private:
+  Rect rect_;
+  int bands_ = 0;
+  PixelType type_ = PixelType::kU8;
+  size_t stride_ = 0;
+  AlignedBuffer buffer_;
+};
+
+// Iterates a tile grid in row-major order:
+//   for (TileIndex t : TileRange(info)) { ... }
+class TileRange {
+ public:
+  class iterator {
+   public:
+    iterator(int tiles_x, int i) : tiles_x_(tiles_x), i_(i) {}
+    TileIndex operator*() const {
+      return TileIndex{i_ % tiles_x_, i_ / tiles_x_};
+    }
+    iterator& operator++() { ++i_; return *this; }
+    bool operator!=(const iterator& o) const { return i_ != o.i_; }
+
+   private:
+    int tiles_x_;
+    int i_;
+  };
+  explicit TileRange(const RasterInfo& info)
+      : tiles_x_(info.tiles_x()), count_(info.tiles_x() * info.tiles_y()) {}
+  iterator begin() const { return iterator(tiles_x_, 0); }
+  iterator end() const { return iterator(tiles_x_, count_); }
+
+ private:
+  int tiles_x_;
+  int count_;
+};
+
+// Raster georeferencing: pixel (col, row) has its top-left corner at
+// (origin_x + col * pixel_width, origin_y + row * pixel_height).
+struct Georef {
+  double origin_x = 0.0;
+  double origin_y = 0.0;
+  double pixel_width = 1.0;
+  double pixel_height = 1.0;
+  int width = 0;
+  int height = 0;
+  int epsg = 0;  // CRS of the coordinates; 0 when unknown.
+};
+
+// Converts `n` samples between pixel types. Float to integer conversions
+// round and saturate.
+void ConvertSamples(const void* src, PixelType src_type, void* dst,
+                    PixelType dst_type, size_t n);
+
+// Anything that can hand out pixel windows: decoders, in-memory rasters and
+// operation outputs. Implementations must be safe to call concurrently.
+class RasterSource {
+ public:
+  virtual ~RasterSource() = default;
+  virtual const RasterInfo& info() const = 0;
+
+  // Copies `rect` into `dst` (rows `dst_stride` bytes apart) as `type`, all
+  // bands interleaved. Pixels outside the raster replicate the nearest edge
+  // pixel, so halo reads at the border need no special casing.
+  virtual grpc::Status ReadWindow(const Rect& rect, PixelType type, void* dst,
+                                  size_t dst_stride) = 0;
+
+  // Fills `tile` (already shaped to info().TileRect(t)) in the source's own
+  // pixel type. Sources that produce whole tiles natively override this to
+  // skip the window copy.
+  virtual grpc::Status ReadTile(TileIndex t, Tile* tile) {
+    (void)t;
+    return ReadWindow(tile->rect(), tile->type(), tile->row(0), tile->stride());
+  }
+
+  // Drops decoded state the source can rebuild (decoder row windows) once a
+  // consumer is done with it. Later reads still work, redoing that work.
+  virtual void Trim() {}
+
+  // Georeferencing embedded in the encoded raster (GeoTIFF tags), if any.
+  virtual bool GetGeoref(Georef* out) const {
+    (void)out;
+    return false;
+  }
+
+  // A stored lower-resolution copy (e.g. a COG overview) reduced by at most
+  // `factor` in each axis, or null. Consumers that shrink the raster read
+  // from it instead of decoding full resolution.
+  virtual std::shared_ptr<RasterSource> Reduced(double factor) {
+    (void)factor;
+    return nullptr;
+  }
+};
+
+// Sparse in-memory raster. Tiles are allocated on first write and can be
+// released once consumed, so callers control residency tile by tile.
+class TiledRaster : public RasterSource {
+ public:
+  explicit TiledRaster(const RasterInfo& info);
+
+  const RasterInfo& info() const override { return info_; }
+  grpc::Status ReadWindow(const Rect& rect, PixelType type, void* dst,
+                          size_t dst_stride) override;
+
+  bool HasTile(int tx, int ty) const;
+  // Returns the tile, allocating (zero-filled) on first use.
+  Tile& MutableTile(int tx, int ty);
+  // Installs a tile computed elsewhere.
+  void PutTile(int tx, int ty, Tile tile);
+  void ReleaseTile(int tx, int ty);
+  size_t resident_bytes() const;
+
+ private:
+  Tile* FindTile(int tx, int ty);
+
+  RasterInfo info_;
+  mutable std::mutex mu_;
+  std::vector<std::unique_ptr<Tile>> tiles_;
+};
+
+// Receives output tiles one tile row at a time, top to bottom.
+class RasterSink {
+ public:
+  virtual ~RasterSink() = default;
+  virtual grpc::Status Begin(const RasterInfo& info) = 0;
+  // `tiles` holds every tile of tile row `ty`, left to right.
+  virtual grpc::Status WriteTileRow(int ty, std::vector<Tile>& tiles) = 0;
+  virtual grpc::Status Finish() = 0;
+};
+
+}  // namespace vision
+}  // namespace lucidia
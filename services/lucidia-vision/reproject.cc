@@ -0,0 +1,329 @@
+#include "services/lucidia-vision/reproject.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace lucidia {
+namespace vision {
+
+namespace {
+
+// Coarsest lattice tried; halved until the error bound holds.
+constexpr int kMaxStep = 64;
+// Below this spacing the lattice costs as much as exact transforms.
+constexpr int kMinStep = 2;
+// Largest lattice refined to (half the shared cache; a step-64 lattice over
+// the largest output fits). Past it, exact transforms are cheaper to hold.
+constexpr size_t kMaxGridBytes = size_t{32} << 20;
+// Largest source window one output tile may read.
+constexpr int64_t kMaxFootprint = int64_t{1} << 26;
+constexpr int kMaxOutputSide = 1 << 16;
+
+RasterInfo OutputInfo(const RasterInfo& in, const Georef& dst) {
+  RasterInfo info = in;
+  info.width = dst.width;
+  info.height = dst.height;
+  return info;
+}
+
+}  // namespace
+
+// CoordGrid -----------------------------------------------------------------
+
+std::shared_ptr<const CoordGrid> CoordGrid::Build(const CoordTransform& to_src,
+                                                  const Georef& dst,
+                                                  double tolerance) {
+  std::shared_ptr<CoordGrid> grid(new CoordGrid(to_src, dst));
+  if (tolerance > 0) {
+    for (int step = kMaxStep; step >= kMinStep; step /= 2) {
+      const size_t nodes =
+          static_cast<size_t>((dst.width - 1) / step + 2) *
+          ((dst.height - 1) / step + 2);
+      if (nodes * 2 * sizeof(double) > kMaxGridBytes) break;
+      grid->Sample(step);
+      if (grid->MaxError() <= tolerance) return grid;
+    }
+  }
+  grid->step_ = 0;
+  grid->nodes_.clear();
+  grid->nodes_.shrink_to_fit();
+  return grid;
+}
+
+void CoordGrid::Sample(int step) {
+  step_ = step;
+  // Node i sits on output pixel i * step; the last node is at or past the
+  // final pixel so every pixel has a cell.
+  nodes_x_ = (dst_.width - 1) / step + 2;
+  nodes_y_ = (dst_.height - 1) / step + 2;
+  nodes_.resize(static_cast<size_t>(nodes_x_) * nodes_y_ * 2);
+  for (int j = 0; j < nodes_y_; ++j) {
+    const double y = dst_.origin_y + (j * step + 0.5) * dst_.pixel_height;
+    for (int i = 0; i < nodes_x_; ++i) {
+      const double x = dst_.origin_x + (i * step + 0.5) * dst_.pixel_width;
+      double* n = &nodes_[(static_cast<size_t>(j) * nodes_x_ + i) * 2];
+      to_src_.Apply(x, y, &n[0], &n[1]);
+    }
+  }
+}
+
+void CoordGrid::Interpolate(double px, double py, double* x, double* y) const {
+  const int i = std::min(static_cast<int>(px) / step_, nodes_x_ - 2);
+  const int j = std::min(static_cast<int>(py) / step_, nodes_y_ - 2);
+  const double fx = (px - i * step_) / step_;
+  const double fy = (py - j * step_) / step_;
+  const double* n00 = &nodes_[(static_cast<size_t>(j) * nodes_x_ + i) * 2];
+  const double* n10 = n00 + 2;
+  const double* n01 = n00 + nodes_x_ * 2;
+  const double* n11 = n01 + 2;
+  for (int c = 0; c < 2; ++c) {
+    const double top = n00[c] + (n10[c] - n00[c]) * fx;
+    const double bottom = n01[c] + (n11[c] - n01[c]) * fx;
+    (c == 0 ? *x : *y) = top + (bottom - top) * fy;
+  }
+}
+
+double CoordGrid::MaxError() const {
+  // Interpolation error peaks mid-cell and mid-edge; probe those points.
+  const double half = step_ / 2.0;
+  double worst = 0.0;
+  for (int j = 0; j + 1 < nodes_y_; ++j) {
+    for (int i = 0; i + 1 < nodes_x_; ++i) {
+      const double probes[3][2] = {{i * step_ + half, j * step_ + half},
+                                   {i * step_ + half, j * step_ + 0.0},
+                                   {i * step_ + 0.0, j * step_ + half}};
+      for (const auto& p : probes) {
+        double ex, ey, ax, ay;
+        to_src_.Apply(dst_.origin_x + (p[0] + 0.5) * dst_.pixel_width,
+                      dst_.origin_y + (p[1] + 0.5) * dst_.pixel_height, &ex,
+                      &ey);
+        Interpolate(p[0], p[1], &ax, &ay);
+        // A node or probe outside the transform's domain is NaN, which
+        // std::max would drop; such a lattice cannot stand in for it.
+        if (!std::isfinite(ex) || !std::isfinite(ey) || !std::isfinite(ax) ||
+            !std::isfinite(ay)) {
+          return std::numeric_limits<double>::infinity();
+        }
+        worst = std::max({worst, std::abs(ex - ax), std::abs(ey - ay)});
+      }
+    }
+  }
+  return worst;
+}
+
+void CoordGrid::MapRow(int x0, int y, int n, double* xs, double* ys) const {
+  if (step_ == 0) {
+    const double gy = dst_.origin_y + (y + 0.5) * dst_.pixel_height;
+    for (int k = 0; k < n; ++k) {
+      to_src_.Apply(dst_.origin_x + (x0 + k + 0.5) * dst_.pixel_width, gy,
+                    &xs[k], &ys[k]);
+    }
+    return;
+  }
+  for (int k = 0; k < n; ++k) Interpolate(x0 + k, y, &xs[k], &ys[k]);
+}
+
+// CoordGridCache ------------------------------------------------------------
+
+CoordGridCache& CoordGridCache::Shared() {
+  static CoordGridCache* cache = new CoordGridCache(size_t{64} << 20);
+  return *cache;
+}
+
+grpc::Status CoordGridCache::Get(int src_epsg, int dst_epsg, const Georef& dst,
+                                 double tolerance,
+                                 std::shared_ptr<const CoordGrid>* out) {
+  const Key key{src_epsg,         dst_epsg,  dst.origin_x, dst.origin_y,
+                dst.pixel_width,  dst.pixel_height, dst.width, dst.height,
+                tolerance};
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      ++hits_;
+      lru_.splice(lru_.begin(), lru_, it->second);
+      *out = it->second->second;
+      return grpc::Status::OK;
+    }
+    ++misses_;
+  }
+
+  // Built outside the lock; a concurrent miss on the same key builds an
+  // identical grid and the second insert is dropped.
+  std::shared_ptr<const Projection> src, dst_proj;
+  grpc::Status s = FindProjection(src_epsg, &src);
+  if (!s.ok()) return s;
+  s = FindProjection(dst_epsg, &dst_proj);
+  if (!s.ok()) return s;
+  auto grid = CoordGrid::Build(CoordTransform(dst_proj, src), dst, tolerance);
+
+  std::lock_guard<std::mutex> lock(mu_);
+  // A grid larger than the whole budget is used once and not kept.
+  if (grid->bytes() <= max_bytes_ && index_.find(key) == index_.end()) {
+    lru_.emplace_front(key, grid);
+    index_[key] = lru_.begin();
+    bytes_ += grid->bytes();
+    while (bytes_ > max_bytes_) {
+      bytes_ -= lru_.back().second->bytes();
+      index_.erase(lru_.back().first);
+      lru_.pop_back();
+    }
+  }
+  *out = std::move(grid);
+  return grpc::Status::OK;
+}
+
+uint64_t CoordGridCache::hits() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return hits_;
+}
+
+uint64_t CoordGridCache::misses() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return misses_;
+}
+
+// PlanReprojection ----------------------------------------------------------
+
+grpc::Status PlanReprojection(const CoordTransform& to_dst, const Georef& src,
+                              Georef* dst) {
+  // Trace the source outline; interior extrema are rare for the supported
+  // projections over single-zone extents.
+  constexpr int kEdgeSamples = 32;
+  double min_x = std::numeric_limits<double>::infinity(), min_y = min_x;
+  double max_x = -min_x, max_y = -min_x;
+  auto add = [&](double col, double row) {
+    double x, y;
+    if (!to_dst.Apply(src.origin_x + col * src.pixel_width,
+                      src.origin_y + row * src.pixel_height, &x, &y)) {
+      return;
+    }
+    min_x = std::min(min_x, x);
+    max_x = std::max(max_x, x);
+    min_y = std::min(min_y, y);
+    max_y = std::max(max_y, y);
+  };
+  for (int k = 0; k <= kEdgeSamples; ++k) {
+    const double f = static_cast<double>(k) / kEdgeSamples;
+    add(f * src.width, 0);
+    add(f * src.width, src.height);
+    add(0, f * src.height);
+    add(src.width, f * src.height);
+  }
+  if (!(min_x < max_x && min_y < max_y)) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "reproject: input lies outside the target projection");
+  }
+  // Keep the diagonal pixel count, as GDAL's suggested warp output does.
+  const double diag = std::hypot(max_x - min_x, max_y - min_y);
+  const double res = diag / std::hypot(src.width, src.height);
+  const double w = std::ceil((max_x - min_x) / res);
+  const double h = std::ceil((max_y - min_y) / res);
+  if (w > kMaxOutputSide || h > kMaxOutputSide) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "reproject: output larger than 65536 pixels a side");
+  }
+  dst->origin_x = min_x;
+  dst->origin_y = max_y;
+  dst->pixel_width = res;
+  dst->pixel_height = -res;
+  dst->width = std::max(1, static_cast<int>(w));
+  dst->height = std::max(1, static_cast<int>(h));
+  return grpc::Status::OK;
+}
+
+// ReprojectSource -----------------------------------------------------------
+
+ReprojectSource::ReprojectSource(std::shared_ptr<RasterSource> input,
+                                 const Georef& src,
+                                 std::shared_ptr<const CoordGrid> grid,
+                                 const Georef& dst)
+    : TileOpSource(OutputInfo(input->info(), dst)),
+      input_(std::move(input)),
+      src_(src),
+      grid_(std::move(grid)),
+      dst_(dst) {}
+
+grpc::Status ReprojectSource::ComputeTile(TileIndex t, Tile* out) {
+  (void)t;
+  const Rect& rect = out->rect();
+  const int bands = info_.bands;
+  const size_t n = static_cast<size_t>(rect.width) * rect.height;
+
+  // Source pixel-centre coordinates of every output pixel; NaN outside.
+  ScratchArray<float> u(n), v(n);
+  ScratchArray<double> xs(rect.width), ys(rect.width);
+  float min_u = std::numeric_limits<float>::infinity(), min_v = min_u;
+  float max_u = -min_u, max_v = -min_u;
+  const float lim_u = src_.width - 0.5f, lim_v = src_.height - 0.5f;
+  for (int y = 0; y < rect.height; ++y) {
+    grid_->MapRow(rect.x, rect.y + y, rect.width, xs.data(), ys.data());
+    for (int x = 0; x < rect.width; ++x) {
+      float pu = static_cast<float>((xs[x] - src_.origin_x) /
+                                    src_.pixel_width - 0.5);
+      float pv = static_cast<float>((ys[x] - src_.origin_y) /
+                                    src_.pixel_height - 0.5);
+      if (!(pu >= -0.5f && pu <= lim_u && pv >= -0.5f && pv <= lim_v)) {
+        pu = pv = std::numeric_limits<float>::quiet_NaN();
+      } else {
+        min_u = std::min(min_u, pu);
+        max_u = std::max(max_u, pu);
+        min_v = std::min(min_v, pv);
+        max_v = std::max(max_v, pv);
+      }
+      u[static_cast<size_t>(y) * rect.width + x] = pu;
+      v[static_cast<size_t>(y) * rect.width + x] = pv;
+    }
+  }
+
+  if (!(min_u <= max_u)) {
+    for (int y = 0; y < rect.height; ++y) {
+      std::fill_n(out->row(y), rect.width * info_.pixel_bytes(), 0);
+    }
+    return grpc::Status::OK;
+  }
+
+  // Footprint plus the bilinear neighbour; the edge halo is replicated.
+  const int wx = static_cast<int>(std::floor(min_u));
+  const int wy = static_cast<int>(std::floor(min_v));
+  const Rect window{wx, wy, static_cast<int>(std::floor(max_u)) - wx + 2,
+                    static_cast<int>(std::floor(max_v)) - wy + 2};
+  if (static_cast<int64_t>(window.width) * window.height > kMaxFootprint) {
+    return grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED,
+                        "reproject: tile footprint too large");
+  }
+  const size_t in_row = static_cast<size_t>(window.width) * bands;
+  ScratchArray<float> in(in_row * window.height);
+  grpc::Status s = input_->ReadWindow(window, PixelType::kF32, in.data(),
+                                      in_row * sizeof(float));
+  if (!s.ok()) return s;
+
+  ScratchArray<float> acc(static_cast<size_t>(rect.width) * bands);
+  for (int y = 0; y < rect.height; ++y) {
+    for (int x = 0; x < rect.width; ++x) {
+      const size_t k = static_cast<size_t>(y) * rect.width + x;
+      float* dst = &acc[static_cast<size_t>(x) * bands];
+      if (std::isnan(u[k])) {
+        std::fill_n(dst, bands, 0.0f);
+        continue;
+      }
+      const float fu = u[k] - wx, fv = v[k] - wy;
+      const int ix = static_cast<int>(fu), iy = static_cast<int>(fv);
+      const float ax = fu - ix, ay = fv - iy;
+      const float* p00 = &in[iy * in_row + static_cast<size_t>(ix) * bands];
+      const float* p01 = p00 + in_row;
+      for (int b = 0; b < bands; ++b) {
+        const float top = p00[b] + (p00[bands + b] - p00[b]) * ax;
+        const float bottom = p01[b] + (p01[bands + b] - p01[b]) * ax;
+        dst[b] = top + (bottom - top) * ay;
+      }
+    }
+    ConvertSamples(acc.data(), PixelType::kF32, out->row(y), info_.type,
+                   acc.size());
+  }
+  return grpc::Status::OK;
+}
+
+}  // namespace vision
+}  // namespace lucidia
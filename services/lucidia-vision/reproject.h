@@ -0,0 +1,107 @@
+// Reprojection between the built-in projections.
+//
+// Output pixels are mapped back into the source with an approximate
+// transform: exact transforms on a coarse lattice of output pixels, refined
+// until bilinear interpolation between lattice nodes stays within an error
+// bound. Lattices depend only on the projections and the output geometry,
+// so they live in a process-wide LRU and are shared by repeated requests
+// over the same area.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#include "services/lucidia-vision/engine.h"
+#include "services/lucidia-vision/projection.h"
+
+namespace lucidia {
+namespace vision {
+
+// Source-projection coordinates of every output pixel centre.
+class CoordGrid {
+ public:
+  // `tolerance` is in source units; <= 0 transforms every pixel exactly, as
+  // does a tolerance no lattice within the size budget meets.
+  static std::shared_ptr<const CoordGrid> Build(const CoordTransform& to_src,
+                                                const Georef& dst,
+                                                double tolerance);
+
+  // Source coordinates of output pixels [x0, x0 + n) of row y; NaN where the
+  // transform is undefined.
+  void MapRow(int x0, int y, int n, double* xs, double* ys) const;
+
+  // Lattice spacing in output pixels; 0 for exact mode.
+  int step() const { return step_; }
+  size_t bytes() const { return nodes_.size() * sizeof(double); }
+
+ private:
+  CoordGrid(const CoordTransform& to_src, const Georef& dst)
+      : to_src_(to_src), dst_(dst) {}
+  void Sample(int step);
+  double MaxError() const;
+  void Interpolate(double px, double py, double* x, double* y) const;
+
+  CoordTransform to_src_;
+  Georef dst_;
+  int step_ = 0;
+  int nodes_x_ = 0;
+  int nodes_y_ = 0;
+  std::vector<double> nodes_;  // (x, y) pairs, row-major.
+};
+
+// Process-wide LRU of CoordGrids bounded by their total size.
+class CoordGridCache {
+ public:
+  explicit CoordGridCache(size_t max_bytes) : max_bytes_(max_bytes) {}
+  static CoordGridCache& Shared();
+
+  grpc::Status Get(int src_epsg, int dst_epsg, const Georef& dst,
+                   double tolerance, std::shared_ptr<const CoordGrid>* out);
+
+  uint64_t hits() const;
+  uint64_t misses() const;
+
+ private:
+  using Key = std::tuple<int, int, double, double, double, double, int, int,
+                         double>;
+  using Entry = std::pair<Key, std::shared_ptr<const CoordGrid>>;
+
+  const size_t max_bytes_;
+  mutable std::mutex mu_;
+  std::list<Entry> lru_;  // Most recent first.
+  std::map<Key, std::list<Entry>::iterator> index_;
+  size_t bytes_ = 0;
+  uint64_t hits_ = 0;
+  uint64_t misses_ = 0;
+};
+
+// Output georeferencing covering the whole source in the target projection,
+// at roughly the source's resolution.
+grpc::Status PlanReprojection(const CoordTransform& to_dst, const Georef& src,
+                              Georef* dst);
+
+// Bilinearly resampled view of `input` (georeferenced by `src`) on the
+// output grid. Pixels that map outside the source are zero.
+class ReprojectSource : public TileOpSource {
+ public:
+  ReprojectSource(std::shared_ptr<RasterSource> input, const Georef& src,
+                  std::shared_ptr<const CoordGrid> grid, const Georef& dst);
+
+ protected:
+  grpc::Status ComputeTile(TileIndex t, Tile* out) override;
+
+ private:
+  std::shared_ptr<RasterSource> input_;
+  Georef src_;
+  std::shared_ptr<const CoordGrid> grid_;
+  Georef dst_;
+};
+
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,96 @@
+#include "services/lucidia-vision/reproject.h"
+
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace lucidia {
+namespace vision {
+namespace {
+
+CoordTransform Transform(int from, int to) {
+  std::shared_ptr<const Projection> a, b;
+  EXPECT_TRUE(FindProjection(from, &a).ok());
+  EXPECT_TRUE(FindProjection(to, &b).ok());
+  return CoordTransform(a, b);
+}
+
+Georef Geographic(double west, double north, double degrees, int width,
+                  int height) {
+  Georef g;
+  g.origin_x = west;
+  g.origin_y = north;
+  g.pixel_width = degrees;
+  g.pixel_height = -degrees;
+  g.width = width;
+  g.height = height;
+  g.epsg = 4326;
+  return g;
+}
+
+// An unreachable tolerance over the largest output stops refining at the
+// size budget instead of halving down to a multi-gigabyte lattice.
+TEST(CoordGridTest, RefinementStopsAtTheBudget) {
+  const Georef dst = Geographic(-90.0, 60.0, 120.0 / 65536, 65536, 65536);
+  auto grid = CoordGrid::Build(Transform(4326, 3857), dst, 1e-9);
+  EXPECT_EQ(grid->step(), 0);
+  EXPECT_EQ(grid->bytes(), 0u);
+}
+
+// Rows past Web Mercator's latitude limit have no source position. A lattice
+// cell straddling the limit would interpolate NaN over pixels that do have
+// one, so the grid is exact and every pixel keeps its own transform.
+TEST(CoordGridTest, DomainEdgeFallsBackToExact) {
+  const Georef dst = Geographic(10.0, 89.0, 0.01, 300, 800);
+  const CoordTransform to_src = Transform(4326, 3857);
+  // Loose enough that any lattice of finite nodes would do.
+  auto grid = CoordGrid::Build(to_src, dst, 1e7);
+  EXPECT_EQ(grid->step(), 0);
+  std::vector<double> xs(dst.width), ys(dst.width);
+  for (int y = 0; y < dst.height; ++y) {
+    grid->MapRow(0, y, dst.width, xs.data(), ys.data());
+    for (int x = 0; x < dst.width; ++x) {
+      double ex, ey;
+      to_src.Apply(dst.origin_x + (x + 0.5) * dst.pixel_width,
+                   dst.origin_y + (y + 0.5) * dst.pixel_height, &ex, &ey);
+      ASSERT_EQ(std::isnan(xs[x]), std::isnan(ex)) << x << "," << y;
+    }
+  }
+}
+
+// Well inside the domain the lattice holds the bound.
+TEST(CoordGridTest, LatticeMeetsTolerance) {
+  const Georef dst = Geographic(10.0, 50.0, 0.001, 1000, 700);
+  const CoordTransform to_src = Transform(4326, 3857);
+  auto grid = CoordGrid::Build(to_src, dst, 0.05);
+  ASSERT_GT(grid->step(), 0);
+  std::vector<double> xs(dst.width), ys(dst.width);
+  for (int y = 0; y < dst.height; y += 7) {
+    grid->MapRow(0, y, dst.width, xs.data(), ys.data());
+    for (int x = 0; x < dst.width; ++x) {
+      double ex, ey;
+      to_src.Apply(dst.origin_x + (x + 0.5) * dst.pixel_width,
+                   dst.origin_y + (y + 0.5) * dst.pixel_height, &ex, &ey);
+      ASSERT_NEAR(xs[x], ex, 0.05) << x << "," << y;
+      ASSERT_NEAR(ys[x], ey, 0.05) << x << "," << y;
+    }
+  }
+}
+
+// Grids over the cache's whole budget are handed out but not kept.
+TEST(CoordGridCacheTest, OversizedGridIsNotKept) {
+  CoordGridCache cache(1024);
+  const Georef dst = Geographic(10.0, 50.0, 0.001, 1000, 700);
+  std::shared_ptr<const CoordGrid> grid;
+  ASSERT_TRUE(cache.Get(3857, 4326, dst, 0.05, &grid).ok());
+  ASSERT_GT(grid->bytes(), 1024u);
+  ASSERT_TRUE(cache.Get(3857, 4326, dst, 0.05, &grid).ok());
+  EXPECT_EQ(cache.hits(), 0u);
+  EXPECT_EQ(cache.misses(), 2u);
+}
+
+}  // namespace
+}  // namespace vision
+}  // namespace lucidia
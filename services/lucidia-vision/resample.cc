@@ -0,0 +1,310 @@
+#include "services/lucidia-vision/resample.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+
+#include "services/lucidia-vision/thread_pool.h"
+
+namespace lucidia {
+namespace vision {
+
+namespace {
+
+constexpr double kPi = 3.14159265358979323846;
+
+// Rows or output columns per parallel band inside one tile. Large
+// single-tile outputs (thumbnails) still spread over the pool; when
+// Materialize already keeps every worker busy the bands simply run inline.
+constexpr int kBandRows = 32;
+constexpr int kBandColumns = 32;
+
+// Source rows are read in chunks of about this many bytes, so a tile's
+// memory stays bounded however much source it reduces (a whole 40k x 40k
+// raster into one thumbnail tile) and block caches are not flushed.
+constexpr size_t kChunkBytes = size_t{4} << 20;
+
+void ForEachBand(int rows, const std::function<void(int, int)>& fn) {
+  const int bands = (rows + kBandRows - 1) / kBandRows;
+  ParallelFor(bands, [&](int i) {
+    fn(i * kBandRows, std::min(rows, (i + 1) * kBandRows));
+  });
+}
+
+void ForEachColumnBand(int columns, const std::function<void(int, int)>& fn) {
+  const int bands = (columns + kBandColumns - 1) / kBandColumns;
+  ParallelFor(bands, [&](int i) {
+    fn(i * kBandColumns, std::min(columns, (i + 1) * kBandColumns));
+  });
+}
+
+// Source rows per chunk for rows of `row_bytes`; at least one.
+int ChunkRows(size_t row_bytes) {
+  return static_cast<int>(std::max<size_t>(1, kChunkBytes / row_bytes));
+}
+
+double Sinc(double x) {
+  if (x == 0.0) return 1.0;
+  x *= kPi;
+  return std::sin(x) / x;
+}
+
+// Kernel radius in source pixels at unit scale.
+double Radius(ResampleFilter filter) {
+  switch (filter) {
+    case ResampleFilter::kBilinear: return 1.0;
+    case ResampleFilter::kBicubic: return 2.0;
+    case ResampleFilter::kLanczos3: return 3.0;
+    default: return 0.5;
+  }
+}
+
+double Kernel(ResampleFilter filter, double x) {
+  x = std::abs(x);
+  switch (filter) {
+    case ResampleFilter::kBilinear:
+      return x < 1.0 ? 1.0 - x : 0.0;
+    case ResampleFilter::kBicubic: {
+      // Catmull-Rom (a = -0.5).
+      constexpr double a = -0.5;
+      if (x < 1.0) return ((a + 2) * x - (a + 3)) * x * x + 1;
+      if (x < 2.0) return ((a * x - 5 * a) * x + 8 * a) * x - 4 * a;
+      return 0.0;
+    }
+    case ResampleFilter::kLanczos3:
+      return x < 3.0 ? Sinc(x) * Sinc(x / 3.0) : 0.0;
+    default:
+      return 0.0;
+  }
+}
+
+}  // namespace
+
+const char* ResampleFilterName(ResampleFilter filter) {
+  switch (filter) {
+    case ResampleFilter::kNearest: return "nearest";
+    case ResampleFilter::kBilinear: return "bilinear";
+    case ResampleFilter::kBicubic: return "bicubic";
+    case ResampleFilter::kLanczos3: return "lanczos3";
+    case ResampleFilter::kArea: return "area";
+  }
+  return "unknown";
+}
+
+FilterAxis FilterAxis::Build(ResampleFilter filter, int src_size,
+                             int dst_size) {
+  FilterAxis axis;
+  const double scale = static_cast<double>(src_size) / dst_size;
+  axis.start.resize(dst_size);
+
+  if (filter == ResampleFilter::kNearest) {
+    axis.taps = 1;
+    axis.weights.assign(dst_size, 1.0f);
+    for (int i = 0; i < dst_size; ++i) {
+      axis.start[i] = std::min(static_cast<int>((i + 0.5) * scale),
+                               src_size - 1);
+    }
+    return axis;
+  }
+
+  if (filter == ResampleFilter::kArea) {
+    // Each output covers [i*scale, (i+1)*scale) of the source; weights are
+    // the overlap of that interval with each source pixel.
+    axis.taps = static_cast<int>(std::ceil(scale)) + 1;
+    axis.weights.assign(static_cast<size_t>(dst_size) * axis.taps, 0.0f);
+    for (int i = 0; i < dst_size; ++i) {
+      const double lo = i * scale, hi = (i + 1) * scale;
+      const int first = static_cast<int>(std::floor(lo));
+      axis.start[i] = first;
+      float* w = &axis.weights[static_cast<size_t>(i) * axis.taps];
+      for (int k = 0; k < axis.taps; ++k) {
+        const double overlap =
+            std::min(hi, first + k + 1.0) - std::max(lo, first + k + 0.0);
+        w[k] = overlap > 0 ? static_cast<float>(overlap / scale) : 0.0f;
+      }
+    }
+    return axis;
+  }
+
+  // Downscaling stretches the kernel over `scale` source pixels so it also
+  // acts as the anti-aliasing low-pass.
+  const double stretch = std::max(scale, 1.0);
+  const double support = Radius(filter) * stretch;
+  axis.taps = static_cast<int>(std::ceil(2 * support)) + 1;
+  axis.weights.assign(static_cast<size_t>(dst_size) * axis.taps, 0.0f);
+  for (int i = 0; i < dst_size; ++i) {
+    const double center = (i + 0.5) * scale - 0.5;
+    const int first = static_cast<int>(std::floor(center - support)) + 1;
+    axis.start[i] = first;
+    float* w = &axis.weights[static_cast<size_t>(i) * axis.taps];
+    double sum = 0.0;
+    for (int k = 0; k < axis.taps; ++k) {
+      const double v = Kernel(filter, (first + k - center) / stretch);
+      w[k] = static_cast<float>(v);
+      sum += v;
+    }
+    if (sum != 0.0) {
+      for (int k = 0; k < axis.taps; ++k) w[k] = static_cast<float>(w[k] / sum);
+    }
+  }
+  return axis;
+}
+
+void FilterAxis::Span(int begin, int end, int* lo, int* hi) const {
+  // Starts never decrease along the axis.
+  *lo = start[begin];
+  *hi = start[end - 1] + taps;
+}
+
+// ResampleSource ------------------------------------------------------------
+
+namespace {
+
+RasterInfo ResampledInfo(const RasterInfo& in, int width, int height) {
+  RasterInfo info = in;
+  info.width = width;
+  info.height = height;
+  return info;
+}
+
+// Integer reduction factor for the box fast path, or 0.
+int BoxFactor(int src, int dst) {
+  return dst > 0 && src % dst == 0 && src / dst >= 2 ? src / dst : 0;
+}
+
+}  // namespace
+
+ResampleSource::ResampleSource(std::shared_ptr<RasterSource> input, int width,
+                               int height, ResampleFilter filter)
+    : TileOpSource(ResampledInfo(input->info(), width, height)),
+      input_(std::move(input)) {
+  const RasterInfo& in = input_->info();
+  if (filter == ResampleFilter::kArea) {
+    box_x_ = BoxFactor(in.width, width);
+    box_y_ = BoxFactor(in.height, height);
+    if (box_x_ == 0 || box_y_ == 0) box_x_ = box_y_ = 0;
+  }
+  if (box_x_ == 0) {
+    horizontal_ = FilterAxis::Build(filter, in.width, width);
+    vertical_ = FilterAxis::Build(filter, in.height, height);
+  }
+}
+
+grpc::Status ResampleSource::ComputeTile(TileIndex t, Tile* out) {
+  (void)t;
+  if (box_x_ != 0) return ComputeBoxTile(out);
+
+  const Rect& rect = out->rect();
+  const int bands = info_.bands;
+  int sx0, sx1, sy0, sy1;
+  horizontal_.Span(rect.x, rect.right(), &sx0, &sx1);
+  vertical_.Span(rect.y, rect.bottom(), &sy0, &sy1);
+
+  // The source span is streamed through in chunks of rows: each chunk is
+  // filtered horizontally and added into every output row it contributes
+  // to. Rows are visited in order, so the sums match a single pass.
+  const size_t in_row = static_cast<size_t>(sx1 - sx0) * bands;
+  const size_t mid_row = static_cast<size_t>(rect.width) * bands;
+  const int chunk = std::min(ChunkRows(in_row * sizeof(float)), sy1 - sy0);
+  ScratchArray<float> in(in_row * chunk);
+  ScratchArray<float> mid(mid_row * chunk);
+  ScratchArray<float> acc(mid_row * rect.height, 0.0f);
+  const int htaps = horizontal_.taps, vtaps = vertical_.taps;
+  for (int c0 = sy0; c0 < sy1; c0 += chunk) {
+    const int c1 = std::min(sy1, c0 + chunk);
+    grpc::Status s = input_->ReadWindow(Rect{sx0, c0, sx1 - sx0, c1 - c0},
+                                        PixelType::kF32, in.data(),
+                                        in_row * sizeof(float));
+    if (!s.ok()) return s;
+    ForEachColumnBand(rect.width, [&](int x0, int x1) {
+      // Horizontal pass: the chunk's rows to these output columns.
+      for (int r = 0; r < c1 - c0; ++r) {
+        const float* src = in.data() + r * in_row;
+        float* dst = mid.data() + r * mid_row;
+        for (int x = x0; x < x1; ++x) {
+          const int ox = rect.x + x;
+          const float* w =
+              &horizontal_.weights[static_cast<size_t>(ox) * htaps];
+          const float* p = src + (horizontal_.start[ox] - sx0) * bands;
+          for (int b = 0; b < bands; ++b) {
+            float sum = 0.0f;
+            for (int k = 0; k < htaps; ++k) sum += w[k] * p[k * bands + b];
+            dst[x * bands + b] = sum;
+          }
+        }
+      }
+      // Vertical pass: each output row adds the chunk rows under its taps;
+      // the inner loop is a contiguous multiply-add the compiler vectorizes.
+      const size_t i0 = static_cast<size_t>(x0) * bands;
+      const size_t i1 = static_cast<size_t>(x1) * bands;
+      for (int y = 0; y < rect.height; ++y) {
+        const int oy = rect.y + y;
+        const int start = vertical_.start[oy];
+        const int k0 = std::max(0, c0 - start);
+        const int k1 = std::min(vtaps, c1 - start);
+        const float* w = &vertical_.weights[static_cast<size_t>(oy) * vtaps];
+        float* dst = acc.data() + y * mid_row;
+        for (int k = k0; k < k1; ++k) {
+          if (w[k] == 0.0f) continue;
+          const float* row = mid.data() + (start + k - c0) * mid_row;
+          for (size_t i = i0; i < i1; ++i) dst[i] += w[k] * row[i];
+        }
+      }
+    });
+  }
+  ForEachBand(rect.height, [&](int y0, int y1) {
+    for (int y = y0; y < y1; ++y) {
+      ConvertSamples(acc.data() + y * mid_row, PixelType::kF32, out->row(y),
+                     info_.type, mid_row);
+    }
+  });
+  return grpc::Status::OK;
+}
+
+grpc::Status ResampleSource::ComputeBoxTile(Tile* out) {
+  const Rect& rect = out->rect();
+  const int bands = info_.bands;
+  const Rect window{rect.x * box_x_, rect.y * box_y_, rect.width * box_x_,
+                    rect.height * box_y_};
+  const size_t in_row = static_cast<size_t>(window.width) * bands;
+  const size_t out_row = static_cast<size_t>(rect.width) * bands;
+  const int chunk = std::min(ChunkRows(in_row * sizeof(float)), window.height);
+  ScratchArray<float> in(in_row * chunk);
+  ScratchArray<float> acc(out_row * rect.height, 0.0f);
+  for (int c0 = 0; c0 < window.height; c0 += chunk) {
+    const int c1 = std::min(window.height, c0 + chunk);
+    grpc::Status s = input_->ReadWindow(
+        Rect{window.x, window.y + c0, window.width, c1 - c0}, PixelType::kF32,
+        in.data(), in_row * sizeof(float));
+    if (!s.ok()) return s;
+    // Every chunk row folds box_x_ neighbouring pixels into the output row
+    // whose box holds it.
+    ForEachColumnBand(rect.width, [&](int x0, int x1) {
+      for (int r = c0; r < c1; ++r) {
+        const float* src = in.data() + (r - c0) * in_row;
+        float* dst = acc.data() + (r / box_y_) * out_row;
+        for (int x = x0; x < x1; ++x) {
+          const float* p = src + static_cast<size_t>(x) * box_x_ * bands;
+          for (int b = 0; b < bands; ++b) {
+            float v = 0.0f;
+            for (int k = 0; k < box_x_; ++k) v += p[k * bands + b];
+            dst[x * bands + b] += v;
+          }
+        }
+      }
+    });
+  }
+
+  const float norm = 1.0f / (box_x_ * box_y_);
+  ForEachBand(rect.height, [&](int y0, int y1) {
+    for (int y = y0; y < y1; ++y) {
+      float* row = acc.data() + y * out_row;
+      for (size_t i = 0; i < out_row; ++i) row[i] *= norm;
+      ConvertSamples(row, PixelType::kF32, out->row(y), info_.type, out_row);
+    }
+  });
+  return grpc::Status::OK;
+}
+
+}  // namespace vision
+}  // namespace lucidia
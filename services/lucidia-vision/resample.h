@@ -0,0 +1,55 @@
+// Separable raster resampling.
+//
+// Output tiles are filtered in two passes: horizontally over the source rows
+// the tile needs, then vertically. Contributor weights are computed once per
+// output column and row when the source is built, and shared by all tiles.
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "services/lucidia-vision/engine.h"
+
+namespace lucidia {
+namespace vision {
+
+enum class ResampleFilter { kNearest, kBilinear, kBicubic, kLanczos3, kArea };
+
+const char* ResampleFilterName(ResampleFilter filter);
+
+// Contributors of every output position along one axis: output i reads
+// source samples [start[i], start[i] + taps) with weights
+// weights[i * taps, (i + 1) * taps). Starts may lie outside the source;
+// reads there replicate the edge.
+struct FilterAxis {
+  int taps = 0;
+  std::vector<int> start;
+  std::vector<float> weights;
+
+  static FilterAxis Build(ResampleFilter filter, int src_size, int dst_size);
+  // Source samples [*lo, *hi) read by outputs [begin, end).
+  void Span(int begin, int end, int* lo, int* hi) const;
+};
+
+class ResampleSource : public TileOpSource {
+ public:
+  // Output keeps the input's bands, pixel type and tile size.
+  ResampleSource(std::shared_ptr<RasterSource> input, int width, int height,
+                 ResampleFilter filter);
+
+ protected:
+  grpc::Status ComputeTile(TileIndex t, Tile* out) override;
+
+ private:
+  // Integer area reductions (thumbnails) average k x k blocks directly.
+  grpc::Status ComputeBoxTile(Tile* out);
+
+  std::shared_ptr<RasterSource> input_;
+  FilterAxis horizontal_;
+  FilterAxis vertical_;
+  int box_x_ = 0;  // Integer reduction factors when the box path applies.
+  int box_y_ = 0;
+};
+
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,194 @@
+#include "services/lucidia-vision/resample.h"
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include "services/lucidia-vision/test_util.h"
+
+namespace lucidia {
+namespace vision {
+namespace {
+
+using testing::MakeRaster;
+using testing::ReadAll;
+
+std::vector<float> Resample(std::shared_ptr<RasterSource> input, int width,
+                            int height, ResampleFilter filter) {
+  ResampleSource resampled(std::move(input), width, height, filter);
+  return ReadAll<float>(resampled, PixelType::kF32);
+}
+
+TEST(FilterAxisTest, WeightsSumToOne) {
+  for (ResampleFilter filter :
+       {ResampleFilter::kNearest, ResampleFilter::kBilinear,
+        ResampleFilter::kBicubic, ResampleFilter::kLanczos3,
+        ResampleFilter::kArea}) {
+    for (auto sizes : {std::make_pair(100, 37), std::make_pair(37, 100),
+                       std::make_pair(64, 64), std::make_pair(1000, 3)}) {
+      const FilterAxis axis =
+          FilterAxis::Build(filter, sizes.first, sizes.second);
+      ASSERT_EQ(axis.start.size(), static_cast<size_t>(sizes.second));
+      for (int i = 0; i < sizes.second; ++i) {
+        float sum = 0;
+        for (int k = 0; k < axis.taps; ++k) {
+          sum += axis.weights[i * axis.taps + k];
+        }
+        ASSERT_NEAR(sum, 1.0f, 1e-5f) << ResampleFilterName(filter) << " "
+                                      << sizes.first << "->" << sizes.second;
+      }
+    }
+  }
+}
+
+TEST(ResampleTest, AreaAveragesWholeBlocks) {
+  auto input = MakeRaster(8, 6, 1, PixelType::kF32, [](int x, int y, int) {
+    return static_cast<float>(y * 8 + x);
+  });
+  const std::vector<float> out =
+      Resample(input, 4, 3, ResampleFilter::kArea);
+  // Block (bx, by) covers x = 2bx, 2bx+1 and y = 2by, 2by+1.
+  const std::vector<float> expected = {4.5f,  6.5f,  8.5f,  10.5f,
+                                       20.5f, 22.5f, 24.5f, 26.5f,
+                                       36.5f, 38.5f, 40.5f, 42.5f};
+  EXPECT_EQ(out, expected);
+}
+
+TEST(ResampleTest, NearestDoublingReplicatesPixels) {
+  auto input = MakeRaster(3, 2, 2, PixelType::kU8, [](int x, int y, int b) {
+    return static_cast<float>(10 * y + x + 100 * b);
+  });
+  ResampleSource doubled(input, 6, 4, ResampleFilter::kNearest);
+  const std::vector<uint8_t> out = ReadAll<uint8_t>(doubled, PixelType::kU8);
+  for (int y = 0; y < 4; ++y) {
+    for (int x = 0; x < 6; ++x) {
+      for (int b = 0; b < 2; ++b) {
+        EXPECT_EQ(out[(y * 6 + x) * 2 + b], 10 * (y / 2) + x / 2 + 100 * b);
+      }
+    }
+  }
+}
+
+// Pixel centres map as (i + 0.5) * src / dst - 0.5, and linear filters
+// reproduce a ramp exactly away from the replicated edges.
+TEST(ResampleTest, BilinearKeepsRampsLinear) {
+  auto input = MakeRaster(50, 4, 1, PixelType::kF32,
+                          [](int x, int, int) { return 3.0f * x; });
+  const std::vector<float> out =
+      Resample(input, 200, 4, ResampleFilter::kBilinear);
+  for (int x = 4; x < 196; ++x) {
+    EXPECT_NEAR(out[x], 3.0 * ((x + 0.5) / 4.0 - 0.5), 1e-3) << x;
+  }
+}
+
+TEST(ResampleTest, EveryFilterKeepsConstantsConstant) {
+  auto input = MakeRaster(333, 211, 3, PixelType::kF32,
+                          [](int, int, int b) { return 17.25f + b; });
+  for (ResampleFilter filter :
+       {ResampleFilter::kNearest, ResampleFilter::kBilinear,
+        ResampleFilter::kBicubic, ResampleFilter::kLanczos3,
+        ResampleFilter::kArea}) {
+    for (auto size : {std::make_pair(100, 70), std::make_pair(700, 500)}) {
+      const std::vector<float> out =
+          Resample(input, size.first, size.second, filter);
+      ASSERT_EQ(out.size(), static_cast<size_t>(size.first) * size.second * 3);
+      for (size_t i = 0; i < out.size(); ++i) {
+        ASSERT_NEAR(out[i], 17.25f + i % 3, 1e-3f)
+            << ResampleFilterName(filter) << " " << size.first;
+      }
+    }
+  }
+}
+
+// Computes z = x + 2y on demand, so a large raster costs no memory, and
+// records the largest window read from it.
+class RampSource : public RasterSource {
+ public:
+  RampSource(int width, int height) {
+    info_.width = width;
+    info_.height = height;
+    info_.type = PixelType::kF32;
+  }
+  const RasterInfo& info() const override { return info_; }
+  grpc::Status ReadWindow(const Rect& rect, PixelType type, void* dst,
+                          size_t dst_stride) override {
+    EXPECT_EQ(type, PixelType::kF32);
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      max_pixels_ = std::max(
+          max_pixels_, static_cast<size_t>(rect.width) * rect.height);
+    }
+    for (int y = 0; y < rect.height; ++y) {
+      auto* row = reinterpret_cast<float*>(static_cast<uint8_t*>(dst) +
+                                           y * dst_stride);
+      const int sy = std::clamp(rect.y + y, 0, info_.height - 1);
+      for (int x = 0; x < rect.width; ++x) {
+        row[x] = std::clamp(rect.x + x, 0, info_.width - 1) + 2.0f * sy;
+      }
+    }
+    return grpc::Status::OK;
+  }
+  size_t max_pixels() const { return max_pixels_; }
+
+ private:
+  RasterInfo info_;
+  std::mutex mu_;
+  size_t max_pixels_ = 0;
+};
+
+// A thumbnail of a raster with no overviews is one output tile reducing the
+// whole source; it must still read it a bounded chunk at a time.
+TEST(ResampleTest, ThumbnailReadsSourceInBoundedChunks) {
+  constexpr size_t kMaxReadPixels = (size_t{4} << 20) / sizeof(float);
+  {
+    auto ramp = std::make_shared<RampSource>(12000, 9000);
+    // Integer factor: the box path. Box (x, y) averages to its centre.
+    const std::vector<float> out =
+        Resample(ramp, 120, 90, ResampleFilter::kArea);
+    EXPECT_LE(ramp->max_pixels(), kMaxReadPixels);
+    ASSERT_EQ(out.size(), 120u * 90u);
+    for (int y = 0; y < 90; y += 11) {
+      for (int x = 0; x < 120; x += 13) {
+        EXPECT_NEAR(out[y * 120 + x], (100 * x + 49.5) + 2 * (100 * y + 49.5),
+                    0.05)
+            << x << "," << y;
+      }
+    }
+  }
+  {
+    auto ramp = std::make_shared<RampSource>(12000, 9000);
+    const std::vector<float> out =
+        Resample(ramp, 97, 71, ResampleFilter::kLanczos3);
+    EXPECT_LE(ramp->max_pixels(), kMaxReadPixels);
+    const double sx = 12000.0 / 97, sy = 9000.0 / 71;
+    for (int y = 10; y < 60; y += 7) {
+      for (int x = 10; x < 87; x += 9) {
+        const double cx = (x + 0.5) * sx - 0.5, cy = (y + 0.5) * sy - 0.5;
+        EXPECT_NEAR(out[y * 97 + x], cx + 2 * cy, 0.1) << x << "," << y;
+      }
+    }
+  }
+}
+
+TEST(ResampleTest, OutputDoesNotDependOnTileSize) {
+  auto terrain = [](int x, int y, int) {
+    return 100.0f * std::sin(x * 0.03f) + 50.0f * std::cos(y * 0.021f);
+  };
+  for (ResampleFilter filter :
+       {ResampleFilter::kLanczos3, ResampleFilter::kArea}) {
+    const std::vector<float> big = Resample(
+        MakeRaster(900, 700, 1, PixelType::kF32, terrain, 512), 300, 233,
+        filter);
+    const std::vector<float> small = Resample(
+        MakeRaster(900, 700, 1, PixelType::kF32, terrain, 32), 300, 233,
+        filter);
+    EXPECT_EQ(big, small) << ResampleFilterName(filter);
+  }
+}
+
+}  // namespace
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,262 @@
+#include "services/lucidia-vision/result_cache.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+#include <vector>
+
+#include "services/lucidia-vision/content_hash.h"
+#include "services/lucidia-vision/image_io.h"
+
+namespace lucidia {
+namespace vision {
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr char kSuffix[] = ".res";
+constexpr size_t kKeyHexChars = 2 * sizeof(ResultCache::Key);
+
+// Every file starts with this. The key rejects a file renamed from another
+// entry; the length and checksum reject one cut short or damaged, so only
+// the bytes WriteDisk was given are ever served.
+struct DiskHeader {
+  ResultCache::Key key;
+  uint64_t size;      // Payload bytes after the header.
+  uint64_t checksum;  // XXH64 of the payload.
+};
+constexpr size_t kHeaderBytes = sizeof(DiskHeader);
+static_assert(kHeaderBytes == 48, "DiskHeader must not be padded");
+
+uint64_t Checksum(const std::string& bytes) {
+  Xxh64 h;
+  h.Update(bytes.data(), bytes.size());
+  return h.Digest();
+}
+
+bool ParseKey(const std::string& hex, ResultCache::Key* key) {
+  if (hex.size() != kKeyHexChars) return false;
+  for (size_t i = 0; i < key->size(); ++i) {
+    unsigned byte;
+    if (!std::isxdigit(static_cast<unsigned char>(hex[2 * i])) ||
+        !std::isxdigit(static_cast<unsigned char>(hex[2 * i + 1])) ||
+        std::sscanf(hex.c_str() + 2 * i, "%2x", &byte) != 1) {
+      return false;
+    }
+    (*key)[i] = static_cast<uint8_t>(byte);
+  }
+  return true;
+}
+
+}  // namespace
+
+ResultCache::ResultCache(const ResultCacheOptions& options)
+    : options_(options) {
+  if (options_.disk_dir.empty()) return;
+  std::error_code ec;
+  fs::create_directories(options_.disk_dir, ec);
+  std::vector<std::pair<fs::file_time_type, std::pair<Key, size_t>>> found;
+  for (const auto& entry : fs::directory_iterator(options_.disk_dir, ec)) {
+    const std::string name = entry.path().filename().string();
+    Key key;
+    if (name.size() != kKeyHexChars + sizeof(kSuffix) - 1 ||
+        name.compare(kKeyHexChars, std::string::npos, kSuffix) != 0 ||
+        !ParseKey(name.substr(0, kKeyHexChars), &key)) {
+      continue;
+    }
+    found.push_back({entry.last_write_time(ec),
+                     {key, static_cast<size_t>(entry.file_size(ec))}});
+  }
+  std::sort(found.begin(), found.end(),
+            [](const auto& a, const auto& b) { return a.first > b.first; });
+  for (const auto& f : found) {
+    disk_lru_.push_back(f.second);
+    disk_index_[f.second.first] = std::prev(disk_lru_.end());
+    stats_.disk_bytes += f.second.second;
+  }
+}
+
+grpc::Status ResultCache::GetOrCompute(const Key& key, const Compute& compute,
+                                       Value* value, bool* computed) {
+  *computed = false;
+  std::promise<Result> promise;
+  std::shared_future<Result> wait;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (Value v = LookupMemory(key)) {
+      ++stats_.memory_hits;
+      *value = std::move(v);
+      return grpc::Status::OK;
+    }
+    auto p = pending_.find(key);
+    if (p != pending_.end()) {
+      ++stats_.coalesced;
+      wait = p->second;
+    } else {
+      pending_[key] = promise.get_future().share();
+    }
+  }
+  if (wait.valid()) {
+    const Result& r = wait.get();
+    *value = r.second;
+    return r.first;
+  }
+
+  // This caller owns the key until the promise is fulfilled.
+  Result result;
+  if (Value v = ReadDisk(key)) {
+    result = {grpc::Status::OK, std::move(v)};
+  } else {
+    auto bytes = std::make_shared<std::string>();
+    result.first = compute(bytes.get());
+    *computed = true;
+    if (result.first.ok()) result.second = std::move(bytes);
+  }
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (*computed) {
+      ++stats_.misses;
+    } else {
+      ++stats_.disk_hits;
+    }
+    if (result.first.ok()) InsertMemory(key, result.second);
+    pending_.erase(key);
+  }
+  promise.set_value(result);
+  if (*computed && result.first.ok()) WriteDisk(key, *result.second);
+  *value = result.second;
+  return result.first;
+}
+
+ResultCache::Stats ResultCache::stats() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return stats_;
+}
+
+ResultCache::Value ResultCache::LookupMemory(const Key& key) {
+  auto it = index_.find(key);
+  if (it == index_.end()) return nullptr;
+  lru_.splice(lru_.begin(), lru_, it->second);
+  return it->second->second;
+}
+
+void ResultCache::InsertMemory(const Key& key, Value value) {
+  if (value->size() > options_.memory_bytes || index_.count(key)) return;
+  stats_.memory_bytes += value->size();
+  lru_.emplace_front(key, std::move(value));
+  index_[key] = lru_.begin();
+  while (stats_.memory_bytes > options_.memory_bytes) {
+    stats_.memory_bytes -= lru_.back().second->size();
+    index_.erase(lru_.back().first);
+    lru_.pop_back();
+  }
+}
+
+std::string ResultCache::DiskPath(const Key& key) const {
+  std::string name;
+  name.reserve(kKeyHexChars + sizeof(kSuffix));
+  for (uint8_t byte : key) {
+    char hex[3];
+    std::snprintf(hex, sizeof(hex), "%02x", byte);
+    name += hex;
+  }
+  name += kSuffix;
+  return (fs::path(options_.disk_dir) / name).string();
+}
+
+ResultCache::Value ResultCache::ReadDisk(const Key& key) {
+  if (options_.disk_dir.empty()) return nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = disk_index_.find(key);
+    if (it == disk_index_.end()) return nullptr;
+    disk_lru_.splice(disk_lru_.begin(), disk_lru_, it->second);
+  }
+  const std::string path = DiskPath(key);
+  std::ifstream in(path, std::ios::binary);
+  DiskHeader header;
+  std::error_code ec;
+  const uintmax_t file_size = fs::file_size(path, ec);
+  if (in.read(reinterpret_cast<char*>(&header), kHeaderBytes) &&
+      header.key == key && !ec && file_size - kHeaderBytes == header.size) {
+    auto bytes = std::make_shared<std::string>(header.size, '\0');
+    if (in.read(&(*bytes)[0], static_cast<std::streamsize>(header.size)) &&
+        Checksum(*bytes) == header.checksum) {
+      return bytes;
+    }
+  }
+  // Damaged: forget it, so the recomputed result takes its place.
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = disk_index_.find(key);
+    if (it != disk_index_.end()) {
+      stats_.disk_bytes -= it->second->second;
+      disk_lru_.erase(it->second);
+      disk_index_.erase(it);
+    }
+  }
+  fs::remove(path, ec);
+  return nullptr;
+}
+
+void ResultCache::WriteDisk(const Key& key, const std::string& bytes) {
+  if (options_.disk_dir.empty() ||
+      bytes.size() + kHeaderBytes > options_.disk_bytes) {
+    return;
+  }
+  // Write under a unique name and rename, so readers never see a partial
+  // file even across processes sharing the directory.
+  const std::string path = DiskPath(key);
+  const std::string tmp =
+      path + ".tmp" +
+      std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+  const DiskHeader header{key, bytes.size(), Checksum(bytes)};
+  std::error_code ec;
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), kHeaderBytes);
+    out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    // The last buffered bytes only reach the file on close.
+    out.close();
+    if (!out) {
+      fs::remove(tmp, ec);
+      return;
+    }
+  }
+  fs::rename(tmp, path, ec);
+  if (ec) return;
+
+  std::vector<Key> evict;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (disk_index_.count(key)) return;
+    const size_t size = bytes.size() + kHeaderBytes;
+    disk_lru_.emplace_front(key, size);
+    disk_index_[key] = disk_lru_.begin();
+    stats_.disk_bytes += size;
+    while (stats_.disk_bytes > options_.disk_bytes) {
+      stats_.disk_bytes -= disk_lru_.back().second;
+      evict.push_back(disk_lru_.back().first);
+      disk_index_.erase(disk_lru_.back().first);
+      disk_lru_.pop_back();
+    }
+  }
+  for (const Key& k : evict) fs::remove(DiskPath(k), ec);
+}
+
+ResultCache::Key HashRequest(const char* method,
+                             const google::protobuf::Message& req) {
+  Sha256 h;
+  h.Update(method, std::strlen(method) + 1);
+  HashMessage(req, &h);
+  HashImageFiles(req, &h);
+  return h.Digest();
+}
+
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,96 @@
+// Content-addressed cache of serialized RPC responses.
+//
+// Keys are SHA-256 digests of the method name and the whole request, image
+// bytes included, so identical requests from any client share one entry and
+// no client can craft a request that collides with another's. A memory LRU sits
+// in front of an optional directory of files; concurrent misses on the same
+// key are coalesced so only the first caller computes.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <grpcpp/support/status.h>
+
+#include "services/lucidia-vision/content_hash.h"
+
+namespace google {
+namespace protobuf {
+class Message;
+}  // namespace protobuf
+}  // namespace google
+
+namespace lucidia {
+namespace vision {
+
+struct ResultCacheOptions {
+  size_t memory_bytes = size_t{256} << 20;
+  std::string disk_dir;  // Empty disables the disk tier.
+  size_t disk_bytes = size_t{4} << 30;
+};
+
+class ResultCache {
+ public:
+  using Key = Sha256Digest;
+  using Value = std::shared_ptr<const std::string>;
+  using Compute = std::function<grpc::Status(std::string* out)>;
+
+  struct Stats {
+    uint64_t memory_hits = 0;
+    uint64_t disk_hits = 0;
+    uint64_t misses = 0;
+    uint64_t coalesced = 0;  // Misses that waited on another caller.
+    size_t memory_bytes = 0;
+    size_t disk_bytes = 0;
+  };
+
+  // Indexes files already in options.disk_dir, so the disk tier survives
+  // restarts.
+  explicit ResultCache(const ResultCacheOptions& options);
+
+  // Sets *value to the cached bytes for `key`, or runs `compute` to produce
+  // them. Only OK results are stored. *computed tells the caller whether
+  // its own `compute` ran (and so already filled its response).
+  grpc::Status GetOrCompute(const Key& key, const Compute& compute,
+                            Value* value, bool* computed);
+
+  Stats stats() const;
+
+ private:
+  using Result = std::pair<grpc::Status, Value>;
+
+  template <typename V>
+  using KeyMap = std::unordered_map<Key, V, Sha256DigestHash>;
+
+  Value LookupMemory(const Key& key);
+  void InsertMemory(const Key& key, Value value);
+  Value ReadDisk(const Key& key);
+  void WriteDisk(const Key& key, const std::string& bytes);
+  std::string DiskPath(const Key& key) const;
+
+  const ResultCacheOptions options_;
+  mutable std::mutex mu_;
+  // Memory tier, most recent first.
+  std::list<std::pair<Key, Value>> lru_;
+  KeyMap<std::list<std::pair<Key, Value>>::iterator> index_;
+  // Disk tier bookkeeping (file sizes), most recent first.
+  std::list<std::pair<Key, size_t>> disk_lru_;
+  KeyMap<std::list<std::pair<Key, size_t>>::iterator> disk_index_;
+  KeyMap<std::shared_future<Result>> pending_;
+  Stats stats_;
+};
+
+// Cache key for `req` arriving on `method`. Inputs named by Image.path are
+// keyed by their file's identity too, so replacing a file misses.
+ResultCache::Key HashRequest(const char* method,
+                             const google::protobuf::Message& req);
+
+}  // namespace vision
+}  // namespace lucidia
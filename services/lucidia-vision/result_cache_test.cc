@@ -0,0 +1,197 @@
+#include "services/lucidia-vision/result_cache.h"
+
+#include <unistd.h>
+
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <string>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+namespace lucidia {
+namespace vision {
+namespace {
+
+namespace fs = std::filesystem;
+
+ResultCache::Key KeyOf(const std::string& name) {
+  Sha256 h;
+  h.Update(name.data(), name.size());
+  return h.Digest();
+}
+
+// Looks `key` up, computing `bytes` on a miss; returns the cached bytes and
+// whether this call computed them.
+std::pair<std::string, bool> Get(ResultCache* cache,
+                                 const ResultCache::Key& key,
+                                 const std::string& bytes) {
+  ResultCache::Value value;
+  bool computed = false;
+  EXPECT_TRUE(cache
+                  ->GetOrCompute(
+                      key,
+                      [&](std::string* out) {
+                        *out = bytes;
+                        return grpc::Status::OK;
+                      },
+                      &value, &computed)
+                  .ok());
+  return {value ? *value : std::string(), computed};
+}
+
+TEST(ResultCacheTest, CoalescesConcurrentMisses) {
+  ResultCache cache(ResultCacheOptions{});
+  const ResultCache::Key key = KeyOf("a");
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  std::atomic<int> computes{0};
+  auto call = [&] {
+    ResultCache::Value value;
+    bool computed = false;
+    grpc::Status s = cache.GetOrCompute(
+        key,
+        [&](std::string* out) {
+          ++computes;
+          released.wait();
+          *out = "result";
+          return grpc::Status::OK;
+        },
+        &value, &computed);
+    EXPECT_TRUE(s.ok());
+    EXPECT_EQ(*value, "result");
+  };
+  std::thread first(call);
+  std::thread second(call);
+  // Whichever call got in second waits on the first's compute.
+  while (cache.stats().coalesced == 0) std::this_thread::yield();
+  release.set_value();
+  first.join();
+  second.join();
+  EXPECT_EQ(computes.load(), 1);
+  EXPECT_EQ(cache.stats().misses, 1u);
+  EXPECT_EQ(cache.stats().coalesced, 1u);
+}
+
+TEST(ResultCacheTest, EvictsLeastRecentlyUsed) {
+  ResultCacheOptions options;
+  options.memory_bytes = 250;
+  ResultCache cache(options);
+  const std::string bytes(100, 'x');
+  Get(&cache, KeyOf("a"), bytes);
+  Get(&cache, KeyOf("b"), bytes);
+  EXPECT_FALSE(Get(&cache, KeyOf("a"), bytes).second);  // Now most recent.
+  Get(&cache, KeyOf("c"), bytes);  // Over budget: "b" goes.
+  EXPECT_EQ(cache.stats().memory_bytes, 200u);
+  EXPECT_FALSE(Get(&cache, KeyOf("a"), bytes).second);
+  EXPECT_FALSE(Get(&cache, KeyOf("c"), bytes).second);
+  EXPECT_TRUE(Get(&cache, KeyOf("b"), bytes).second);
+}
+
+TEST(ResultCacheTest, KeysDifferingInOneByteAreDistinct) {
+  ResultCache cache(ResultCacheOptions{});
+  ResultCache::Key a = KeyOf("a");
+  ResultCache::Key b = a;
+  b[31] ^= 1;  // Same bucket hash: it reads only the first bytes.
+  Get(&cache, a, "first");
+  EXPECT_EQ(Get(&cache, b, "second"), std::make_pair(std::string("second"),
+                                                     true));
+  EXPECT_EQ(Get(&cache, a, "").first, "first");
+}
+
+class ResultCacheDiskTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    options_.disk_dir = (fs::temp_directory_path() /
+                         ("lucidia-result-cache-" + std::to_string(::getpid())))
+                            .string();
+    fs::remove_all(options_.disk_dir);
+  }
+  void TearDown() override { fs::remove_all(options_.disk_dir); }
+
+  // The single entry file in the disk tier.
+  fs::path EntryFile() const {
+    fs::path found;
+    for (const auto& entry : fs::directory_iterator(options_.disk_dir)) {
+      EXPECT_TRUE(found.empty()) << "more than one entry";
+      found = entry.path();
+    }
+    return found;
+  }
+
+  ResultCacheOptions options_;
+};
+
+TEST_F(ResultCacheDiskTest, ServesEntriesAcrossRestarts) {
+  const ResultCache::Key key = KeyOf("a");
+  {
+    ResultCache cache(options_);
+    EXPECT_TRUE(Get(&cache, key, "stored").second);
+  }
+  ResultCache cache(options_);
+  EXPECT_EQ(Get(&cache, key, "recomputed"),
+            std::make_pair(std::string("stored"), false));
+  EXPECT_EQ(cache.stats().disk_hits, 1u);
+}
+
+TEST_F(ResultCacheDiskTest, RejectsTruncatedEntry) {
+  const ResultCache::Key key = KeyOf("a");
+  {
+    ResultCache cache(options_);
+    Get(&cache, key, std::string(1000, 'x'));
+  }
+  const fs::path file = EntryFile();
+  fs::resize_file(file, fs::file_size(file) - 10);
+  ResultCache cache(options_);
+  EXPECT_EQ(Get(&cache, key, "recomputed"),
+            std::make_pair(std::string("recomputed"), true));
+  // The good result replaced the damaged file.
+  ResultCache reopened(options_);
+  EXPECT_EQ(Get(&reopened, key, "again").first, "recomputed");
+}
+
+TEST_F(ResultCacheDiskTest, RejectsCorruptedPayload) {
+  const ResultCache::Key key = KeyOf("a");
+  {
+    ResultCache cache(options_);
+    Get(&cache, key, std::string(1000, 'x'));
+  }
+  {
+    std::fstream f(EntryFile(), std::ios::in | std::ios::out |
+                                    std::ios::binary);
+    f.seekp(500);
+    f.put('y');
+  }
+  ResultCache cache(options_);
+  EXPECT_TRUE(Get(&cache, key, "recomputed").second);
+}
+
+TEST_F(ResultCacheDiskTest, RejectsEntryUnderAnotherKey) {
+  const ResultCache::Key a = KeyOf("a");
+  const ResultCache::Key b = KeyOf("b");
+  {
+    ResultCache cache(options_);
+    Get(&cache, a, "for a");
+  }
+  // Move a's file to where b's entry would live.
+  const fs::path file = EntryFile();
+  {
+    ResultCache cache(options_);
+    Get(&cache, b, "for b");
+  }
+  fs::path b_file;
+  for (const auto& entry : fs::directory_iterator(options_.disk_dir)) {
+    if (entry.path() != file) b_file = entry.path();
+  }
+  ASSERT_FALSE(b_file.empty());
+  fs::rename(file, b_file);
+  ResultCache cache(options_);
+  EXPECT_EQ(Get(&cache, b, "recomputed"),
+            std::make_pair(std::string("recomputed"), true));
+}
+
+}  // namespace
+}  // namespace vision
+}  // namespace lucidia
@@ -1,79 +1,225 @@
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+
 #include <grpcpp/grpcpp.h>
+#include <grpcpp/resource_quota.h>
 #include "proto/vision_service.grpc.pb.h"
+#include "services/lucidia-vision/admission.h"
+#include "services/lucidia-vision/async_server.h"
+#include "services/lucidia-vision/buffer_pool.h"
+#include "services/lucidia-vision/dataset_registry.h"
+#include "services/lucidia-vision/image_io.h"
+#include "services/lucidia-vision/metrics.h"
+#include "services/lucidia-vision/metrics_server.h"
+#include "services/lucidia-vision/result_cache.h"
+#include "services/lucidia-vision/thread_pool.h"
+#include "services/lucidia-vision/vision_service_impl.h"
 
-using lucidia::vision::v1::VisionService;
-using lucidia::vision::v1::*;  // import request/response messages
-
-class VisionServiceImpl final : public VisionService::Service {
- public:
-  grpc::Status ReprojectImage(grpc::ServerContext*,
-                              const ReprojectImageRequest* req,
-                              ReprojectImageResponse* res) override {
-    // TODO: invoke VW reprojection, enforce quotas.
-    (void)req; (void)res;
-    return grpc::Status::OK;
-  }
+using lucidia::vision::AdmissionController;
+using lucidia::vision::AsyncVisionServer;
+using lucidia::vision::BufferPool;
+using lucidia::vision::DatasetRegistry;
+using lucidia::vision::DatasetRegistryOptions;
+using lucidia::vision::HybridVisionService;
+using lucidia::vision::Metrics;
+using lucidia::vision::MetricsHttpServer;
+using lucidia::vision::ResultCache;
+using lucidia::vision::ResultCacheOptions;
+using lucidia::vision::ThreadPool;
+using lucidia::vision::VisionServiceImpl;
 
-  grpc::Status TilePyramid(grpc::ServerContext*,
-                           const TilePyramidRequest* req,
-                           TilePyramidResponse* res) override {
-    // TODO: VW quadtree tiling.
-    (void)req; (void)res;
-    return grpc::Status::OK;
-  }
+namespace {
 
-  grpc::Status Mosaic(grpc::ServerContext*,
-                      const MosaicRequest* req,
-                      MosaicResponse* res) override {
-    // TODO: VW mosaic.
-    (void)req; (void)res;
-    return grpc::Status::OK;
-  }
+struct Flags {
+  std::string address = "0.0.0.0:50051";
+  bool async = false;
+  int workers = 0;          // 0: one per core.
+  int max_queue = 0;        // 0: 4 per worker.
+  int cq_threads = 2;
+  int sync_threads = 0;     // 0: 4 per worker.
+  int max_in_flight = 0;    // Default per-method limit; 0: unlimited.
+  std::vector<std::pair<std::string, int>> limits;  // --limit=Method:N
+  int cache_mb = 256;       // Memory tier of the result cache; 0 disables it.
+  std::string cache_dir;    // Disk tier directory; empty: memory only.
+  int cache_disk_mb = 4096;
+  int buffer_pool_mb = 256;  // Idle pixel buffers kept for reuse.
+  std::string data_dir;     // Root for Image.path; empty: paths rejected.
+  std::string dataset_dir;  // Registered datasets; empty: none.
+  int dataset_mb = 65536;   // Disk budget for registered datasets.
+  int max_upload_mb = 4096;  // Per upload call, all inputs together.
+  int max_uploads = 0;      // Upload calls in flight, each; 0: workers / 2.
+  std::string metrics_address = "127.0.0.1:9464";  // Empty disables /metrics.
+};
+
+bool ParseFlag(const std::string& arg, const char* name, std::string* value) {
+  const std::string prefix = std::string("--") + name + "=";
+  if (arg.compare(0, prefix.size(), prefix) != 0) return false;
+  *value = arg.substr(prefix.size());
+  return true;
+}
 
-  grpc::Status Hillshade(grpc::ServerContext*,
-                         const HillshadeRequest* req,
-                         HillshadeResponse* res) override {
-    // TODO: VW hillshade.
-    (void)req; (void)res;
-    return grpc::Status::OK;
+Flags ParseFlags(int argc, char** argv) {
+  Flags f;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    std::string v;
+    if (arg == "--async") {
+      f.async = true;
+    } else if (ParseFlag(arg, "address", &v)) {
+      f.address = v;
+    } else if (ParseFlag(arg, "workers", &v)) {
+      f.workers = std::atoi(v.c_str());
+    } else if (ParseFlag(arg, "max_queue", &v)) {
+      f.max_queue = std::atoi(v.c_str());
+    } else if (ParseFlag(arg, "cq_threads", &v)) {
+      f.cq_threads = std::atoi(v.c_str());
+    } else if (ParseFlag(arg, "sync_threads", &v)) {
+      f.sync_threads = std::atoi(v.c_str());
+    } else if (ParseFlag(arg, "max_in_flight", &v)) {
+      f.max_in_flight = std::atoi(v.c_str());
+    } else if (ParseFlag(arg, "cache_mb", &v)) {
+      f.cache_mb = std::atoi(v.c_str());
+    } else if (ParseFlag(arg, "cache_dir", &v)) {
+      f.cache_dir = v;
+    } else if (ParseFlag(arg, "cache_disk_mb", &v)) {
+      f.cache_disk_mb = std::atoi(v.c_str());
+    } else if (ParseFlag(arg, "buffer_pool_mb", &v)) {
+      f.buffer_pool_mb = std::max(0, std::atoi(v.c_str()));
+    } else if (ParseFlag(arg, "data_dir", &v)) {
+      f.data_dir = v;
+    } else if (ParseFlag(arg, "dataset_dir", &v)) {
+      f.dataset_dir = v;
+    } else if (ParseFlag(arg, "dataset_mb", &v)) {
+      f.dataset_mb = std::max(0, std::atoi(v.c_str()));
+    } else if (ParseFlag(arg, "max_upload_mb", &v)) {
+      f.max_upload_mb = std::max(1, std::atoi(v.c_str()));
+    } else if (ParseFlag(arg, "max_uploads", &v)) {
+      f.max_uploads = std::atoi(v.c_str());
+    } else if (ParseFlag(arg, "metrics_address", &v)) {
+      f.metrics_address = v;
+    } else if (ParseFlag(arg, "limit", &v) &&
+               v.find(':') != std::string::npos) {
+      f.limits.emplace_back(v.substr(0, v.find(':')),
+                            std::atoi(v.substr(v.find(':') + 1).c_str()));
+    } else {
+      std::cerr << "ignoring unknown flag " << arg << std::endl;
+    }
+  }
+  if (f.workers <= 0) {
+    f.workers = std::max(1u, std::thread::hardware_concurrency());
   }
+  if (f.max_queue <= 0) f.max_queue = 4 * f.workers;
+  if (f.sync_threads <= 0) f.sync_threads = 4 * f.workers;
+  if (f.max_uploads <= 0) f.max_uploads = std::max(1, f.workers / 2);
+  return f;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const Flags flags = ParseFlags(argc, argv);
 
-  grpc::Status OrthorectifyDEM(grpc::ServerContext*,
-                               const OrthorectifyDEMRequest* req,
-                               OrthorectifyDEMResponse* res) override {
-    // TODO: VW orthorectification.
-    (void)req; (void)res;
-    return grpc::Status::OK;
+  ThreadPool pool(flags.workers, flags.max_queue);
+  lucidia::vision::SetDefaultPool(&pool);
+  lucidia::vision::SetImageRoot(flags.data_dir);
+  BufferPool::Shared().set_max_cached_bytes(
+      static_cast<size_t>(flags.buffer_pool_mb) << 20);
+
+  AdmissionController admission;
+  for (int i = 0; i < lucidia::vision::kNumVisionMethods; ++i) {
+    admission.SetLimit(lucidia::vision::kVisionMethods[i], flags.max_in_flight);
+  }
+  // Each upload holds a handler thread, a pump thread and up to
+  // --max_upload_mb of memory, and its kernels share the pool once the
+  // bytes are in; a default limit keeps slow clients from piling up.
+  for (const char* method :
+       {"UploadReprojectImage", "UploadHillshade", "UploadOrthorectifyDEM"}) {
+    admission.SetLimit(method, flags.max_uploads);
+  }
+  for (const auto& limit : flags.limits) {
+    admission.SetLimit(limit.first, limit.second);
   }
 
-  grpc::Status Resample(grpc::ServerContext*,
-                        const ResampleRequest* req,
-                        ResampleResponse* res) override {
-    // TODO: VW resample.
-    (void)req; (void)res;
-    return grpc::Status::OK;
+  // Caps the threads the sync handlers may occupy; past that gRPC itself
+  // answers RESOURCE_EXHAUSTED.
+  grpc::ResourceQuota quota("lucidia-vision");
+  quota.SetMaxThreads(flags.sync_threads);
+
+  grpc::ServerBuilder builder;
+  builder.AddListeningPort(flags.address, grpc::InsecureServerCredentials());
+  builder.SetResourceQuota(quota);
+
+  std::unique_ptr<ResultCache> cache;
+  if (flags.cache_mb > 0) {
+    ResultCacheOptions options;
+    options.memory_bytes = static_cast<size_t>(flags.cache_mb) << 20;
+    options.disk_dir = flags.cache_dir;
+    options.disk_bytes = static_cast<size_t>(flags.cache_disk_mb) << 20;
+    cache = std::make_unique<ResultCache>(options);
   }
 
-  grpc::Status ColorMap(grpc::ServerContext*,
-                        const ColorMapRequest* req,
-                        ColorMapResponse* res) override {
-    // TODO: VW color mapping.
-    (void)req; (void)res;
-    return grpc::Status::OK;
+  std::unique_ptr<DatasetRegistry> datasets;
+  if (!flags.dataset_dir.empty()) {
+    DatasetRegistryOptions options;
+    options.dir = flags.dataset_dir;
+    options.max_bytes = static_cast<size_t>(flags.dataset_mb) << 20;
+    datasets = std::make_unique<DatasetRegistry>(options);
   }
-};
+  lucidia::vision::SetDatasetRegistry(datasets.get());
 
-int main(int argc, char** argv) {
-  (void)argc; (void)argv;
-  std::string server_address("0.0.0.0:50051");
-  VisionServiceImpl service;
+  Metrics metrics(lucidia::vision::kVisionMethods,
+                  lucidia::vision::kNumVisionMethods);
+  metrics.WatchAdmission(&admission);
+  metrics.WatchPool(&pool);
+  metrics.WatchCache(cache.get());
+  metrics.WatchBuffers(&BufferPool::Shared());
+  metrics.WatchDatasets(datasets.get());
+  MetricsHttpServer metrics_server(&metrics);
+  if (!flags.metrics_address.empty()) {
+    grpc::Status s = metrics_server.Start(flags.metrics_address);
+    if (!s.ok()) {
+      std::cerr << s.error_message() << std::endl;
+      return 1;
+    }
+  }
 
-  grpc::ServerBuilder builder;
-  builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
-  builder.RegisterService(&service);
+  VisionServiceImpl service(&admission);
+  HybridVisionService hybrid;
+  VisionServiceImpl handlers;  // Runs calls the async server already admitted.
+  handlers.set_item_admission(&admission);
+  service.set_cache(cache.get());
+  handlers.set_cache(cache.get());
+  service.set_metrics(&metrics);
+  hybrid.set_metrics(&metrics);
+  handlers.set_metrics(&metrics);
+  service.set_datasets(datasets.get());
+  handlers.set_datasets(datasets.get());
+  // Uploads keep their synchronous handlers in both modes.
+  const uint64_t max_upload_bytes =
+      static_cast<uint64_t>(flags.max_upload_mb) << 20;
+  service.set_max_upload_bytes(max_upload_bytes);
+  hybrid.set_max_upload_bytes(max_upload_bytes);
+  AsyncVisionServer async_server(&hybrid, &handlers, &pool, &admission);
+  if (flags.async) {
+    hybrid.set_admission(&admission);
+    builder.RegisterService(&hybrid);
+    async_server.AddCompletionQueues(&builder, flags.cq_threads);
+  } else {
+    builder.RegisterService(&service);
+  }
 
   std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
-  std::cout << "VisionService listening on " << server_address << std::endl;
+  if (flags.async) async_server.Start();
+  std::cout << "VisionService listening on " << flags.address
+            << (flags.async ? " (async, " : " (sync, ") << flags.workers
+            << " workers)" << std::endl;
+  if (!flags.metrics_address.empty()) {
+    std::cout << "Metrics on http://" << flags.metrics_address << "/metrics"
+              << std::endl;
+  }
   server->Wait();
   return 0;
 }
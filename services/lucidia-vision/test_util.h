@@ -0,0 +1,68 @@
+// Helpers shared by the lucidia-vision unit tests (*_test.cc).
+//
+// Each test file builds against GoogleTest (gtest_main) and the rest of
+// lucidia-vision, without server.cc, vision_bench.cc or vision_loadgen.cc,
+// e.g.
+//   png_codec_test --gtest_brief=1
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "services/lucidia-vision/raster.h"
+
+namespace lucidia {
+namespace vision {
+namespace testing {
+
+// In-memory raster whose sample at (x, y) in band b is fn(x, y, b),
+// converted (rounded and saturated) to `type`.
+inline std::shared_ptr<TiledRaster> MakeRaster(
+    int width, int height, int bands, PixelType type,
+    const std::function<float(int x, int y, int b)>& fn,
+    int tile_size = kDefaultTileSize) {
+  RasterInfo info;
+  info.width = width;
+  info.height = height;
+  info.bands = bands;
+  info.type = type;
+  info.tile_size = tile_size;
+  auto raster = std::make_shared<TiledRaster>(info);
+  std::vector<float> row;
+  for (TileIndex t : TileRange(info)) {
+    Tile& tile = raster->MutableTile(t.tx, t.ty);
+    const Rect& r = tile.rect();
+    row.resize(static_cast<size_t>(r.width) * bands);
+    for (int y = 0; y < r.height; ++y) {
+      for (int x = 0; x < r.width; ++x) {
+        for (int b = 0; b < bands; ++b) {
+          row[static_cast<size_t>(x) * bands + b] = fn(r.x + x, r.y + y, b);
+        }
+      }
+      ConvertSamples(row.data(), PixelType::kF32, tile.row(y), type,
+                     row.size());
+    }
+  }
+  return raster;
+}
+
+// Every sample of `source` as T (u8, u16 or f32), bands interleaved and
+// rows packed. Empty if the read fails.
+template <typename T>
+std::vector<T> ReadAll(RasterSource& source, PixelType type) {
+  const RasterInfo& info = source.info();
+  std::vector<T> out(static_cast<size_t>(info.width) * info.height *
+                     info.bands);
+  const grpc::Status s =
+      source.ReadWindow(info.bounds(), type, out.data(),
+                        static_cast<size_t>(info.width) * info.bands *
+                            sizeof(T));
+  if (!s.ok()) out.clear();
+  return out;
+}
+
+}  // namespace testing
+}  // namespace vision
+}  // namespace lucidia
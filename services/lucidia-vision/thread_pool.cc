@@ -0,0 +1,127 @@
+#include "services/lucidia-vision/thread_pool.h"
+
+#include <algorithm>
+#include <memory>
+#include <utility>
+
+namespace lucidia {
+namespace vision {
+
+ThreadPool::ThreadPool(size_t threads, size_t max_queue)
+    : max_queue_(max_queue) {
+  threads = std::max<size_t>(threads, 1);
+  workers_.reserve(threads);
+  for (size_t i = 0; i < threads; ++i) {
+    workers_.emplace_back([this] { WorkerLoop(); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  for (auto& t : workers_) t.join();
+}
+
+bool ThreadPool::TrySubmit(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (max_queue_ != 0 && queue_.size() >= max_queue_) return false;
+    queue_.push_back(std::move(task));
+  }
+  cv_.notify_one();
+  return true;
+}
+
+void ThreadPool::SubmitUrgent(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    urgent_.push_back(std::move(task));
+  }
+  cv_.notify_one();
+}
+
+size_t ThreadPool::queue_depth() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return queue_.size() + urgent_.size();
+}
+
+void ThreadPool::WorkerLoop() {
+  for (;;) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      cv_.wait(lock, [&] {
+        return stopping_ || !urgent_.empty() || !queue_.empty();
+      });
+      if (!urgent_.empty()) {
+        task = std::move(urgent_.front());
+        urgent_.pop_front();
+      } else if (!queue_.empty()) {
+        task = std::move(queue_.front());
+        queue_.pop_front();
+      } else {
+        return;  // Stopping and drained.
+      }
+    }
+    task();
+  }
+}
+
+namespace {
+std::atomic<ThreadPool*> g_default_pool{nullptr};
+// Innermost SerialWhile predicate of this thread, if any.
+thread_local const std::function<bool()>* t_serial = nullptr;
+}  // namespace
+
+ThreadPool* DefaultPool() { return g_default_pool.load(); }
+
+void SetDefaultPool(ThreadPool* pool) { g_default_pool.store(pool); }
+
+void ParallelFor(int n, const std::function<void(int)>& fn) {
+  ThreadPool* pool = DefaultPool();
+  if (pool == nullptr || n <= 1 || (t_serial != nullptr && (*t_serial)())) {
+    for (int i = 0; i < n; ++i) fn(i);
+    return;
+  }
+  struct State {
+    std::atomic<int> next{0};
+    std::atomic<int> done{0};
+    std::mutex mu;
+    std::condition_variable cv;
+  };
+  auto state = std::make_shared<State>();
+  // Helpers hold `state` and only claim indices, so a helper that starts
+  // after the caller finished everything exits without touching `fn`.
+  auto work = [state, &fn, n] {
+    for (int i; (i = state->next.fetch_add(1)) < n;) {
+      fn(i);
+      if (state->done.fetch_add(1) + 1 == n) {
+        std::lock_guard<std::mutex> lock(state->mu);
+        state->cv.notify_all();
+      }
+    }
+  };
+  const int helpers =
+      std::min<int>(n - 1, static_cast<int>(pool->threads()));
+  for (int h = 0; h < helpers; ++h) {
+    pool->SubmitUrgent([state, work, n] {
+      if (state->next.load() < n) work();
+    });
+  }
+  work();
+  std::unique_lock<std::mutex> lock(state->mu);
+  state->cv.wait(lock, [&] { return state->done.load() == n; });
+}
+
+SerialWhile::SerialWhile(std::function<bool()> serial)
+    : serial_(std::move(serial)), outer_(t_serial) {
+  t_serial = &serial_;
+}
+
+SerialWhile::~SerialWhile() { t_serial = outer_; }
+
+}  // namespace vision
+}  // namespace lucidia
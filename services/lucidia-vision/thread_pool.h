@@ -0,0 +1,70 @@
+// Bounded worker pool shared by request handling and tile kernels.
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace lucidia {
+namespace vision {
+
+class ThreadPool {
+ public:
+  // `max_queue` bounds tasks submitted through TrySubmit that are waiting for
+  // a worker; 0 means unbounded.
+  ThreadPool(size_t threads, size_t max_queue);
+  ~ThreadPool();
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // Queues `task` unless the queue is full; never blocks.
+  bool TrySubmit(std::function<void()> task);
+  // Queues `task` ahead of waiting requests, ignoring the bound. Used for
+  // helpers of work that is already admitted so it can always finish.
+  void SubmitUrgent(std::function<void()> task);
+
+  size_t threads() const { return workers_.size(); }
+  size_t queue_depth() const;
+
+ private:
+  void WorkerLoop();
+
+  const size_t max_queue_;
+  mutable std::mutex mu_;
+  std::condition_variable cv_;
+  std::deque<std::function<void()>> urgent_;
+  std::deque<std::function<void()>> queue_;
+  bool stopping_ = false;
+  std::vector<std::thread> workers_;
+};
+
+// Process-wide pool used by kernels; null (the default) runs them inline.
+ThreadPool* DefaultPool();
+void SetDefaultPool(ThreadPool* pool);
+
+// Runs fn(0..n-1) across the default pool. The caller works too and returns
+// once every index is done, so it is safe to call from a pool worker.
+void ParallelFor(int n, const std::function<void(int)>& fn);
+
+// While alive, ParallelFor calls made on the constructing thread run inline
+// whenever `serial()` is true. Upload handlers hold one until their bytes
+// have all arrived, so no pool worker waits on the network for them.
+class SerialWhile {
+ public:
+  explicit SerialWhile(std::function<bool()> serial);
+  ~SerialWhile();
+  SerialWhile(const SerialWhile&) = delete;
+  SerialWhile& operator=(const SerialWhile&) = delete;
+
+ private:
+  std::function<bool()> serial_;
+  const std::function<bool()>* outer_;
+};
+
+}  // namespace vision
+}  // namespace lucidia
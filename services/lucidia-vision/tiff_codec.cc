@@ -0,0 +1,1278 @@
+#include "services/lucidia-vision/tiff_codec.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <future>
+#include <list>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <zlib.h>
+#if __has_include(<zstd.h>)
+#include <zstd.h>
+#define LUCIDIA_VISION_HAVE_ZSTD 1
+#endif
+
+#include "services/lucidia-vision/thread_pool.h"
+
+namespace lucidia {
+namespace vision {
+
+namespace {
+
+grpc::Status TiffError(const std::string& what) {
+  return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "tiff: " + what);
+}
+
+grpc::Status TiffUnsupported(const std::string& what) {
+  return grpc::Status(grpc::StatusCode::UNIMPLEMENTED, "tiff: " + what);
+}
+
+// Decoded blocks kept per file, shared by every level.
+constexpr size_t kBlockCacheBytes = size_t{64} << 20;
+// Sanity bounds on what an IFD may declare.
+constexpr int kMaxSide = 1 << 20;
+// Largest decoded block, and the most stored bytes a block of `n` decoded
+// bytes may declare: LZW, the worst of our codecs, grows data by 3/2.
+constexpr uint64_t kMaxBlockBytes = uint64_t{1} << 30;
+constexpr uint64_t MaxStoredBytes(uint64_t n) { return 2 * n + 4096; }
+constexpr int kMaxBands = 64;
+
+enum Tag : uint16_t {
+  kNewSubfileType = 254,
+  kImageWidth = 256,
+  kImageLength = 257,
+  kBitsPerSample = 258,
+  kCompression = 259,
+  kStripOffsets = 273,
+  kSamplesPerPixel = 277,
+  kRowsPerStrip = 278,
+  kStripByteCounts = 279,
+  kPlanarConfig = 284,
+  kPredictor = 317,
+  kTileWidth = 322,
+  kTileLength = 323,
+  kTileOffsets = 324,
+  kTileByteCounts = 325,
+  kSampleFormat = 339,
+  kModelPixelScale = 33550,
+  kModelTiepoint = 33922,
+  kGeoKeyDirectory = 34735,
+};
+
+enum Compression : uint32_t {
+  kNone = 1,
+  kLzw = 5,
+  kDeflate = 8,
+  kPackBits = 32773,
+  kAdobeDeflate = 32946,
+  kZstd = 50000,
+};
+
+enum SampleFormat : uint32_t { kUint = 1, kInt = 2, kFloat = 3 };
+
+size_t TypeSize(uint16_t type) {
+  switch (type) {
+    case 1: case 2: case 6: case 7: return 1;   // BYTE ASCII SBYTE UNDEFINED
+    case 3: case 8: return 2;                   // SHORT SSHORT
+    case 4: case 9: case 11: case 13: return 4; // LONG SLONG FLOAT IFD
+    case 5: case 10: case 12: return 8;         // RATIONAL SRATIONAL DOUBLE
+    case 16: case 17: case 18: return 8;        // LONG8 SLONG8 IFD8
+    default: return 0;
+  }
+}
+
+// Reverses each `width`-byte element of `p` in place.
+void SwapElements(uint8_t* p, size_t count, int width) {
+  for (size_t i = 0; i < count; ++i, p += width) std::reverse(p, p + width);
+}
+
+// Decompressors -------------------------------------------------------------
+
+grpc::Status Inflate(const uint8_t* src, size_t n, uint8_t* dst, size_t out) {
+  z_stream z{};
+  if (inflateInit(&z) != Z_OK) return TiffError("zlib init failed");
+  z.next_in = const_cast<Bytef*>(src);
+  z.avail_in = static_cast<uInt>(n);
+  z.next_out = dst;
+  z.avail_out = static_cast<uInt>(out);
+  const int rc = inflate(&z, Z_FINISH);
+  const size_t produced = out - z.avail_out;
+  inflateEnd(&z);
+  // Some writers pad the stream; a full output buffer is what matters.
+  if (produced != out || (rc != Z_STREAM_END && rc != Z_BUF_ERROR &&
+                          rc != Z_OK)) {
+    return TiffError("corrupt deflate block");
+  }
+  return grpc::Status::OK;
+}
+
+// TIFF 6.0 LZW: MSB-first codes of 9-12 bits with "early change".
+grpc::Status LzwDecode(const uint8_t* src, size_t n, uint8_t* dst, size_t out) {
+  constexpr int kClear = 256, kEoi = 257, kMaxCodes = 4096;
+  if (n >= 2 && src[0] == 0 && (src[1] & 1)) {
+    return TiffUnsupported("pre-6.0 LZW");
+  }
+  std::vector<uint16_t> prefix(kMaxCodes);
+  std::vector<uint16_t> length(kMaxCodes);
+  std::vector<uint8_t> suffix(kMaxCodes), first(kMaxCodes);
+  for (int i = 0; i < 256; ++i) {
+    suffix[i] = first[i] = static_cast<uint8_t>(i);
+    length[i] = 1;
+  }
+  int next = 258, width = 9, prev = -1;
+  uint64_t bits = 0;
+  int nbits = 0;
+  size_t in = 0, pos = 0;
+
+  // Writes the string for `code` and returns its first byte.
+  auto emit = [&](int code) -> bool {
+    const size_t len = length[code];
+    if (pos + len > out) return false;
+    for (size_t i = len; i-- > 0;) {
+      dst[pos + i] = suffix[code];
+      code = prefix[code];
+    }
+    pos += len;
+    return true;
+  };
+  auto add = [&](int p, uint8_t c) {
+    if (next >= kMaxCodes) return;
+    prefix[next] = static_cast<uint16_t>(p);
+    suffix[next] = c;
+    first[next] = first[p];
+    length[next] = static_cast<uint16_t>(length[p] + 1);
+    ++next;
+    if (next + 1 == (1 << width) && width < 12) ++width;
+  };
+
+  while (pos < out) {
+    while (nbits < width && in < n) {
+      bits = (bits << 8) | src[in++];
+      nbits += 8;
+    }
+    if (nbits < width) break;
+    const int code = static_cast<int>((bits >> (nbits - width)) &
+                                      ((1u << width) - 1));
+    nbits -= width;
+    if (code == kEoi) break;
+    if (code == kClear) {
+      next = 258;
+      width = 9;
+      prev = -1;
+      continue;
+    }
+    if (prev < 0) {
+      if (code > 255 || !emit(code)) return TiffError("corrupt LZW block");
+    } else if (code < next) {
+      if (!emit(code)) return TiffError("corrupt LZW block");
+      add(prev, first[code]);
+    } else if (code == next) {
+      add(prev, first[prev]);
+      if (!emit(code)) return TiffError("corrupt LZW block");
+    } else {
+      return TiffError("corrupt LZW block");
+    }
+    prev = code;
+  }
+  if (pos != out) return TiffError("truncated LZW block");
+  return grpc::Status::OK;
+}
+
+grpc::Status PackBitsDecode(const uint8_t* src, size_t n, uint8_t* dst,
+                            size_t out) {
+  size_t in = 0, pos = 0;
+  while (pos < out && in < n) {
+    const int8_t h = static_cast<int8_t>(src[in++]);
+    if (h >= 0) {
+      const size_t len = h + 1;
+      if (in + len > n || pos + len > out) break;
+      std::memcpy(dst + pos, src + in, len);
+      in += len;
+      pos += len;
+    } else if (h != -128) {
+      const size_t len = 1 - h;
+      if (in >= n || pos + len > out) break;
+      std::memset(dst + pos, src[in++], len);
+      pos += len;
+    }
+  }
+  if (pos != out) return TiffError("corrupt PackBits block");
+  return grpc::Status::OK;
+}
+
+grpc::Status ZstdDecode(const uint8_t* src, size_t n, uint8_t* dst,
+                        size_t out) {
+#ifdef LUCIDIA_VISION_HAVE_ZSTD
+  const size_t got = ZSTD_decompress(dst, out, src, n);
+  if (ZSTD_isError(got) || got != out) return TiffError("corrupt ZSTD block");
+  return grpc::Status::OK;
+#else
+  (void)src; (void)n; (void)dst; (void)out;
+  return TiffUnsupported("built without ZSTD support");
+#endif
+}
+
+// Predictors ----------------------------------------------------------------
+
+template <typename T>
+void UndoHorizontal(uint8_t* row, int width, int spp) {
+  T* p = reinterpret_cast<T*>(row);
+  for (int i = spp; i < width * spp; ++i) {
+    p[i] = static_cast<T>(p[i] + p[i - spp]);
+  }
+}
+
+// Predictor 3: bytes of each row were split into planes (most significant
+// first) and byte-differenced. Undoing it yields host-order samples.
+void UndoFloatingPoint(uint8_t* row, int width, int spp, int bytes,
+                       std::vector<uint8_t>* scratch) {
+  const size_t n = static_cast<size_t>(width) * spp * bytes;
+  for (size_t i = spp; i < n; ++i) {
+    row[i] = static_cast<uint8_t>(row[i] + row[i - spp]);
+  }
+  scratch->assign(row, row + n);
+  const size_t count = static_cast<size_t>(width) * spp;
+  const bool little = [] {
+    const uint16_t probe = 1;
+    return *reinterpret_cast<const uint8_t*>(&probe) == 1;
+  }();
+  for (size_t c = 0; c < count; ++c) {
+    for (int b = 0; b < bytes; ++b) {
+      const int plane = little ? bytes - 1 - b : b;
+      row[c * bytes + b] = (*scratch)[plane * count + c];
+    }
+  }
+}
+
+// Widens a decoded sample run to f32.
+template <typename T>
+void WidenRun(const uint8_t* src, float* dst, size_t n) {
+  const T* p = reinterpret_cast<const T*>(src);
+  for (size_t i = 0; i < n; ++i) dst[i] = static_cast<float>(p[i]);
+}
+
+}  // namespace
+
+// File ----------------------------------------------------------------------
+
+struct TiffSource::File {
+  struct Level {
+    int width = 0, height = 0;
+    int block_w = 0, block_h = 0;  // Strips are full-width blocks.
+    int blocks_x = 0, blocks_y = 0;
+    bool tiled = false;
+    int spp = 1;
+    int bits = 8;
+    uint32_t sample_format = kUint;
+    uint32_t compression = kNone;
+    uint32_t predictor = 1;
+    PixelType type = PixelType::kU8;  // Type decoded blocks are kept in.
+    std::vector<uint64_t> offsets, counts;
+
+    size_t block_row_bytes() const {
+      return static_cast<size_t>(block_w) * spp * BytesPerSample(type);
+    }
+  };
+  using BlockPtr = std::shared_ptr<const AlignedBuffer>;
+  using Result = std::pair<grpc::Status, BlockPtr>;
+
+  std::shared_ptr<ByteStream> stream;
+  bool big_endian = false;
+  bool big_tiff = false;
+  std::vector<Level> levels;
+  bool has_georef = false;
+  Georef georef;  // Level 0.
+
+  using Lru = std::list<std::pair<uint64_t, BlockPtr>>;
+  std::mutex mu;
+  Lru lru;
+  std::unordered_map<uint64_t, Lru::iterator> index;
+  std::unordered_map<uint64_t, std::shared_future<Result>> pending;
+  size_t cached_bytes = 0;
+
+  grpc::Status ReadExact(uint64_t offset, void* dst, size_t n) {
+    size_t got = 0;
+    grpc::Status s = stream->ReadAt(offset, dst, n, &got);
+    if (!s.ok()) return s;
+    if (got != n) return TiffError("truncated file");
+    return grpc::Status::OK;
+  }
+
+  uint64_t Get(const uint8_t* p, int width) const {
+    uint64_t v = 0;
+    for (int i = 0; i < width; ++i) {
+      v = big_endian ? (v << 8) | p[i] : v | (uint64_t{p[i]} << (8 * i));
+    }
+    return v;
+  }
+
+  grpc::Status Parse();
+  grpc::Status ParseIfd(uint64_t offset, uint64_t* next);
+  grpc::Status Block(int level, int bx, int by, BlockPtr* out);
+  grpc::Status DecodeBlock(const Level& l, int bx, int by, AlignedBuffer* out);
+};
+
+namespace {
+
+struct Entry {
+  uint16_t tag;
+  uint16_t type;
+  uint64_t count;
+  uint64_t value_or_offset;
+  bool inline_value;
+  uint8_t raw[8];
+};
+
+}  // namespace
+
+grpc::Status TiffSource::File::Parse() {
+  uint8_t head[16];
+  grpc::Status s = ReadExact(0, head, 8);
+  if (!s.ok()) return s;
+  if (!LooksLikeTiff(head, 8)) return TiffError("bad signature");
+  big_endian = head[0] == 'M';
+  big_tiff = Get(head + 2, 2) == 43;
+  uint64_t offset;
+  if (big_tiff) {
+    s = ReadExact(0, head, 16);
+    if (!s.ok()) return s;
+    if (Get(head + 4, 2) != 8) return TiffError("bad BigTIFF header");
+    offset = Get(head + 8, 8);
+  } else {
+    offset = Get(head + 4, 4);
+  }
+  // Bound the chain so a cyclic file cannot loop forever.
+  for (int i = 0; offset != 0 && i < 64; ++i) {
+    s = ParseIfd(offset, &offset);
+    if (!s.ok()) return s;
+  }
+  if (levels.empty()) return TiffError("no image");
+  // Overviews in ascending reduction, whatever order the writer used.
+  std::stable_sort(levels.begin() + 1, levels.end(),
+                   [](const Level& a, const Level& b) {
+                     return a.width > b.width;
+                   });
+  return grpc::Status::OK;
+}
+
+grpc::Status TiffSource::File::ParseIfd(uint64_t offset, uint64_t* next) {
+  const int count_bytes = big_tiff ? 8 : 2;
+  const int entry_bytes = big_tiff ? 20 : 12;
+  const int value_bytes = big_tiff ? 8 : 4;
+  uint8_t buf[8];
+  grpc::Status s = ReadExact(offset, buf, count_bytes);
+  if (!s.ok()) return s;
+  const uint64_t n = Get(buf, count_bytes);
+  if (n > 4096) return TiffError("implausible IFD");
+  std::vector<uint8_t> raw(n * entry_bytes + value_bytes);
+  s = ReadExact(offset + count_bytes, raw.data(), raw.size());
+  if (!s.ok()) return s;
+  *next = Get(raw.data() + n * entry_bytes, value_bytes);
+
+  std::vector<Entry> entries(n);
+  for (uint64_t i = 0; i < n; ++i) {
+    const uint8_t* e = raw.data() + i * entry_bytes;
+    Entry& en = entries[i];
+    en.tag = static_cast<uint16_t>(Get(e, 2));
+    en.type = static_cast<uint16_t>(Get(e + 2, 2));
+    en.count = Get(e + 4, big_tiff ? 8 : 4);
+    const uint8_t* v = e + (big_tiff ? 12 : 8);
+    std::memcpy(en.raw, v, value_bytes);
+    en.value_or_offset = Get(v, value_bytes);
+    en.inline_value =
+        TypeSize(en.type) * en.count <= static_cast<uint64_t>(value_bytes);
+  }
+
+  auto find = [&](uint16_t tag) -> const Entry* {
+    for (const Entry& e : entries) {
+      if (e.tag == tag) return &e;
+    }
+    return nullptr;
+  };
+  // Reads an integer or floating array tag as doubles.
+  auto values = [&](const Entry& e, std::vector<double>* out) -> grpc::Status {
+    const size_t size = TypeSize(e.type);
+    if (size == 0 || e.count > (1u << 26)) return TiffError("bad tag type");
+    std::vector<uint8_t> bytes(size * e.count);
+    if (e.inline_value) {
+      std::memcpy(bytes.data(), e.raw, bytes.size());
+    } else {
+      grpc::Status st =
+          ReadExact(e.value_or_offset, bytes.data(), bytes.size());
+      if (!st.ok()) return st;
+    }
+    out->resize(e.count);
+    for (uint64_t i = 0; i < e.count; ++i) {
+      const uint8_t* p = bytes.data() + i * size;
+      switch (e.type) {
+        case 5: case 10: {
+          const uint64_t num = Get(p, 4), den = Get(p + 4, 4);
+          (*out)[i] =
+              e.type == 5
+                  ? static_cast<double>(num) / den
+                  : static_cast<double>(static_cast<int32_t>(num)) /
+                        static_cast<int32_t>(den);
+          break;
+        }
+        case 11: {
+          const uint32_t bits = static_cast<uint32_t>(Get(p, 4));
+          float f;
+          std::memcpy(&f, &bits, 4);
+          (*out)[i] = f;
+          break;
+        }
+        case 12: {
+          const uint64_t bits = Get(p, 8);
+          double d;
+          std::memcpy(&d, &bits, 8);
+          (*out)[i] = d;
+          break;
+        }
+        case 6: (*out)[i] = static_cast<int8_t>(Get(p, 1)); break;
+        case 8: (*out)[i] = static_cast<int16_t>(Get(p, 2)); break;
+        case 9: (*out)[i] = static_cast<int32_t>(Get(p, 4)); break;
+        case 17:
+          (*out)[i] = static_cast<double>(static_cast<int64_t>(Get(p, 8)));
+          break;
+        default:
+          (*out)[i] = static_cast<double>(Get(p, static_cast<int>(size)));
+      }
+    }
+    return grpc::Status::OK;
+  };
+  auto scalar = [&](uint16_t tag, uint64_t fallback,
+                    uint64_t* out) -> grpc::Status {
+    const Entry* e = find(tag);
+    if (e == nullptr) {
+      *out = fallback;
+      return grpc::Status::OK;
+    }
+    std::vector<double> v;
+    grpc::Status st = values(*e, &v);
+    if (!st.ok()) return st;
+    *out = v.empty() ? fallback : static_cast<uint64_t>(v[0]);
+    return grpc::Status::OK;
+  };
+
+  uint64_t subfile, width, height, bits, compression, spp, planar, predictor,
+      format, tile_w, tile_h, rows_per_strip;
+  for (auto [tag, fallback, out] :
+       {std::make_tuple(kNewSubfileType, uint64_t{0}, &subfile),
+        std::make_tuple(kImageWidth, uint64_t{0}, &width),
+        std::make_tuple(kImageLength, uint64_t{0}, &height),
+        std::make_tuple(kBitsPerSample, uint64_t{1}, &bits),
+        std::make_tuple(kCompression, uint64_t{kNone}, &compression),
+        std::make_tuple(kSamplesPerPixel, uint64_t{1}, &spp),
+        std::make_tuple(kPlanarConfig, uint64_t{1}, &planar),
+        std::make_tuple(kPredictor, uint64_t{1}, &predictor),
+        std::make_tuple(kSampleFormat, uint64_t{kUint}, &format),
+        std::make_tuple(kTileWidth, uint64_t{0}, &tile_w),
+        std::make_tuple(kTileLength, uint64_t{0}, &tile_h),
+        std::make_tuple(kRowsPerStrip, uint64_t{0}, &rows_per_strip)}) {
+    s = scalar(tag, fallback, out);
+    if (!s.ok()) return s;
+  }
+
+  // Masks (bit 2) are not pixels; only the first full-resolution image and
+  // its reduced-resolution IFDs (bit 0) are kept.
+  if (subfile & 4) return grpc::Status::OK;
+  const bool reduced = subfile & 1;
+  if (levels.empty() == reduced) return grpc::Status::OK;
+
+  Level l;
+  if (width == 0 || height == 0 || width > kMaxSide || height > kMaxSide) {
+    return TiffError("bad image size");
+  }
+  if (spp == 0 || spp > kMaxBands) return TiffUnsupported("too many samples");
+  if (planar != 1 && spp > 1) return TiffUnsupported("planar layout");
+  if (bits != 8 && bits != 16 && bits != 32 && bits != 64) {
+    return TiffUnsupported(std::to_string(bits) + "-bit samples");
+  }
+  if (format == kFloat && bits < 32) return TiffUnsupported("half floats");
+  if (format != kUint && format != kInt && format != kFloat) {
+    return TiffUnsupported("sample format " + std::to_string(format));
+  }
+  l.width = static_cast<int>(width);
+  l.height = static_cast<int>(height);
+  l.spp = static_cast<int>(spp);
+  l.bits = static_cast<int>(bits);
+  l.sample_format = static_cast<uint32_t>(format);
+  l.compression = static_cast<uint32_t>(compression);
+  l.predictor = static_cast<uint32_t>(predictor);
+  if (l.sample_format == kUint && l.bits == 8) {
+    l.type = PixelType::kU8;
+  } else if (l.sample_format == kUint && l.bits == 16) {
+    l.type = PixelType::kU16;
+  } else {
+    l.type = PixelType::kF32;
+  }
+  l.tiled = find(kTileOffsets) != nullptr;
+  if (l.tiled) {
+    if (tile_w == 0 || tile_h == 0 || tile_w > 1 << 16 || tile_h > 1 << 16) {
+      return TiffError("bad tile size");
+    }
+    l.block_w = static_cast<int>(tile_w);
+    l.block_h = static_cast<int>(tile_h);
+  } else {
+    l.block_w = l.width;
+    l.block_h = rows_per_strip == 0 || rows_per_strip > height
+                    ? l.height
+                    : static_cast<int>(rows_per_strip);
+  }
+  l.blocks_x = (l.width + l.block_w - 1) / l.block_w;
+  l.blocks_y = (l.height + l.block_h - 1) / l.block_h;
+
+  const Entry* off = find(l.tiled ? kTileOffsets : kStripOffsets);
+  const Entry* cnt = find(l.tiled ? kTileByteCounts : kStripByteCounts);
+  if (off == nullptr || cnt == nullptr) return TiffError("missing block table");
+  const uint64_t block_bytes = static_cast<uint64_t>(l.block_w) * l.spp *
+                               (l.bits / 8) * l.block_h;
+  if (block_bytes > kMaxBlockBytes) return TiffUnsupported("blocks over 1 GiB");
+  // Offsets and counts arrive as doubles; anything that is no uint64 is as
+  // corrupt as a block outside the file.
+  auto to_u64 = [](const std::vector<double>& v, std::vector<uint64_t>* out) {
+    for (double d : v) {
+      if (!(d >= 0 && d < 18446744073709551616.0)) return false;
+    }
+    out->assign(v.begin(), v.end());
+    return true;
+  };
+  std::vector<double> v;
+  s = values(*off, &v);
+  if (!s.ok()) return s;
+  if (!to_u64(v, &l.offsets)) return TiffError("bad block offset");
+  s = values(*cnt, &v);
+  if (!s.ok()) return s;
+  if (!to_u64(v, &l.counts)) return TiffError("bad block byte count");
+  const size_t blocks = static_cast<size_t>(l.blocks_x) * l.blocks_y;
+  if (l.offsets.size() < blocks || l.counts.size() < blocks) {
+    return TiffError("short block table");
+  }
+  // Blocks are read (and for streams without a view, copied) whole, so each
+  // must lie inside the file and be no larger than its pixels could need.
+  // Uploads still arriving have no size yet; reads past their end fail.
+  uint64_t file_size = 0;
+  const bool sized = stream->FinalSize(&file_size);
+  for (size_t i = 0; i < blocks; ++i) {
+    const uint64_t offset = l.offsets[i], count = l.counts[i];
+    if (offset == 0 || count == 0) continue;  // Sparse.
+    if (count > MaxStoredBytes(block_bytes)) {
+      return TiffError("block byte count exceeds its size");
+    }
+    if (sized && (offset > file_size || count > file_size - offset)) {
+      return TiffError("block outside the file");
+    }
+  }
+
+  if (!reduced) {
+    const Entry* scale = find(kModelPixelScale);
+    const Entry* tie = find(kModelTiepoint);
+    if (scale != nullptr && tie != nullptr) {
+      std::vector<double> sc, tp;
+      s = values(*scale, &sc);
+      if (s.ok()) s = values(*tie, &tp);
+      if (!s.ok()) return s;
+      if (sc.size() >= 2 && tp.size() >= 6 && sc[0] > 0 && sc[1] > 0) {
+        has_georef = true;
+        georef.pixel_width = sc[0];
+        georef.pixel_height = -sc[1];
+        georef.origin_x = tp[3] - tp[0] * sc[0];
+        georef.origin_y = tp[4] + tp[1] * sc[1];
+        georef.width = l.width;
+        georef.height = l.height;
+        // GTRasterTypeGeoKey = RasterPixelIsPoint puts the tiepoint on the
+        // pixel centre rather than its corner. Geographic- and
+        // ProjectedCSTypeGeoKey name the CRS by EPSG code.
+        if (const Entry* keys = find(kGeoKeyDirectory)) {
+          std::vector<double> k;
+          if (values(*keys, &k).ok() && k.size() >= 4) {
+            for (size_t i = 4; i + 3 < k.size(); i += 4) {
+              if (k[i + 1] != 0) continue;
+              if (k[i] == 1025 && k[i + 3] == 2) {
+                georef.origin_x -= 0.5 * sc[0];
+                georef.origin_y += 0.5 * sc[1];
+              }
+              // 32767 is user-defined: no EPSG code.
+              if ((k[i] == 2048 || k[i] == 3072) && k[i + 3] != 32767) {
+                georef.epsg = static_cast<int>(k[i + 3]);
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+  levels.push_back(std::move(l));
+  return grpc::Status::OK;
+}
+
+grpc::Status TiffSource::File::DecodeBlock(const Level& l, int bx, int by,
+                                           AlignedBuffer* out) {
+  const size_t index = static_cast<size_t>(by) * l.blocks_x + bx;
+  const int bytes = l.bits / 8;
+  const size_t row_bytes = static_cast<size_t>(l.block_w) * l.spp * bytes;
+  // The last strip may be short; tiles are always whole.
+  const int rows = l.tiled ? l.block_h
+                           : std::min(l.block_h, l.height - by * l.block_h);
+  const size_t raw_bytes = row_bytes * rows;
+  *out = AlignedBuffer(l.block_row_bytes() * l.block_h);
+
+  const uint64_t offset = l.offsets[index], count = l.counts[index];
+  if (offset == 0 || count == 0) {
+    // Sparse (GDAL SPARSE_OK) block: nodata, stored as zeros.
+    std::memset(out->data(), 0, out->size());
+    return grpc::Status::OK;
+  }
+
+  // Decoding in place works whenever the file's samples are kept as is.
+  const bool native = l.type != PixelType::kF32 ||
+                      (l.sample_format == kFloat && l.bits == 32);
+  std::vector<uint8_t> widen;
+  uint8_t* raw = out->data();
+  if (!native) {
+    widen.resize(raw_bytes);
+    raw = widen.data();
+  }
+
+  std::vector<uint8_t> copy;
+  const uint8_t* src = stream->View(offset, count);
+  if (src == nullptr) {
+    copy.resize(count);
+    grpc::Status s = ReadExact(offset, copy.data(), count);
+    if (!s.ok()) return s;
+    src = copy.data();
+  }
+  grpc::Status s;
+  switch (l.compression) {
+    case kNone:
+      if (count < raw_bytes) return TiffError("short block");
+      std::memcpy(raw, src, raw_bytes);
+      break;
+    case kLzw:
+      s = LzwDecode(src, count, raw, raw_bytes);
+      break;
+    case kDeflate:
+    case kAdobeDeflate:
+      s = Inflate(src, count, raw, raw_bytes);
+      break;
+    case kPackBits:
+      s = PackBitsDecode(src, count, raw, raw_bytes);
+      break;
+    case kZstd:
+      s = ZstdDecode(src, count, raw, raw_bytes);
+      break;
+    default:
+      return TiffUnsupported("compression " + std::to_string(l.compression));
+  }
+  if (!s.ok()) return s;
+
+  if (l.predictor == 3) {
+    if (l.sample_format != kFloat) return TiffError("predictor 3 on integers");
+    std::vector<uint8_t> scratch;
+    for (int r = 0; r < rows; ++r) {
+      UndoFloatingPoint(raw + r * row_bytes, l.block_w, l.spp, bytes, &scratch);
+    }
+  } else {
+    if (big_endian && bytes > 1) {
+      SwapElements(raw, raw_bytes / bytes, bytes);
+    }
+    if (l.predictor == 2) {
+      for (int r = 0; r < rows; ++r) {
+        uint8_t* row = raw + r * row_bytes;
+        switch (bytes) {
+          case 1: UndoHorizontal<uint8_t>(row, l.block_w, l.spp); break;
+          case 2: UndoHorizontal<uint16_t>(row, l.block_w, l.spp); break;
+          case 4: UndoHorizontal<uint32_t>(row, l.block_w, l.spp); break;
+          case 8: UndoHorizontal<uint64_t>(row, l.block_w, l.spp); break;
+        }
+      }
+    } else if (l.predictor != 1) {
+      return TiffUnsupported("predictor " + std::to_string(l.predictor));
+    }
+  }
+
+  if (!native) {
+    const size_t n = raw_bytes / bytes;
+    float* dst = reinterpret_cast<float*>(out->data());
+    const bool is_int = l.sample_format == kInt;
+    switch (bytes) {
+      case 1:
+        if (is_int) WidenRun<int8_t>(raw, dst, n);
+        break;
+      case 2:
+        if (is_int) WidenRun<int16_t>(raw, dst, n);
+        break;
+      case 4:
+        if (is_int) {
+          WidenRun<int32_t>(raw, dst, n);
+        } else {
+          WidenRun<uint32_t>(raw, dst, n);
+        }
+        break;
+      case 8:
+        if (l.sample_format == kFloat) {
+          WidenRun<double>(raw, dst, n);
+        } else if (is_int) {
+          WidenRun<int64_t>(raw, dst, n);
+        } else {
+          WidenRun<uint64_t>(raw, dst, n);
+        }
+        break;
+    }
+  }
+  if (rows < l.block_h) {
+    std::memset(out->data() + rows * l.block_row_bytes(), 0,
+                (l.block_h - rows) * l.block_row_bytes());
+  }
+  return grpc::Status::OK;
+}
+
+grpc::Status TiffSource::File::Block(int level, int bx, int by,
+                                     BlockPtr* out) {
+  const Level& l = levels[level];
+  const uint64_t key = (uint64_t{static_cast<uint32_t>(level)} << 40) |
+                       (static_cast<uint64_t>(by) * l.blocks_x + bx);
+  std::promise<Result> promise;
+  std::shared_future<Result> wait;
+  {
+    std::lock_guard<std::mutex> lock(mu);
+    auto it = index.find(key);
+    if (it != index.end()) {
+      lru.splice(lru.begin(), lru, it->second);
+      *out = it->second->second;
+      return grpc::Status::OK;
+    }
+    auto p = pending.find(key);
+    if (p != pending.end()) {
+      wait = p->second;
+    } else {
+      pending[key] = promise.get_future().share();
+    }
+  }
+  if (wait.valid()) {
+    const Result& r = wait.get();
+    *out = r.second;
+    return r.first;
+  }
+
+  auto block = std::make_shared<AlignedBuffer>();
+  grpc::Status s = DecodeBlock(l, bx, by, block.get());
+  BlockPtr result = s.ok() ? BlockPtr(block) : nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mu);
+    pending.erase(key);
+    if (s.ok()) {
+      lru.emplace_front(key, result);
+      index[key] = lru.begin();
+      cached_bytes += result->size();
+      while (cached_bytes > kBlockCacheBytes && lru.size() > 1) {
+        cached_bytes -= lru.back().second->size();
+        index.erase(lru.back().first);
+        lru.pop_back();
+      }
+    }
+  }
+  promise.set_value({s, result});
+  *out = result;
+  return s;
+}
+
+// TiffSource ----------------------------------------------------------------
+
+bool LooksLikeTiff(const uint8_t* head, size_t n) {
+  if (n < 4) return false;
+  return (head[0] == 'I' && head[1] == 'I' &&
+          (head[2] == 42 || head[2] == 43) && head[3] == 0) ||
+         (head[0] == 'M' && head[1] == 'M' && head[2] == 0 &&
+          (head[3] == 42 || head[3] == 43));
+}
+
+TiffSource::TiffSource(std::shared_ptr<File> file, int level, int tile_size)
+    : file_(std::move(file)), level_(level) {
+  const File::Level& l = file_->levels[level];
+  info_.width = l.width;
+  info_.height = l.height;
+  info_.bands = l.spp;
+  info_.type = l.type;
+  info_.tile_size = tile_size;
+}
+
+TiffSource::~TiffSource() = default;
+
+grpc::Status TiffSource::Open(std::shared_ptr<ByteStream> stream,
+                              int tile_size, std::unique_ptr<TiffSource>* out) {
+  auto file = std::make_shared<File>();
+  file->stream = std::move(stream);
+  grpc::Status s = file->Parse();
+  if (!s.ok()) return s;
+  out->reset(new TiffSource(std::move(file), 0, tile_size));
+  return grpc::Status::OK;
+}
+
+int TiffSource::levels() const {
+  return static_cast<int>(file_->levels.size());
+}
+
+bool TiffSource::GetGeoref(Georef* out) const {
+  if (!file_->has_georef) return false;
+  const Georef& g = file_->georef;
+  *out = g;
+  out->pixel_width = g.pixel_width * g.width / info_.width;
+  out->pixel_height = g.pixel_height * g.height / info_.height;
+  out->width = info_.width;
+  out->height = info_.height;
+  return true;
+}
+
+std::shared_ptr<RasterSource> TiffSource::Reduced(double factor) {
+  // Coarsest overview that is still at least as fine as requested.
+  int best = -1;
+  const File::Level& full = file_->levels[0];
+  for (int i = level_ + 1; i < levels(); ++i) {
+    const double r = static_cast<double>(full.width) / file_->levels[i].width;
+    const double current =
+        static_cast<double>(full.width) / file_->levels[level_].width;
+    if (r / current <= factor * 1.001) best = i;
+  }
+  if (best < 0) return nullptr;
+  return std::shared_ptr<RasterSource>(
+      new TiffSource(file_, best, info_.tile_size));
+}
+
+grpc::Status TiffSource::ReadWindow(const Rect& rect, PixelType type,
+                                    void* dst, size_t dst_stride) {
+  const File::Level& l = file_->levels[level_];
+  const size_t px = info_.pixel_bytes();
+  const size_t dst_px = BytesPerSample(type) * info_.bands;
+  auto* out = static_cast<uint8_t*>(dst);
+  std::vector<int> sx(rect.width);
+  for (int c = 0; c < rect.width; ++c) {
+    sx[c] = std::clamp(rect.x + c, 0, info_.width - 1);
+  }
+  File::BlockPtr block;
+  int cur_bx = -1, cur_by = -1;
+  for (int r = 0; r < rect.height; ++r) {
+    const int sy = std::clamp(rect.y + r, 0, info_.height - 1);
+    const int by = sy / l.block_h;
+    uint8_t* drow = out + r * dst_stride;
+    int c = 0;
+    while (c < rect.width) {
+      const int bx = sx[c] / l.block_w;
+      if (bx != cur_bx || by != cur_by) {
+        grpc::Status s = file_->Block(level_, bx, by, &block);
+        if (!s.ok()) return s;
+        cur_bx = bx;
+        cur_by = by;
+      }
+      int run = 1;
+      while (c + run < rect.width && sx[c + run] == sx[c] + run &&
+             sx[c + run] / l.block_w == bx) {
+        ++run;
+      }
+      const uint8_t* srow = block->data() +
+                            (sy - by * l.block_h) * l.block_row_bytes() +
+                            (sx[c] - bx * l.block_w) * px;
+      ConvertSamples(srow, info_.type, drow + c * dst_px, type,
+                     static_cast<size_t>(run) * info_.bands);
+      c += run;
+    }
+  }
+  return grpc::Status::OK;
+}
+
+// CogSink -------------------------------------------------------------------
+
+namespace {
+
+enum FieldType : uint16_t { kShort = 3, kLong = 4, kDouble = 12 };
+
+void PutLe(std::string* out, uint64_t v, int width) {
+  for (int i = 0; i < width; ++i) {
+    out->push_back(static_cast<char>(v >> (8 * i)));
+  }
+}
+
+struct IfdField {
+  uint16_t tag;
+  uint16_t type;
+  uint32_t count;
+  std::string data;  // Little-endian values.
+};
+
+IfdField Shorts(uint16_t tag, const std::vector<uint16_t>& v) {
+  IfdField f{tag, kShort, static_cast<uint32_t>(v.size()), {}};
+  for (uint16_t x : v) PutLe(&f.data, x, 2);
+  return f;
+}
+
+IfdField Long(uint16_t tag, uint32_t v) {
+  IfdField f{tag, kLong, 1, {}};
+  PutLe(&f.data, v, 4);
+  return f;
+}
+
+IfdField Doubles(uint16_t tag, const std::vector<double>& v) {
+  IfdField f{tag, kDouble, static_cast<uint32_t>(v.size()), {}};
+  for (double d : v) {
+    uint64_t bits;
+    std::memcpy(&bits, &d, 8);
+    PutLe(&f.data, bits, 8);
+  }
+  return f;
+}
+
+// Halves one pair of rows: each output sample averages a 2x2 block, with the
+// last column (and `b`, at the bottom edge) repeated for odd sizes.
+template <typename T>
+void HalveRows(const uint8_t* a_bytes, const uint8_t* b_bytes, int width,
+               int bands, uint8_t* out_bytes) {
+  const T* a = reinterpret_cast<const T*>(a_bytes);
+  const T* b = reinterpret_cast<const T*>(b_bytes);
+  T* out = reinterpret_cast<T*>(out_bytes);
+  const int out_width = (width + 1) / 2;
+  for (int x = 0; x < out_width; ++x) {
+    const int x0 = 2 * x * bands;
+    const int x1 = std::min(2 * x + 1, width - 1) * bands;
+    for (int c = 0; c < bands; ++c) {
+      if constexpr (std::is_floating_point_v<T>) {
+        out[x * bands + c] =
+            0.25f * (a[x0 + c] + a[x1 + c] + b[x0 + c] + b[x1 + c]);
+      } else {
+        out[x * bands + c] = static_cast<T>(
+            (uint32_t{a[x0 + c]} + a[x1 + c] + b[x0 + c] + b[x1 + c] + 2) >> 2);
+      }
+    }
+  }
+}
+
+void HalveRows(PixelType type, const uint8_t* a, const uint8_t* b, int width,
+               int bands, uint8_t* out) {
+  switch (type) {
+    case PixelType::kU8: HalveRows<uint8_t>(a, b, width, bands, out); break;
+    case PixelType::kU16: HalveRows<uint16_t>(a, b, width, bands, out); break;
+    case PixelType::kF32: HalveRows<float>(a, b, width, bands, out); break;
+  }
+}
+
+// Inverse of UndoHorizontal / UndoFloatingPoint on one row.
+template <typename T>
+void ApplyHorizontal(uint8_t* row, int width, int spp) {
+  T* p = reinterpret_cast<T*>(row);
+  for (int i = width * spp - 1; i >= spp; --i) {
+    p[i] = static_cast<T>(p[i] - p[i - spp]);
+  }
+}
+
+void ApplyFloatingPoint(uint8_t* row, int width, int spp,
+                        std::vector<uint8_t>* scratch) {
+  const size_t count = static_cast<size_t>(width) * spp;
+  const size_t n = count * 4;
+  scratch->assign(row, row + n);
+  const bool little = [] {
+    const uint16_t probe = 1;
+    return *reinterpret_cast<const uint8_t*>(&probe) == 1;
+  }();
+  for (size_t c = 0; c < count; ++c) {
+    for (int b = 0; b < 4; ++b) {
+      const int plane = little ? 3 - b : b;
+      row[plane * count + c] = (*scratch)[c * 4 + b];
+    }
+  }
+  for (size_t i = n - 1; i >= static_cast<size_t>(spp); --i) {
+    row[i] = static_cast<uint8_t>(row[i] - row[i - spp]);
+  }
+}
+
+}  // namespace
+
+struct CogSink::Level {
+  int width = 0, height = 0;
+  int tiles_x = 0, tiles_y = 0;
+  size_t row_bytes = 0;    // Pixels of one image row.
+  size_t strip_stride = 0; // tiles_x * tile_size pixels; the tail stays zero.
+  AlignedBuffer strip;     // The tile row being filled.
+  int strip_rows = 0;
+  int strip_index = 0;
+  int rows_in = 0;
+  AlignedBuffer pending;   // Upper row of the next 2x2 pair, for the level
+  bool has_pending = false;// below; `halved` receives the result.
+  AlignedBuffer halved;
+  std::vector<uint32_t> offsets, counts;
+  size_t offsets_at = 0, counts_at = 0;  // Table positions in the output.
+};
+
+CogSink::CogSink(std::string* out, const Georef* georef,
+                 int compression_level)
+    : out_(out),
+      level_(compression_level > 0 ? std::min(compression_level, 9) : 6),
+      has_georef_(georef != nullptr) {
+  if (georef != nullptr) georef_ = *georef;
+}
+
+CogSink::~CogSink() = default;
+
+grpc::Status CogSink::Begin(const RasterInfo& info) {
+  if (info.bands < 1 || info.bands > kMaxBands) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "tiff: 1 to 64 bands supported");
+  }
+  info_ = info;
+  // TIFF tiles must be multiples of 16 pixels.
+  tile_size_ = std::clamp((info.tile_size + 15) / 16 * 16, 16, 1024);
+  const size_t px = info.pixel_bytes();
+  levels_.clear();
+  int w = info.width, h = info.height;
+  for (;;) {
+    auto l = std::make_unique<Level>();
+    l->width = w;
+    l->height = h;
+    l->tiles_x = (w + tile_size_ - 1) / tile_size_;
+    l->tiles_y = (h + tile_size_ - 1) / tile_size_;
+    l->row_bytes = static_cast<size_t>(w) * px;
+    l->strip_stride = static_cast<size_t>(l->tiles_x) * tile_size_ * px;
+    l->strip = AlignedBuffer(l->strip_stride * tile_size_);
+    std::memset(l->strip.data(), 0, l->strip.size());
+    const size_t tiles = static_cast<size_t>(l->tiles_x) * l->tiles_y;
+    l->offsets.assign(tiles, 0);
+    l->counts.assign(tiles, 0);
+    const bool last = std::max(w, h) <= tile_size_;
+    if (!last) {
+      l->pending = AlignedBuffer(l->row_bytes);
+      l->halved = AlignedBuffer(static_cast<size_t>((w + 1) / 2) * px);
+    }
+    levels_.push_back(std::move(l));
+    if (last) break;
+    w = (w + 1) / 2;
+    h = (h + 1) / 2;
+  }
+  scanline_ = AlignedBuffer(levels_[0]->row_bytes);
+  WriteHeader();
+  return grpc::Status::OK;
+}
+
+void CogSink::WriteHeader() {
+  std::string& out = *out_;
+  out.assign("II*\0", 4);
+  PutLe(&out, 8, 4);
+
+  const int bands = info_.bands;
+  const uint16_t bits = static_cast<uint16_t>(8 * BytesPerSample(info_.type));
+  const uint16_t format = info_.type == PixelType::kF32 ? kFloat : kUint;
+  const uint16_t extra = static_cast<uint16_t>(bands - (bands >= 3 ? 3 : 1));
+  for (size_t i = 0; i < levels_.size(); ++i) {
+    Level& l = *levels_[i];
+    std::vector<IfdField> fields;
+    if (i > 0) fields.push_back(Long(kNewSubfileType, 1));
+    fields.push_back(Long(kImageWidth, l.width));
+    fields.push_back(Long(kImageLength, l.height));
+    fields.push_back(
+        Shorts(kBitsPerSample, std::vector<uint16_t>(bands, bits)));
+    fields.push_back(Shorts(kCompression, {static_cast<uint16_t>(kDeflate)}));
+    fields.push_back(Shorts(262, {static_cast<uint16_t>(bands >= 3 ? 2 : 1)}));
+    fields.push_back(Shorts(kSamplesPerPixel, {static_cast<uint16_t>(bands)}));
+    fields.push_back(Shorts(kPlanarConfig, {1}));
+    fields.push_back(
+        Shorts(kPredictor, {static_cast<uint16_t>(format == kFloat ? 3 : 2)}));
+    fields.push_back(Shorts(kTileWidth, {static_cast<uint16_t>(tile_size_)}));
+    fields.push_back(Shorts(kTileLength, {static_cast<uint16_t>(tile_size_)}));
+    IfdField offsets{kTileOffsets, kLong,
+                     static_cast<uint32_t>(l.offsets.size()),
+                     std::string(l.offsets.size() * 4, '\0')};
+    IfdField counts{kTileByteCounts, kLong,
+                    static_cast<uint32_t>(l.counts.size()),
+                    std::string(l.counts.size() * 4, '\0')};
+    fields.push_back(std::move(offsets));
+    fields.push_back(std::move(counts));
+    if (extra > 0) {
+      // Gray+alpha and RGBA carry unassociated alpha; anything else is
+      // unspecified data.
+      std::vector<uint16_t> kinds(extra, 0);
+      if (bands == 2 || bands == 4) kinds[0] = 2;
+      fields.push_back(Shorts(338, kinds));
+    }
+    fields.push_back(
+        Shorts(kSampleFormat, std::vector<uint16_t>(bands, format)));
+    // North-up rasters only; GeoTIFF pixel scale cannot express a flip.
+    if (i == 0 && has_georef_ && georef_.pixel_height < 0) {
+      fields.push_back(Doubles(
+          kModelPixelScale, {georef_.pixel_width, -georef_.pixel_height, 0}));
+      fields.push_back(Doubles(
+          kModelTiepoint,
+          {0, 0, 0, georef_.origin_x, georef_.origin_y, 0}));
+      // Version 1.1.0; keys sorted by ID as {id, location 0, count 1,
+      // value}: GTRasterTypeGeoKey = RasterPixelIsArea, and for a known CRS
+      // GTModelTypeGeoKey plus GeographicTypeGeoKey or ProjectedCSTypeGeoKey.
+      // EPSG numbers geographic 2D systems 4000-4999.
+      const int epsg = georef_.epsg;
+      const bool known = epsg > 0 && epsg <= 0xffff;
+      const uint16_t model = epsg >= 4000 && epsg < 5000 ? 2 : 1;
+      std::vector<uint16_t> keys = {1, 1, 0, 1};
+      if (known) keys.insert(keys.end(), {1024, 0, 1, model});
+      keys.insert(keys.end(), {1025, 0, 1, 1});
+      if (known) {
+        const uint16_t cs = model == 2 ? 2048 : 3072;
+        keys.insert(keys.end(), {cs, 0, 1, static_cast<uint16_t>(epsg)});
+      }
+      keys[3] = static_cast<uint16_t>(keys.size() / 4 - 1);
+      fields.push_back(Shorts(kGeoKeyDirectory, keys));
+    }
+
+    const size_t ifd_at = out.size();
+    const size_t ifd_bytes = 2 + 12 * fields.size() + 4;
+    size_t external = ifd_at + ifd_bytes;
+    std::string values;
+    PutLe(&out, fields.size(), 2);
+    for (const IfdField& f : fields) {
+      PutLe(&out, f.tag, 2);
+      PutLe(&out, f.type, 2);
+      PutLe(&out, f.count, 4);
+      size_t at;
+      if (f.data.size() <= 4) {
+        at = out.size();
+        out += f.data;
+        out.append(4 - f.data.size(), '\0');
+      } else {
+        at = external + values.size();
+        PutLe(&out, at, 4);
+        values += f.data;
+        if (values.size() % 2) values.push_back('\0');
+      }
+      if (f.tag == kTileOffsets) l.offsets_at = at;
+      if (f.tag == kTileByteCounts) l.counts_at = at;
+    }
+    const bool last = i + 1 == levels_.size();
+    PutLe(&out, last ? 0 : external + values.size(), 4);
+    out += values;
+  }
+}
+
+grpc::Status CogSink::WriteTileRow(int ty, std::vector<Tile>& tiles) {
+  (void)ty;
+  const size_t px = info_.pixel_bytes();
+  const int rows = tiles.empty() ? 0 : tiles.front().rect().height;
+  const int x0 = tiles.empty() ? 0 : tiles.front().rect().x;
+  for (int y = 0; y < rows; ++y) {
+    for (const Tile& t : tiles) {
+      std::memcpy(scanline_.data() + (t.rect().x - x0) * px, t.row(y),
+                  t.rect().width * px);
+    }
+    grpc::Status s = PushRow(0, scanline_.data());
+    if (!s.ok()) return s;
+  }
+  return grpc::Status::OK;
+}
+
+grpc::Status CogSink::PushRow(size_t level, const uint8_t* row) {
+  Level& l = *levels_[level];
+  std::memcpy(l.strip.data() + l.strip_rows * l.strip_stride, row,
+              l.row_bytes);
+  ++l.strip_rows;
+  ++l.rows_in;
+  if (level + 1 < levels_.size()) {
+    if (!l.has_pending) {
+      std::memcpy(l.pending.data(), row, l.row_bytes);
+      l.has_pending = true;
+    } else {
+      HalveRows(info_.type, l.pending.data(), row, l.width, info_.bands,
+                l.halved.data());
+      l.has_pending = false;
+      grpc::Status s = PushRow(level + 1, l.halved.data());
+      if (!s.ok()) return s;
+    }
+  }
+  if (l.strip_rows == tile_size_) return FlushStrip(l);
+  return grpc::Status::OK;
+}
+
+grpc::Status CogSink::FlushStrip(Level& l) {
+  const size_t px = info_.pixel_bytes();
+  const size_t tile_row = static_cast<size_t>(tile_size_) * px;
+  std::vector<std::string> packed(l.tiles_x);
+  std::vector<bool> failed(l.tiles_x, false);
+  ParallelFor(l.tiles_x, [&](int tx) {
+    AlignedBuffer tile(tile_row * tile_size_);
+    std::vector<uint8_t> scratch;
+    for (int y = 0; y < tile_size_; ++y) {
+      uint8_t* dst = tile.data() + y * tile_row;
+      std::memcpy(dst, l.strip.data() + y * l.strip_stride + tx * tile_row,
+                  tile_row);
+      switch (info_.type) {
+        case PixelType::kU8:
+          ApplyHorizontal<uint8_t>(dst, tile_size_, info_.bands);
+          break;
+        case PixelType::kU16:
+          ApplyHorizontal<uint16_t>(dst, tile_size_, info_.bands);
+          break;
+        case PixelType::kF32:
+          ApplyFloatingPoint(dst, tile_size_, info_.bands, &scratch);
+          break;
+      }
+    }
+    uLongf size = compressBound(tile.size());
+    packed[tx].resize(size);
+    if (compress2(reinterpret_cast<Bytef*>(&packed[tx][0]), &size,
+                  tile.data(), tile.size(), level_) != Z_OK) {
+      failed[tx] = true;
+    }
+    packed[tx].resize(size);
+  });
+  for (int tx = 0; tx < l.tiles_x; ++tx) {
+    if (failed[tx]) {
+      return grpc::Status(grpc::StatusCode::INTERNAL, "tiff: deflate failed");
+    }
+    const size_t index = static_cast<size_t>(l.strip_index) * l.tiles_x + tx;
+    if (out_->size() + packed[tx].size() > UINT32_MAX) {
+      return grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED,
+                          "tiff: output larger than 4 GiB");
+    }
+    l.offsets[index] = static_cast<uint32_t>(out_->size());
+    l.counts[index] = static_cast<uint32_t>(packed[tx].size());
+    out_->append(packed[tx]);
+  }
+  ++l.strip_index;
+  l.strip_rows = 0;
+  std::memset(l.strip.data(), 0, l.strip.size());
+  return grpc::Status::OK;
+}
+
+grpc::Status CogSink::Finish() {
+  for (size_t i = 0; i < levels_.size(); ++i) {
+    Level& l = *levels_[i];
+    grpc::Status s;
+    if (l.has_pending) {
+      // Odd height: the last row pairs with itself.
+      HalveRows(info_.type, l.pending.data(), l.pending.data(), l.width,
+                info_.bands, l.halved.data());
+      l.has_pending = false;
+      s = PushRow(i + 1, l.halved.data());
+    }
+    if (s.ok() && l.strip_rows > 0) s = FlushStrip(l);
+    if (!s.ok()) return s;
+    if (l.rows_in != l.height) {
+      return grpc::Status(grpc::StatusCode::INTERNAL,
+                          "tiff: sink received the wrong number of rows");
+    }
+  }
+  for (const auto& l : levels_) {
+    for (size_t i = 0; i < l->offsets.size(); ++i) {
+      for (int b = 0; b < 4; ++b) {
+        (*out_)[l->offsets_at + 4 * i + b] =
+            static_cast<char>(l->offsets[i] >> (8 * b));
+        (*out_)[l->counts_at + 4 * i + b] =
+            static_cast<char>(l->counts[i] >> (8 * b));
+      }
+    }
+  }
+  levels_.clear();
+  return grpc::Status::OK;
+}
+
+}  // namespace vision
+}  // namespace lucidia
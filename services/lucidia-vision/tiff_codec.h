@@ -0,0 +1,87 @@
+// GeoTIFF / Cloud-Optimized GeoTIFF decoding and encoding.
+//
+// IFDs are parsed once at open. Pixels are decoded one internal tile (or
+// strip) at a time on demand, straight from the stream's memory when it
+// exposes a View (mmap'd files, request bytes), so a window read touches
+// only the tiles under it. Reduced-resolution IFDs are exposed as overviews
+// through RasterSource::Reduced.
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "services/lucidia-vision/byte_stream.h"
+#include "services/lucidia-vision/raster.h"
+
+namespace lucidia {
+namespace vision {
+
+// Classic and BigTIFF, chunky (or single-band) layout, 8/16/32/64-bit
+// integer and float samples. Compression: none, LZW, DEFLATE, PackBits and,
+// when built against libzstd, ZSTD; predictors 2 and 3. Samples other than
+// u8/u16/f32 are widened to f32.
+class TiffSource : public RasterSource {
+ public:
+  static grpc::Status Open(std::shared_ptr<ByteStream> stream, int tile_size,
+                           std::unique_ptr<TiffSource>* out);
+  ~TiffSource() override;
+
+  const RasterInfo& info() const override { return info_; }
+  grpc::Status ReadWindow(const Rect& rect, PixelType type, void* dst,
+                          size_t dst_stride) override;
+  bool GetGeoref(Georef* out) const override;
+  std::shared_ptr<RasterSource> Reduced(double factor) override;
+
+  // Number of IFDs: the full-resolution image plus its overviews.
+  int levels() const;
+
+ private:
+  struct File;
+  TiffSource(std::shared_ptr<File> file, int level, int tile_size);
+
+  std::shared_ptr<File> file_;
+  int level_;
+  RasterInfo info_;
+};
+
+// Writes a tiled Cloud-Optimized GeoTIFF: every IFD up front, then tile data,
+// so a reader finds any tile of any level with one header read. Overviews
+// are halved (2x2 average) from the incoming rows in the same pass until the
+// image fits one tile; each finished tile row of every level is DEFLATE
+// compressed in parallel and appended straight to `out`, and only the block
+// tables are patched at Finish. Tile data therefore follows completion order
+// rather than the smallest-overview-first order some validators prefer.
+class CogSink : public RasterSink {
+ public:
+  // `georef`, if not null, is embedded as GeoTIFF pixel scale and tiepoint,
+  // with its EPSG code (when set) in the GeoKey directory.
+  // `compression_level` is the deflate level 1-9; 0 picks 6.
+  CogSink(std::string* out, const Georef* georef, int compression_level = 0);
+  ~CogSink() override;
+
+  grpc::Status Begin(const RasterInfo& info) override;
+  grpc::Status WriteTileRow(int ty, std::vector<Tile>& tiles) override;
+  grpc::Status Finish() override;
+
+ private:
+  struct Level;
+  void WriteHeader();
+  grpc::Status PushRow(size_t level, const uint8_t* row);
+  grpc::Status FlushStrip(Level& l);
+
+  std::string* out_;
+  int level_;
+  bool has_georef_;
+  Georef georef_;
+  RasterInfo info_;
+  int tile_size_ = 0;
+  std::vector<std::unique_ptr<Level>> levels_;
+  AlignedBuffer scanline_;
+};
+
+// True if `head` (at least 4 bytes) starts a TIFF or BigTIFF file.
+bool LooksLikeTiff(const uint8_t* head, size_t n);
+
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,639 @@
+#include "services/lucidia-vision/tiff_codec.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include "proto/vision_service.pb.h"
+#include "services/lucidia-vision/byte_stream.h"
+#include "services/lucidia-vision/image_io.h"
+#include "services/lucidia-vision/test_util.h"
+
+namespace lucidia {
+namespace vision {
+namespace {
+
+using testing::MakeRaster;
+using testing::ReadAll;
+
+std::unique_ptr<TiffSource> OpenTiff(const std::string& data) {
+  std::unique_ptr<TiffSource> tiff;
+  const grpc::Status s = TiffSource::Open(
+      std::make_shared<MemoryByteStream>(data.data(), data.size()),
+      kDefaultTileSize, &tiff);
+  EXPECT_TRUE(s.ok()) << s.error_message();
+  return tiff;
+}
+
+// Hand-built baseline TIFFs: block data first, then one IFD with its
+// out-of-line values. Classic or BigTIFF, either byte order.
+class TiffBuilder {
+ public:
+  enum Type : uint16_t { kShort = 3, kLong = 4, kLong8 = 16 };
+
+  TiffBuilder(bool big_endian, bool big_tiff)
+      : big_endian_(big_endian), big_tiff_(big_tiff) {
+    out_ = big_endian ? "MM" : "II";
+    Put(&out_, big_tiff ? 43 : 42, 2);
+    if (big_tiff) {
+      Put(&out_, 8, 2);
+      Put(&out_, 0, 2);
+    }
+    ifd_at_ = out_.size();
+    Put(&out_, 0, big_tiff ? 8 : 4);  // Patched by Finish.
+  }
+
+  // Appends block bytes; returns their file offset.
+  uint64_t AddData(const std::string& bytes) {
+    const uint64_t at = out_.size();
+    out_ += bytes;
+    return at;
+  }
+
+  void Tag(uint16_t tag, Type type, std::vector<uint64_t> values) {
+    tags_.push_back({tag, type, std::move(values)});
+  }
+
+  std::string Finish() {
+    if (out_.size() % 2) out_.push_back('\0');
+    std::sort(tags_.begin(), tags_.end(),
+              [](const Field& a, const Field& b) { return a.tag < b.tag; });
+    const int count_bytes = big_tiff_ ? 8 : 2;
+    const int entry_bytes = big_tiff_ ? 20 : 12;
+    const int value_bytes = big_tiff_ ? 8 : 4;
+    std::string ifd;
+    std::string values;
+    const uint64_t ifd_at = out_.size();
+    const uint64_t values_at =
+        ifd_at + count_bytes + entry_bytes * tags_.size() + value_bytes;
+    Put(&ifd, tags_.size(), count_bytes);
+    for (const Field& f : tags_) {
+      const int width = f.type == kShort ? 2 : f.type == kLong ? 4 : 8;
+      std::string data;
+      for (uint64_t v : f.values) Put(&data, v, width);
+      Put(&ifd, f.tag, 2);
+      Put(&ifd, f.type, 2);
+      Put(&ifd, f.values.size(), big_tiff_ ? 8 : 4);
+      if (data.size() <= static_cast<size_t>(value_bytes)) {
+        data.resize(value_bytes, '\0');
+        ifd += data;
+      } else {
+        Put(&ifd, values_at + values.size(), value_bytes);
+        values += data;
+      }
+    }
+    Put(&ifd, 0, value_bytes);  // No next IFD.
+    std::string head;
+    Put(&head, ifd_at, big_tiff_ ? 8 : 4);
+    out_.replace(ifd_at_, head.size(), head);
+    return out_ + ifd + values;
+  }
+
+ private:
+  struct Field {
+    uint16_t tag;
+    Type type;
+    std::vector<uint64_t> values;
+  };
+
+  void Put(std::string* s, uint64_t v, int width) const {
+    for (int i = 0; i < width; ++i) {
+      const int shift = 8 * (big_endian_ ? width - 1 - i : i);
+      s->push_back(static_cast<char>(v >> shift));
+    }
+  }
+
+  bool big_endian_, big_tiff_;
+  std::string out_;
+  size_t ifd_at_ = 0;
+  std::vector<Field> tags_;
+};
+
+// A 16x16 single-strip 8-bit BigTIFF whose strip claims `offset`/`count`.
+std::string BigTiffWithStrip(uint64_t offset, uint64_t count) {
+  TiffBuilder b(false, true);
+  b.AddData(std::string(256, '\x7f'));
+  b.Tag(256, TiffBuilder::kLong, {16});
+  b.Tag(257, TiffBuilder::kLong, {16});
+  b.Tag(258, TiffBuilder::kShort, {8});
+  b.Tag(278, TiffBuilder::kLong, {16});
+  b.Tag(273, TiffBuilder::kLong8, {offset});
+  b.Tag(279, TiffBuilder::kLong8, {count});
+  return b.Finish();
+}
+
+// TIFF 6.0 LZW as libtiff writes it: MSB-first codes that widen one code
+// early, a Clear first and whenever the table fills, EOI last.
+std::string LzwEncode(const std::string& in) {
+  constexpr int kClear = 256, kEoi = 257;
+  std::map<std::pair<int, uint8_t>, int> table;
+  int next = 258;
+  uint64_t bits = 0;
+  int nbits = 0;
+  std::string out;
+  auto put = [&](int code) {
+    const int width = next < 512 ? 9 : next < 1024 ? 10 : next < 2048 ? 11 : 12;
+    bits = bits << width | static_cast<uint64_t>(code);
+    nbits += width;
+    while (nbits >= 8) {
+      out.push_back(static_cast<char>(bits >> (nbits - 8)));
+      nbits -= 8;
+    }
+    bits &= (uint64_t{1} << nbits) - 1;
+  };
+  put(kClear);
+  int prefix = -1;
+  for (char ch : in) {
+    const auto c = static_cast<uint8_t>(ch);
+    if (prefix < 0) {
+      prefix = c;
+      continue;
+    }
+    auto it = table.find({prefix, c});
+    if (it != table.end()) {
+      prefix = it->second;
+      continue;
+    }
+    put(prefix);
+    table[{prefix, c}] = next++;
+    if (next == 4094) {
+      put(kClear);
+      table.clear();
+      next = 258;
+    }
+    prefix = c;
+  }
+  if (prefix >= 0) put(prefix);
+  put(kEoi);
+  if (nbits > 0) out.push_back(static_cast<char>(bits << (8 - nbits)));
+  return out;
+}
+
+// PackBits: runs of three or more repeated bytes, literals between them.
+std::string PackBitsEncode(const std::string& in) {
+  std::string out;
+  size_t i = 0;
+  while (i < in.size()) {
+    size_t run = 1;
+    while (i + run < in.size() && run < 128 && in[i + run] == in[i]) ++run;
+    if (run >= 3) {
+      out.push_back(static_cast<char>(1 - static_cast<int>(run)));
+      out.push_back(in[i]);
+      i += run;
+      continue;
+    }
+    size_t lit = 0;
+    while (i + lit < in.size() && lit < 128 &&
+           !(i + lit + 2 < in.size() && in[i + lit] == in[i + lit + 1] &&
+             in[i + lit] == in[i + lit + 2])) {
+      ++lit;
+    }
+    out.push_back(static_cast<char>(lit - 1));
+    out.append(in, i, lit);
+    i += lit;
+  }
+  return out;
+}
+
+// How a fixture is stored. Samples are unsigned, signed or float
+// (SampleFormat 1-3) of `bits` each.
+struct Layout {
+  const char* name;
+  bool big_endian;
+  bool big_tiff;
+  int tile;            // Tile side; 0 for strips.
+  int rows_per_strip;  // 0 for a single strip.
+  uint16_t compression;
+  uint16_t predictor;
+  int bits;
+  uint16_t format;
+  int width;
+  int height;
+  int spp;
+};
+
+void PrintTo(const Layout& l, std::ostream* os) { *os << l.name; }
+
+// Sample (x, y, b) of every fixture, representable in each format: bytes
+// vary enough for LZW to fill its table, 16-bit samples wrap under the
+// predictor and signed ones go negative.
+double FixtureSample(const Layout& l, int x, int y, int b) {
+  const uint32_t h = (static_cast<uint32_t>(x) * 2654435761u) ^
+                     (static_cast<uint32_t>(y) * 40503u + b * 977u);
+  if (l.format == 3) return (static_cast<int>(h % 20001) - 10000) * 0.125;
+  if (l.bits == 8) return (h >> 7) % 256;
+  if (l.format == 2) return static_cast<int>(h % 60001) - 30000;
+  return (60000 + 700 * x + 13 * y + 4099 * b) % 65536;
+}
+
+// Stored bytes of one block row: samples in the file's byte order after the
+// predictor. `row` holds the samples, edge padding already zero.
+std::string EncodeRow(const Layout& l, const std::vector<double>& row) {
+  const int bytes = l.bits / 8;
+  const size_t count = row.size();
+  std::vector<uint64_t> words(count);
+  for (size_t i = 0; i < count; ++i) {
+    if (l.format == 3) {
+      const float f = static_cast<float>(row[i]);
+      uint32_t u;
+      std::memcpy(&u, &f, sizeof(u));
+      words[i] = u;
+    } else {
+      words[i] = static_cast<uint64_t>(static_cast<int64_t>(row[i]));
+    }
+  }
+  const uint64_t mask = bytes == 8 ? ~uint64_t{0}
+                                   : (uint64_t{1} << (8 * bytes)) - 1;
+  std::string out(count * bytes, '\0');
+  if (l.predictor == 3) {
+    // Byte planes, most significant first, then byte differences.
+    for (size_t c = 0; c < count; ++c) {
+      for (int p = 0; p < bytes; ++p) {
+        out[p * count + c] =
+            static_cast<char>(words[c] >> (8 * (bytes - 1 - p)));
+      }
+    }
+    for (size_t i = out.size() - 1; i >= static_cast<size_t>(l.spp); --i) {
+      out[i] = static_cast<char>(out[i] - out[i - l.spp]);
+    }
+    return out;
+  }
+  if (l.predictor == 2) {
+    for (size_t i = count - 1; i >= static_cast<size_t>(l.spp); --i) {
+      words[i] = (words[i] - words[i - l.spp]) & mask;
+    }
+  }
+  for (size_t c = 0; c < count; ++c) {
+    for (int k = 0; k < bytes; ++k) {
+      const int shift = 8 * (l.big_endian ? bytes - 1 - k : k);
+      out[c * bytes + k] = static_cast<char>(words[c] >> shift);
+    }
+  }
+  return out;
+}
+
+std::string Compress(const Layout& l, const std::string& raw) {
+  switch (l.compression) {
+    case 5: return LzwEncode(raw);
+    case 8: {
+      uLongf n = compressBound(static_cast<uLong>(raw.size()));
+      std::string out(n, '\0');
+      compress2(reinterpret_cast<Bytef*>(&out[0]), &n,
+                reinterpret_cast<const Bytef*>(raw.data()),
+                static_cast<uLong>(raw.size()), 6);
+      out.resize(n);
+      return out;
+    }
+    case 32773: return PackBitsEncode(raw);
+  }
+  return raw;
+}
+
+// The fixture `l` describes, with FixtureSample's pixels.
+std::string BuildFixture(const Layout& l) {
+  TiffBuilder b(l.big_endian, l.big_tiff);
+  const int block_w = l.tile > 0 ? l.tile : l.width;
+  const int block_h = l.tile > 0            ? l.tile
+                      : l.rows_per_strip > 0 ? l.rows_per_strip
+                                             : l.height;
+  std::vector<uint64_t> offsets, counts;
+  for (int by = 0; by * block_h < l.height; ++by) {
+    for (int bx = 0; bx * block_w < l.width; ++bx) {
+      // Strips end with the image; tiles are padded to full size.
+      const int rows = l.tile > 0 ? block_h
+                                  : std::min(block_h, l.height - by * block_h);
+      std::string raw;
+      for (int r = 0; r < rows; ++r) {
+        std::vector<double> row(static_cast<size_t>(block_w) * l.spp, 0.0);
+        const int y = by * block_h + r;
+        for (int c = 0; c < block_w; ++c) {
+          const int x = bx * block_w + c;
+          if (x >= l.width || y >= l.height) continue;
+          for (int s = 0; s < l.spp; ++s) {
+            row[c * l.spp + s] = FixtureSample(l, x, y, s);
+          }
+        }
+        raw += EncodeRow(l, row);
+      }
+      const std::string stored = Compress(l, raw);
+      offsets.push_back(b.AddData(stored));
+      counts.push_back(stored.size());
+    }
+  }
+  const auto offset_type =
+      l.big_tiff ? TiffBuilder::kLong8 : TiffBuilder::kLong;
+  b.Tag(256, TiffBuilder::kLong, {static_cast<uint64_t>(l.width)});
+  b.Tag(257, TiffBuilder::kLong, {static_cast<uint64_t>(l.height)});
+  b.Tag(258, TiffBuilder::kShort,
+        std::vector<uint64_t>(l.spp, static_cast<uint64_t>(l.bits)));
+  b.Tag(259, TiffBuilder::kShort, {l.compression});
+  b.Tag(277, TiffBuilder::kShort, {static_cast<uint64_t>(l.spp)});
+  b.Tag(317, TiffBuilder::kShort, {l.predictor});
+  b.Tag(339, TiffBuilder::kShort,
+        std::vector<uint64_t>(l.spp, uint64_t{l.format}));
+  if (l.tile > 0) {
+    b.Tag(322, TiffBuilder::kShort, {static_cast<uint64_t>(l.tile)});
+    b.Tag(323, TiffBuilder::kShort, {static_cast<uint64_t>(l.tile)});
+    b.Tag(324, offset_type, offsets);
+    b.Tag(325, offset_type, counts);
+  } else {
+    b.Tag(278, TiffBuilder::kLong, {static_cast<uint64_t>(block_h)});
+    b.Tag(273, offset_type, offsets);
+    b.Tag(279, offset_type, counts);
+  }
+  return b.Finish();
+}
+
+grpc::Status OpenStatus(const std::string& data) {
+  std::unique_ptr<TiffSource> tiff;
+  return TiffSource::Open(
+      std::make_shared<MemoryByteStream>(data.data(), data.size()),
+      kDefaultTileSize, &tiff);
+}
+
+uint32_t Le(const std::string& s, size_t at, int bytes) {
+  uint32_t v = 0;
+  for (int i = bytes - 1; i >= 0; --i) {
+    v = v << 8 | static_cast<uint8_t>(s[at + i]);
+  }
+  return v;
+}
+
+// The first IFD's GeoKeyDirectory (tag 34735) of a little-endian TIFF.
+std::vector<uint16_t> GeoKeys(const std::string& tiff) {
+  const size_t ifd = Le(tiff, 4, 4);
+  const int n = static_cast<int>(Le(tiff, ifd, 2));
+  for (int i = 0; i < n; ++i) {
+    const size_t entry = ifd + 2 + 12 * i;
+    if (Le(tiff, entry, 2) != 34735) continue;
+    const uint32_t count = Le(tiff, entry + 4, 4);
+    const size_t at = count > 2 ? Le(tiff, entry + 8, 4) : entry + 8;
+    std::vector<uint16_t> keys(count);
+    for (uint32_t k = 0; k < count; ++k) {
+      keys[k] = static_cast<uint16_t>(Le(tiff, at + 2 * k, 2));
+    }
+    return keys;
+  }
+  return {};
+}
+
+struct Shape {
+  int width;
+  int height;
+  int bands;
+  PixelType type;
+};
+
+void PrintTo(const Shape& s, std::ostream* os) {
+  *os << s.width << "x" << s.height << "x" << s.bands << " "
+      << PixelTypeName(s.type);
+}
+
+class CogRoundTripTest : public ::testing::TestWithParam<Shape> {};
+
+TEST_P(CogRoundTripTest, Pixels) {
+  const Shape shape = GetParam();
+  auto raster = MakeRaster(
+      shape.width, shape.height, shape.bands, shape.type,
+      [&](int x, int y, int b) {
+        const float v = static_cast<float>((x * 31 + y * 17 + b * 7) % 4001);
+        return shape.type == PixelType::kF32 ? v * 0.25f - 300.0f : v;
+      });
+  v1::Image cog;
+  ASSERT_TRUE(EncodeImage(*raster, "tiff", &cog).ok());
+  auto tiff = OpenTiff(cog.data());
+  ASSERT_NE(tiff, nullptr);
+  ASSERT_EQ(tiff->info().width, shape.width);
+  ASSERT_EQ(tiff->info().height, shape.height);
+  ASSERT_EQ(tiff->info().bands, shape.bands);
+  ASSERT_EQ(tiff->info().type, shape.type);
+  EXPECT_EQ(ReadAll<float>(*tiff, PixelType::kF32),
+            ReadAll<float>(*raster, PixelType::kF32));
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Shapes, CogRoundTripTest,
+    ::testing::Values(Shape{1, 1, 1, PixelType::kU8},
+                      Shape{300, 200, 3, PixelType::kU8},
+                      Shape{513, 257, 4, PixelType::kU8},
+                      Shape{400, 300, 1, PixelType::kU16},
+                      Shape{600, 520, 1, PixelType::kF32}));
+
+TEST(CogSinkTest, EmbedsGeoref) {
+  auto raster = MakeRaster(300, 200, 1, PixelType::kU8,
+                           [](int x, int, int) { return x % 256; });
+  v1::Image cog;
+  auto* geo = cog.mutable_geo();
+  geo->set_origin_x(500000.0);
+  geo->set_origin_y(4200000.0);
+  geo->set_pixel_width(30.0);
+  geo->set_pixel_height(-30.0);
+  geo->set_epsg(32633);
+  ASSERT_TRUE(EncodeImage(*raster, "tiff", &cog).ok());
+  auto tiff = OpenTiff(cog.data());
+  ASSERT_NE(tiff, nullptr);
+  Georef georef;
+  ASSERT_TRUE(tiff->GetGeoref(&georef));
+  EXPECT_DOUBLE_EQ(georef.origin_x, 500000.0);
+  EXPECT_DOUBLE_EQ(georef.origin_y, 4200000.0);
+  EXPECT_DOUBLE_EQ(georef.pixel_width, 30.0);
+  EXPECT_DOUBLE_EQ(georef.pixel_height, -30.0);
+  EXPECT_EQ(georef.width, 300);
+  EXPECT_EQ(georef.height, 200);
+  EXPECT_EQ(georef.epsg, 32633);
+}
+
+TEST(CogSinkTest, GeoKeysNameTheCrs) {
+  auto raster = MakeRaster(32, 32, 1, PixelType::kU8,
+                           [](int x, int y, int) { return x + y; });
+  v1::Image cog;
+  auto* geo = cog.mutable_geo();
+  geo->set_pixel_width(30.0);
+  geo->set_pixel_height(-30.0);
+  // Projected: GTModelType 1, ProjectedCSType.
+  geo->set_epsg(3857);
+  ASSERT_TRUE(EncodeImage(*raster, "tiff", &cog).ok());
+  EXPECT_EQ(GeoKeys(cog.data()),
+            (std::vector<uint16_t>{1, 1, 0, 3, 1024, 0, 1, 1, 1025, 0, 1, 1,
+                                   3072, 0, 1, 3857}));
+  // Geographic: GTModelType 2, GeographicType.
+  geo->set_epsg(4326);
+  ASSERT_TRUE(EncodeImage(*raster, "tiff", &cog).ok());
+  EXPECT_EQ(GeoKeys(cog.data()),
+            (std::vector<uint16_t>{1, 1, 0, 3, 1024, 0, 1, 2, 1025, 0, 1, 1,
+                                   2048, 0, 1, 4326}));
+  auto tiff = OpenTiff(cog.data());
+  ASSERT_NE(tiff, nullptr);
+  Georef georef;
+  ASSERT_TRUE(tiff->GetGeoref(&georef));
+  EXPECT_EQ(georef.epsg, 4326);
+  // Unknown CRS: the raster type alone.
+  geo->set_epsg(0);
+  ASSERT_TRUE(EncodeImage(*raster, "tiff", &cog).ok());
+  EXPECT_EQ(GeoKeys(cog.data()),
+            (std::vector<uint16_t>{1, 1, 0, 1, 1025, 0, 1, 1}));
+}
+
+TEST(CogSinkTest, OverviewsAverageTwoByTwo) {
+  // Each sample is the sum of a term in x and a term in y, so a 2x2 mean is
+  // exact.
+  auto raster = MakeRaster(1024, 1024, 1, PixelType::kF32, [](int x, int y,
+                                                              int) {
+    return static_cast<float>(x % 64) * 2.0f + static_cast<float>(y % 32);
+  });
+  v1::Image cog;
+  ASSERT_TRUE(EncodeImage(*raster, "tiff", &cog).ok());
+  auto tiff = OpenTiff(cog.data());
+  ASSERT_NE(tiff, nullptr);
+  EXPECT_EQ(tiff->levels(), 3);  // 1024, 512 and 256 (one tile).
+
+  auto half = tiff->Reduced(2.0);
+  ASSERT_NE(half, nullptr);
+  ASSERT_EQ(half->info().width, 512);
+  ASSERT_EQ(half->info().height, 512);
+  const std::vector<float> full = ReadAll<float>(*raster, PixelType::kF32);
+  const std::vector<float> reduced = ReadAll<float>(*half, PixelType::kF32);
+  ASSERT_EQ(reduced.size(), 512u * 512u);
+  for (int y = 0; y < 512; y += 37) {
+    for (int x = 0; x < 512; x += 29) {
+      const float mean = (full[(2 * y) * 1024 + 2 * x] +
+                          full[(2 * y) * 1024 + 2 * x + 1] +
+                          full[(2 * y + 1) * 1024 + 2 * x] +
+                          full[(2 * y + 1) * 1024 + 2 * x + 1]) /
+                         4.0f;
+      EXPECT_FLOAT_EQ(reduced[y * 512 + x], mean) << x << "," << y;
+    }
+  }
+  // Asking for less than one level's reduction stays at full resolution.
+  EXPECT_EQ(tiff->Reduced(1.5), nullptr);
+}
+
+TEST(TiffSourceTest, RejectsTruncatedFile) {
+  auto raster = MakeRaster(64, 64, 1, PixelType::kU8,
+                           [](int x, int y, int) { return x ^ y; });
+  v1::Image cog;
+  ASSERT_TRUE(EncodeImage(*raster, "tiff", &cog).ok());
+  const std::string truncated = cog.data().substr(0, 6);
+  std::unique_ptr<TiffSource> tiff;
+  EXPECT_FALSE(TiffSource::Open(std::make_shared<MemoryByteStream>(
+                                    truncated.data(), truncated.size()),
+                                kDefaultTileSize, &tiff)
+                   .ok());
+}
+
+TEST(TiffSourceTest, ReadsWellFormedBuilderOutput) {
+  // BigTiffWithStrip's data sits right after the 16-byte header.
+  const std::string data = BigTiffWithStrip(16, 256);
+  auto tiff = OpenTiff(data);
+  ASSERT_NE(tiff, nullptr);
+  EXPECT_EQ(ReadAll<uint8_t>(*tiff, PixelType::kU8),
+            std::vector<uint8_t>(256, 0x7f));
+}
+
+// Crafted block tables fail at Open instead of allocating the declared
+// count or reading outside the buffer.
+TEST(TiffSourceTest, RejectsOversizedByteCount) {
+  const grpc::Status s = OpenStatus(BigTiffWithStrip(16, uint64_t{1} << 50));
+  EXPECT_EQ(s.error_code(), grpc::StatusCode::INVALID_ARGUMENT);
+}
+
+TEST(TiffSourceTest, RejectsBlockOutsideFile) {
+  for (auto [offset, count] :
+       {std::make_pair(uint64_t{0xFFFFFFFFFFFFF000}, uint64_t{0x2000}),
+        std::make_pair(uint64_t{16}, uint64_t{4096}),
+        std::make_pair(uint64_t{1} << 40, uint64_t{256})}) {
+    const grpc::Status s = OpenStatus(BigTiffWithStrip(offset, count));
+    EXPECT_EQ(s.error_code(), grpc::StatusCode::INVALID_ARGUMENT)
+        << offset << "+" << count;
+  }
+}
+
+// Files from other writers: every codec, predictor, block layout, byte
+// order and header variant the reader supports, built by hand.
+class TiffFixtureTest : public ::testing::TestWithParam<Layout> {};
+
+TEST_P(TiffFixtureTest, Pixels) {
+  const Layout& l = GetParam();
+  const std::string data = BuildFixture(l);
+  auto tiff = OpenTiff(data);
+  ASSERT_NE(tiff, nullptr);
+  ASSERT_EQ(tiff->info().width, l.width);
+  ASSERT_EQ(tiff->info().height, l.height);
+  ASSERT_EQ(tiff->info().bands, l.spp);
+  const std::vector<float> got = ReadAll<float>(*tiff, PixelType::kF32);
+  ASSERT_EQ(got.size(), static_cast<size_t>(l.width) * l.height * l.spp);
+  for (int y = 0; y < l.height; ++y) {
+    for (int x = 0; x < l.width; ++x) {
+      for (int b = 0; b < l.spp; ++b) {
+        ASSERT_EQ(got[(static_cast<size_t>(y) * l.width + x) * l.spp + b],
+                  static_cast<float>(FixtureSample(l, x, y, b)))
+            << x << "," << y << " band " << b;
+      }
+    }
+  }
+}
+
+// name, big_endian, big_tiff, tile, rows_per_strip, compression, predictor,
+// bits, format, width, height, spp.
+INSTANTIATE_TEST_SUITE_P(
+    Layouts, TiffFixtureTest,
+    ::testing::Values(
+        Layout{"Strips", false, false, 0, 5, 1, 1, 8, 1, 13, 12, 3},
+        Layout{"Lzw", false, false, 0, 0, 5, 1, 8, 1, 128, 96, 1},
+        Layout{"LzwPredictor2Tiled", false, false, 16, 0, 5, 2, 16, 1, 40,
+               20, 2},
+        Layout{"PackBits", false, false, 0, 4, 32773, 1, 8, 1, 30, 10, 1},
+        Layout{"PackBitsPredictor2", false, false, 0, 3, 32773, 2, 8, 1, 30,
+               10, 2},
+        Layout{"BigEndianPredictor2Tiled", true, false, 16, 0, 1, 2, 16, 1,
+               20, 18, 1},
+        Layout{"BigEndianSignedLzw", true, false, 0, 7, 5, 2, 16, 2, 21, 15,
+               1},
+        Layout{"Predictor3Deflate", false, false, 0, 6, 8, 3, 32, 3, 19, 13,
+               2},
+        Layout{"Predictor3BigEndian", true, false, 0, 0, 1, 3, 32, 3, 17, 5,
+               1},
+        Layout{"BigTiffBigEndianLzwTiled", true, true, 16, 0, 5, 3, 32, 3, 33,
+               17, 1},
+        Layout{"BigTiffStrips", false, true, 0, 8, 1, 1, 16, 1, 25, 20, 3}),
+    [](const ::testing::TestParamInfo<Layout>& info) {
+      return std::string(info.param.name);
+    });
+
+// The example from Apple's PackBits technical note, including a -128
+// no-op header, as an 8x3 strip.
+TEST(TiffSourceTest, PackBitsReferenceVector) {
+  const std::string packed("\xFE\xAA\x02\x80\x00\x2A\x80\xFD\xAA\x03\x80\x00"
+                           "\x2A\x22\xF7\xAA",
+                           16);
+  TiffBuilder b(false, false);
+  const uint64_t at = b.AddData(packed);
+  b.Tag(256, TiffBuilder::kLong, {8});
+  b.Tag(257, TiffBuilder::kLong, {3});
+  b.Tag(258, TiffBuilder::kShort, {8});
+  b.Tag(259, TiffBuilder::kShort, {32773});
+  b.Tag(273, TiffBuilder::kLong, {at});
+  b.Tag(278, TiffBuilder::kLong, {3});
+  b.Tag(279, TiffBuilder::kLong, {packed.size()});
+  const std::string data = b.Finish();
+  auto tiff = OpenTiff(data);
+  ASSERT_NE(tiff, nullptr);
+  EXPECT_EQ(ReadAll<uint8_t>(*tiff, PixelType::kU8),
+            (std::vector<uint8_t>{0xAA, 0xAA, 0xAA, 0x80, 0x00, 0x2A, 0xAA,
+                                  0xAA, 0xAA, 0xAA, 0x80, 0x00, 0x2A, 0x22,
+                                  0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA,
+                                  0xAA, 0xAA, 0xAA}));
+}
+
+}  // namespace
+}  // namespace vision
+}  // namespace lucidia
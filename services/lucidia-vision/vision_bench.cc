@@ -0,0 +1,300 @@
+// Microbenchmarks for the vision kernels on synthetic rasters.
+//
+// Each kernel runs end to end through Materialize over in-memory inputs, so
+// decode and network time are excluded but tiling, halos and the thread pool
+// are not. Every benchmark reports:
+//   Mpixel/s     output pixels per second, in millions;
+//   bytes/pixel  for kernels, input plus output sample bytes per output
+//                pixel; for encoders, encoded bytes per pixel.
+// The `threads` argument sizes the worker pool behind ParallelFor (1 runs
+// inline), not Google Benchmark's own threads.
+//
+// Build against Google Benchmark and the rest of lucidia-vision, then e.g.
+//   vision_bench --benchmark_format=json --benchmark_out=bench.json
+//   vision_bench --benchmark_filter='Hillshade/side:4096'
+
+#include <benchmark/benchmark.h>
+
+#include <cmath>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "services/lucidia-vision/colormap.h"
+#include "services/lucidia-vision/engine.h"
+#include "services/lucidia-vision/hillshade.h"
+#include "services/lucidia-vision/image_io.h"
+#include "services/lucidia-vision/mosaic.h"
+#include "services/lucidia-vision/resample.h"
+#include "services/lucidia-vision/thread_pool.h"
+
+namespace lucidia {
+namespace vision {
+namespace {
+
+// Rolling terrain: a few octaves of sines, so hillshade and encoders see
+// realistic gradients rather than noise or flats.
+float Terrain(int x, int y) {
+  float z = 0.0f, amplitude = 400.0f, f = 0.002f;
+  for (int octave = 0; octave < 5; ++octave) {
+    z += amplitude * std::sin(x * f + octave) *
+         std::cos(y * f * 1.3f - octave);
+    amplitude *= 0.45f;
+    f *= 2.1f;
+  }
+  return z;
+}
+
+// Synthetic raster, built once per shape and shared by every benchmark.
+// f32 rasters hold the terrain; u8 ones shade it into `bands` channels.
+std::shared_ptr<TiledRaster> Synthetic(int width, int height, int bands,
+                                       PixelType type) {
+  static std::map<std::tuple<int, int, int, PixelType>,
+                  std::shared_ptr<TiledRaster>>
+      cache;
+  auto& slot = cache[std::make_tuple(width, height, bands, type)];
+  if (slot) return slot;
+  RasterInfo info;
+  info.width = width;
+  info.height = height;
+  info.bands = bands;
+  info.type = type;
+  slot = std::make_shared<TiledRaster>(info);
+  std::vector<float> row;
+  for (int ty = 0; ty < info.tiles_y(); ++ty) {
+    for (int tx = 0; tx < info.tiles_x(); ++tx) {
+      Tile& tile = slot->MutableTile(tx, ty);
+      const Rect& r = tile.rect();
+      row.resize(static_cast<size_t>(r.width) * bands);
+      for (int y = 0; y < r.height; ++y) {
+        for (int x = 0; x < r.width; ++x) {
+          const float z = Terrain(r.x + x, r.y + y);
+          for (int b = 0; b < bands; ++b) {
+            row[static_cast<size_t>(x) * bands + b] =
+                type == PixelType::kF32 ? z
+                                        : 128.0f + z * (0.25f + 0.1f * b);
+          }
+        }
+        ConvertSamples(row.data(), PixelType::kF32, tile.row(y), type,
+                       row.size());
+      }
+    }
+  }
+  return slot;
+}
+
+// Discards output tiles, counting their bytes.
+class CountingSink : public RasterSink {
+ public:
+  grpc::Status Begin(const RasterInfo& info) override {
+    info_ = info;
+    return grpc::Status::OK;
+  }
+  grpc::Status WriteTileRow(int, std::vector<Tile>& tiles) override {
+    for (const Tile& t : tiles) {
+      bytes_ += static_cast<size_t>(t.rect().width) * t.rect().height *
+                info_.pixel_bytes();
+    }
+    return grpc::Status::OK;
+  }
+  grpc::Status Finish() override { return grpc::Status::OK; }
+  size_t bytes() const { return bytes_; }
+
+ private:
+  RasterInfo info_;
+  size_t bytes_ = 0;
+};
+
+// Installs a pool of `threads` workers for the benchmark's lifetime.
+class PoolScope {
+ public:
+  explicit PoolScope(int threads) {
+    if (threads > 1) pool_ = std::make_unique<ThreadPool>(threads, 0);
+    SetDefaultPool(pool_.get());
+  }
+  ~PoolScope() { SetDefaultPool(nullptr); }
+
+ private:
+  std::unique_ptr<ThreadPool> pool_;
+};
+
+void Report(benchmark::State& state, double pixels, double bytes_per_pixel) {
+  state.counters["Mpixel/s"] = benchmark::Counter(
+      pixels * state.iterations() / 1e6, benchmark::Counter::kIsRate);
+  state.counters["bytes/pixel"] = bytes_per_pixel;
+}
+
+// Materializes the source `make()` returns each iteration (op sources cache
+// tiles, so they are not reused) and reports against its output size.
+template <typename Make>
+void RunKernel(benchmark::State& state, double input_bytes, Make make) {
+  double pixels = 0, bytes = 0;
+  for (auto _ : state) {
+    std::shared_ptr<RasterSource> source = make();
+    if (!source) {
+      state.SkipWithError("could not set up the kernel");
+      return;
+    }
+    CountingSink sink;
+    grpc::Status s = Materialize(*source, sink);
+    if (!s.ok()) {
+      state.SkipWithError(s.error_message().c_str());
+      return;
+    }
+    pixels = static_cast<double>(source->info().width) *
+             source->info().height;
+    bytes = static_cast<double>(sink.bytes());
+  }
+  Report(state, pixels, (input_bytes + bytes) / pixels);
+}
+
+double RasterBytes(const RasterSource& r) {
+  return static_cast<double>(r.info().width) * r.info().height *
+         r.info().pixel_bytes();
+}
+
+// Args: side, bands, threads. Lanczos3 down to 2/3 of the input side.
+void BM_Resample(benchmark::State& state) {
+  const int side = static_cast<int>(state.range(0));
+  auto input = Synthetic(side, side, static_cast<int>(state.range(1)),
+                         PixelType::kU8);
+  PoolScope pool(static_cast<int>(state.range(2)));
+  RunKernel(state, RasterBytes(*input), [&] {
+    return std::make_shared<ResampleSource>(input, side * 2 / 3, side * 2 / 3,
+                                            ResampleFilter::kLanczos3);
+  });
+}
+
+// Args: side, threads.
+void BM_Hillshade(benchmark::State& state) {
+  const int side = static_cast<int>(state.range(0));
+  auto dem = Synthetic(side, side, 1, PixelType::kF32);
+  PoolScope pool(static_cast<int>(state.range(1)));
+  state.SetLabel(HillshadeKernelName());
+  RunKernel(state, RasterBytes(*dem),
+            [&] { return MakeHillshadeSource(dem, HillshadeParams()); });
+}
+
+// Args: side, threads. Six lights around the compass, blended.
+void BM_HillshadeLights(benchmark::State& state) {
+  const int side = static_cast<int>(state.range(0));
+  auto dem = Synthetic(side, side, 1, PixelType::kF32);
+  PoolScope pool(static_cast<int>(state.range(1)));
+  state.SetLabel(HillshadeKernelName());
+  HillshadeParams params;
+  for (int l = 0; l < 6; ++l) params.lights.push_back({l * 60.0, 45.0, 1.0});
+  RunKernel(state, RasterBytes(*dem),
+            [&] { return MakeHillshadeSource(dem, params); });
+}
+
+// Args: side, threads. f32 DEM to RGBA through viridis.
+void BM_ColorMap(benchmark::State& state) {
+  const int side = static_cast<int>(state.range(0));
+  auto dem = Synthetic(side, side, 1, PixelType::kF32);
+  PoolScope pool(static_cast<int>(state.range(1)));
+  ColorMapParams params;
+  params.palette = FindPalette("");
+  params.has_range = true;
+  params.min = -600.0;
+  params.max = 600.0;
+  RunKernel(state, RasterBytes(*dem),
+            [&] { return MakeColorMapSource(dem, params); });
+}
+
+// Args: side, bands, threads. Four quadrant inputs overlapping by 1/8 of
+// the side, blended with the default 32-pixel feather.
+void BM_MosaicBlend(benchmark::State& state) {
+  const int side = static_cast<int>(state.range(0));
+  const int bands = static_cast<int>(state.range(1));
+  const int part = side / 2 + side / 16;
+  auto input = Synthetic(part, part, bands, PixelType::kU8);
+  PoolScope pool(static_cast<int>(state.range(2)));
+  RunKernel(state, 4 * RasterBytes(*input), [&] {
+    std::vector<MosaicInput> inputs(4);
+    for (int i = 0; i < 4; ++i) {
+      inputs[i].source = input;
+      inputs[i].georef.origin_x = (i % 2) * (side - part);
+      inputs[i].georef.origin_y = -(i / 2) * (side - part);
+      inputs[i].georef.pixel_width = 1.0;
+      inputs[i].georef.pixel_height = -1.0;
+      inputs[i].georef.width = part;
+      inputs[i].georef.height = part;
+    }
+    std::unique_ptr<MosaicSource> mosaic;
+    if (!MosaicSource::Create(std::move(inputs), 32, &mosaic).ok()) {
+      return std::shared_ptr<RasterSource>();
+    }
+    return std::shared_ptr<RasterSource>(std::move(mosaic));
+  });
+}
+
+// Args: tile side, bands, threads, format (0 png, 1 tiff). Deflate level 6.
+void BM_EncodeTile(benchmark::State& state) {
+  const int side = static_cast<int>(state.range(0));
+  const int bands = static_cast<int>(state.range(1));
+  const std::string format = state.range(3) == 0 ? "png" : "tiff";
+  auto image = Synthetic(side, side, bands, PixelType::kU8);
+  PoolScope pool(static_cast<int>(state.range(2)));
+  state.SetLabel(format);
+  double encoded = 0;
+  for (auto _ : state) {
+    // Tiles are move-only and consumed by the encoder; the copy in is a
+    // memcpy, noise next to deflate.
+    Tile tile(Rect{0, 0, side, side}, bands, PixelType::kU8);
+    grpc::Status s = image->ReadWindow(tile.rect(), PixelType::kU8,
+                                       tile.row(0), tile.stride());
+    v1::Image out;
+    if (s.ok()) s = EncodeTile(std::move(tile), format, &out, 6);
+    if (!s.ok()) {
+      state.SkipWithError(s.error_message().c_str());
+      return;
+    }
+    encoded = static_cast<double>(out.data().size());
+  }
+  const double pixels = static_cast<double>(side) * side;
+  Report(state, pixels, encoded / pixels);
+}
+
+void KernelArgs(benchmark::internal::Benchmark* b, bool with_bands) {
+  for (int side : {1024, 4096}) {
+    for (int bands : {1, 3}) {
+      for (int threads : {1, 4, 16}) {
+        if (with_bands) {
+          b->Args({side, bands, threads});
+        } else if (bands == 1) {
+          b->Args({side, threads});
+        }
+      }
+    }
+  }
+  b->Unit(benchmark::kMillisecond)->UseRealTime();
+}
+
+BENCHMARK(BM_Resample)
+    ->ArgNames({"side", "bands", "threads"})
+    ->Apply([](benchmark::internal::Benchmark* b) { KernelArgs(b, true); });
+BENCHMARK(BM_Hillshade)
+    ->ArgNames({"side", "threads"})
+    ->Apply([](benchmark::internal::Benchmark* b) { KernelArgs(b, false); });
+BENCHMARK(BM_HillshadeLights)
+    ->ArgNames({"side", "threads"})
+    ->Apply([](benchmark::internal::Benchmark* b) { KernelArgs(b, false); });
+BENCHMARK(BM_ColorMap)
+    ->ArgNames({"side", "threads"})
+    ->Apply([](benchmark::internal::Benchmark* b) { KernelArgs(b, false); });
+BENCHMARK(BM_MosaicBlend)
+    ->ArgNames({"side", "bands", "threads"})
+    ->Apply([](benchmark::internal::Benchmark* b) { KernelArgs(b, true); });
+BENCHMARK(BM_EncodeTile)
+    ->ArgNames({"side", "bands", "threads", "tiff"})
+    ->ArgsProduct({{256, 1024}, {1, 3, 4}, {1, 4}, {0, 1}})
+    ->Unit(benchmark::kMicrosecond)
+    ->UseRealTime();
+
+}  // namespace
+}  // namespace vision
+}  // namespace lucidia
+
+BENCHMARK_MAIN();
@@ -0,0 +1,630 @@
+// Open-loop load generator for VisionService.
+//
+// Replays a weighted mix of the seven unary RPCs against a running server at
+// a fixed offered rate, with input rasters drawn from a weighted size
+// distribution, and reports client-side latency percentiles and status codes
+// per method. Requests go out on schedule whether or not earlier ones have
+// finished, and latency is measured from the scheduled send time, so a
+// stalled server shows up as queueing delay instead of a lower request rate
+// (no coordinated omission). Use it to size replicas and to check that
+// admission control sheds load with RESOURCE_EXHAUSTED rather than letting
+// latency grow without bound.
+//
+//   vision_loadgen --target=localhost:50051 --qps=200 --duration_s=60
+//       --mix=Hillshade:4,Resample:2,ColorMap:2,TilePyramid:1
+//       --sizes=256:0.6,1024:0.3,2048:0.1
+//
+// Inputs are synthetic terrain encoded once at startup, so the server sees
+// the same bytes for a given method and size; run it with --cache_mb=0 or
+// the result cache will answer most calls.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+#include "proto/vision_service.grpc.pb.h"
+#include "services/lucidia-vision/engine.h"
+#include "services/lucidia-vision/image_io.h"
+
+namespace v1 = lucidia::vision::v1;
+using lucidia::vision::PixelType;
+using lucidia::vision::RasterInfo;
+using lucidia::vision::Tile;
+using lucidia::vision::TiledRaster;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+constexpr int kStatusCodes = 17;
+const char* const kCodeNames[kStatusCodes] = {
+    "OK",
+    "CANCELLED",
+    "UNKNOWN",
+    "INVALID_ARGUMENT",
+    "DEADLINE_EXCEEDED",
+    "NOT_FOUND",
+    "ALREADY_EXISTS",
+    "PERMISSION_DENIED",
+    "RESOURCE_EXHAUSTED",
+    "FAILED_PRECONDITION",
+    "ABORTED",
+    "OUT_OF_RANGE",
+    "UNIMPLEMENTED",
+    "INTERNAL",
+    "UNAVAILABLE",
+    "DATA_LOSS",
+    "UNAUTHENTICATED",
+};
+
+enum Method {
+  kReprojectImage,
+  kTilePyramid,
+  kMosaic,
+  kHillshade,
+  kOrthorectifyDEM,
+  kResample,
+  kColorMap,
+  kNumMethods,
+};
+const char* const kMethodNames[kNumMethods] = {
+    "ReprojectImage", "TilePyramid", "Mosaic",   "Hillshade",
+    "OrthorectifyDEM", "Resample",   "ColorMap",
+};
+
+struct Flags {
+  std::string target = "localhost:50051";
+  double qps = 50;
+  double duration_s = 30;
+  double warmup_s = 2;         // Sent but not reported.
+  std::string mix;             // Method:weight,...; empty: all equally.
+  std::string sizes = "256:0.6,1024:0.3,2048:0.1";  // Side:weight,...
+  std::string format = "png";  // Payload and output encoding.
+  bool poisson = false;        // Exponential gaps instead of a fixed period.
+  int channels = 4;            // Separate HTTP/2 connections.
+  int max_outstanding = 10000; // Past this, sends are dropped and counted.
+  int deadline_ms = 30000;
+  unsigned seed = 1;
+  bool json = false;
+};
+
+bool ParseFlag(const std::string& arg, const char* name, std::string* value) {
+  const std::string prefix = std::string("--") + name + "=";
+  if (arg.compare(0, prefix.size(), prefix) != 0) return false;
+  *value = arg.substr(prefix.size());
+  return true;
+}
+
+Flags ParseFlags(int argc, char** argv) {
+  Flags f;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    std::string v;
+    if (arg == "--poisson") {
+      f.poisson = true;
+    } else if (arg == "--json") {
+      f.json = true;
+    } else if (ParseFlag(arg, "target", &v)) {
+      f.target = v;
+    } else if (ParseFlag(arg, "qps", &v)) {
+      f.qps = std::atof(v.c_str());
+    } else if (ParseFlag(arg, "duration_s", &v)) {
+      f.duration_s = std::atof(v.c_str());
+    } else if (ParseFlag(arg, "warmup_s", &v)) {
+      f.warmup_s = std::atof(v.c_str());
+    } else if (ParseFlag(arg, "mix", &v)) {
+      f.mix = v;
+    } else if (ParseFlag(arg, "sizes", &v)) {
+      f.sizes = v;
+    } else if (ParseFlag(arg, "format", &v)) {
+      f.format = v;
+    } else if (ParseFlag(arg, "channels", &v)) {
+      f.channels = std::max(1, std::atoi(v.c_str()));
+    } else if (ParseFlag(arg, "max_outstanding", &v)) {
+      f.max_outstanding = std::max(1, std::atoi(v.c_str()));
+    } else if (ParseFlag(arg, "deadline_ms", &v)) {
+      f.deadline_ms = std::atoi(v.c_str());
+    } else if (ParseFlag(arg, "seed", &v)) {
+      f.seed = static_cast<unsigned>(std::strtoul(v.c_str(), nullptr, 10));
+    } else {
+      std::cerr << "ignoring unknown flag " << arg << std::endl;
+    }
+  }
+  return f;
+}
+
+// Splits "key:weight,key:weight" into pairs; false on a malformed entry.
+bool ParseWeights(const std::string& spec,
+                  std::vector<std::pair<std::string, double>>* out) {
+  size_t start = 0;
+  while (start < spec.size()) {
+    size_t end = spec.find(',', start);
+    if (end == std::string::npos) end = spec.size();
+    const std::string item = spec.substr(start, end - start);
+    const size_t colon = item.find(':');
+    if (colon == std::string::npos) return false;
+    const double weight = std::atof(item.c_str() + colon + 1);
+    if (!(weight >= 0)) return false;
+    out->emplace_back(item.substr(0, colon), weight);
+    start = end + 1;
+  }
+  return true;
+}
+
+// Payloads -------------------------------------------------------------------
+
+// Rolling terrain in metres, as in the benchmarks.
+float Terrain(int x, int y) {
+  float z = 0.0f, amplitude = 400.0f, f = 0.002f;
+  for (int octave = 0; octave < 5; ++octave) {
+    z += amplitude * std::sin(x * f + octave) *
+         std::cos(y * f * 1.3f - octave);
+    amplitude *= 0.45f;
+    f *= 2.1f;
+  }
+  return z;
+}
+
+// A side x side raster of the terrain encoded as `format`: a u16 DEM (metres
+// plus 1000) for one band, shaded u8 imagery otherwise.
+grpc::Status SyntheticImage(int side, int bands, const std::string& format,
+                            const v1::GeoTransform* geo, v1::Image* out) {
+  RasterInfo info;
+  info.width = side;
+  info.height = side;
+  info.bands = bands;
+  info.type = bands == 1 ? PixelType::kU16 : PixelType::kU8;
+  TiledRaster raster(info);
+  std::vector<float> row;
+  for (int ty = 0; ty < info.tiles_y(); ++ty) {
+    for (int tx = 0; tx < info.tiles_x(); ++tx) {
+      Tile& tile = raster.MutableTile(tx, ty);
+      const lucidia::vision::Rect& r = tile.rect();
+      row.resize(static_cast<size_t>(r.width) * bands);
+      for (int y = 0; y < r.height; ++y) {
+        for (int x = 0; x < r.width; ++x) {
+          const float z = Terrain(r.x + x, r.y + y);
+          for (int b = 0; b < bands; ++b) {
+            row[static_cast<size_t>(x) * bands + b] =
+                bands == 1 ? 1000.0f + z : 128.0f + z * (0.25f + 0.1f * b);
+          }
+        }
+        lucidia::vision::ConvertSamples(row.data(), PixelType::kF32,
+                                        tile.row(y), info.type, row.size());
+      }
+    }
+  }
+  if (geo != nullptr) *out->mutable_geo() = *geo;
+  return lucidia::vision::EncodeImage(raster, format, out);
+}
+
+v1::GeoTransform Grid(double origin_x, double origin_y, double pixel) {
+  v1::GeoTransform geo;
+  geo.set_origin_x(origin_x);
+  geo.set_origin_y(origin_y);
+  geo.set_pixel_width(pixel);
+  geo.set_pixel_height(-pixel);
+  return geo;
+}
+
+// Everything one size class sends, built once and shared by every call:
+// async unary calls serialize the request when they start.
+struct Payloads {
+  v1::ReprojectImageRequest reproject;
+  v1::TilePyramidRequest pyramid;
+  v1::MosaicRequest mosaic;
+  v1::HillshadeRequest hillshade;
+  v1::OrthorectifyDEMRequest ortho;
+  v1::ResampleRequest resample;
+  v1::ColorMapRequest colormap;
+  size_t bytes[kNumMethods] = {};
+};
+
+grpc::Status BuildPayloads(int side, const std::string& format, Payloads* p) {
+  v1::Image dem, rgb;
+  // 30 m cells in Web Mercator for the DEM; imagery reuses the same pixels.
+  const v1::GeoTransform metric = Grid(1e6, 5e6, 30.0);
+  grpc::Status s = SyntheticImage(side, 1, format, &metric, &dem);
+  if (s.ok()) s = SyntheticImage(side, 3, format, &metric, &rgb);
+  if (!s.ok()) return s;
+
+  // Reproject: a lon/lat image of about 1e-4 degrees per pixel.
+  s = SyntheticImage(side, 3, format, nullptr, p->reproject.mutable_input());
+  if (!s.ok()) return s;
+  *p->reproject.mutable_input()->mutable_geo() = Grid(10.0, 50.0, 1e-4);
+  p->reproject.mutable_src_proj()->set_epsg(4326);
+  p->reproject.mutable_dst_proj()->set_epsg(3857);
+  p->reproject.set_output_format(format);
+
+  // TilePyramid: every zoom down to one tile per 256 pixels of input.
+  *p->pyramid.mutable_input() = rgb;
+  p->pyramid.mutable_proj()->set_epsg(3857);
+  p->pyramid.set_tile_size(256);
+  int zoom = 0;
+  while ((256 << zoom) < side) ++zoom;
+  p->pyramid.set_min_zoom(0);
+  p->pyramid.set_max_zoom(static_cast<uint32_t>(zoom));
+  p->pyramid.set_output_format(format);
+
+  // Mosaic: two copies overlapping by half their width.
+  for (int i = 0; i < 2; ++i) {
+    v1::Image* input = p->mosaic.add_inputs();
+    *input = rgb;
+    *input->mutable_geo() = Grid(1e6 + i * 15.0 * side, 5e6, 30.0);
+  }
+  p->mosaic.mutable_proj()->set_epsg(3857);
+  p->mosaic.set_output_format(format);
+
+  *p->hillshade.mutable_dem() = dem;
+  p->hillshade.mutable_proj()->set_epsg(3857);
+  p->hillshade.set_output_format(format);
+
+  // Ortho: a nadir camera twice the DEM's width above its centre, with the
+  // focal length chosen so the texture spans the DEM at one pixel per cell.
+  *p->ortho.mutable_dem() = dem;
+  *p->ortho.mutable_texture() = rgb;
+  p->ortho.mutable_proj()->set_epsg(3857);
+  p->ortho.set_output_format(format);
+  v1::FrameCamera* camera = p->ortho.mutable_camera();
+  const double extent = 30.0 * side;
+  camera->set_x(1e6 + extent / 2);
+  camera->set_y(5e6 - extent / 2);
+  camera->set_z(1000.0 + 2 * extent);
+  camera->set_focal_px(2.0 * side);
+
+  *p->resample.mutable_input() = rgb;
+  p->resample.set_width(static_cast<uint32_t>(side / 2));
+  p->resample.set_height(static_cast<uint32_t>(side / 2));
+  p->resample.set_output_format(format);
+
+  *p->colormap.mutable_input() = dem;
+  p->colormap.set_palette("terrain");
+  p->colormap.mutable_range()->set_min(400.0);
+  p->colormap.mutable_range()->set_max(1600.0);
+  p->colormap.set_output_format(format);
+
+  p->bytes[kReprojectImage] = p->reproject.ByteSizeLong();
+  p->bytes[kTilePyramid] = p->pyramid.ByteSizeLong();
+  p->bytes[kMosaic] = p->mosaic.ByteSizeLong();
+  p->bytes[kHillshade] = p->hillshade.ByteSizeLong();
+  p->bytes[kOrthorectifyDEM] = p->ortho.ByteSizeLong();
+  p->bytes[kResample] = p->resample.ByteSizeLong();
+  p->bytes[kColorMap] = p->colormap.ByteSizeLong();
+  return grpc::Status::OK;
+}
+
+// Calls ----------------------------------------------------------------------
+
+// One call in flight; its address is the completion queue tag.
+struct Call {
+  virtual ~Call() = default;
+  // Sends the request and queues the completion.
+  virtual void Start() = 0;
+
+  int method = 0;
+  int size = 0;
+  bool reported = false;   // Scheduled after the warmup.
+  Clock::time_point scheduled;
+  grpc::ClientContext context;
+  grpc::Status status;
+};
+
+template <typename Response>
+struct TypedCall : Call {
+  void Start() override {
+    reader->StartCall();
+    reader->Finish(&response, &status, this);
+  }
+
+  Response response;
+  std::unique_ptr<grpc::ClientAsyncResponseReader<Response>> reader;
+};
+
+// The deadline has to be on the context before the call is prepared. gRPC
+// takes system_clock deadlines, so the steady one is carried over as an
+// offset from now.
+template <typename Response, typename Prepare>
+Call* NewCall(Clock::time_point deadline, Prepare prepare) {
+  auto* call = new TypedCall<Response>;
+  if (deadline != Clock::time_point::max()) {
+    call->context.set_deadline(
+        std::chrono::system_clock::now() +
+        std::chrono::duration_cast<std::chrono::system_clock::duration>(
+            deadline - Clock::now()));
+  }
+  call->reader = prepare(&call->context);
+  return call;
+}
+
+Call* PrepareCall(v1::VisionService::Stub* stub, grpc::CompletionQueue* cq,
+                  int method, const Payloads& p, Clock::time_point deadline) {
+  using C = grpc::ClientContext;
+  switch (method) {
+    case kReprojectImage:
+      return NewCall<v1::ReprojectImageResponse>(deadline, [&](C* c) {
+        return stub->PrepareAsyncReprojectImage(c, p.reproject, cq);
+      });
+    case kTilePyramid:
+      return NewCall<v1::TilePyramidResponse>(deadline, [&](C* c) {
+        return stub->PrepareAsyncTilePyramid(c, p.pyramid, cq);
+      });
+    case kMosaic:
+      return NewCall<v1::MosaicResponse>(deadline, [&](C* c) {
+        return stub->PrepareAsyncMosaic(c, p.mosaic, cq);
+      });
+    case kHillshade:
+      return NewCall<v1::HillshadeResponse>(deadline, [&](C* c) {
+        return stub->PrepareAsyncHillshade(c, p.hillshade, cq);
+      });
+    case kOrthorectifyDEM:
+      return NewCall<v1::OrthorectifyDEMResponse>(deadline, [&](C* c) {
+        return stub->PrepareAsyncOrthorectifyDEM(c, p.ortho, cq);
+      });
+    case kResample:
+      return NewCall<v1::ResampleResponse>(deadline, [&](C* c) {
+        return stub->PrepareAsyncResample(c, p.resample, cq);
+      });
+    default:
+      return NewCall<v1::ColorMapResponse>(deadline, [&](C* c) {
+        return stub->PrepareAsyncColorMap(c, p.colormap, cq);
+      });
+  }
+}
+
+// Results --------------------------------------------------------------------
+
+struct MethodStats {
+  std::vector<int64_t> latency_us;  // Every reported call, any status.
+  uint64_t codes[kStatusCodes] = {};
+  uint64_t dropped = 0;             // Not sent: --max_outstanding reached.
+  uint64_t request_bytes = 0;
+};
+
+// One line of the report: a method at one raster side (0: all sides), or
+// every call when `method` is "all".
+struct Row {
+  const char* method;
+  int side;
+  const MethodStats* stats;
+};
+
+double Percentile(const std::vector<int64_t>& sorted, double q) {
+  if (sorted.empty()) return 0.0;
+  const size_t rank = static_cast<size_t>(std::ceil(q * sorted.size()));
+  return sorted[std::min(sorted.size(), std::max<size_t>(rank, 1)) - 1] * 1e-3;
+}
+
+void PrintRow(const Row& row, double seconds, bool json, bool last) {
+  const MethodStats& m = *row.stats;
+  std::vector<int64_t> sorted = m.latency_us;
+  std::sort(sorted.begin(), sorted.end());
+  const double q[] = {Percentile(sorted, 0.5), Percentile(sorted, 0.99),
+                      Percentile(sorted, 0.999),
+                      sorted.empty() ? 0.0 : sorted.back() * 1e-3};
+  const auto sent = static_cast<unsigned long long>(sorted.size());
+  const auto dropped = static_cast<unsigned long long>(m.dropped);
+  if (json) {
+    std::printf(
+        "    {\"method\": \"%s\", \"side\": %d, \"sent\": %llu, "
+        "\"qps\": %.3f, \"p50_ms\": %.3f, \"p99_ms\": %.3f, "
+        "\"p999_ms\": %.3f, \"max_ms\": %.3f, \"dropped\": %llu, "
+        "\"request_bytes\": %llu, \"codes\": {",
+        row.method, row.side, sent, sent / seconds, q[0], q[1], q[2], q[3],
+        dropped, static_cast<unsigned long long>(m.request_bytes));
+  } else {
+    const std::string name =
+        row.side ? "  " + std::to_string(row.side) + "px" : row.method;
+    std::printf("%-16s %8llu %9.1f %9.1f %9.1f %9.1f %9.1f  %8llu ",
+                name.c_str(), sent, sent / seconds, q[0], q[1], q[2], q[3],
+                dropped);
+  }
+  bool first = true;
+  for (int c = 0; c < kStatusCodes; ++c) {
+    if (m.codes[c] == 0) continue;
+    std::printf(json ? "%s\"%s\": %llu" : "%s %s=%llu",
+                first ? "" : json ? ", " : "", kCodeNames[c],
+                static_cast<unsigned long long>(m.codes[c]));
+    first = false;
+  }
+  std::printf(json ? "}}%s\n" : "\n", last ? "" : ",");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const Flags flags = ParseFlags(argc, argv);
+  if (!(flags.qps > 0) || !(flags.duration_s > 0)) {
+    std::cerr << "--qps and --duration_s must be positive" << std::endl;
+    return 1;
+  }
+
+  // Method and size distributions.
+  std::vector<double> method_weights(kNumMethods, flags.mix.empty() ? 1 : 0);
+  std::vector<std::pair<std::string, double>> parsed;
+  if (!ParseWeights(flags.mix, &parsed)) {
+    std::cerr << "bad --mix " << flags.mix << std::endl;
+    return 1;
+  }
+  for (const auto& entry : parsed) {
+    const auto* found = std::find_if(
+        kMethodNames, kMethodNames + kNumMethods,
+        [&](const char* name) { return entry.first == name; });
+    if (found == kMethodNames + kNumMethods) {
+      std::cerr << "unknown method in --mix: " << entry.first << std::endl;
+      return 1;
+    }
+    method_weights[found - kMethodNames] = entry.second;
+  }
+  parsed.clear();
+  std::vector<int> sides;
+  std::vector<double> size_weights;
+  if (!ParseWeights(flags.sizes, &parsed) || parsed.empty()) {
+    std::cerr << "bad --sizes " << flags.sizes << std::endl;
+    return 1;
+  }
+  for (const auto& entry : parsed) {
+    const int side = std::atoi(entry.first.c_str());
+    if (side < 16) {
+      std::cerr << "raster side must be at least 16: " << entry.first
+                << std::endl;
+      return 1;
+    }
+    sides.push_back(side);
+    size_weights.push_back(entry.second);
+  }
+  std::mt19937_64 rng(flags.seed);
+  std::discrete_distribution<int> pick_method(method_weights.begin(),
+                                              method_weights.end());
+  std::discrete_distribution<int> pick_size(size_weights.begin(),
+                                            size_weights.end());
+  std::exponential_distribution<double> gap(flags.qps);
+
+  std::vector<Payloads> payloads(sides.size());
+  for (size_t i = 0; i < sides.size(); ++i) {
+    grpc::Status s = BuildPayloads(sides[i], flags.format, &payloads[i]);
+    if (!s.ok()) {
+      std::cerr << "building " << sides[i] << "px payloads: "
+                << s.error_message() << std::endl;
+      return 1;
+    }
+  }
+
+  // A local subchannel pool keeps the channels on separate connections.
+  std::vector<std::unique_ptr<v1::VisionService::Stub>> stubs;
+  for (int i = 0; i < flags.channels; ++i) {
+    grpc::ChannelArguments args;
+    args.SetMaxReceiveMessageSize(-1);
+    args.SetMaxSendMessageSize(-1);
+    args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+    stubs.push_back(v1::VisionService::NewStub(grpc::CreateCustomChannel(
+        flags.target, grpc::InsecureChannelCredentials(), args)));
+  }
+
+  // Only the poller touches `stats` until it is joined.
+  std::vector<std::vector<MethodStats>> stats(
+      sides.size(), std::vector<MethodStats>(kNumMethods));
+  grpc::CompletionQueue cq;
+  std::atomic<int> outstanding{0};
+  std::thread poller([&] {
+    void* tag;
+    bool ok;
+    while (cq.Next(&tag, &ok)) {
+      std::unique_ptr<Call> call(static_cast<Call*>(tag));
+      if (call->reported) {
+        MethodStats& m = stats[call->size][call->method];
+        m.latency_us.push_back(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                Clock::now() - call->scheduled)
+                .count());
+        const int code = static_cast<int>(call->status.error_code());
+        ++m.codes[code >= 0 && code < kStatusCodes ? code : 2];
+      }
+      outstanding.fetch_sub(1, std::memory_order_relaxed);
+    }
+  });
+
+  std::cerr << "offering " << flags.qps << " qps to " << flags.target
+            << " for " << flags.warmup_s << "+" << flags.duration_s << " s"
+            << std::endl;
+  const Clock::time_point start = Clock::now();
+  const auto seconds = [](double s) {
+    return std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(s));
+  };
+  const Clock::time_point measure_from = start + seconds(flags.warmup_s);
+  const Clock::time_point end =
+      measure_from + seconds(flags.duration_s);
+  double offset_s = 0;
+  std::vector<std::vector<uint64_t>> dropped(
+      sides.size(), std::vector<uint64_t>(kNumMethods));
+  for (uint64_t n = 0;; ++n) {
+    offset_s = flags.poisson ? offset_s + gap(rng) : n / flags.qps;
+    const Clock::time_point when = start + seconds(offset_s);
+    if (when >= end) break;
+    std::this_thread::sleep_until(when);
+    const int method = pick_method(rng);
+    const int size = pick_size(rng);
+    const bool reported = when >= measure_from;
+    if (outstanding.load(std::memory_order_relaxed) >= flags.max_outstanding) {
+      if (reported) ++dropped[size][method];
+      continue;
+    }
+    Call* call = PrepareCall(
+        stubs[n % stubs.size()].get(), &cq, method, payloads[size],
+        flags.deadline_ms > 0
+            ? when + std::chrono::milliseconds(flags.deadline_ms)
+            : Clock::time_point::max());
+    call->method = method;
+    call->size = size;
+    call->reported = reported;
+    call->scheduled = when;
+    if (reported) {
+      stats[size][method].request_bytes += payloads[size].bytes[method];
+    }
+    outstanding.fetch_add(1, std::memory_order_relaxed);
+    call->Start();
+  }
+  // Deadlines bound the drain; with --deadline_ms=0 it waits for every reply.
+  while (outstanding.load(std::memory_order_relaxed) > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  cq.Shutdown();
+  poller.join();
+
+  // Per method over all sizes, per method and size, then everything.
+  std::vector<MethodStats> by_method(kNumMethods);
+  MethodStats total;
+  const auto merge = [](MethodStats* into, const MethodStats& from) {
+    into->latency_us.insert(into->latency_us.end(), from.latency_us.begin(),
+                            from.latency_us.end());
+    for (int c = 0; c < kStatusCodes; ++c) into->codes[c] += from.codes[c];
+    into->dropped += from.dropped;
+    into->request_bytes += from.request_bytes;
+  };
+  for (size_t s = 0; s < sides.size(); ++s) {
+    for (int m = 0; m < kNumMethods; ++m) {
+      stats[s][m].dropped = dropped[s][m];
+      merge(&by_method[m], stats[s][m]);
+      merge(&total, stats[s][m]);
+    }
+  }
+
+  const double measured = flags.duration_s;
+  std::vector<Row> rows;
+  for (int m = 0; m < kNumMethods; ++m) {
+    if (by_method[m].latency_us.empty() && by_method[m].dropped == 0) continue;
+    rows.push_back({kMethodNames[m], 0, &by_method[m]});
+    if (sides.size() < 2) continue;
+    for (size_t s = 0; s < sides.size(); ++s) {
+      if (stats[s][m].latency_us.empty() && stats[s][m].dropped == 0) continue;
+      rows.push_back({kMethodNames[m], sides[s], &stats[s][m]});
+    }
+  }
+  rows.push_back({"all", 0, &total});
+  if (flags.json) {
+    std::printf("{\n  \"target\": \"%s\", \"offered_qps\": %.3f, "
+                "\"duration_s\": %.3f,\n  \"results\": [\n",
+                flags.target.c_str(), flags.qps, measured);
+  } else {
+    std::printf("%-16s %8s %9s %9s %9s %9s %9s  %8s  codes\n", "method",
+                "sent", "qps", "p50 ms", "p99 ms", "p99.9 ms", "max ms",
+                "dropped");
+  }
+  for (size_t i = 0; i < rows.size(); ++i) {
+    PrintRow(rows[i], measured, flags.json, i + 1 == rows.size());
+  }
+  if (flags.json) std::printf("  ]\n}\n");
+  return 0;
+}
@@ -0,0 +1,508 @@
+#include "services/lucidia-vision/vision_ops.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+
+#include "services/lucidia-vision/colormap.h"
+#include "services/lucidia-vision/engine.h"
+#include "services/lucidia-vision/hillshade.h"
+#include "services/lucidia-vision/image_io.h"
+#include "services/lucidia-vision/mosaic.h"
+#include "services/lucidia-vision/ortho.h"
+#include "services/lucidia-vision/reproject.h"
+#include "services/lucidia-vision/resample.h"
+
+namespace lucidia {
+namespace vision {
+
+namespace {
+
+// Largest output side Resample will produce.
+constexpr uint32_t kMaxResampleSide = 1 << 16;
+constexpr int kMaxPipelineStages = 16;
+
+ResampleFilter ToResampleFilter(v1::ResampleFilter filter, bool shrinking) {
+  switch (filter) {
+    case v1::RESAMPLE_FILTER_NEAREST: return ResampleFilter::kNearest;
+    case v1::RESAMPLE_FILTER_BILINEAR: return ResampleFilter::kBilinear;
+    case v1::RESAMPLE_FILTER_BICUBIC: return ResampleFilter::kBicubic;
+    case v1::RESAMPLE_FILTER_LANCZOS3: return ResampleFilter::kLanczos3;
+    case v1::RESAMPLE_FILTER_AREA: return ResampleFilter::kArea;
+    default:
+      return shrinking ? ResampleFilter::kArea : ResampleFilter::kBilinear;
+  }
+}
+
+constexpr double kDefaultMaxError = 0.125;
+constexpr int kDefaultFeather = 32;
+
+Georef ToGeoref(const v1::GeoTransform& geo, const RasterInfo& info) {
+  Georef g;
+  g.origin_x = geo.origin_x();
+  g.origin_y = geo.origin_y();
+  g.pixel_width = geo.pixel_width();
+  g.pixel_height = geo.pixel_height();
+  g.epsg = geo.epsg();
+  g.width = info.width;
+  g.height = info.height;
+  return g;
+}
+
+// Pixel rectangle `window` selects, before clipping.
+grpc::Status WindowRect(const v1::Window& window, const char* op,
+                        const Georef* geo, Rect* out) {
+  if (window.has_pixels()) {
+    const v1::PixelWindow& p = window.pixels();
+    if (p.width() == 0 || p.height() == 0) {
+      return grpc::Status(
+          grpc::StatusCode::INVALID_ARGUMENT,
+          std::string(op) + ": window.pixels needs a width and height");
+    }
+    // Clamp in 64 bits so x + width cannot overflow.
+    const int64_t x0 = p.x(), y0 = p.y();
+    const int64_t x1 = std::min<int64_t>(x0 + p.width(), INT32_MAX);
+    const int64_t y1 = std::min<int64_t>(y0 + p.height(), INT32_MAX);
+    *out = Rect{static_cast<int>(x0), static_cast<int>(y0),
+                static_cast<int>(x1 - x0), static_cast<int>(y1 - y0)};
+    return grpc::Status::OK;
+  }
+  const v1::GeoBounds& b = window.bounds();
+  if (geo == nullptr) {
+    return grpc::Status(
+        grpc::StatusCode::INVALID_ARGUMENT,
+        std::string(op) + ": window.bounds needs a georeferenced raster");
+  }
+  if (!(b.max_x() > b.min_x() && b.max_y() > b.min_y())) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        std::string(op) + ": window.bounds is empty");
+  }
+  // Pixel-edge coordinates of the corners; either axis may be flipped.
+  const double c0 = (b.min_x() - geo->origin_x) / geo->pixel_width;
+  const double c1 = (b.max_x() - geo->origin_x) / geo->pixel_width;
+  const double r0 = (b.min_y() - geo->origin_y) / geo->pixel_height;
+  const double r1 = (b.max_y() - geo->origin_y) / geo->pixel_height;
+  // Beyond the raster the window is clipped away anyway; clamping first
+  // keeps the integer conversion defined. NaN lands on -1, which clips to
+  // nothing.
+  const auto edge = [](double v, int size, bool up) {
+    if (!(v > -1.0)) v = -1.0;
+    if (v > size + 1.0) v = size + 1.0;
+    return static_cast<int>(up ? std::ceil(v) : std::floor(v));
+  };
+  const int x0 = edge(std::min(c0, c1), geo->width, false);
+  const int x1 = edge(std::max(c0, c1), geo->width, true);
+  const int y0 = edge(std::min(r0, r1), geo->height, false);
+  const int y1 = edge(std::max(r0, r1), geo->height, true);
+  *out = Rect{x0, y0, x1 - x0, y1 - y0};
+  return grpc::Status::OK;
+}
+
+}  // namespace
+
+void ToGeoTransform(const Georef& g, v1::GeoTransform* geo) {
+  geo->set_origin_x(g.origin_x);
+  geo->set_origin_y(g.origin_y);
+  geo->set_pixel_width(g.pixel_width);
+  geo->set_pixel_height(g.pixel_height);
+  geo->set_epsg(g.epsg);
+}
+
+bool ResolveGeoref(const v1::Image& image, const RasterSource& source,
+                   Georef* out) {
+  const v1::GeoTransform& geo = image.geo();
+  if (geo.pixel_width() != 0 && geo.pixel_height() != 0) {
+    *out = ToGeoref(geo, source.info());
+    return true;
+  }
+  return source.GetGeoref(out);
+}
+
+grpc::Status CropToWindow(const v1::Window& window, const char* op,
+                          std::shared_ptr<RasterSource>* source, Georef* geo) {
+  if (window.region_case() == v1::Window::REGION_NOT_SET) {
+    return grpc::Status::OK;
+  }
+  Rect rect;
+  grpc::Status s = WindowRect(window, op, geo, &rect);
+  if (!s.ok()) return s;
+  rect = rect.Intersect((*source)->info().bounds());
+  if (rect.empty()) {
+    return grpc::Status(
+        grpc::StatusCode::INVALID_ARGUMENT,
+        std::string(op) + ": window does not overlap the raster");
+  }
+  if (rect.width == (*source)->info().width &&
+      rect.height == (*source)->info().height) {
+    return grpc::Status::OK;
+  }
+  *source = std::make_shared<CropSource>(std::move(*source), rect);
+  if (geo != nullptr) {
+    geo->origin_x += rect.x * geo->pixel_width;
+    geo->origin_y += rect.y * geo->pixel_height;
+    geo->width = rect.width;
+    geo->height = rect.height;
+  }
+  return grpc::Status::OK;
+}
+
+namespace {
+
+// Stage builders shared by the single-operation RPCs and Pipeline. Each
+// wraps `*source` in the operation's lazily computed output; `geo` is the
+// source's placement (null when it has none) and is updated to the
+// output's.
+
+grpc::Status ApplyReproject(const v1::ReprojectImageRequest& req,
+                            std::shared_ptr<RasterSource>* source,
+                            Georef* geo) {
+  if (geo == nullptr) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "reproject: input.geo is required");
+  }
+  const int src_epsg = req.src_proj().epsg(), dst_epsg = req.dst_proj().epsg();
+  std::shared_ptr<const Projection> src_proj, dst_proj;
+  grpc::Status s = FindProjection(src_epsg, &src_proj);
+  if (!s.ok()) return s;
+  s = FindProjection(dst_epsg, &dst_proj);
+  if (!s.ok()) return s;
+
+  const Georef src = *geo;
+  Georef dst;
+  s = PlanReprojection(CoordTransform(src_proj, dst_proj), src, &dst);
+  if (!s.ok()) return s;
+  const double max_error =
+      req.max_error() != 0 ? req.max_error() : kDefaultMaxError;
+  const double tolerance =
+      max_error *
+      std::min(std::abs(src.pixel_width), std::abs(src.pixel_height));
+  std::shared_ptr<const CoordGrid> grid;
+  s = CoordGridCache::Shared().Get(src_epsg, dst_epsg, dst, tolerance, &grid);
+  if (!s.ok()) return s;
+
+  *source = std::make_shared<ReprojectSource>(std::move(*source), src,
+                                              std::move(grid), dst);
+  *geo = dst;
+  geo->epsg = dst_epsg;
+  return grpc::Status::OK;
+}
+
+grpc::Status ApplyHillshade(const v1::HillshadeRequest& req,
+                            std::shared_ptr<RasterSource>* source,
+                            const Georef* geo) {
+  if ((*source)->info().bands != 1) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "hillshade: dem must have a single band");
+  }
+  if (req.sun_elevation() < 0 || req.sun_elevation() > 90) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "hillshade: sun_elevation must be in [0, 90]");
+  }
+  if (req.lights_size() > kMaxHillshadeLights) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "hillshade: at most " +
+                            std::to_string(kMaxHillshadeLights) + " lights");
+  }
+  HillshadeParams params;
+  if (req.sun_azimuth() != 0 || req.sun_elevation() != 0) {
+    params.azimuth_deg = req.sun_azimuth();
+    params.altitude_deg = req.sun_elevation();
+  }
+  for (int i = 0; i < req.lights_size(); ++i) {
+    const v1::HillshadeLight& light = req.lights(i);
+    const std::string field = "hillshade: lights[" + std::to_string(i) + "]";
+    if (light.elevation() < 0 || light.elevation() > 90) {
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                          field + ".elevation must be in [0, 90]");
+    }
+    if (light.weight() < 0) {
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                          field + ".weight must not be negative");
+    }
+    params.lights.push_back(
+        {light.azimuth(), light.elevation(),
+         light.weight() != 0 ? light.weight() : 1.0});
+  }
+  params.band_per_light = req.band_per_light();
+  params.z_factor = req.z_factor() != 0 ? req.z_factor() : 1.0;
+  if (geo != nullptr) {
+    params.cell_x = std::abs(geo->pixel_width);
+    params.cell_y = std::abs(geo->pixel_height);
+  }
+  // The raster's own CRS (GeoKeys, a dataset, an earlier stage) wins over
+  // the request's.
+  const int epsg =
+      geo != nullptr && geo->epsg != 0 ? geo->epsg : req.proj().epsg();
+  if (geo != nullptr && epsg == 4326) {
+    // Geographic DEMs: degrees to metres at the raster's centre latitude.
+    const double lat = geo->origin_y + 0.5 * geo->height * geo->pixel_height;
+    params.cell_x *= 111320.0 * std::cos(lat * M_PI / 180.0);
+    params.cell_y *= 110574.0;
+  }
+  *source = MakeHillshadeSource(std::move(*source), params);
+  return grpc::Status::OK;
+}
+
+grpc::Status ApplyResample(const v1::ResampleRequest& req,
+                           std::shared_ptr<RasterSource>* source,
+                           Georef* geo) {
+  const RasterInfo in = (*source)->info();
+  uint64_t width = req.width(), height = req.height();
+  if (width == 0 && height == 0) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "resample: width or height is required");
+  }
+  if (width == 0) width = std::max<uint64_t>(1, height * in.width / in.height);
+  if (height == 0) height = std::max<uint64_t>(1, width * in.height / in.width);
+  if (width > kMaxResampleSide || height > kMaxResampleSide) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "resample: output larger than 65536 pixels a side");
+  }
+  const bool shrinking = width < static_cast<uint64_t>(in.width) &&
+                         height < static_cast<uint64_t>(in.height);
+  std::shared_ptr<RasterSource> input = std::move(*source);
+  if (shrinking) {
+    // Start from the finest stored overview that is still at least as large
+    // as the output; the filter then only covers the remaining factor.
+    const double factor = std::min(static_cast<double>(in.width) / width,
+                                   static_cast<double>(in.height) / height);
+    if (auto overview = input->Reduced(factor)) input = std::move(overview);
+  }
+  *source = std::make_shared<ResampleSource>(
+      std::move(input), static_cast<int>(width), static_cast<int>(height),
+      ToResampleFilter(req.filter(), shrinking));
+  if (geo != nullptr) {
+    geo->pixel_width *= static_cast<double>(in.width) / width;
+    geo->pixel_height *= static_cast<double>(in.height) / height;
+    geo->width = static_cast<int>(width);
+    geo->height = static_cast<int>(height);
+  }
+  return grpc::Status::OK;
+}
+
+grpc::Status ApplyColorMap(const v1::ColorMapRequest& req,
+                           std::shared_ptr<RasterSource>* source) {
+  if ((*source)->info().bands != 1) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "colormap: input must have a single band");
+  }
+  ColorMapParams params;
+  params.palette = FindPalette(req.palette());
+  if (params.palette == nullptr) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "colormap: unknown palette \"" + req.palette() +
+                            "\" (have " + PaletteNames() + ")");
+  }
+  const uint32_t nan = req.nan_rgba();
+  params.nan = Rgba{static_cast<uint8_t>(nan >> 24),
+                    static_cast<uint8_t>(nan >> 16),
+                    static_cast<uint8_t>(nan >> 8), static_cast<uint8_t>(nan)};
+  if (req.has_range()) {
+    if (!std::isfinite(req.range().min()) ||
+        !std::isfinite(req.range().max())) {
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                          "colormap: range must be finite");
+    }
+    params.has_range = true;
+    params.min = req.range().min();
+    params.max = req.range().max();
+  } else if ((*source)->info().type == PixelType::kF32) {
+    grpc::Status s = ScanValueRange(**source, &params.min, &params.max);
+    if (!s.ok()) return s;
+  }
+  *source = MakeColorMapSource(std::move(*source), params);
+  return grpc::Status::OK;
+}
+
+}  // namespace
+
+grpc::Status RunReproject(const v1::ReprojectImageRequest& req,
+                          std::shared_ptr<RasterSource> input,
+                          v1::ReprojectImageResponse* res) {
+  Georef geo;
+  if (!ResolveGeoref(req.input(), *input, &geo)) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "reproject: input.geo is required");
+  }
+  grpc::Status s = CropToWindow(req.window(), "reproject", &input, &geo);
+  if (!s.ok()) return s;
+  s = ApplyReproject(req, &input, &geo);
+  if (!s.ok()) return s;
+  ToGeoTransform(geo, res->mutable_output()->mutable_geo());
+  return EncodeImage(*input, req.output_format(), res->mutable_output(),
+                     req.compression_level());
+}
+
+grpc::Status RunMosaic(const v1::MosaicRequest& req,
+                       std::vector<std::shared_ptr<RasterSource>> inputs,
+                       v1::MosaicResponse* res) {
+  std::vector<MosaicInput> placed(inputs.size());
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    if (!ResolveGeoref(req.inputs(static_cast<int>(i)), *inputs[i],
+                       &placed[i].georef)) {
+      return grpc::Status(
+          grpc::StatusCode::INVALID_ARGUMENT,
+          "mosaic: inputs[" + std::to_string(i) + "].geo is required");
+    }
+    placed[i].source = std::move(inputs[i]);
+  }
+  std::unique_ptr<MosaicSource> mosaic;
+  grpc::Status s = MosaicSource::Create(
+      std::move(placed), req.feather() != 0 ? req.feather() : kDefaultFeather,
+      &mosaic);
+  if (!s.ok()) return s;
+  Georef geo = mosaic->georef();
+  if (geo.epsg == 0) geo.epsg = req.proj().epsg();
+  std::shared_ptr<RasterSource> output(std::move(mosaic));
+  s = CropToWindow(req.window(), "mosaic", &output, &geo);
+  if (!s.ok()) return s;
+  ToGeoTransform(geo, res->mutable_output()->mutable_geo());
+  return EncodeImage(*output, req.output_format(), res->mutable_output(),
+                     req.compression_level());
+}
+
+grpc::Status RunHillshade(const v1::HillshadeRequest& req,
+                          std::shared_ptr<RasterSource> dem,
+                          v1::HillshadeResponse* res) {
+  Georef geo;
+  const bool has_geo = ResolveGeoref(req.dem(), *dem, &geo);
+  if (geo.epsg == 0) geo.epsg = req.proj().epsg();
+  grpc::Status s =
+      CropToWindow(req.window(), "hillshade", &dem, has_geo ? &geo : nullptr);
+  if (!s.ok()) return s;
+  s = ApplyHillshade(req, &dem, has_geo ? &geo : nullptr);
+  if (!s.ok()) return s;
+  if (has_geo) ToGeoTransform(geo, res->mutable_output()->mutable_geo());
+  return EncodeImage(*dem, req.output_format(), res->mutable_output(),
+                     req.compression_level());
+}
+
+grpc::Status RunOrthorectify(const v1::OrthorectifyDEMRequest& req,
+                             std::shared_ptr<RasterSource> dem,
+                             std::shared_ptr<RasterSource> texture,
+                             v1::OrthorectifyDEMResponse* res) {
+  if (dem->info().bands != 1) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "orthorectify: dem must have a single band");
+  }
+  Georef geo;
+  if (!ResolveGeoref(req.dem(), *dem, &geo)) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "orthorectify: dem.geo is required");
+  }
+  if (geo.epsg == 0) geo.epsg = req.proj().epsg();
+  const v1::FrameCamera& in = req.camera();
+  if (!(in.focal_px() > 0)) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "orthorectify: camera.focal_px must be positive");
+  }
+  FrameCamera camera;
+  camera.x = in.x();
+  camera.y = in.y();
+  camera.z = in.z();
+  camera.omega_deg = in.omega();
+  camera.phi_deg = in.phi();
+  camera.kappa_deg = in.kappa();
+  camera.focal_px = in.focal_px();
+  camera.cx = in.cx();
+  camera.cy = in.cy();
+  std::shared_ptr<RasterSource> ortho;
+  grpc::Status s = MakeOrthoSource(std::move(dem), geo, std::move(texture),
+                                   camera, &ortho);
+  if (!s.ok()) return s;
+  // The model above still spans the whole DEM: terrain outside the window
+  // can hide parts of it.
+  s = CropToWindow(req.window(), "orthorectify", &ortho, &geo);
+  if (!s.ok()) return s;
+  ToGeoTransform(geo, res->mutable_output()->mutable_geo());
+  return EncodeImage(*ortho, req.output_format(), res->mutable_output(),
+                     req.compression_level());
+}
+
+grpc::Status RunResample(const v1::ResampleRequest& req,
+                         std::shared_ptr<RasterSource> input,
+                         v1::ResampleResponse* res) {
+  Georef geo;
+  const bool has_geo = ResolveGeoref(req.input(), *input, &geo);
+  grpc::Status s =
+      CropToWindow(req.window(), "resample", &input, has_geo ? &geo : nullptr);
+  if (!s.ok()) return s;
+  s = ApplyResample(req, &input, has_geo ? &geo : nullptr);
+  if (!s.ok()) return s;
+  if (has_geo) ToGeoTransform(geo, res->mutable_output()->mutable_geo());
+  const std::string& format = req.output_format().empty()
+                                  ? req.input().format()
+                                  : req.output_format();
+  return EncodeImage(*input, format, res->mutable_output(),
+                     req.compression_level());
+}
+
+grpc::Status RunColorMap(const v1::ColorMapRequest& req,
+                         std::shared_ptr<RasterSource> input,
+                         v1::ColorMapResponse* res) {
+  if (input->info().bands != 1) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "colormap: input must have a single band");
+  }
+  Georef geo;
+  const bool has_geo = ResolveGeoref(req.input(), *input, &geo);
+  grpc::Status s =
+      CropToWindow(req.window(), "colormap", &input, has_geo ? &geo : nullptr);
+  if (!s.ok()) return s;
+  s = ApplyColorMap(req, &input);
+  if (!s.ok()) return s;
+  if (has_geo) ToGeoTransform(geo, res->mutable_output()->mutable_geo());
+  return EncodeImage(*input, req.output_format(), res->mutable_output(),
+                     req.compression_level());
+}
+
+grpc::Status RunPipeline(const v1::PipelineRequest& req,
+                         std::shared_ptr<RasterSource> input,
+                         v1::PipelineResponse* res) {
+  if (req.stages_size() == 0 || req.stages_size() > kMaxPipelineStages) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "pipeline: 1 to " + std::to_string(kMaxPipelineStages) +
+                            " stages required");
+  }
+  Georef geo;
+  bool has_geo = ResolveGeoref(req.input(), *input, &geo);
+  grpc::Status s =
+      CropToWindow(req.window(), "pipeline", &input, has_geo ? &geo : nullptr);
+  if (!s.ok()) return s;
+  // Only sources are chained here; tiles are computed when the encoder
+  // pulls them, each stage reading its upstream through the tile cache.
+  for (int i = 0; i < req.stages_size(); ++i) {
+    const v1::PipelineStage& stage = req.stages(i);
+    Georef* placed = has_geo ? &geo : nullptr;
+    switch (stage.op_case()) {
+      case v1::PipelineStage::kReproject:
+        s = ApplyReproject(stage.reproject(), &input, placed);
+        break;
+      case v1::PipelineStage::kResample:
+        s = ApplyResample(stage.resample(), &input, placed);
+        break;
+      case v1::PipelineStage::kHillshade:
+        s = ApplyHillshade(stage.hillshade(), &input, placed);
+        break;
+      case v1::PipelineStage::kColorMap:
+        s = ApplyColorMap(stage.color_map(), &input);
+        break;
+      case v1::PipelineStage::OP_NOT_SET:
+        s = grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                         "stage has no operation");
+        break;
+    }
+    if (!s.ok()) {
+      return grpc::Status(s.error_code(), "pipeline: stages[" +
+                                              std::to_string(i) + "]: " +
+                                              s.error_message());
+    }
+  }
+  if (has_geo) ToGeoTransform(geo, res->mutable_output()->mutable_geo());
+  return EncodeImage(*input, req.output_format(), res->mutable_output(),
+                     req.compression_level());
+}
+
+}  // namespace vision
+}  // namespace lucidia
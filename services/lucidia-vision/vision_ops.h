@@ -0,0 +1,62 @@
+// VisionService operations on already-opened raster sources.
+//
+// The unary handlers, the chunked-upload handlers and any other entry point
+// open their inputs however suits them and then call into these.
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "proto/vision_service.pb.h"
+#include "services/lucidia-vision/raster.h"
+
+namespace lucidia {
+namespace vision {
+
+// Placement of `source`: the request's GeoTransform when set, else whatever
+// the encoded raster carries (GeoTIFF tags). False if neither has one.
+bool ResolveGeoref(const v1::Image& image, const RasterSource& source,
+                   Georef* out);
+
+// Writes `g`'s placement and CRS into `geo`.
+void ToGeoTransform(const Georef& g, v1::GeoTransform* geo);
+
+// Narrows `*source` to the part `window` selects, clipped to the raster.
+// `geo` is the source's placement, or null when it has none (bounds windows
+// then fail); it is moved to the window. No region leaves both unchanged.
+// `op` prefixes error messages.
+grpc::Status CropToWindow(const v1::Window& window, const char* op,
+                          std::shared_ptr<RasterSource>* source, Georef* geo);
+
+grpc::Status RunReproject(const v1::ReprojectImageRequest& req,
+                          std::shared_ptr<RasterSource> input,
+                          v1::ReprojectImageResponse* res);
+
+grpc::Status RunMosaic(const v1::MosaicRequest& req,
+                       std::vector<std::shared_ptr<RasterSource>> inputs,
+                       v1::MosaicResponse* res);
+
+grpc::Status RunHillshade(const v1::HillshadeRequest& req,
+                          std::shared_ptr<RasterSource> dem,
+                          v1::HillshadeResponse* res);
+
+grpc::Status RunOrthorectify(const v1::OrthorectifyDEMRequest& req,
+                             std::shared_ptr<RasterSource> dem,
+                             std::shared_ptr<RasterSource> texture,
+                             v1::OrthorectifyDEMResponse* res);
+
+grpc::Status RunResample(const v1::ResampleRequest& req,
+                         std::shared_ptr<RasterSource> input,
+                         v1::ResampleResponse* res);
+
+grpc::Status RunColorMap(const v1::ColorMapRequest& req,
+                         std::shared_ptr<RasterSource> input,
+                         v1::ColorMapResponse* res);
+
+// Chains the stages on `input` and encodes only the last one's output.
+grpc::Status RunPipeline(const v1::PipelineRequest& req,
+                         std::shared_ptr<RasterSource> input,
+                         v1::PipelineResponse* res);
+
+}  // namespace vision
+}  // namespace lucidia
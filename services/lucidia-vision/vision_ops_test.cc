@@ -0,0 +1,240 @@
+#include "services/lucidia-vision/vision_ops.h"
+
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <string>
+
+#include <gtest/gtest.h>
+#include "proto/vision_service.pb.h"
+#include "services/lucidia-vision/image_io.h"
+#include "services/lucidia-vision/test_util.h"
+
+namespace lucidia {
+namespace vision {
+namespace {
+
+using testing::MakeRaster;
+
+std::shared_ptr<RasterSource> Gradient(int width, int height) {
+  return MakeRaster(width, height, 1, PixelType::kU8,
+                    [](int x, int y, int) { return (x + y) % 256; });
+}
+
+void Place(v1::Image* image) {
+  v1::GeoTransform* geo = image->mutable_geo();
+  geo->set_origin_x(500000.0);
+  geo->set_origin_y(4200000.0);
+  geo->set_pixel_width(10.0);
+  geo->set_pixel_height(-10.0);
+}
+
+TEST(RunResampleTest, ScalesPixelSize) {
+  v1::ResampleRequest req;
+  Place(req.mutable_input());
+  req.set_width(200);
+  v1::ResampleResponse res;
+  ASSERT_TRUE(RunResample(req, Gradient(400, 300), &res).ok());
+  ASSERT_EQ(res.output().height(), 150u);
+  ASSERT_TRUE(res.output().has_geo());
+  const v1::GeoTransform& geo = res.output().geo();
+  EXPECT_DOUBLE_EQ(geo.origin_x(), 500000.0);
+  EXPECT_DOUBLE_EQ(geo.origin_y(), 4200000.0);
+  EXPECT_DOUBLE_EQ(geo.pixel_width(), 20.0);
+  EXPECT_DOUBLE_EQ(geo.pixel_height(), -20.0);
+}
+
+// The output is placed at the window, not at the whole input.
+TEST(RunResampleTest, PlacesWindow) {
+  v1::ResampleRequest req;
+  Place(req.mutable_input());
+  v1::PixelWindow* pixels = req.mutable_window()->mutable_pixels();
+  pixels->set_x(100);
+  pixels->set_y(40);
+  pixels->set_width(200);
+  pixels->set_height(100);
+  req.set_width(50);
+  v1::ResampleResponse res;
+  ASSERT_TRUE(RunResample(req, Gradient(400, 300), &res).ok());
+  ASSERT_EQ(res.output().height(), 25u);
+  const v1::GeoTransform& geo = res.output().geo();
+  EXPECT_DOUBLE_EQ(geo.origin_x(), 501000.0);
+  EXPECT_DOUBLE_EQ(geo.origin_y(), 4199600.0);
+  EXPECT_DOUBLE_EQ(geo.pixel_width(), 40.0);
+  EXPECT_DOUBLE_EQ(geo.pixel_height(), -40.0);
+}
+
+TEST(RunResampleTest, UnplacedInputStaysUnplaced) {
+  v1::ResampleRequest req;
+  req.set_width(200);
+  v1::ResampleResponse res;
+  ASSERT_TRUE(RunResample(req, Gradient(400, 300), &res).ok());
+  EXPECT_FALSE(res.output().has_geo());
+}
+
+TEST(RunColorMapTest, KeepsGeo) {
+  v1::ColorMapRequest req;
+  Place(req.mutable_input());
+  v1::ColorMapResponse res;
+  ASSERT_TRUE(RunColorMap(req, Gradient(64, 48), &res).ok());
+  ASSERT_TRUE(res.output().has_geo());
+  const v1::GeoTransform& geo = res.output().geo();
+  EXPECT_DOUBLE_EQ(geo.origin_x(), 500000.0);
+  EXPECT_DOUBLE_EQ(geo.origin_y(), 4200000.0);
+  EXPECT_DOUBLE_EQ(geo.pixel_width(), 10.0);
+  EXPECT_DOUBLE_EQ(geo.pixel_height(), -10.0);
+}
+
+TEST(RunColorMapTest, PlacesBoundsWindow) {
+  v1::ColorMapRequest req;
+  Place(req.mutable_input());
+  // Pixels 10-29 across, 5-14 down; edges inside a pixel widen to it.
+  v1::GeoBounds* bounds = req.mutable_window()->mutable_bounds();
+  bounds->set_min_x(500105.0);
+  bounds->set_max_x(500295.0);
+  bounds->set_min_y(4199855.0);
+  bounds->set_max_y(4199945.0);
+  v1::ColorMapResponse res;
+  ASSERT_TRUE(RunColorMap(req, Gradient(64, 48), &res).ok());
+  EXPECT_EQ(res.output().width(), 20u);
+  EXPECT_EQ(res.output().height(), 10u);
+  const v1::GeoTransform& geo = res.output().geo();
+  EXPECT_DOUBLE_EQ(geo.origin_x(), 500100.0);
+  EXPECT_DOUBLE_EQ(geo.origin_y(), 4199950.0);
+  EXPECT_DOUBLE_EQ(geo.pixel_width(), 10.0);
+  EXPECT_DOUBLE_EQ(geo.pixel_height(), -10.0);
+}
+
+TEST(RunColorMapTest, RejectsNonFiniteRange) {
+  const double bad[] = {std::numeric_limits<double>::quiet_NaN(),
+                        std::numeric_limits<double>::infinity()};
+  for (double v : bad) {
+    v1::ColorMapRequest req;
+    req.mutable_range()->set_min(v);
+    req.mutable_range()->set_max(100.0);
+    v1::ColorMapResponse res;
+    EXPECT_EQ(RunColorMap(req, Gradient(8, 8), &res).error_code(),
+              grpc::StatusCode::INVALID_ARGUMENT);
+    req.mutable_range()->set_min(0.0);
+    req.mutable_range()->set_max(-v);
+    EXPECT_EQ(RunColorMap(req, Gradient(8, 8), &res).error_code(),
+              grpc::StatusCode::INVALID_ARGUMENT);
+  }
+}
+
+// The mosaic keeps its inputs' CRS; the request's proj only fills in for
+// inputs that name none.
+TEST(RunMosaicTest, OutputCrsFromInputsThenProj) {
+  auto mosaic = [](int input_epsg, int request_epsg) {
+    v1::MosaicRequest req;
+    for (int i = 0; i < 2; ++i) {
+      v1::Image* image = req.add_inputs();
+      Place(image);
+      image->mutable_geo()->set_origin_x(500000.0 + 320.0 * i);
+      image->mutable_geo()->set_epsg(input_epsg);
+    }
+    req.mutable_proj()->set_epsg(request_epsg);
+    v1::MosaicResponse res;
+    EXPECT_TRUE(RunMosaic(req, {Gradient(64, 48), Gradient(64, 48)}, &res)
+                    .ok());
+    return res.output().geo().epsg();
+  };
+  EXPECT_EQ(mosaic(32633, 0), 32633);
+  EXPECT_EQ(mosaic(32633, 32633), 32633);
+  EXPECT_EQ(mosaic(0, 32633), 32633);
+  EXPECT_EQ(mosaic(0, 0), 0);
+}
+
+// Degree-sized cells of a geographic DEM are converted to metres whether
+// the CRS comes with the raster or only from the request's proj; a raster
+// that names a projected CRS is not converted.
+TEST(RunHillshadeTest, GeographicCrsFromRasterOrRequest) {
+  auto dem = MakeRaster(64, 64, 1, PixelType::kF32,
+                        [](int x, int y, int) { return 5.0f * x + 2.0f * y; });
+  auto shade = [&](int raster_epsg, int request_epsg) {
+    v1::HillshadeRequest req;
+    v1::GeoTransform* geo = req.mutable_dem()->mutable_geo();
+    geo->set_origin_x(10.0);
+    geo->set_origin_y(45.0);
+    geo->set_pixel_width(0.0001);
+    geo->set_pixel_height(-0.0001);
+    geo->set_epsg(raster_epsg);
+    req.mutable_proj()->set_epsg(request_epsg);
+    v1::HillshadeResponse res;
+    EXPECT_TRUE(RunHillshade(req, dem, &res).ok());
+    return res.output().data();
+  };
+  const std::string from_raster = shade(4326, 0);
+  ASSERT_FALSE(from_raster.empty());
+  EXPECT_TRUE(from_raster == shade(0, 4326));
+  EXPECT_TRUE(from_raster == shade(4326, 32633));
+  const std::string unconverted = shade(0, 0);
+  EXPECT_FALSE(from_raster == unconverted);
+  EXPECT_TRUE(unconverted == shade(32633, 4326));
+}
+
+// Resample, Hillshade and ColorMap as one Pipeline call and as three calls
+// passing TIFF between them encode the same PNG.
+TEST(RunPipelineTest, MatchesChainedCallsThroughTiff) {
+  auto dem = MakeRaster(400, 300, 1, PixelType::kF32, [](int x, int y, int) {
+    return 300.0f + 80.0f * std::sin(x * 0.05f) * std::cos(y * 0.04f);
+  });
+  v1::Window window;
+  v1::PixelWindow* pixels = window.mutable_pixels();
+  pixels->set_x(30);
+  pixels->set_y(20);
+  pixels->set_width(320);
+  pixels->set_height(240);
+
+  v1::ResampleRequest resample;
+  resample.set_width(200);
+  resample.set_filter(v1::RESAMPLE_FILTER_BILINEAR);
+  v1::HillshadeRequest hillshade;
+  hillshade.set_sun_azimuth(300.0);
+  hillshade.set_sun_elevation(40.0);
+  hillshade.set_z_factor(2.0);
+  v1::ColorMapRequest color_map;
+  color_map.set_palette("terrain");
+
+  v1::PipelineRequest pipeline;
+  Place(pipeline.mutable_input());
+  *pipeline.mutable_window() = window;
+  *pipeline.add_stages()->mutable_resample() = resample;
+  *pipeline.add_stages()->mutable_hillshade() = hillshade;
+  *pipeline.add_stages()->mutable_color_map() = color_map;
+  v1::PipelineResponse piped;
+  ASSERT_TRUE(RunPipeline(pipeline, dem, &piped).ok());
+
+  Place(resample.mutable_input());
+  *resample.mutable_window() = window;
+  resample.set_output_format("tiff");
+  v1::ResampleResponse resampled;
+  ASSERT_TRUE(RunResample(resample, dem, &resampled).ok());
+  std::shared_ptr<RasterSource> source;
+  ASSERT_TRUE(OpenImage(resampled.output(), kDefaultTileSize, &source).ok());
+
+  *hillshade.mutable_dem() = resampled.output();
+  hillshade.set_output_format("tiff");
+  v1::HillshadeResponse shaded;
+  ASSERT_TRUE(RunHillshade(hillshade, source, &shaded).ok());
+  ASSERT_TRUE(OpenImage(shaded.output(), kDefaultTileSize, &source).ok());
+
+  *color_map.mutable_input() = shaded.output();
+  v1::ColorMapResponse colored;
+  ASSERT_TRUE(RunColorMap(color_map, source, &colored).ok());
+
+  const v1::Image& a = piped.output();
+  const v1::Image& b = colored.output();
+  EXPECT_EQ(a.width(), 200u);
+  EXPECT_EQ(a.height(), 150u);
+  EXPECT_EQ(a.width(), b.width());
+  EXPECT_EQ(a.height(), b.height());
+  EXPECT_EQ(a.geo().SerializeAsString(), b.geo().SerializeAsString());
+  ASSERT_FALSE(a.data().empty());
+  EXPECT_TRUE(a.data() == b.data()) << a.data().size() << " vs "
+                                    << b.data().size() << " bytes";
+}
+
+}  // namespace
+}  // namespace vision
+}  // namespace lucidia
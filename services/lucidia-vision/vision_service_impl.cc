@@ -0,0 +1,653 @@
+#include "services/lucidia-vision/vision_service_impl.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "services/lucidia-vision/byte_stream.h"
+#include "services/lucidia-vision/image_io.h"
+#include "services/lucidia-vision/metrics.h"
+#include "services/lucidia-vision/raster.h"
+#include "services/lucidia-vision/thread_pool.h"
+#include "services/lucidia-vision/vision_ops.h"
+
+namespace lucidia {
+namespace vision {
+
+using namespace v1;  // import request/response messages
+
+const char* const kVisionMethods[] = {
+    "ReprojectImage",
+    "TilePyramid",
+    "Mosaic",
+    "Hillshade",
+    "OrthorectifyDEM",
+    "Resample",
+    "ColorMap",
+    "Pipeline",
+    "Batch",
+    "RegisterDataset",
+    "ReleaseDataset",
+    "StreamTilePyramid",
+    "UploadReprojectImage",
+    "UploadHillshade",
+    "UploadOrthorectifyDEM",
+};
+const int kNumVisionMethods =
+    sizeof(kVisionMethods) / sizeof(kVisionMethods[0]);
+
+namespace {
+
+constexpr int kMaxBatchItems = 4096;
+// How long a finished upload call waits for the client to end its stream.
+constexpr std::chrono::seconds kUploadEndGrace(1);
+
+// Answers from `cache` when it holds `req`'s result; otherwise runs
+// `compute` to fill `res` and stores it. Without a cache just computes.
+template <typename Res, typename Fn>
+grpc::Status Cached(ResultCache* cache, const char* method,
+                    const google::protobuf::Message& req, Res* res,
+                    Fn compute) {
+  if (cache == nullptr) return compute();
+  ResultCache::Value value;
+  bool computed = false;
+  grpc::Status s = cache->GetOrCompute(
+      HashRequest(method, req),
+      [&](std::string* out) {
+        grpc::Status s = compute();
+        if (s.ok()) res->SerializeToString(out);
+        return s;
+      },
+      &value, &computed);
+  if (!s.ok() || computed) return s;
+  if (!res->ParseFromString(*value)) {
+    return grpc::Status(grpc::StatusCode::INTERNAL,
+                        std::string(method) + ": corrupt cache entry");
+  }
+  return grpc::Status::OK;
+}
+
+// Output pixels of every non-empty Image in `msg`, however deeply nested.
+uint64_t ImagePixels(const google::protobuf::Message& msg) {
+  if (msg.GetDescriptor() == Image::descriptor()) {
+    const Image& image = static_cast<const Image&>(msg);
+    return image.empty() ? 0 : uint64_t{image.width()} * image.height();
+  }
+  const google::protobuf::Reflection* reflection = msg.GetReflection();
+  std::vector<const google::protobuf::FieldDescriptor*> fields;
+  reflection->ListFields(msg, &fields);
+  uint64_t pixels = 0;
+  for (const auto* field : fields) {
+    if (field->cpp_type() !=
+        google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE) {
+      continue;
+    }
+    if (!field->is_repeated()) {
+      pixels += ImagePixels(reflection->GetMessage(msg, field));
+      continue;
+    }
+    for (int i = 0; i < reflection->FieldSize(msg, field); ++i) {
+      pixels += ImagePixels(reflection->GetRepeatedMessage(msg, field, i));
+    }
+  }
+  return pixels;
+}
+
+// Records a finished call, counting `res` when it is being sent.
+grpc::Status Replied(CallRecorder* call, grpc::Status status,
+                     const google::protobuf::Message& res) {
+  if (status.ok()) {
+    call->AddBytesOut(res.ByteSizeLong());
+    call->AddPixels(ImagePixels(res));
+  }
+  return call->Finish(std::move(status));
+}
+
+// Runs a unary handler body under `metrics` (when set): latency by status
+// code, request and response sizes and output pixels.
+template <typename Fn>
+grpc::Status Measured(Metrics* metrics, const char* method,
+                      const google::protobuf::Message& req,
+                      const google::protobuf::Message& res, Fn body) {
+  if (metrics == nullptr) return body();
+  CallRecorder call(metrics, method);
+  call.AddBytesIn(req.ByteSizeLong());
+  return Replied(&call, body(), res);
+}
+
+using UploadInputs = std::vector<std::shared_ptr<ChunkedByteStream>>;
+
+// Runs `compute` on the calling gRPC handler thread while a thread of the
+// call's own feeds upload chunks into `inputs`, so ingest overlaps network
+// time. Until every input has arrived, ParallelFor inside `compute` runs
+// inline: pool workers would otherwise wait on the client for the bytes.
+// Fails with RESOURCE_EXHAUSTED once the inputs together pass `max_bytes`.
+// A call whose compute ends while the client is still sending is cancelled,
+// so a stalled client cannot hold the handler in a read.
+template <typename Upload>
+grpc::Status PumpUpload(grpc::ServerContext* ctx,
+                        grpc::ServerReader<Upload>* reader,
+                        const UploadInputs& inputs, uint64_t max_bytes,
+                        CallRecorder* call,
+                        const std::function<grpc::Status()>& compute) {
+  std::atomic<bool> stop{false};
+  grpc::Status status;
+  std::promise<void> drained;
+  std::future<void> pump_done = drained.get_future();
+  std::thread pump([&] {
+    uint64_t bytes = 0;
+    Upload msg;
+    while (!stop.load() && reader->Read(&msg)) {
+      call->AddBytesIn(msg.ByteSizeLong());
+      if (!msg.has_chunk() || msg.chunk().input() >= inputs.size()) {
+        status = grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                              "expected a chunk for a known input");
+        break;
+      }
+      bytes += msg.chunk().data().size();
+      if (bytes > max_bytes) {
+        status = grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED,
+                              "upload: inputs exceed " +
+                                  std::to_string(max_bytes >> 20) + " MiB");
+        break;
+      }
+      inputs[msg.chunk().input()]->Append(
+          std::move(*msg.mutable_chunk()->mutable_data()));
+    }
+    drained.set_value();  // Done reading; compute may see the end any time.
+    for (const auto& in : inputs) {
+      if (status.ok()) {
+        in->Close();
+      } else {
+        in->Abort(status);
+      }
+    }
+  });
+  grpc::Status result;
+  {
+    SerialWhile serial([&] {
+      uint64_t size;
+      for (const auto& in : inputs) {
+        if (!in->FinalSize(&size)) return true;
+      }
+      return false;
+    });
+    result = compute();
+  }
+  // The pump may be blocked reading from a client that has stopped
+  // sending. After a success the client is given a moment to end its
+  // stream; otherwise the call is cancelled so the read returns.
+  stop.store(true);
+  const auto grace = result.ok() ? kUploadEndGrace : std::chrono::seconds(0);
+  if (pump_done.wait_for(grace) != std::future_status::ready) {
+    ctx->TryCancel();
+  }
+  pump.join();
+  return status.ok() ? result : status;
+}
+
+template <typename Upload, typename Request>
+grpc::Status ReadUploadHeader(grpc::ServerReader<Upload>* reader,
+                              Request* header, CallRecorder* call) {
+  Upload msg;
+  if (!reader->Read(&msg) || !msg.has_header()) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "first upload message must carry the request header");
+  }
+  call->AddBytesIn(msg.ByteSizeLong());
+  header->Swap(msg.mutable_header());
+  return grpc::Status::OK;
+}
+
+// Method whose limit a Batch item counts against; null without an op.
+const char* BatchItemMethod(const BatchItem& item) {
+  switch (item.op_case()) {
+    case BatchItem::kReproject: return "ReprojectImage";
+    case BatchItem::kTilePyramid: return "TilePyramid";
+    case BatchItem::kMosaic: return "Mosaic";
+    case BatchItem::kHillshade: return "Hillshade";
+    case BatchItem::kOrthorectify: return "OrthorectifyDEM";
+    case BatchItem::kResample: return "Resample";
+    case BatchItem::kColorMap: return "ColorMap";
+    case BatchItem::kPipeline: return "Pipeline";
+    case BatchItem::OP_NOT_SET: break;
+  }
+  return nullptr;
+}
+
+UploadInputs MakeUploadInputs(size_t n) {
+  UploadInputs inputs;
+  for (size_t i = 0; i < n; ++i) {
+    inputs.push_back(std::make_shared<ChunkedByteStream>());
+  }
+  return inputs;
+}
+
+}  // namespace
+
+grpc::Status VisionServiceImpl::Admit(const char* method,
+                                      AdmissionController::Ticket* ticket) {
+  if (admission_ == nullptr) return grpc::Status::OK;
+  return admission_->Admit(method, ticket);
+}
+
+grpc::Status VisionServiceImpl::ReprojectImage(grpc::ServerContext*,
+                                               const ReprojectImageRequest* req,
+                                               ReprojectImageResponse* res) {
+  return Measured(metrics_, "ReprojectImage", *req, *res, [&] {
+    AdmissionController::Ticket ticket;
+    grpc::Status s = Admit("ReprojectImage", &ticket);
+    if (!s.ok()) return s;
+    return ComputeReprojectImage(*req, res);
+  });
+}
+
+grpc::Status VisionServiceImpl::TilePyramid(grpc::ServerContext*,
+                                            const TilePyramidRequest* req,
+                                            TilePyramidResponse* res) {
+  return Measured(metrics_, "TilePyramid", *req, *res, [&] {
+    AdmissionController::Ticket ticket;
+    grpc::Status s = Admit("TilePyramid", &ticket);
+    if (!s.ok()) return s;
+    return ComputeTilePyramid(*req, res);
+  });
+}
+
+grpc::Status VisionServiceImpl::StreamTilePyramid(
+    grpc::ServerContext* ctx, const TilePyramidRequest* req,
+    grpc::ServerWriter<PyramidTile>* writer) {
+  CallRecorder call(metrics_, "StreamTilePyramid");
+  call.AddBytesIn(req->ByteSizeLong());
+  AdmissionController::Ticket ticket;
+  grpc::Status s = Admit("StreamTilePyramid", &ticket);
+  if (!s.ok()) return call.Finish(s);
+  s = RunTilePyramid(*req, [&](int z, int x, int y, Image* tile) {
+    if (ctx->IsCancelled()) {
+      return grpc::Status(grpc::StatusCode::CANCELLED, "client cancelled");
+    }
+    PyramidTile t;
+    t.set_z(z);
+    t.set_x(x);
+    t.set_y(y);
+    t.mutable_tile()->Swap(tile);
+    if (!writer->Write(t)) {
+      return grpc::Status(grpc::StatusCode::CANCELLED, "stream closed");
+    }
+    call.AddBytesOut(t.ByteSizeLong());
+    call.AddPixels(ImagePixels(t));
+    return grpc::Status::OK;
+  });
+  return call.Finish(s);
+}
+
+grpc::Status VisionServiceImpl::Mosaic(grpc::ServerContext*,
+                                       const MosaicRequest* req,
+                                       MosaicResponse* res) {
+  return Measured(metrics_, "Mosaic", *req, *res, [&] {
+    AdmissionController::Ticket ticket;
+    grpc::Status s = Admit("Mosaic", &ticket);
+    if (!s.ok()) return s;
+    return ComputeMosaic(*req, res);
+  });
+}
+
+grpc::Status VisionServiceImpl::Hillshade(grpc::ServerContext*,
+                                          const HillshadeRequest* req,
+                                          HillshadeResponse* res) {
+  return Measured(metrics_, "Hillshade", *req, *res, [&] {
+    AdmissionController::Ticket ticket;
+    grpc::Status s = Admit("Hillshade", &ticket);
+    if (!s.ok()) return s;
+    return ComputeHillshade(*req, res);
+  });
+}
+
+grpc::Status VisionServiceImpl::OrthorectifyDEM(
+    grpc::ServerContext*, const OrthorectifyDEMRequest* req,
+    OrthorectifyDEMResponse* res) {
+  return Measured(metrics_, "OrthorectifyDEM", *req, *res, [&] {
+    AdmissionController::Ticket ticket;
+    grpc::Status s = Admit("OrthorectifyDEM", &ticket);
+    if (!s.ok()) return s;
+    return ComputeOrthorectifyDEM(*req, res);
+  });
+}
+
+grpc::Status VisionServiceImpl::Resample(grpc::ServerContext*,
+                                         const ResampleRequest* req,
+                                         ResampleResponse* res) {
+  return Measured(metrics_, "Resample", *req, *res, [&] {
+    AdmissionController::Ticket ticket;
+    grpc::Status s = Admit("Resample", &ticket);
+    if (!s.ok()) return s;
+    return ComputeResample(*req, res);
+  });
+}
+
+grpc::Status VisionServiceImpl::ColorMap(grpc::ServerContext*,
+                                         const ColorMapRequest* req,
+                                         ColorMapResponse* res) {
+  return Measured(metrics_, "ColorMap", *req, *res, [&] {
+    AdmissionController::Ticket ticket;
+    grpc::Status s = Admit("ColorMap", &ticket);
+    if (!s.ok()) return s;
+    return ComputeColorMap(*req, res);
+  });
+}
+
+grpc::Status VisionServiceImpl::Pipeline(grpc::ServerContext*,
+                                         const PipelineRequest* req,
+                                         PipelineResponse* res) {
+  return Measured(metrics_, "Pipeline", *req, *res, [&] {
+    AdmissionController::Ticket ticket;
+    grpc::Status s = Admit("Pipeline", &ticket);
+    if (!s.ok()) return s;
+    return ComputePipeline(*req, res);
+  });
+}
+
+grpc::Status VisionServiceImpl::Batch(grpc::ServerContext* ctx,
+                                      const BatchRequest* req,
+                                      BatchResponse* res) {
+  return RunBatch(req, res,
+                  [ctx] { return ctx != nullptr && ctx->IsCancelled(); });
+}
+
+grpc::Status VisionServiceImpl::RunBatch(
+    const BatchRequest* req, BatchResponse* res,
+    const std::function<bool()>& cancelled) {
+  return Measured(metrics_, "Batch", *req, *res, [&] {
+    if (req->items_size() > kMaxBatchItems) {
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                          "batch: at most " + std::to_string(kMaxBatchItems) +
+                              " items");
+    }
+    AdmissionController::Ticket ticket;
+    grpc::Status s = Admit("Batch", &ticket);
+    if (!s.ok()) return s;
+    for (int i = 0; i < req->items_size(); ++i) res->add_results();
+    // One pool task per item rather than per RPC. Small items are a single
+    // tile, so their own kernels run inline on the task that picked them up.
+    ParallelFor(req->items_size(), [&](int i) {
+      const BatchItem& item = req->items(i);
+      BatchResult* result = res->mutable_results(i);
+      // Held while the item runs, so items count against their method's
+      // limit exactly as separate calls would.
+      AdmissionController::Ticket item_ticket;
+      grpc::Status s;
+      if (cancelled()) {
+        s = grpc::Status(grpc::StatusCode::CANCELLED, "client cancelled");
+      } else if (item_admission_ != nullptr &&
+                 BatchItemMethod(item) != nullptr) {
+        s = item_admission_->Admit(BatchItemMethod(item), &item_ticket);
+      }
+      if (s.ok()) s = RunBatchItem(item, result);
+      if (!s.ok()) {
+        result->Clear();
+        result->set_code(s.error_code());
+        result->set_message(s.error_message());
+      }
+    });
+    return grpc::Status::OK;
+  });
+}
+
+grpc::Status VisionServiceImpl::RunBatchItem(const BatchItem& item,
+                                             BatchResult* result) {
+  switch (item.op_case()) {
+    case BatchItem::kReproject:
+      return ComputeReprojectImage(item.reproject(),
+                                   result->mutable_reproject());
+    case BatchItem::kTilePyramid:
+      return ComputeTilePyramid(item.tile_pyramid(),
+                                result->mutable_tile_pyramid());
+    case BatchItem::kMosaic:
+      return ComputeMosaic(item.mosaic(), result->mutable_mosaic());
+    case BatchItem::kHillshade:
+      return ComputeHillshade(item.hillshade(), result->mutable_hillshade());
+    case BatchItem::kOrthorectify:
+      return ComputeOrthorectifyDEM(item.orthorectify(),
+                                    result->mutable_orthorectify());
+    case BatchItem::kResample:
+      return ComputeResample(item.resample(), result->mutable_resample());
+    case BatchItem::kColorMap:
+      return ComputeColorMap(item.color_map(), result->mutable_color_map());
+    case BatchItem::kPipeline:
+      return ComputePipeline(item.pipeline(), result->mutable_pipeline());
+    case BatchItem::OP_NOT_SET:
+      break;
+  }
+  return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                      "batch: item has no operation");
+}
+
+grpc::Status VisionServiceImpl::ComputeReprojectImage(
+    const ReprojectImageRequest& req, ReprojectImageResponse* res) {
+  return Cached(cache_, "ReprojectImage", req, res, [&] {
+    std::shared_ptr<RasterSource> input;
+    grpc::Status s = OpenImage(req.input(), kDefaultTileSize, &input);
+    if (!s.ok()) return s;
+    return RunReproject(req, input, res);
+  });
+}
+
+grpc::Status VisionServiceImpl::ComputeTilePyramid(
+    const TilePyramidRequest& req, TilePyramidResponse* res) {
+  return Cached(cache_, "TilePyramid", req, res, [&] {
+    std::vector<PyramidTile> tiles;
+    grpc::Status s =
+        RunTilePyramid(req, [&](int z, int x, int y, Image* tile) {
+          PyramidTile t;
+          t.set_z(z);
+          t.set_x(x);
+          t.set_y(y);
+          t.mutable_tile()->Swap(tile);
+          tiles.push_back(std::move(t));
+          return grpc::Status::OK;
+        });
+    if (!s.ok()) return s;
+    std::sort(tiles.begin(), tiles.end(),
+              [](const PyramidTile& a, const PyramidTile& b) {
+                return std::make_tuple(a.z(), a.x(), a.y()) <
+                       std::make_tuple(b.z(), b.x(), b.y());
+              });
+    for (PyramidTile& t : tiles) res->add_tiles()->Swap(t.mutable_tile());
+    return grpc::Status::OK;
+  });
+}
+
+grpc::Status VisionServiceImpl::ComputeMosaic(const MosaicRequest& req,
+                                              MosaicResponse* res) {
+  return Cached(cache_, "Mosaic", req, res, [&] {
+    std::vector<std::shared_ptr<RasterSource>> inputs(req.inputs_size());
+    for (int i = 0; i < req.inputs_size(); ++i) {
+      grpc::Status s = OpenImage(req.inputs(i), kDefaultTileSize, &inputs[i]);
+      if (!s.ok()) return s;
+    }
+    return RunMosaic(req, std::move(inputs), res);
+  });
+}
+
+grpc::Status VisionServiceImpl::ComputeHillshade(const HillshadeRequest& req,
+                                                 HillshadeResponse* res) {
+  return Cached(cache_, "Hillshade", req, res, [&] {
+    std::shared_ptr<RasterSource> dem;
+    grpc::Status s = OpenImage(req.dem(), kDefaultTileSize, &dem);
+    if (!s.ok()) return s;
+    return RunHillshade(req, dem, res);
+  });
+}
+
+grpc::Status VisionServiceImpl::ComputeOrthorectifyDEM(
+    const OrthorectifyDEMRequest& req, OrthorectifyDEMResponse* res) {
+  return Cached(cache_, "OrthorectifyDEM", req, res, [&] {
+    std::shared_ptr<RasterSource> dem, texture;
+    grpc::Status s = OpenImage(req.dem(), kDefaultTileSize, &dem);
+    if (!s.ok()) return s;
+    s = OpenImage(req.texture(), kDefaultTileSize, &texture);
+    if (!s.ok()) return s;
+    return RunOrthorectify(req, dem, texture, res);
+  });
+}
+
+grpc::Status VisionServiceImpl::ComputeResample(const ResampleRequest& req,
+                                                ResampleResponse* res) {
+  return Cached(cache_, "Resample", req, res, [&] {
+    std::shared_ptr<RasterSource> input;
+    grpc::Status s = OpenImage(req.input(), kDefaultTileSize, &input);
+    if (!s.ok()) return s;
+    return RunResample(req, input, res);
+  });
+}
+
+grpc::Status VisionServiceImpl::ComputeColorMap(const ColorMapRequest& req,
+                                                ColorMapResponse* res) {
+  return Cached(cache_, "ColorMap", req, res, [&] {
+    std::shared_ptr<RasterSource> input;
+    grpc::Status s = OpenImage(req.input(), kDefaultTileSize, &input);
+    if (!s.ok()) return s;
+    return RunColorMap(req, input, res);
+  });
+}
+
+grpc::Status VisionServiceImpl::ComputePipeline(const PipelineRequest& req,
+                                                PipelineResponse* res) {
+  return Cached(cache_, "Pipeline", req, res, [&] {
+    std::shared_ptr<RasterSource> input;
+    grpc::Status s = OpenImage(req.input(), kDefaultTileSize, &input);
+    if (!s.ok()) return s;
+    return RunPipeline(req, input, res);
+  });
+}
+
+grpc::Status VisionServiceImpl::RegisterDataset(
+    grpc::ServerContext*, const RegisterDatasetRequest* req,
+    RegisterDatasetResponse* res) {
+  return Measured(metrics_, "RegisterDataset", *req, *res, [&] {
+    AdmissionController::Ticket ticket;
+    grpc::Status s = Admit("RegisterDataset", &ticket);
+    if (!s.ok()) return s;
+    if (datasets_ == nullptr) {
+      return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION,
+                          "register: datasets are disabled (no --dataset_dir)");
+    }
+    DatasetRegistry::Info info;
+    s = datasets_->Register(req->image(), &info);
+    if (!s.ok()) return s;
+    res->set_dataset_id(info.id);
+    res->set_width(info.raster.width);
+    res->set_height(info.raster.height);
+    res->set_bands(info.raster.bands);
+    res->set_pixel_type(PixelTypeName(info.raster.type));
+    if (info.has_georef) ToGeoTransform(info.georef, res->mutable_geo());
+    res->set_stored_bytes(info.stored_bytes);
+    res->set_references(info.references);
+    return grpc::Status::OK;
+  });
+}
+
+grpc::Status VisionServiceImpl::ReleaseDataset(grpc::ServerContext*,
+                                               const ReleaseDatasetRequest* req,
+                                               ReleaseDatasetResponse* res) {
+  return Measured(metrics_, "ReleaseDataset", *req, *res, [&] {
+    if (datasets_ == nullptr) {
+      return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION,
+                          "release: datasets are disabled (no --dataset_dir)");
+    }
+    uint32_t references = 0;
+    grpc::Status s = datasets_->Release(req->dataset_id(), &references);
+    if (s.ok()) res->set_references(references);
+    return s;
+  });
+}
+
+grpc::Status VisionServiceImpl::UploadReprojectImage(
+    grpc::ServerContext* ctx, grpc::ServerReader<ReprojectImageUpload>* reader,
+    ReprojectImageResponse* res) {
+  CallRecorder call(metrics_, "UploadReprojectImage");
+  AdmissionController::Ticket ticket;
+  grpc::Status s = Admit("UploadReprojectImage", &ticket);
+  if (!s.ok()) return call.Finish(s);
+  ReprojectImageRequest req;
+  s = ReadUploadHeader(reader, &req, &call);
+  if (!s.ok()) return call.Finish(s);
+  UploadInputs inputs = MakeUploadInputs(1);
+  s = PumpUpload(ctx, reader, inputs, max_upload_bytes_, &call, [&]() {
+    std::shared_ptr<RasterSource> input;
+    grpc::Status s = OpenImageStream(req.input().format(), inputs[0],
+                                     kDefaultTileSize, &input);
+    if (!s.ok()) return s;
+    return RunReproject(req, input, res);
+  });
+  return Replied(&call, s, *res);
+}
+
+grpc::Status VisionServiceImpl::UploadHillshade(
+    grpc::ServerContext* ctx, grpc::ServerReader<HillshadeUpload>* reader,
+    HillshadeResponse* res) {
+  CallRecorder call(metrics_, "UploadHillshade");
+  AdmissionController::Ticket ticket;
+  grpc::Status s = Admit("UploadHillshade", &ticket);
+  if (!s.ok()) return call.Finish(s);
+  HillshadeRequest req;
+  s = ReadUploadHeader(reader, &req, &call);
+  if (!s.ok()) return call.Finish(s);
+  UploadInputs inputs = MakeUploadInputs(1);
+  s = PumpUpload(ctx, reader, inputs, max_upload_bytes_, &call, [&]() {
+    std::shared_ptr<RasterSource> dem;
+    grpc::Status s = OpenImageStream(req.dem().format(), inputs[0],
+                                     kDefaultTileSize, &dem);
+    if (!s.ok()) return s;
+    return RunHillshade(req, dem, res);
+  });
+  return Replied(&call, s, *res);
+}
+
+grpc::Status VisionServiceImpl::UploadOrthorectifyDEM(
+    grpc::ServerContext* ctx, grpc::ServerReader<OrthorectifyDEMUpload>* reader,
+    OrthorectifyDEMResponse* res) {
+  CallRecorder call(metrics_, "UploadOrthorectifyDEM");
+  AdmissionController::Ticket ticket;
+  grpc::Status s = Admit("UploadOrthorectifyDEM", &ticket);
+  if (!s.ok()) return call.Finish(s);
+  OrthorectifyDEMRequest req;
+  s = ReadUploadHeader(reader, &req, &call);
+  if (!s.ok()) return call.Finish(s);
+  UploadInputs inputs = MakeUploadInputs(2);
+  s = PumpUpload(ctx, reader, inputs, max_upload_bytes_, &call, [&]() {
+    std::shared_ptr<RasterSource> dem, texture;
+    grpc::Status s = OpenImageStream(req.dem().format(), inputs[0],
+                                     kDefaultTileSize, &dem);
+    if (!s.ok()) return s;
+    s = OpenImageStream(req.texture().format(), inputs[1], kDefaultTileSize,
+                        &texture);
+    if (!s.ok()) return s;
+    return RunOrthorectify(req, dem, texture, res);
+  });
+  return Replied(&call, s, *res);
+}
+
+grpc::Status VisionServiceImpl::RunTilePyramid(const TilePyramidRequest& req,
+                                               const TileEmitter& emit) {
+  PyramidOptions opts;
+  grpc::Status s = ValidatePyramid(req, &opts);
+  if (!s.ok()) return s;
+  std::shared_ptr<RasterSource> input;
+  s = OpenImage(req.input(), opts.tile_size, &input);
+  if (!s.ok()) return s;
+  Georef geo;
+  const bool has_geo = ResolveGeoref(req.input(), *input, &geo);
+  s = CropToWindow(req.window(), "pyramid", &input, has_geo ? &geo : nullptr);
+  if (!s.ok()) return s;
+  return BuildTilePyramid(*input, opts, emit);
+}
+
+}  // namespace vision
+}  // namespace lucidia
@@ -0,0 +1,149 @@
+// Synchronous VisionService handlers.
+#pragma once
+
+#include <cstdint>
+#include <functional>
+
+#include "proto/vision_service.grpc.pb.h"
+#include "services/lucidia-vision/admission.h"
+#include "services/lucidia-vision/dataset_registry.h"
+#include "services/lucidia-vision/metrics.h"
+#include "services/lucidia-vision/pyramid.h"
+#include "services/lucidia-vision/result_cache.h"
+
+namespace lucidia {
+namespace vision {
+
+// Every handler decodes its inputs lazily into the tiled raster core; kernels
+// then run tile by tile on top of the returned sources.
+class VisionServiceImpl : public v1::VisionService::Service {
+ public:
+  // With an AdmissionController, calls over their method's limit fail with
+  // RESOURCE_EXHAUSTED. The async server admits calls itself and hands them
+  // to an instance without one.
+  explicit VisionServiceImpl(AdmissionController* admission = nullptr)
+      : admission_(admission), item_admission_(admission) {}
+  void set_admission(AdmissionController* admission) {
+    admission_ = item_admission_ = admission;
+  }
+  // Batch items are admitted one by one against their own method's limit.
+  // Instances whose calls are admitted elsewhere (by the async server) set
+  // this alone, so a batch still cannot run more items of a method than
+  // that method's limit.
+  void set_item_admission(AdmissionController* admission) {
+    item_admission_ = admission;
+  }
+  // With a ResultCache, unary calls are answered from it when an identical
+  // request was seen before. Streaming and upload calls bypass it.
+  void set_cache(ResultCache* cache) { cache_ = cache; }
+  // With Metrics, every call's latency, status, sizes and output pixels are
+  // recorded.
+  void set_metrics(Metrics* metrics) { metrics_ = metrics; }
+  Metrics* metrics() const { return metrics_; }
+  // Registry behind RegisterDataset and ReleaseDataset; without one they
+  // fail with FAILED_PRECONDITION. (OpenImage resolves Image.dataset through
+  // SetDatasetRegistry.)
+  void set_datasets(DatasetRegistry* datasets) { datasets_ = datasets; }
+  // Upload calls whose inputs together pass this many bytes fail with
+  // RESOURCE_EXHAUSTED; uploads are held in memory while they decode.
+  void set_max_upload_bytes(uint64_t bytes) { max_upload_bytes_ = bytes; }
+
+  grpc::Status ReprojectImage(grpc::ServerContext* ctx,
+                              const v1::ReprojectImageRequest* req,
+                              v1::ReprojectImageResponse* res) override;
+  grpc::Status TilePyramid(grpc::ServerContext* ctx,
+                           const v1::TilePyramidRequest* req,
+                           v1::TilePyramidResponse* res) override;
+  grpc::Status Mosaic(grpc::ServerContext* ctx, const v1::MosaicRequest* req,
+                      v1::MosaicResponse* res) override;
+  grpc::Status Hillshade(grpc::ServerContext* ctx,
+                         const v1::HillshadeRequest* req,
+                         v1::HillshadeResponse* res) override;
+  grpc::Status OrthorectifyDEM(grpc::ServerContext* ctx,
+                               const v1::OrthorectifyDEMRequest* req,
+                               v1::OrthorectifyDEMResponse* res) override;
+  grpc::Status Resample(grpc::ServerContext* ctx,
+                        const v1::ResampleRequest* req,
+                        v1::ResampleResponse* res) override;
+  grpc::Status ColorMap(grpc::ServerContext* ctx,
+                        const v1::ColorMapRequest* req,
+                        v1::ColorMapResponse* res) override;
+  // Resample, Hillshade, ColorMap and so on chained on one input; see
+  // RunPipeline. Cached and admitted as a single call.
+  grpc::Status Pipeline(grpc::ServerContext* ctx,
+                        const v1::PipelineRequest* req,
+                        v1::PipelineResponse* res) override;
+  // Runs every item, concurrently on the default pool. Each item is admitted
+  // under its own method (an item over that limit fails alone with
+  // RESOURCE_EXHAUSTED) and looked up in and stored to the result cache on
+  // its own. Fails as a whole only when the batch itself is rejected.
+  grpc::Status Batch(grpc::ServerContext* ctx, const v1::BatchRequest* req,
+                     v1::BatchResponse* res) override;
+  // Batch with cancellation reported by `cancelled` instead of a
+  // ServerContext: an async call's context may not be asked until the call
+  // is done. Items not yet started when it returns true fail with CANCELLED.
+  grpc::Status RunBatch(const v1::BatchRequest* req, v1::BatchResponse* res,
+                        const std::function<bool()>& cancelled);
+
+  grpc::Status RegisterDataset(grpc::ServerContext* ctx,
+                               const v1::RegisterDatasetRequest* req,
+                               v1::RegisterDatasetResponse* res) override;
+  grpc::Status ReleaseDataset(grpc::ServerContext* ctx,
+                              const v1::ReleaseDatasetRequest* req,
+                              v1::ReleaseDatasetResponse* res) override;
+
+  grpc::Status StreamTilePyramid(
+      grpc::ServerContext* ctx, const v1::TilePyramidRequest* req,
+      grpc::ServerWriter<v1::PyramidTile>* writer) override;
+
+  grpc::Status UploadReprojectImage(
+      grpc::ServerContext* ctx,
+      grpc::ServerReader<v1::ReprojectImageUpload>* reader,
+      v1::ReprojectImageResponse* res) override;
+  grpc::Status UploadHillshade(grpc::ServerContext* ctx,
+                               grpc::ServerReader<v1::HillshadeUpload>* reader,
+                               v1::HillshadeResponse* res) override;
+  grpc::Status UploadOrthorectifyDEM(
+      grpc::ServerContext* ctx,
+      grpc::ServerReader<v1::OrthorectifyDEMUpload>* reader,
+      v1::OrthorectifyDEMResponse* res) override;
+
+ private:
+  grpc::Status Admit(const char* method, AdmissionController::Ticket* ticket);
+
+  // Bodies of the unary methods, shared with Batch: cached, but neither
+  // admitted nor measured.
+  grpc::Status ComputeReprojectImage(const v1::ReprojectImageRequest& req,
+                                     v1::ReprojectImageResponse* res);
+  grpc::Status ComputeTilePyramid(const v1::TilePyramidRequest& req,
+                                  v1::TilePyramidResponse* res);
+  grpc::Status ComputeMosaic(const v1::MosaicRequest& req,
+                             v1::MosaicResponse* res);
+  grpc::Status ComputeHillshade(const v1::HillshadeRequest& req,
+                                v1::HillshadeResponse* res);
+  grpc::Status ComputeOrthorectifyDEM(const v1::OrthorectifyDEMRequest& req,
+                                      v1::OrthorectifyDEMResponse* res);
+  grpc::Status ComputeResample(const v1::ResampleRequest& req,
+                               v1::ResampleResponse* res);
+  grpc::Status ComputeColorMap(const v1::ColorMapRequest& req,
+                               v1::ColorMapResponse* res);
+  grpc::Status ComputePipeline(const v1::PipelineRequest& req,
+                               v1::PipelineResponse* res);
+  grpc::Status RunBatchItem(const v1::BatchItem& item, v1::BatchResult* result);
+  static grpc::Status RunTilePyramid(const v1::TilePyramidRequest& req,
+                                     const TileEmitter& emit);
+
+  AdmissionController* admission_;
+  AdmissionController* item_admission_;
+  ResultCache* cache_ = nullptr;
+  Metrics* metrics_ = nullptr;
+  DatasetRegistry* datasets_ = nullptr;
+  uint64_t max_upload_bytes_ = uint64_t{4} << 30;
+};
+
+// Every RPC name, for configuring per-method limits.
+extern const char* const kVisionMethods[];
+extern const int kNumVisionMethods;
+
+}  // namespace vision
+}  // namespace lucidia
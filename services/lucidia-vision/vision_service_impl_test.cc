@@ -0,0 +1,210 @@
+#include "services/lucidia-vision/vision_service_impl.h"
+
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <string>
+
+#include <grpcpp/grpcpp.h>
+#include <gtest/gtest.h>
+#include "proto/vision_service.grpc.pb.h"
+#include "services/lucidia-vision/image_io.h"
+#include "services/lucidia-vision/test_util.h"
+
+namespace lucidia {
+namespace vision {
+namespace {
+
+namespace fs = std::filesystem;
+
+using testing::MakeRaster;
+
+// A PNG of `width` x `height` u8 samples of (x + y) % 256.
+v1::Image Gradient(int width, int height) {
+  auto raster = MakeRaster(width, height, 1, PixelType::kU8,
+                           [](int x, int y, int) { return (x + y) % 256; });
+  v1::Image image;
+  EXPECT_TRUE(EncodeImage(*raster, "png", &image).ok());
+  return image;
+}
+
+// Serves `service_` in process; tests configure it before Start().
+class VisionServiceTest : public ::testing::Test {
+ protected:
+  void TearDown() override {
+    if (server_ != nullptr) server_->Shutdown();
+  }
+  void Start() {
+    grpc::ServerBuilder builder;
+    builder.RegisterService(&service_);
+    server_ = builder.BuildAndStart();
+    ASSERT_NE(server_, nullptr);
+    stub_ = v1::VisionService::NewStub(
+        server_->InProcessChannel(grpc::ChannelArguments()));
+  }
+
+  AdmissionController admission_;
+  VisionServiceImpl service_{&admission_};
+  std::unique_ptr<grpc::Server> server_;
+  std::unique_ptr<v1::VisionService::Stub> stub_;
+};
+
+// Sends `header` and then `data` in `chunks` slices to UploadHillshade.
+// Without `end` the stream is left open, as by a stalled client.
+grpc::Status UploadHillshade(v1::VisionService::Stub& stub,
+                             const v1::HillshadeRequest& header,
+                             const std::string& data, int chunks, bool end,
+                             v1::HillshadeResponse* res) {
+  grpc::ClientContext ctx;
+  ctx.set_deadline(std::chrono::system_clock::now() +
+                   std::chrono::seconds(30));
+  auto writer = stub.UploadHillshade(&ctx, res);
+  v1::HillshadeUpload msg;
+  *msg.mutable_header() = header;
+  bool open = writer->Write(msg);
+  const size_t step = (data.size() + chunks - 1) / chunks;
+  for (size_t at = 0; open && at < data.size(); at += step) {
+    msg.mutable_chunk()->set_data(data.substr(at, step));
+    open = writer->Write(msg);
+  }
+  if (end) writer->WritesDone();
+  return writer->Finish();
+}
+
+// The upload's chunks are reassembled in order: the result matches the
+// unary call on the whole image.
+TEST_F(VisionServiceTest, UploadMatchesUnaryCall) {
+  Start();
+  v1::HillshadeRequest req;
+  *req.mutable_dem() = Gradient(600, 500);
+  v1::HillshadeResponse unary;
+  {
+    grpc::ClientContext ctx;
+    ASSERT_TRUE(stub_->Hillshade(&ctx, req, &unary).ok());
+  }
+  const std::string data = req.dem().data();
+  v1::HillshadeRequest header = req;
+  header.mutable_dem()->clear_data();
+  header.mutable_dem()->set_format("png");
+  v1::HillshadeResponse uploaded;
+  const grpc::Status s =
+      UploadHillshade(*stub_, header, data, 7, true, &uploaded);
+  ASSERT_TRUE(s.ok()) << s.error_message();
+  EXPECT_TRUE(uploaded.output().data() == unary.output().data());
+}
+
+TEST_F(VisionServiceTest, UploadOverCapIsRejected) {
+  service_.set_max_upload_bytes(1000);
+  Start();
+  v1::HillshadeRequest header;
+  header.mutable_dem()->set_format("png");
+  const std::string data = Gradient(600, 500).data();
+  ASSERT_GT(data.size(), 1000u);
+  v1::HillshadeResponse res;
+  EXPECT_EQ(UploadHillshade(*stub_, header, data, 4, true, &res).error_code(),
+            grpc::StatusCode::RESOURCE_EXHAUSTED);
+}
+
+// Bytes that do not decode fail the call without waiting for the rest of
+// the upload, even from a client that never ends its stream.
+TEST_F(VisionServiceTest, UploadFailsEarlyOnBadImage) {
+  Start();
+  v1::HillshadeRequest header;
+  header.mutable_dem()->set_format("png");
+  const auto start = std::chrono::steady_clock::now();
+  v1::HillshadeResponse res;
+  const grpc::Status s = UploadHillshade(
+      *stub_, header, std::string(4096, 'x'), 1, false, &res);
+  EXPECT_FALSE(s.ok());
+  EXPECT_NE(s.error_code(), grpc::StatusCode::DEADLINE_EXCEEDED);
+  EXPECT_LT(std::chrono::steady_clock::now() - start,
+            std::chrono::seconds(10));
+}
+
+// Each Batch item is admitted under its own method: with Hillshade's one
+// slot taken, its items fail alone while the ColorMap items succeed.
+TEST_F(VisionServiceTest, BatchItemOverItsMethodLimitFailsAlone) {
+  admission_.SetLimit("Hillshade", 1);
+  Start();
+  AdmissionController::Ticket held;
+  ASSERT_TRUE(admission_.Admit("Hillshade", &held).ok());
+  v1::BatchRequest req;
+  for (int i = 0; i < 4; ++i) {
+    *req.add_items()->mutable_color_map()->mutable_input() = Gradient(16, 16);
+    *req.add_items()->mutable_hillshade()->mutable_dem() = Gradient(16, 16);
+  }
+  grpc::ClientContext ctx;
+  v1::BatchResponse res;
+  ASSERT_TRUE(stub_->Batch(&ctx, req, &res).ok());
+  ASSERT_EQ(res.results_size(), 8);
+  for (int i = 0; i < 8; ++i) {
+    const v1::BatchResult& result = res.results(i);
+    if (req.items(i).has_hillshade()) {
+      EXPECT_EQ(result.code(), grpc::StatusCode::RESOURCE_EXHAUSTED) << i;
+      EXPECT_FALSE(result.has_hillshade()) << i;
+    } else {
+      EXPECT_EQ(result.code(), grpc::StatusCode::OK) << result.message();
+      EXPECT_TRUE(result.has_color_map()) << i;
+    }
+  }
+}
+
+// Items that have not started when the batch learns of its cancellation
+// fail with CANCELLED; the batch itself still answers.
+TEST_F(VisionServiceTest, CancelledBatchCancelsRemainingItems) {
+  constexpr int kItems = 16;
+  v1::BatchRequest req;
+  for (int i = 0; i < kItems; ++i) {
+    *req.add_items()->mutable_color_map()->mutable_input() = Gradient(16, 16);
+  }
+  // Cancelled once two items have started.
+  std::atomic<int> asked{0};
+  v1::BatchResponse res;
+  ASSERT_TRUE(
+      service_.RunBatch(&req, &res, [&] { return asked++ >= 2; }).ok());
+  ASSERT_EQ(res.results_size(), kItems);
+  int ok = 0, cancelled = 0;
+  for (const v1::BatchResult& result : res.results()) {
+    if (result.code() == grpc::StatusCode::OK) ++ok;
+    if (result.code() == grpc::StatusCode::CANCELLED) ++cancelled;
+  }
+  EXPECT_EQ(ok, 2);
+  EXPECT_EQ(cancelled, kItems - 2);
+}
+
+TEST_F(VisionServiceTest, RegisterDatasetReportsCrs) {
+  const fs::path dir = fs::temp_directory_path() /
+                       ("lucidia-service-" + std::to_string(::getpid()));
+  DatasetRegistryOptions options;
+  options.dir = dir.string();
+  {
+    DatasetRegistry registry(options);
+    service_.set_datasets(&registry);
+    Start();
+    v1::RegisterDatasetRequest req;
+    *req.mutable_image() = Gradient(40, 30);
+    v1::GeoTransform* geo = req.mutable_image()->mutable_geo();
+    geo->set_origin_x(500000.0);
+    geo->set_origin_y(4200000.0);
+    geo->set_pixel_width(10.0);
+    geo->set_pixel_height(-10.0);
+    geo->set_epsg(32633);
+    grpc::ClientContext ctx;
+    v1::RegisterDatasetResponse res;
+    const grpc::Status s = stub_->RegisterDataset(&ctx, req, &res);
+    ASSERT_TRUE(s.ok()) << s.error_message();
+    EXPECT_EQ(res.geo().epsg(), 32633);
+    EXPECT_DOUBLE_EQ(res.geo().origin_x(), 500000.0);
+    EXPECT_DOUBLE_EQ(res.geo().pixel_height(), -10.0);
+    server_->Shutdown();
+    server_.reset();
+  }
+  fs::remove_all(dir);
+}
+
+}  // namespace
+}  // namespace vision
+}  // namespace lucidia